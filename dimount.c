@@ -3,9 +3,12 @@
  */
 
 #define WIN32_NO_STATUS
+// Has to come before <windows.h>, which would pull in version 1 otherwise.
+#include <winsock2.h>
 #include <windows.h>
 #undef WIN32_NO_STATUS
 #include <ntstatus.h>
+#include <afunix.h>
 #include <assert.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -36,25 +39,53 @@ const wchar_t *DOKAN_URL_MESSAGE =
 
 #include "src/backend.h"
 #include "src/utils.c"
+#include "src/arena.c"
+#include "src/rcu.c"
+#include "src/cache.c"
+#include "src/copy.c"
+#include "src/holes.c"
+#include "src/blocksrc.c"
+#include "src/aio.c"
+#include "src/segments.c"
+#include "src/tier.c"
+#include "src/direct.c"
 
 #include "src/fs_fat.c"
+#include "src/fs_exfat.c"
 #include "src/pt_nec.c"
 #include "src/pt_none.c"
 #include "src/c_hdi.c"
 #include "src/c_none.c"
+#include "src/index.c"
+#include "src/extract.c"
+#include "src/catalog.c"
+#include "src/check.c"
+#include "src/revmap.c"
+#include "src/extents.c"
+#include "src/diff.c"
+#include "src/relayout.c"
+#include "src/store.c"
+#include "src/scan.c"
+#include "src/prewarm.c"
+#include "src/heat.c"
+#include "src/bench.c"
+#include "src/nbd.c"
 
-const FSFORMAT *FSFormats[] = {
-	&FS_FAT,
-	NULL
-};
-const PTFORMAT *PTFormats[] = {
-	&PT_NEC,
-	&PT_None,
-	NULL
-};
-const CFORMAT *CFormats[] = {
-	&C_HDI,
-	&C_None,
+#include "src/formats.c"
+
+const COMMAND *Commands[] = {
+	&CMD_Index,
+	&CMD_Extract,
+	&CMD_Ls,
+	&CMD_Check,
+	&CMD_Which,
+	&CMD_Extents,
+	&CMD_Diff,
+	&CMD_Relayout,
+	&CMD_Store,
+	&CMD_Scan,
+	&CMD_Bench,
+	&CMD_ServeNBD,
 	NULL
 };
 
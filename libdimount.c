@@ -0,0 +1,45 @@
+/*
+ * Dokan Image Mounter - Library compilation unit
+ *
+ * Builds the in-process interface declared in src/libdimount.h, without the
+ * Dokan frontend or any of the command-line tools. Compile as a static
+ * library, or as a DLL with LIBDIMOUNT_DLL defined.
+ */
+
+#define WIN32_NO_STATUS
+#include <windows.h>
+#undef WIN32_NO_STATUS
+#include <ntstatus.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define LIBDIMOUNT_BUILD
+#include "src/libdimount.h"
+#include "src/backend.h"
+#include "src/utils.c"
+#include "src/arena.c"
+#include "src/rcu.c"
+#include "src/cache.c"
+#include "src/copy.c"
+#include "src/holes.c"
+#include "src/blocksrc.c"
+#include "src/aio.c"
+#include "src/segments.c"
+#include "src/tier.c"
+#include "src/direct.c"
+
+#include "src/fs_fat.c"
+#include "src/fs_exfat.c"
+#include "src/pt_nec.c"
+#include "src/pt_none.c"
+#include "src/c_hdi.c"
+#include "src/c_none.c"
+#include "src/index.c"
+#include "src/store.c"
+
+#include "src/formats.c"
+
+#include "src/backend.c"
+#include "src/lib.c"
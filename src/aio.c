@@ -0,0 +1,297 @@
+/*
+ * Dokan Image Mounter
+ *
+ * Asynchronous, unbuffered reading of image files.
+ */
+
+// Unbuffered I/O has to be aligned to the sector size of the volume. This
+// covers all common ones.
+#define AIO_ALIGN 4096
+
+#define AIO_DEPTH_MAX WORKERS_MAX
+
+// Reads are submitted as overlapped I/O on a completion port, which a single
+// thread drains. A semaphore limits the number of reads in flight across all
+// batches to [Depth]. Without a completion port, each batch is instead read
+// synchronously by up to [Depth] threads.
+typedef struct {
+	HANDLE File;
+	HANDLE Port;
+	HANDLE Completer;
+	HANDLE Slots;
+	unsigned int Depth;
+} AIO;
+
+typedef struct {
+	BLOCK_REQUEST *Requests;
+	size_t Count;
+	HANDLE File;
+	// Used by the thread pool
+	volatile LONG Next;
+	// Used with the completion port
+	volatile LONG Pending;
+	HANDLE Done;
+} AIO_BATCH;
+
+typedef struct {
+	OVERLAPPED Overlapped;
+	AIO_BATCH *Batch;
+	BLOCK_REQUEST *Request;
+} AIO_OP;
+
+DWORD AioAlignedSize(size_t Size)
+{
+	return (DWORD)((Size + AIO_ALIGN - 1) & ~(size_t)(AIO_ALIGN - 1));
+}
+
+void AioComplete(AIO_BATCH *Batch, BLOCK_REQUEST *Request, bool OK, DWORD Bytes)
+{
+	// Reads at the end of the file come back short.
+	if(OK && Bytes < Request->Size) {
+		ZeroMemory(Request->Buf + Bytes, Request->Size - Bytes);
+	}
+	Request->OK = OK;
+	if(Batch->Done && InterlockedDecrement(&Batch->Pending) == 0) {
+		SetEvent(Batch->Done);
+	}
+}
+
+DWORD WINAPI AioCompleter(void *Param)
+{
+	AIO *aio = (AIO*)Param;
+	for(;;) {
+		DWORD bytes = 0;
+		ULONG_PTR key;
+		OVERLAPPED *ov = NULL;
+		BOOL ok = GetQueuedCompletionStatus(aio->Port, &bytes, &key, &ov, INFINITE);
+		// AioClose() posts an empty packet.
+		if(!ov) {
+			break;
+		}
+		AIO_OP *op = CONTAINING_RECORD(ov, AIO_OP, Overlapped);
+		AioComplete(op->Batch, op->Request, ok || GetLastError() == ERROR_HANDLE_EOF, bytes);
+		ReleaseSemaphore(aio->Slots, 1, NULL);
+	}
+	return 0;
+}
+
+DWORD WINAPI AioWorker(void *Param)
+{
+	AIO_BATCH *batch = (AIO_BATCH*)Param;
+	size_t i;
+	while((i = (size_t)InterlockedIncrement(&batch->Next) - 1) < batch->Count) {
+		BLOCK_REQUEST *req = &batch->Requests[i];
+		OVERLAPPED ov = {
+			.Offset = (DWORD)req->Offset,
+			.OffsetHigh = (DWORD)(req->Offset >> 32),
+		};
+		DWORD bytes = 0;
+		BOOL ok = ReadFile(batch->File, req->Buf, AioAlignedSize(req->Size), &bytes, &ov);
+		AioComplete(batch, req, ok || GetLastError() == ERROR_HANDLE_EOF, bytes);
+	}
+	return 0;
+}
+
+bool AioReadPort(AIO *Aio, AIO_BATCH *Batch)
+{
+	AIO_OP *ops = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, Batch->Count * sizeof(AIO_OP));
+	Batch->Done = CreateEventW(NULL, TRUE, FALSE, NULL);
+	if(!ops || !Batch->Done) {
+		HeapFree(GetProcessHeap(), 0, ops);
+		if(Batch->Done) {
+			CloseHandle(Batch->Done);
+		}
+		return false;
+	}
+	// Keeps the event from being set before everything was submitted.
+	Batch->Pending = (LONG)Batch->Count + 1;
+	for(size_t i = 0; i < Batch->Count; i++) {
+		BLOCK_REQUEST *req = &Batch->Requests[i];
+		AIO_OP *op = &ops[i];
+		op->Batch = Batch;
+		op->Request = req;
+		op->Overlapped.Offset = (DWORD)req->Offset;
+		op->Overlapped.OffsetHigh = (DWORD)(req->Offset >> 32);
+		WaitForSingleObject(Aio->Slots, INFINITE);
+		if(!ReadFile(Aio->File, req->Buf, AioAlignedSize(req->Size), NULL, &op->Overlapped)) {
+			DWORD err = GetLastError();
+			if(err != ERROR_IO_PENDING) {
+				// No completion packet is queued in this case.
+				ReleaseSemaphore(Aio->Slots, 1, NULL);
+				AioComplete(Batch, req, err == ERROR_HANDLE_EOF, 0);
+			}
+		}
+	}
+	if(InterlockedDecrement(&Batch->Pending) != 0) {
+		WaitForSingleObject(Batch->Done, INFINITE);
+	}
+	CloseHandle(Batch->Done);
+	HeapFree(GetProcessHeap(), 0, ops);
+	return true;
+}
+
+// Reads all of [Requests], whose buffers must be aligned to AIO_ALIGN and
+// large enough for their size rounded up to it. Returns whether all of them
+// succeeded.
+bool AioRead(AIO *Aio, BLOCK_REQUEST *Requests, size_t Count)
+{
+	AIO_BATCH batch = {
+		.Requests = Requests,
+		.Count = Count,
+		.File = Aio->File,
+	};
+	for(size_t i = 0; i < Count; i++) {
+		Requests[i].OK = false;
+	}
+	if(Aio->Port) {
+		if(!AioReadPort(Aio, &batch)) {
+			return false;
+		}
+	} else {
+		if(Count == 1 || Aio->Depth == 1) {
+			AioWorker(&batch);
+		} else {
+			WorkersRun((unsigned int)min(Count, Aio->Depth), AioWorker, &batch);
+		}
+	}
+	for(size_t i = 0; i < Count; i++) {
+		if(!Requests[i].OK) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void AioClose(AIO *Aio)
+{
+	assert(Aio);
+	if(Aio->Completer) {
+		PostQueuedCompletionStatus(Aio->Port, 0, 0, NULL);
+		WaitForSingleObject(Aio->Completer, INFINITE);
+		CloseHandle(Aio->Completer);
+	}
+	if(Aio->Port) {
+		CloseHandle(Aio->Port);
+	}
+	if(Aio->Slots) {
+		CloseHandle(Aio->Slots);
+	}
+	if(Aio->File && Aio->File != INVALID_HANDLE_VALUE) {
+		CloseHandle(Aio->File);
+	}
+	ZeroMemory(Aio, sizeof(AIO));
+}
+
+// Opens [FN] for unbuffered reads, with up to [Depth] of them in flight.
+// Uses the thread pool right away if [Threads] is true, and falls back on it
+// if no completion port can be set up. Returns 0 on success, or a Win32 error
+// code.
+DWORD AioOpen(AIO *Aio, const wchar_t *FN, unsigned int Depth, bool Threads)
+{
+	assert(Aio);
+	ZeroMemory(Aio, sizeof(AIO));
+	Aio->Depth = min(max(Depth, 1), AIO_DEPTH_MAX);
+	Aio->File = CreateFileW(
+		FN, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+		FILE_FLAG_NO_BUFFERING | (Threads ? 0 : FILE_FLAG_OVERLAPPED), NULL
+	);
+	if(Aio->File == INVALID_HANDLE_VALUE) {
+		DWORD err = GetLastError();
+		AioClose(Aio);
+		return err;
+	}
+	if(Threads) {
+		return 0;
+	}
+	Aio->Slots = CreateSemaphoreW(NULL, Aio->Depth, Aio->Depth, NULL);
+	Aio->Port = CreateIoCompletionPort(Aio->File, NULL, 0, 1);
+	if(Aio->Slots && Aio->Port) {
+		Aio->Completer = CreateThread(NULL, 0, AioCompleter, Aio, 0, NULL);
+	}
+	if(!Aio->Completer) {
+		// The handle is overlapped, so it has to be reopened.
+		AioClose(Aio);
+		return AioOpen(Aio, FN, Depth, true);
+	}
+	return 0;
+}
+
+/// Images
+/// ------
+// Number of reads in flight for image files, set from the command line.
+// 0 maps image files into memory instead.
+unsigned int AioImageDepth = 0;
+
+// Cache cost of a page, since the storage that calls for this engine is
+// usually slow.
+#define AIO_IMAGE_COST 4
+
+typedef struct {
+	BLOCK_SOURCE Source;
+	AIO Aio;
+} AIO_IMAGE;
+
+bool AioImageRead(BLOCK_SOURCE *Source, uint64_t Offset, uint8_t *Buf, size_t Size)
+{
+	BLOCK_REQUEST req = {.Offset = Offset, .Buf = Buf, .Size = Size};
+	return AioRead(&((AIO_IMAGE*)Source)->Aio, &req, 1);
+}
+
+void AioImageReadBatch(BLOCK_SOURCE *Source, BLOCK_REQUEST *Requests, size_t Count)
+{
+	AioRead(&((AIO_IMAGE*)Source)->Aio, Requests, Count);
+}
+
+void AioImageFree(BLOCK_SOURCE *Source)
+{
+	AIO_IMAGE *ai = (AIO_IMAGE*)Source;
+	AioClose(&ai->Aio);
+	HeapFree(GetProcessHeap(), 0, ai);
+}
+
+// Opens [FN] with unbuffered reads through a block source, rather than
+// mapping it. Returns 0 on success, or the negative exit code of dimount on
+// failure.
+int AioImageOpen(CONTAINER *Image, const wchar_t *FN)
+{
+	int ret = 0;
+	LARGE_INTEGER size;
+	AIO_IMAGE *ai = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(AIO_IMAGE));
+	if(!ai) {
+		fwprintf(stderr, L"**Error** Out of memory while opening %s.\n", FN);
+		return -5;
+	}
+	DWORD err = AioOpen(&ai->Aio, FN, AioImageDepth, false);
+	if(err) {
+		ret = ReportError(-2, err, L"Error opening %s", FN);
+		goto end;
+	}
+	W32_ERR_REPORT(!GetFileSizeEx(ai->Aio.File, &size),
+		-3, L"Error retrieving the file size of %s", FN
+	);
+	if(size.QuadPart == 0) {
+		fwprintf(stderr, L"Not mounting an empty file.\n");
+		ret = -4;
+		goto end;
+	}
+	GetFileTime(ai->Aio.File, NULL, NULL, &Image->MTime);
+	ai->Source.Read = AioImageRead;
+	ai->Source.ReadBatch = AioImageReadBatch;
+	ai->Source.Free = AioImageFree;
+	ai->Source.Cost = AIO_IMAGE_COST;
+	err = BlockSourceOpen(&ai->Source, size.QuadPart, FN);
+	if(err) {
+		ret = ReportError(-6, err, L"Error mapping %s into memory", FN);
+		goto end;
+	}
+	Image->Source = &ai->Source;
+	Image->FileView = ai->Source.View;
+	Image->View = Image->FileView;
+	ai = NULL;
+end:
+	if(ai) {
+		AioImageFree(&ai->Source);
+	}
+	return ret;
+}
+/// ------
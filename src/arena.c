@@ -0,0 +1,142 @@
+/*
+ * Dokan Image Mounter - Per-file system metadata memory
+ */
+
+// Default size of a newly allocated arena chunk, including its header.
+#define ARENA_CHUNK_SIZE 0x10000
+
+typedef struct ARENA_CHUNK {
+	struct ARENA_CHUNK *Prev;
+	size_t Size;
+	size_t Used;
+	// Keeps the data 16-byte-aligned on both 32- and 64-bit.
+	uint64_t Padding;
+} ARENA_CHUNK;
+
+size_t PoolClass(size_t Size)
+{
+	size_t c = 0;
+	while((POOL_MIN_SIZE << c) < Size) {
+		c++;
+	}
+	return c;
+}
+
+// Bump-allocates [Size] bytes from the current chunk of [Arena], without
+// locking or accounting. Returns NULL if we're out of memory or would go over
+// the arena's limit.
+void* ArenaAllocUnlocked(ARENA *Arena, size_t Size)
+{
+	Size = (Size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	ARENA_CHUNK *chunk = Arena->Chunk;
+	if(!chunk || chunk->Size - chunk->Used < Size) {
+		size_t chunk_size = max(ARENA_CHUNK_SIZE, sizeof(ARENA_CHUNK) + Size);
+		if(Arena->Limit && Arena->BytesReserved + chunk_size > Arena->Limit) {
+			return NULL;
+		}
+		chunk = HeapAlloc(GetProcessHeap(), 0, chunk_size);
+		if(!chunk) {
+			return NULL;
+		}
+		chunk->Prev = Arena->Chunk;
+		chunk->Size = chunk_size;
+		chunk->Used = sizeof(ARENA_CHUNK);
+		Arena->Chunk = chunk;
+		Arena->BytesReserved += chunk_size;
+	}
+	void *ret = (uint8_t*)chunk + chunk->Used;
+	chunk->Used += Size;
+	return ret;
+}
+
+void* ArenaAlloc(ARENA *Arena, size_t Size)
+{
+	assert(Arena);
+	AcquireSRWLockExclusive(&Arena->Lock);
+	void *ret = ArenaAllocUnlocked(Arena, Size);
+	if(ret) {
+		// What the allocation actually takes up from its chunk
+		Arena->BytesUsed += (Size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	}
+	ReleaseSRWLockExclusive(&Arena->Lock);
+	if(ret) {
+		ZeroMemory(ret, Size);
+	}
+	return ret;
+}
+
+void* PoolAlloc(ARENA *Arena, size_t Size)
+{
+	assert(Arena);
+	assert(Size <= POOL_MAX_SIZE);
+	size_t c = PoolClass(Size);
+	void *ret;
+	AcquireSRWLockExclusive(&Arena->Lock);
+	ret = Arena->FreeLists[c];
+	if(ret) {
+		Arena->FreeLists[c] = *(void**)ret;
+		Arena->PoolBytesFree -= POOL_MIN_SIZE << c;
+	} else {
+		ret = ArenaAllocUnlocked(Arena, POOL_MIN_SIZE << c);
+		if(ret) {
+			Arena->BytesUsed += POOL_MIN_SIZE << c;
+		}
+	}
+	if(ret) {
+		Arena->PoolBytesLive += POOL_MIN_SIZE << c;
+	}
+	ReleaseSRWLockExclusive(&Arena->Lock);
+	if(ret) {
+		ZeroMemory(ret, Size);
+	}
+	return ret;
+}
+
+void PoolFree(ARENA *Arena, void *Ptr, size_t Size)
+{
+	assert(Arena);
+	if(!Ptr) {
+		return;
+	}
+	size_t c = PoolClass(Size);
+	AcquireSRWLockExclusive(&Arena->Lock);
+	*(void**)Ptr = Arena->FreeLists[c];
+	Arena->FreeLists[c] = Ptr;
+	Arena->PoolBytesLive -= POOL_MIN_SIZE << c;
+	Arena->PoolBytesFree += POOL_MIN_SIZE << c;
+	ReleaseSRWLockExclusive(&Arena->Lock);
+}
+
+void ArenaFree(ARENA *Arena)
+{
+	assert(Arena);
+	ARENA_CHUNK *chunk = Arena->Chunk;
+	while(chunk) {
+		ARENA_CHUNK *prev = chunk->Prev;
+		HeapFree(GetProcessHeap(), 0, chunk);
+		chunk = prev;
+	}
+	uint64_t limit = Arena->Limit;
+	ZeroMemory(Arena, sizeof(*Arena));
+	Arena->Limit = limit;
+}
+
+void ArenaSetLimit(ARENA *Arena, uint64_t Limit)
+{
+	assert(Arena);
+	AcquireSRWLockExclusive(&Arena->Lock);
+	Arena->Limit = Limit;
+	ReleaseSRWLockExclusive(&Arena->Lock);
+}
+
+void ArenaStats(ARENA *Arena, ARENA_STATS *Stats)
+{
+	assert(Arena);
+	assert(Stats);
+	AcquireSRWLockShared(&Arena->Lock);
+	Stats->BytesReserved = Arena->BytesReserved;
+	Stats->BytesUsed = Arena->BytesUsed;
+	Stats->PoolBytesLive = Arena->PoolBytesLive;
+	Stats->PoolBytesFree = Arena->PoolBytesFree;
+	ReleaseSRWLockShared(&Arena->Lock);
+}
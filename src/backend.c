@@ -19,20 +19,21 @@ void CopyFindDataAToW(
 	fd_w->dwReserved0 = fd_a->dwReserved0;
 	fd_w->dwReserved1 = fd_a->dwReserved1;
 	MultiByteToWideChar(
-		CodePage, 0, fd_a->cFileName, -1, fd_w->cFileName, sizeof(fd_w->cFileName)
+		CodePage, 0, fd_a->cFileName, -1, fd_w->cFileName, elementsof(fd_w->cFileName)
 	);
+	fd_w->cAlternateFileName[0] = L'\0';
 }
 
-int FindAddFileA(FIND_CALLBACK_DATA *FCD, WIN32_FIND_DATAA *FD)
+int FindAddFileA(FIND_CALLBACK_DATA *FCD, WIN32_FIND_DATAA *FD, ULONG64 File)
 {
 	WIN32_FIND_DATAW fd_w;
 	CopyFindDataAToW(FCD->FS->CodePage, &fd_w, FD);
-	return FindAddFileW(FCD, &fd_w);
+	return FindAddFileW(FCD, &fd_w, File);
 }
 
-int FindAddFileW(FIND_CALLBACK_DATA *FCD, WIN32_FIND_DATAW *FD)
+int FindAddFileW(FIND_CALLBACK_DATA *FCD, WIN32_FIND_DATAW *FD, ULONG64 File)
 {
-	return FCD->FillFindData(FD, FCD->DokanFileInfo);
+	return FCD->AddFile(FCD, FD, File);
 }
 /// ---------
 
@@ -82,6 +83,43 @@ const CFORMAT* ImageCFormatProbe(CONTAINER *Image)
 	}
 	return NULL;
 }
+
+int ImageProbe(CONTAINER *Image, FILESYSTEM **FS, FILE *Log)
+{
+	assert(Image);
+	assert(FS);
+	*FS = NULL;
+	if(ImageCFormatProbe(Image)) {
+		if(Log) {
+			fwprintf(Log, L"Container format: %s\n", Image->CFormat->Name);
+		}
+	} else {
+		fwprintf(stderr, L"Unknown container format.\n");
+		return -7;
+	}
+	int partitions_found = ImagePTFormatProbe(Image);
+	if(partitions_found > 0) {
+		if(Log) {
+			fwprintf(Log, L"Partition table format: %s\n", Image->PTFormat->Name);
+		}
+	} else if(partitions_found == 0) {
+		fwprintf(stderr, L"No partitions in image.\n");
+		return -8;
+	} else if(partitions_found < 0) {
+		fwprintf(stderr, L"Unknown partition table format.\n");
+		return -9;
+	}
+	for(int i = 0; i < partitions_found; i++) {
+		if(!ImageFSFormatProbe(&Image->Partitions[i])) {
+			*FS = &Image->Partitions[i];
+		}
+	}
+	if(!*FS) {
+		fwprintf(stderr, L"Found no supported file system on any partition.\n");
+		return -10;
+	}
+	return 0;
+}
 /// -------
 
 /// Instance types
@@ -96,6 +134,7 @@ FILESYSTEM* FSNew(CONTAINER *Image, unsigned int PartNum, uint64_t Start, uint64
 	}
 	FILESYSTEM *fs = &Image->Partitions[PartNum];
 	fs->Image = Image;
+	ArenaSetLimit(&fs->Arena, Image->MetadataLimit);
 	fs->View.Memory = memory;
 	fs->View.Size = size;
 	if(!LAt(fs, size, 0)) {
@@ -115,8 +154,497 @@ BOOL FSLabelSetA(FILESYSTEM* FS, const char *Label, size_t LabelLen)
 		FS->CodePage, 0, Label, -1, FS->Label, TrimmedLength(Label, LabelLen)
 	);
 }
+
+void FSClose(FILESYSTEM *FS)
+{
+	assert(FS);
+	if(FS->MetaCache) {
+		CacheUnregister(FS->MetaCache);
+		FS->MetaCache = NULL;
+	}
+	ArenaFree(&FS->Arena);
+	FS->FSData = NULL;
+	FS->FSFormat = NULL;
+}
+
+ULONG64 FSFileLookupW(FILESYSTEM *FS, const wchar_t *FileName)
+{
+	assert(FS);
+	const FSFORMAT *fmt = FS->FSFormat;
+	if(fmt->FileLookupW) {
+		return fmt->FileLookupW(FS, FileName);
+	}
+	char filename_a[MAX_PATH];
+	WideCharToMultiByte(
+		FS->CodePage, 0, FileName, -1, filename_a, sizeof(filename_a), NULL, NULL
+	);
+	return fmt->FileLookupA(FS, filename_a);
+}
+
+int ImageOpen(CONTAINER *Image, const wchar_t *FN)
+{
+	int ret = 0;
+	assert(Image);
+	assert(FN);
+
+	if(StoreIsRecipe(FN)) {
+		return StoreImageOpen(Image, FN);
+	} else if(SegmentIsFirst(FN)) {
+		return SegmentImageOpen(Image, FN);
+	} else if(TierCacheFN) {
+		return TierImageOpen(Image, FN);
+	} else if(AioImageDepth) {
+		return AioImageOpen(Image, FN);
+	}
+	// TODO: Open writable.
+	// TODO: Don't lock the image file.
+	// Direct reads open the file a second time.
+	Image->File = CreateFileW(
+		FN, GENERIC_READ, DirectReads ? FILE_SHARE_READ : 0, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL
+	);
+	W32_ERR_REPORT(Image->File == INVALID_HANDLE_VALUE,
+		-2, L"Error opening %s", FN
+	);
+	LARGE_INTEGER image_size;
+	W32_ERR_REPORT(!GetFileSizeEx(Image->File, &image_size),
+		-3, L"Error retrieving the file size of %s", FN
+	);
+	if(image_size.QuadPart == 0) {
+		fwprintf(stderr, L"Not mounting an empty file.\n");
+		ret = -4;
+		goto end;
+	}
+	GetFileTime(Image->File, NULL, NULL, &Image->MTime);
+	HolesQuery(&Image->Holes, Image->File, image_size.QuadPart);
+	DirectOpen(Image, FN);
+	// TODO: Writable, again.
+	Image->Map = CreateFileMapping(
+		Image->File, NULL, PAGE_READONLY, 0, 0, NULL
+	);
+	W32_ERR_REPORT(
+		!Image->Map, -5, L"Error mapping %s", FN
+	);
+
+	// TODO: Writable, again.
+	Image->FileView.Memory = MapViewOfFile(Image->Map, FILE_MAP_READ, 0, 0, 0);
+	Image->FileView.Size = image_size.QuadPart;
+	W32_ERR_REPORT(
+		!Image->FileView.Memory, -6, L"Error mapping %s into memory", FN
+	);
+	Image->View = Image->FileView;
+end:
+	return ret;
+}
+
+void ImageClose(CONTAINER *Image)
+{
+	assert(Image);
+	for(int i = 0; i < elementsof(Image->Partitions); i++) {
+		FSClose(&Image->Partitions[i]);
+	}
+	if(Image->Source) {
+		BlockSourceClose(Image->Source);
+	} else if(Image->FileView.Memory) {
+		UnmapViewOfFile(Image->FileView.Memory);
+	}
+	if(Image->Map) {
+		CloseHandle(Image->Map);
+	}
+	if(Image->File && Image->File != INVALID_HANDLE_VALUE) {
+		CloseHandle(Image->File);
+	}
+	HolesFree(&Image->Holes);
+	DirectClose(Image);
+	ZeroMemory(Image, sizeof(*Image));
+}
 /// --------------
 
+/// Prefetching
+/// -----------
+// Extents collected per BlockSourcePrefetch() call
+#define FS_PREFETCH_RANGES 64
+
+typedef struct {
+	FILESYSTEM *FS;
+	// Remaining part of the file to skip and to prefetch
+	uint64_t Skip;
+	uint64_t Length;
+	size_t Count;
+	BLOCK_RANGE Ranges[FS_PREFETCH_RANGES];
+} FS_PREFETCH;
+
+void FSPrefetchFlush(FS_PREFETCH *Pre)
+{
+	CONTAINER *image = Pre->FS->Image;
+	uint64_t base = FSImageOffset(Pre->FS, 0);
+	for(size_t i = 0; i < Pre->Count; i++) {
+		Pre->Ranges[i].Offset += base;
+	}
+	BlockSourcePrefetch(image->Source, Pre->Ranges, Pre->Count);
+	Pre->Count = 0;
+}
+
+int FSPrefetchExtent(void *Param, uint64_t Offset, uint64_t Length)
+{
+	FS_PREFETCH *pre = (FS_PREFETCH*)Param;
+	if(pre->Skip >= Length) {
+		pre->Skip -= Length;
+		return 0;
+	}
+	if(Offset == FS_EXTENT_ZERO) {
+		// Nothing to read, and it's the last extent anyway.
+		return 1;
+	}
+	Offset += pre->Skip;
+	Length = min(Length - pre->Skip, pre->Length);
+	pre->Skip = 0;
+	if(pre->Count == FS_PREFETCH_RANGES) {
+		FSPrefetchFlush(pre);
+	}
+	pre->Ranges[pre->Count].Offset = Offset;
+	pre->Ranges[pre->Count].Length = Length;
+	pre->Count++;
+	pre->Length -= Length;
+	return pre->Length == 0;
+}
+
+void FSPrefetch(FILESYSTEM *FS, uint64_t Offset, uint64_t Length)
+{
+	assert(FS);
+	BLOCK_SOURCE *source = FS->Image->Source;
+	if(!source || !source->ReadBatch) {
+		return;
+	}
+	BLOCK_RANGE range = {
+		.Offset = FSImageOffset(FS, Offset),
+		.Length = Length,
+	};
+	BlockSourcePrefetch(source, &range, 1);
+}
+
+void FSPrefetchFile(FILESYSTEM *FS, ULONG64 File, uint64_t Offset, uint64_t Length)
+{
+	assert(FS);
+	BLOCK_SOURCE *source = FS->Image->Source;
+	if(!source || !source->ReadBatch || !Length) {
+		return;
+	}
+	FS_PREFETCH pre = {
+		.FS = FS,
+		.Skip = Offset,
+		.Length = Length,
+	};
+	// All extents of the range go into as few batches as possible, so that
+	// the reads for a fragmented file are still in flight together.
+	FS->FSFormat->FileExtents(FS, File, FSPrefetchExtent, &pre);
+	if(pre.Count) {
+		FSPrefetchFlush(&pre);
+	}
+}
+/// -----------
+
+/// Layout
+/// ------
+// Longest line written by FSFileLayoutText(): three 20-digit numbers, two
+// spaces, a newline and the terminating \0 of snprintf().
+#define FS_LAYOUT_LINE 64
+
+typedef struct {
+	uint64_t Base;
+	uint64_t Logical;
+	char *Text;
+	size_t Cap;
+	size_t Len;
+	bool Failed;
+} FS_LAYOUT;
+
+uint64_t FSImageOffset(FILESYSTEM *FS, uint64_t Offset)
+{
+	assert(FS);
+	return (FS->View.Memory - FS->Image->FileView.Memory) + Offset;
+}
+
+int FSLayoutExtent(void *Param, uint64_t Offset, uint64_t Length)
+{
+	FS_LAYOUT *layout = (FS_LAYOUT*)Param;
+	if(!ArrayReserve(
+		(void**)&layout->Text, &layout->Cap, 1, layout->Len + FS_LAYOUT_LINE
+	)) {
+		layout->Failed = true;
+		return 1;
+	}
+	// Zero extents have no physical location.
+	int len = (Offset == FS_EXTENT_ZERO)
+		? snprintf(
+			layout->Text + layout->Len, FS_LAYOUT_LINE, "%llu - %llu\n",
+			layout->Logical, Length
+		)
+		: snprintf(
+			layout->Text + layout->Len, FS_LAYOUT_LINE, "%llu %llu %llu\n",
+			layout->Logical, layout->Base + Offset, Length
+		);
+	layout->Len += len;
+	layout->Logical += Length;
+	return 0;
+}
+
+char* FSFileLayoutText(FILESYSTEM *FS, ULONG64 File, size_t *Len, NTSTATUS *Status)
+{
+	assert(FS);
+	assert(Len);
+	assert(Status);
+	FS_LAYOUT layout = {.Base = FSImageOffset(FS, 0)};
+	// Empty files still get an (empty) buffer.
+	if(!ArrayReserve((void**)&layout.Text, &layout.Cap, 1, FS_LAYOUT_LINE)) {
+		return NULL;
+	}
+	*Status = FS->FSFormat->FileExtents(FS, File, FSLayoutExtent, &layout);
+	if(layout.Failed) {
+		HeapFree(GetProcessHeap(), 0, layout.Text);
+		return NULL;
+	}
+	*Len = layout.Len;
+	return layout.Text;
+}
+/// ------
+
+/// Traversal
+/// ---------
+typedef struct {
+	FILESYSTEM *FS;
+	FS_WALK_FUNC Func;
+	void *Param;
+	bool Recurse;
+	int Ret;
+	size_t PathLen;
+	wchar_t Path[FS_PATH_MAX];
+} FS_WALK;
+
+int FSWalkAddFile(FIND_CALLBACK_DATA *FCD, WIN32_FIND_DATAW *FD, ULONG64 File)
+{
+	FS_WALK *walk = (FS_WALK*)FCD->Param;
+	if(walk->Ret || IsDotEntryW(FD->cFileName)) {
+		return 0;
+	}
+	size_t parent_len = walk->PathLen;
+	size_t fn_len = wcslen(FD->cFileName);
+	if(parent_len + 1 + fn_len >= elementsof(walk->Path)) {
+		fwprintf(stderr,
+			L"**Warning** skipping %s\\%s: path too long\n", walk->Path, FD->cFileName
+		);
+		return 0;
+	}
+	walk->Path[parent_len] = L'\\';
+	memcpy(&walk->Path[parent_len + 1], FD->cFileName, (fn_len + 1) * sizeof(wchar_t));
+	walk->PathLen += 1 + fn_len;
+
+	int ret = walk->Func(walk->Param, walk->Path, walk->PathLen, FD, File);
+	if(ret == FS_WALK_PRUNE) {
+		ret = 0;
+	} else if(!ret && walk->Recurse && (FD->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+		walk->FS->FSFormat->FindFiles(walk->FS, File, FCD);
+	}
+	walk->Ret = walk->Ret ? walk->Ret : ret;
+	walk->PathLen = parent_len;
+	walk->Path[parent_len] = L'\0';
+	return 0;
+}
+
+int FSWalkDir(FILESYSTEM *FS, const wchar_t *Dir, bool Recurse, FS_WALK_FUNC Func, void *Param)
+{
+	assert(FS);
+	assert(Dir);
+	assert(Func);
+	FS_WALK *walk = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(FS_WALK));
+	if(!walk) {
+		return ERROR_OUTOFMEMORY;
+	}
+	walk->FS = FS;
+	walk->Func = Func;
+	walk->Param = Param;
+	walk->Recurse = Recurse;
+	// Normalize [Dir] to the \a\b form, with an empty root.
+	for(const wchar_t *p = Dir; *p && walk->PathLen < FS_PATH_MAX - 2; p++) {
+		if(!IsDirSepW(*p)) {
+			if(p == Dir || IsDirSepW(p[-1])) {
+				walk->Path[walk->PathLen++] = L'\\';
+			}
+			walk->Path[walk->PathLen++] = *p;
+		}
+	}
+	walk->Path[walk->PathLen] = L'\0';
+	ULONG64 dir = FSFileLookupW(FS, walk->PathLen ? walk->Path : L"\\");
+	if(!dir) {
+		HeapFree(GetProcessHeap(), 0, walk);
+		return ERROR_PATH_NOT_FOUND;
+	}
+
+	FIND_CALLBACK_DATA fcd = {
+		.FS = FS,
+		.AddFile = FSWalkAddFile,
+		.Param = walk
+	};
+	FS->FSFormat->FindFiles(FS, dir, &fcd);
+	int ret = walk->Ret;
+	HeapFree(GetProcessHeap(), 0, walk);
+	return ret;
+}
+
+int FSWalk(FILESYSTEM *FS, FS_WALK_FUNC Func, void *Param)
+{
+	return FSWalkDir(FS, L"\\", true, Func, Param);
+}
+
+typedef struct FS_WALK_QUEUED {
+	struct FS_WALK_QUEUED *Next;
+	ULONG64 Dir;
+	size_t PathLen;
+	wchar_t Path[];
+} FS_WALK_QUEUED;
+
+typedef struct {
+	FILESYSTEM *FS;
+	FS_WALK_FUNC Func;
+	void *Param;
+	SRWLOCK Lock;
+	CONDITION_VARIABLE Wake;
+	FS_WALK_QUEUED *Queue;
+	// Number of directories currently being read
+	LONG Busy;
+	volatile LONG Ret;
+} FS_WALK_PARALLEL;
+
+// Per-thread state, passed as FIND_CALLBACK_DATA::Param.
+typedef struct {
+	FS_WALK_PARALLEL *Walk;
+	const FS_WALK_QUEUED *Parent;
+	wchar_t Path[FS_PATH_MAX];
+} FS_WALK_THREAD;
+
+bool FSWalkQueue(FS_WALK_PARALLEL *Walk, ULONG64 Dir, const wchar_t *Path, size_t PathLen)
+{
+	FS_WALK_QUEUED *q = HeapAlloc(
+		GetProcessHeap(), 0, sizeof(FS_WALK_QUEUED) + (PathLen + 1) * sizeof(wchar_t)
+	);
+	if(!q) {
+		return false;
+	}
+	q->Dir = Dir;
+	q->PathLen = PathLen;
+	memcpy(q->Path, Path, (PathLen + 1) * sizeof(wchar_t));
+	AcquireSRWLockExclusive(&Walk->Lock);
+	q->Next = Walk->Queue;
+	Walk->Queue = q;
+	ReleaseSRWLockExclusive(&Walk->Lock);
+	WakeConditionVariable(&Walk->Wake);
+	return true;
+}
+
+int FSWalkParallelAddFile(FIND_CALLBACK_DATA *FCD, WIN32_FIND_DATAW *FD, ULONG64 File)
+{
+	FS_WALK_THREAD *thread = (FS_WALK_THREAD*)FCD->Param;
+	FS_WALK_PARALLEL *walk = thread->Walk;
+	if(walk->Ret || IsDotEntryW(FD->cFileName)) {
+		return 0;
+	}
+	size_t parent_len = thread->Parent->PathLen;
+	size_t fn_len = wcslen(FD->cFileName);
+	if(parent_len + 1 + fn_len >= elementsof(thread->Path)) {
+		fwprintf(stderr,
+			L"**Warning** skipping %s\\%s: path too long\n", thread->Parent->Path, FD->cFileName
+		);
+		return 0;
+	}
+	size_t path_len = parent_len + 1 + fn_len;
+	memcpy(thread->Path, thread->Parent->Path, parent_len * sizeof(wchar_t));
+	thread->Path[parent_len] = L'\\';
+	memcpy(&thread->Path[parent_len + 1], FD->cFileName, (fn_len + 1) * sizeof(wchar_t));
+
+	int ret = walk->Func(walk->Param, thread->Path, path_len, FD, File);
+	if(ret == FS_WALK_PRUNE) {
+		ret = 0;
+	} else if(!ret && (FD->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+		if(!FSWalkQueue(walk, File, thread->Path, path_len)) {
+			ret = ERROR_OUTOFMEMORY;
+		}
+	}
+	if(ret) {
+		InterlockedCompareExchange(&walk->Ret, ret, 0);
+	}
+	return 0;
+}
+
+DWORD WINAPI FSWalkParallelWorker(void *Param)
+{
+	FS_WALK_PARALLEL *walk = (FS_WALK_PARALLEL*)Param;
+	FS_WALK_THREAD *thread = HeapAlloc(GetProcessHeap(), 0, sizeof(FS_WALK_THREAD));
+	if(!thread) {
+		return ERROR_OUTOFMEMORY;
+	}
+	thread->Walk = walk;
+	FIND_CALLBACK_DATA fcd = {
+		.FS = walk->FS,
+		.AddFile = FSWalkParallelAddFile,
+		.Param = thread
+	};
+	AcquireSRWLockExclusive(&walk->Lock);
+	for(;;) {
+		// The walk is done once the queue is empty and nobody is still
+		// reading a directory that could add more.
+		while(!walk->Queue && walk->Busy && !walk->Ret) {
+			SleepConditionVariableSRW(&walk->Wake, &walk->Lock, INFINITE, 0);
+		}
+		if(!walk->Queue || walk->Ret) {
+			break;
+		}
+		FS_WALK_QUEUED *q = walk->Queue;
+		walk->Queue = q->Next;
+		walk->Busy++;
+		ReleaseSRWLockExclusive(&walk->Lock);
+
+		thread->Parent = q;
+		walk->FS->FSFormat->FindFiles(walk->FS, q->Dir, &fcd);
+		HeapFree(GetProcessHeap(), 0, q);
+
+		AcquireSRWLockExclusive(&walk->Lock);
+		walk->Busy--;
+	}
+	ReleaseSRWLockExclusive(&walk->Lock);
+	WakeAllConditionVariable(&walk->Wake);
+	HeapFree(GetProcessHeap(), 0, thread);
+	return 0;
+}
+
+int FSWalkParallel(FILESYSTEM *FS, unsigned int Threads, FS_WALK_FUNC Func, void *Param)
+{
+	assert(FS);
+	assert(Func);
+	FS_WALK_PARALLEL walk = {
+		.FS = FS,
+		.Func = Func,
+		.Param = Param,
+		.Lock = SRWLOCK_INIT,
+		.Wake = CONDITION_VARIABLE_INIT,
+	};
+	ULONG64 root = FSFileLookupW(FS, L"\\");
+	if(!root) {
+		return ERROR_PATH_NOT_FOUND;
+	}
+	if(!FSWalkQueue(&walk, root, L"", 0)) {
+		return ERROR_OUTOFMEMORY;
+	}
+	WorkersRun(Threads, FSWalkParallelWorker, &walk);
+	// Left over if a callback stopped the traversal.
+	while(walk.Queue) {
+		FS_WALK_QUEUED *q = walk.Queue;
+		walk.Queue = q->Next;
+		HeapFree(GetProcessHeap(), 0, q);
+	}
+	return walk.Ret;
+}
+/// ---------
+
 /// Addressing
 /// ----------
 uint8_t *At(VIEW *View, uint64_t Pos, UINT Size)
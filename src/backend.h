@@ -13,6 +13,58 @@ typedef struct {
 } CHS;
 /// ------------
 
+/// Memory
+/// ------
+// Alignment of all arena and pool allocations.
+#define ARENA_ALIGN 16
+// Size classes of the pool, as powers of two between these two sizes.
+#define POOL_MIN_SIZE 16
+#define POOL_MAX_SIZE 4096
+#define POOL_CLASSES 9
+
+// Region allocator for metadata that lives as long as its file system.
+// Allocations are thread-safe, and everything is freed at once by
+// ArenaFree(). Objects that need to be released individually before that
+// come from a size-class pool on top of the arena, whose freed objects are
+// recycled for later pool allocations of the same class.
+typedef struct {
+	SRWLOCK Lock;
+	struct ARENA_CHUNK *Chunk;
+	void *FreeLists[POOL_CLASSES];
+	// Maximum value of [BytesReserved], or 0 for no limit.
+	uint64_t Limit;
+
+	// Accounting
+	uint64_t BytesReserved; // in chunks allocated from the heap
+	uint64_t BytesUsed; // by arena allocations and pool objects
+	uint64_t PoolBytesLive;
+	uint64_t PoolBytesFree;
+} ARENA;
+
+typedef struct {
+	uint64_t BytesReserved;
+	uint64_t BytesUsed;
+	uint64_t PoolBytesLive;
+	uint64_t PoolBytesFree;
+} ARENA_STATS;
+
+// Returns [Size] zeroed bytes that stay valid until ArenaFree(), or NULL if
+// we're out of memory or over the arena's limit.
+void* ArenaAlloc(ARENA *Arena, size_t Size);
+// Frees all memory allocated from [Arena], keeping its limit.
+void ArenaFree(ARENA *Arena);
+// Makes allocations fail once [Arena] would reserve more than [Limit] bytes
+// from the heap. 0 removes the limit. Memory that is already reserved stays
+// where it is.
+void ArenaSetLimit(ARENA *Arena, uint64_t Limit);
+void ArenaStats(ARENA *Arena, ARENA_STATS *Stats);
+
+// Returns [Size] zeroed bytes, with [Size] <= POOL_MAX_SIZE.
+void* PoolAlloc(ARENA *Arena, size_t Size);
+// [Size] must be the same value that was passed to PoolAlloc() for [Ptr].
+void PoolFree(ARENA *Arena, void *Ptr, size_t Size);
+/// ------
+
 /// Format types
 /// ------------
 typedef struct CONTAINER CONTAINER;
@@ -20,14 +72,31 @@ typedef struct FILESYSTEM FILESYSTEM;
 
 // Callbacks
 // ---------
-typedef struct {
+typedef struct FIND_CALLBACK_DATA FIND_CALLBACK_DATA;
+
+// Receives every file found by FindFiles(), in the style of Dokan's
+// FillFindData(). [File] is the handle of the file, as it would have been
+// returned by FileLookup().
+typedef int(*FIND_ADD_FUNC)(FIND_CALLBACK_DATA *FCD, WIN32_FIND_DATAW *FD, ULONG64 File);
+
+typedef struct FIND_CALLBACK_DATA {
 	FILESYSTEM *FS;
-	PFillFindData FillFindData;
-	PDOKAN_FILE_INFO DokanFileInfo;
+	FIND_ADD_FUNC AddFile;
+	void *Param;
 } FIND_CALLBACK_DATA;
 
-int FindAddFileA(FIND_CALLBACK_DATA *FCD, WIN32_FIND_DATAA *FD);
-int FindAddFileW(FIND_CALLBACK_DATA *FCD, WIN32_FIND_DATAW *FD);
+int FindAddFileA(FIND_CALLBACK_DATA *FCD, WIN32_FIND_DATAA *FD, ULONG64 File);
+int FindAddFileW(FIND_CALLBACK_DATA *FCD, WIN32_FIND_DATAW *FD, ULONG64 File);
+
+// Receives one contiguous run of file data, given as a byte offset into the
+// VIEW of the file system, and its length in bytes. Returning nonzero stops
+// the enumeration.
+typedef int(*FILE_EXTENT_FUNC)(void *Param, uint64_t Offset, uint64_t Length);
+
+// Offset of an extent that doesn't come from the image and reads as zeroes,
+// such as the part of an exFAT file past its valid data length. Only ever
+// passed as the last extent of a file.
+#define FS_EXTENT_ZERO UINT64_MAX
 // ---------
 
 // All callbacks that handle file names come in both A and W functions.
@@ -50,10 +119,23 @@ typedef struct FSFORMAT {
 	ULONG64(*FileLookupW)(FILESYSTEM *FS, const wchar_t *FileName);
 	// Calls FindAddFileA()/FindAddFileW() for every file in [DirName].
 	NTSTATUS(*FindFiles)(FILESYSTEM *FS, ULONG64 Dir, FIND_CALLBACK_DATA *FCD);
-	NTSTATUS(*CreateFileA)(FILESYSTEM *FS, const char *FileName, DWORD AccessMode, DWORD CreationDisposition, DWORD FlagsAndAttributes, PDOKAN_FILE_INFO DokanFileInfo);
-	NTSTATUS(*CreateFileW)(FILESYSTEM *FS, const wchar_t *FileName, DWORD AccessMode, DWORD CreationDisposition, DWORD FlagsAndAttributes, PDOKAN_FILE_INFO DokanFileInfo);
-	NTSTATUS(*GetFileInformation)(FILESYSTEM *FS, LPBY_HANDLE_FILE_INFORMATION HandleFileInfo, PDOKAN_FILE_INFO DokanFileInfo);
-	NTSTATUS(*ReadFile)(FILESYSTEM *FS, uint8_t *Buffer, DWORD BufferLength, LPDWORD ReadLength, LONGLONG Offset, PDOKAN_FILE_INFO DokanFileInfo);
+	// Fills [HandleFileInfo] with the metadata of [File], except for the
+	// volume serial number.
+	NTSTATUS(*GetFileInformation)(FILESYSTEM *FS, ULONG64 File, LPBY_HANDLE_FILE_INFORMATION HandleFileInfo);
+	// Reads [BufferLength] bytes at [Offset] from [File], which must all lie
+	// within the file, and adds the number of bytes read to [ReadLength].
+	NTSTATUS(*ReadFile)(FILESYSTEM *FS, ULONG64 File, uint8_t *Buffer, DWORD BufferLength, LPDWORD ReadLength, LONGLONG Offset);
+	// Calls [Func] for every contiguous run of data in [File], in file order,
+	// with adjacent clusters already merged. Returns STATUS_DISK_CORRUPT_ERROR
+	// if the allocation chain of [File] is broken.
+	NTSTATUS(*FileExtents)(FILESYSTEM *FS, ULONG64 File, FILE_EXTENT_FUNC Func, void *Param);
+	// Returns the number of the first cluster allocated to [File], or 0 if
+	// there is none.
+	uint64_t(*FileFirstCluster)(FILESYSTEM *FS, ULONG64 File);
+	// Calls [Func] for every region of [FS] that holds allocation tables or
+	// other volume-wide metadata outside of any directory, in the same units
+	// as FileExtents().
+	void(*MetadataExtents)(FILESYSTEM *FS, FILE_EXTENT_FUNC Func, void *Param);
 
 	// Returns the file size member of the file system's directory entry structure.
 	LONGLONG(*FileSize)(const void *DEntry);
@@ -67,9 +149,11 @@ typedef struct FSFORMAT {
 		.DiskSizes = FS_##ID##_DiskSizes, \
 		.FileLookup##CharSet = FS_##ID##_FileLookup##CharSet, \
 		.FindFiles = FS_##ID##_FindFiles, \
-		.CreateFile##CharSet = FS_##ID##_CreateFile##CharSet, \
 		.GetFileInformation = FS_##ID##_GetFileInformation, \
 		.ReadFile = FS_##ID##_ReadFile, \
+		.FileExtents = FS_##ID##_FileExtents, \
+		.FileFirstCluster = FS_##ID##_FileFirstCluster, \
+		.MetadataExtents = FS_##ID##_MetadataExtents, \
 		.FileSize = FS_##ID##_FileSize, \
 	}
 
@@ -102,6 +186,28 @@ typedef struct CFORMAT {
 	}
 /// ------------
 
+/// Commands
+/// --------
+typedef struct COMMAND {
+	// Name of the command, as given as the first command-line argument.
+	const wchar_t *Name;
+	// Argument synopsis for the usage message.
+	const wchar_t *Usage;
+	// Minimum number of arguments following the command name.
+	int MinArgs;
+	// Receives the arguments following the command name.
+	int(*Main)(int argc, const wchar_t *argv[]);
+} COMMAND;
+
+#define NEW_COMMAND(ID, _Name, _Usage, _MinArgs) \
+	const COMMAND CMD_##ID = { \
+		.Name = _Name, \
+		.Usage = _Usage, \
+		.MinArgs = _MinArgs, \
+		.Main = CMD_##ID##_Main \
+	}
+/// --------
+
 /// Probing
 /// -------
 // Returns 0 if a suitable file system has been found for [FS].
@@ -112,6 +218,11 @@ int ImagePTFormatProbe(CONTAINER *Image);
 // Returns the container format identified for [Image], or NULL if no suitable
 // format was identified.
 const CFORMAT* ImageCFormatProbe(CONTAINER *Image);
+// Runs all of the above on [Image], printing the results to [Log] (if not
+// NULL) and errors to stderr. Returns 0 and the last partition with a
+// supported file system in [FS] on success, or the negative exit code of
+// dimount on failure.
+int ImageProbe(CONTAINER *Image, FILESYSTEM **FS, FILE *Log);
 /// -------
 
 /// Addressing
@@ -149,8 +260,15 @@ typedef struct FILESYSTEM {
 	CONTAINER *Image; // CONTAINER that contains this file system
 	VIEW View;
 	const FSFORMAT *FSFormat;
-	// Custom filesystem-specific data, allocated using HeapAlloc()
+	// Metadata memory, freed when the file system is closed
+	ARENA Arena;
+	// Custom filesystem-specific data, allocated from [Arena]
 	void *FSData;
+	// Cache of droppable metadata in [Arena], registered by the file system
+	// format and unregistered when the file system is closed
+	struct CACHE *MetaCache;
+	// Metadata index used to answer requests, if any
+	struct INDEX *Index;
 
 	UINT SectorSize;
 	UINT CodePage;
@@ -166,12 +284,272 @@ FILESYSTEM* FSNew(CONTAINER *Image, unsigned int PartNum, uint64_t Start, uint64
 
 BOOL FSLabelSetA(FILESYSTEM* FS, const char *Label, size_t LabelLen);
 
+// Releases all memory held by [FS].
+void FSClose(FILESYSTEM *FS);
+
+// Calls the A or W version of FileLookup(), depending on which one the file
+// system format of [FS] implements.
+ULONG64 FSFileLookupW(FILESYSTEM *FS, const wchar_t *FileName);
+
+// Receives every file and directory found by FSWalk(). [Path] is the full
+// path of the file, starting with a backslash. Returning nonzero stops the
+// traversal, except for FS_WALK_PRUNE.
+typedef int(*FS_WALK_FUNC)(void *Param, const wchar_t *Path, size_t PathLen, WIN32_FIND_DATAW *FD, ULONG64 File);
+
+// Returned by a FS_WALK_FUNC to continue the traversal without descending
+// into the directory it just received.
+#define FS_WALK_PRUNE (-1)
+
+// Maximum path length supported by FSWalk().
+#define FS_PATH_MAX 1024
+
+// Calls [Func] for every file and directory in the directory [Dir] on [FS].
+// If [Recurse] is true, this continues depth-first into subdirectories, which
+// are passed to [Func] before their contents. Returns 0 on success,
+// ERROR_PATH_NOT_FOUND if [Dir] doesn't exist, or the nonzero value returned
+// by [Func].
+int FSWalkDir(FILESYSTEM *FS, const wchar_t *Dir, bool Recurse, FS_WALK_FUNC Func, void *Param);
+
+// Recursively walks the entire file system.
+int FSWalk(FILESYSTEM *FS, FS_WALK_FUNC Func, void *Param);
+
+// Recursively walks the entire file system, reading the directories on
+// [Threads] worker threads (or one per processor if 0). [Func] is called
+// concurrently from all of them, and the order of the calls is undefined,
+// except that a directory is always passed before its contents.
+int FSWalkParallel(FILESYSTEM *FS, unsigned int Threads, FS_WALK_FUNC Func, void *Param);
+
+/// Concurrent maps
+/// ---------------
+// Number of readers that can be inside a map at the same time. Further ones
+// wait for a slot to become free.
+#define EPOCH_SLOTS 64
+
+typedef struct {
+	// Global epoch of the map when the reader entered, 0 if the slot is free
+	volatile LONGLONG Epoch;
+	// Keeps readers from sharing cache lines.
+	uint8_t Pad[64 - sizeof(LONGLONG)];
+} EPOCH_SLOT;
+
+typedef struct RCU_TABLE RCU_TABLE;
+typedef struct RCU_RETIRED RCU_RETIRED;
+
+// Hash map from 64-bit keys to pointers, for read-mostly data shared by many
+// threads. Lookups take no lock, and only write to a slot that their thread
+// doesn't share with others. Writers are serialized, publish every change
+// with a single atomic store, and free replaced memory only once every
+// lookup that could still see it has left (epoch-based reclamation). All
+// memory comes from [Arena], and is released together with it.
+typedef struct {
+	ARENA *Arena;
+	RCU_TABLE *volatile Table;
+	SRWLOCK WriteLock;
+	size_t Count;
+	volatile LONGLONG Epoch;
+	RCU_RETIRED *Retired;
+	EPOCH_SLOT Slots[EPOCH_SLOTS];
+} RCU_MAP;
+
+void RcuMapInit(RCU_MAP *Map, ARENA *Arena);
+// Returns the value stored for [Key], or NULL if there is none.
+void* RcuMapFind(RCU_MAP *Map, uint64_t Key);
+// Stores [Value] for [Key], unless another value is already stored for it.
+// Returns the value that ends up in the map, or NULL if we're out of memory.
+void* RcuMapInsert(RCU_MAP *Map, uint64_t Key, void *Value);
+// Returns false if there was no value for [Key]. If [ValueSize] is nonzero,
+// the value is freed as well, once no reader can use it anymore.
+bool RcuMapRemove(RCU_MAP *Map, uint64_t Key, size_t ValueSize);
+
+// Readers that keep using a value of a map whose values get removed have to
+// look it up with RcuMapLookup() after entering the map, and can use it
+// until they leave. Each thread can only be inside a map once.
+EPOCH_SLOT* RcuEnter(RCU_MAP *Map);
+void RcuLeave(EPOCH_SLOT *Slot);
+void* RcuMapLookup(RCU_MAP *Map, uint64_t Key);
+/// ---------------
+
+/// Caches
+/// ------
+typedef struct CACHE CACHE;
+
+// Process-wide manager for memory that can be recreated on demand. Every
+// cache registers with it and reports each entry it creates, and the
+// manager evicts entries across all caches in CLOCK order once their total
+// size exceeds the budget.
+typedef struct CACHE {
+	// Filled in by the implementation before CacheRegister()
+	// Tests and clears the reference bit of the entry [Key].
+	bool(*Referenced)(CACHE *Cache, uint64_t Key);
+	// Frees the entry [Key]. Called with the manager locked, so this must
+	// not call back into it.
+	void(*Evict)(CACHE *Cache, uint64_t Key);
+
+	// Filled in by CacheRegister()
+	struct CACHE *Next;
+	wchar_t Name[MAX_PATH];
+
+	// Statistics, updated by both the manager and the implementation
+	volatile LONGLONG Bytes;
+	volatile LONGLONG Hits;
+	volatile LONGLONG Misses;
+	volatile LONGLONG Evictions;
+} CACHE;
+
+// Default budget, as a fraction of physical memory.
+#define CACHE_BUDGET_DIVISOR 4
+
+// Sets the total size of all cache entries, in bytes. 0 restores the
+// default.
+void CacheBudgetSet(uint64_t Bytes);
+void CacheRegister(CACHE *Cache, const wchar_t *Name);
+// Forgets all entries of [Cache] without evicting them.
+void CacheUnregister(CACHE *Cache);
+// Records a new entry of [Size] bytes, which would take [Cost] (at least 1)
+// units of work to recreate, and evicts older ones if necessary. Must not be
+// called while holding a lock that Evict() needs. Hits and misses are
+// counted by the implementation, since not every entry is created by a
+// lookup that missed.
+void CacheInsert(CACHE *Cache, uint64_t Key, uint32_t Size, uint8_t Cost);
+// Writes the occupancy and hit rate of every registered cache to [Out].
+void CacheReport(FILE *Out);
+/// ------
+
+/// Block sources
+/// -------------
+typedef struct BLOCK_SOURCE BLOCK_SOURCE;
+
+// Copies [Size] bytes at [Offset] of the image presented by [Source] to
+// [Buf]. Called without the source locked, from inside an exception handler
+// on whatever thread touched the page, so other threads may be reading other
+// pages at the same time. Returns false on failure.
+typedef bool(*BLOCK_READ_FUNC)(BLOCK_SOURCE *Source, uint64_t Offset, uint8_t *Buf, size_t Size);
+
+typedef struct {
+	uint64_t Offset;
+	uint8_t *Buf;
+	size_t Size;
+	// Set by the BLOCK_READ_BATCH_FUNC
+	bool OK;
+} BLOCK_REQUEST;
+
+// Reads all of [Requests] at once, and sets their [OK] member. Called without
+// the source locked, just like BLOCK_READ_FUNC.
+typedef void(*BLOCK_READ_BATCH_FUNC)(BLOCK_SOURCE *Source, BLOCK_REQUEST *Requests, size_t Count);
+
+// Byte range of a view.
+typedef struct {
+	uint64_t Offset;
+	uint64_t Length;
+} BLOCK_RANGE;
+
+// Presents an image that isn't stored as a single file as a read-only VIEW,
+// so that the rest of the backend can keep addressing it as memory. Pages of
+// the view are filled by [Read] when they are first accessed.
+typedef struct BLOCK_SOURCE {
+	// Filled in by the implementation before BlockSourceOpen()
+	BLOCK_READ_FUNC Read;
+	// Optional. Used by BlockSourcePrefetch() to fill many pages at once.
+	BLOCK_READ_BATCH_FUNC ReadBatch;
+	// Frees the implementation's data, called by BlockSourceClose().
+	void(*Free)(BLOCK_SOURCE *Source);
+	// Relative cost of a Read(), for the cache manager. 0 is treated as 1.
+	uint8_t Cost;
+
+	// Filled in by BlockSourceOpen()
+	struct BLOCK_SOURCE *Next;
+	VIEW View;
+	uint8_t *Fill; // writable alias of [View]
+	uint8_t *Filled; // one bit per page
+	uint8_t *Pending; // one bit per page that is being read
+	uint8_t *Referenced; // one bit per page, for the cache manager
+	HANDLE Section;
+	// Guards [Filled] and [Pending]
+	SRWLOCK Lock;
+	// Signaled whenever pending pages are complete
+	CONDITION_VARIABLE Done;
+	volatile LONGLONG PagesFilled;
+	// Filled pages are cache entries, keyed by page number.
+	CACHE Cache;
+} BLOCK_SOURCE;
+
+// Creates the view of [Size] bytes for [Source], whose filled pages count
+// against the cache budget under [Name]. Returns 0 on success, or a Win32
+// error code.
+DWORD BlockSourceOpen(BLOCK_SOURCE *Source, uint64_t Size, const wchar_t *Name);
+void BlockSourceClose(BLOCK_SOURCE *Source);
+// Fills all pages touched by [Ranges] that aren't filled yet with batched
+// reads, if the source supports them. Does nothing otherwise.
+void BlockSourcePrefetch(BLOCK_SOURCE *Source, const BLOCK_RANGE *Ranges, size_t Count);
+/// -------------
+
+/// Holes
+/// -----
+// Allocated ranges of a sparse image file, as byte offsets into the file and
+// sorted by offset. Everything in between reads as zeroes without being
+// backed by any storage.
+typedef struct {
+	bool Sparse;
+	FILE_ALLOCATED_RANGE_BUFFER *Ranges;
+	size_t RangeCap;
+	size_t RangeCount;
+} HOLES;
+
+// Queries the allocated ranges of the [Size] bytes of [File]. Files that
+// aren't sparse, or whose ranges can't be queried, are treated as fully
+// allocated.
+void HolesQuery(HOLES *Holes, HANDLE File, uint64_t Size);
+void HolesFree(HOLES *Holes);
+/// -----
+
 typedef struct CONTAINER {
 	const CFORMAT *CFormat;
 	const PTFORMAT *PTFormat;
 	VIEW View;
+	// Entire image file, including the container header
+	VIEW FileView;
+	HANDLE File;
+	HANDLE Map;
+	// Overlapped handle to [File] for direct reads of file data, if enabled
+	HANDLE DirectFile;
+	// Provides [FileView] if the image isn't a plain file
+	BLOCK_SOURCE *Source;
+	// Holes in [FileView], if the image file is sparse
+	HOLES Holes;
+	FILETIME MTime;
 	CHS CHSSizes;
 	UINT CodePage;
+	// Limit for the metadata arena of each partition, in bytes, or 0 for
+	// none. Must be set before the partitions are probed.
+	uint64_t MetadataLimit;
 	FILESYSTEM Partitions[16];
 } CONTAINER;
+
+// Opens [FN] and maps it into [Image]. Returns 0 on success, or the negative
+// exit code of dimount on failure.
+int ImageOpen(CONTAINER *Image, const wchar_t *FN);
+void ImageClose(CONTAINER *Image);
+
+// Returns the length of the leading part of the [Size] bytes at [Ptr] in the
+// view of [Image] that is either entirely allocated or entirely a hole, and
+// which of the two it is in [Hole].
+uint64_t ImageHoleRun(const CONTAINER *Image, const void *Ptr, uint64_t Size, bool *Hole);
+// Returns whether all [Size] bytes at [Ptr] are in a hole.
+bool ImageIsHole(const CONTAINER *Image, const void *Ptr, uint64_t Size);
+
+// Reads [Length] bytes at [Offset] of the view of [FS] into memory ahead of
+// their use, if the image is read through a block source that can batch its
+// reads.
+void FSPrefetch(FILESYSTEM *FS, uint64_t Offset, uint64_t Length);
+// Same for the [Length] bytes at [Offset] of the data of [File].
+void FSPrefetchFile(FILESYSTEM *FS, ULONG64 File, uint64_t Offset, uint64_t Length);
+
+// Converts [Offset] in the view of [FS] to a byte offset in the image file,
+// including any container header.
+uint64_t FSImageOffset(FILESYSTEM *FS, uint64_t Offset);
+// Describes where the data of [File] is stored in the image file, as text
+// with one "logical physical length" line per extent, all in bytes. Returns
+// a buffer on the process heap with [Len] bytes of text and the result of
+// FileExtents() in [Status], or NULL if we're out of memory.
+char* FSFileLayoutText(FILESYSTEM *FS, ULONG64 File, size_t *Len, NTSTATUS *Status);
 /// --------------
@@ -0,0 +1,571 @@
+/*
+ * Dokan Image Mounter
+ *
+ * Benchmarks of the concurrent map against a locked one, of the copy
+ * engine's effect on the latency of concurrent metadata accesses, of the
+ * throughput of unbuffered image reads at different queue depths, and of
+ * direct file reads against copying from the view.
+ */
+
+/// Concurrent map
+/// --------------
+
+#define BENCH_KEYS 65536
+// One in this many operations removes and reinserts a key.
+#define BENCH_WRITE_EVERY 1024
+#define BENCH_SECONDS 1.0
+
+// Baseline: a fixed-size chained hash table behind a single lock.
+typedef struct {
+	SRWLOCK Lock;
+	RCU_NODE *Buckets[BENCH_KEYS];
+} BENCH_LOCKED_MAP;
+
+typedef struct {
+	// Ensures that every counter gets its own cache line.
+	volatile LONGLONG Ops;
+	uint8_t Pad[64 - sizeof(LONGLONG)];
+} BENCH_COUNTER;
+
+typedef struct {
+	bool RCU;
+	RCU_MAP *Map;
+	BENCH_LOCKED_MAP *Locked;
+	ARENA *Arena;
+	double Deadline;
+	volatile LONG NextThread;
+	// Keeps the lookups from being optimized away.
+	volatile uintptr_t Sink;
+	BENCH_COUNTER Counters[WORKERS_MAX];
+} BENCH;
+
+void* BenchLockedFind(BENCH_LOCKED_MAP *Map, uint64_t Key)
+{
+	void *ret = NULL;
+	AcquireSRWLockExclusive(&Map->Lock);
+	for(RCU_NODE *node = Map->Buckets[Key % BENCH_KEYS]; node; node = node->Next) {
+		if(node->Key == Key) {
+			ret = node->Value;
+			break;
+		}
+	}
+	ReleaseSRWLockExclusive(&Map->Lock);
+	return ret;
+}
+
+void BenchLockedReinsert(BENCH_LOCKED_MAP *Map, ARENA *Arena, uint64_t Key)
+{
+	AcquireSRWLockExclusive(&Map->Lock);
+	RCU_NODE **link = &Map->Buckets[Key % BENCH_KEYS];
+	while(*link && (*link)->Key != Key) {
+		link = &(*link)->Next;
+	}
+	RCU_NODE *node = *link;
+	if(node) {
+		*link = node->Next;
+	} else {
+		node = PoolAlloc(Arena, sizeof(RCU_NODE));
+	}
+	if(node) {
+		node->Key = Key;
+		node->Value = (void*)(uintptr_t)(Key + 1);
+		node->Next = Map->Buckets[Key % BENCH_KEYS];
+		Map->Buckets[Key % BENCH_KEYS] = node;
+	}
+	ReleaseSRWLockExclusive(&Map->Lock);
+}
+
+DWORD WINAPI BenchWorker(void *Param)
+{
+	BENCH *bench = (BENCH*)Param;
+	LONG thread = InterlockedIncrement(&bench->NextThread) - 1;
+	BENCH_COUNTER *counter = &bench->Counters[thread % WORKERS_MAX];
+	uint64_t rng = 0x9E3779B97F4A7C15ULL * (thread + 1);
+	uintptr_t sink = 0;
+	LONGLONG ops = 0;
+
+	while(TimeSeconds() < bench->Deadline) {
+		for(int i = 0; i < BENCH_WRITE_EVERY; i++) {
+			rng ^= rng << 13;
+			rng ^= rng >> 7;
+			rng ^= rng << 17;
+			uint64_t key = rng % BENCH_KEYS;
+			void *value = bench->RCU
+				? RcuMapFind(bench->Map, key)
+				: BenchLockedFind(bench->Locked, key);
+			sink ^= (uintptr_t)value;
+		}
+		uint64_t key = rng % BENCH_KEYS;
+		if(bench->RCU) {
+			RcuMapRemove(bench->Map, key, 0);
+			RcuMapInsert(bench->Map, key, (void*)(uintptr_t)(key + 1));
+		} else {
+			BenchLockedReinsert(bench->Locked, bench->Arena, key);
+		}
+		ops += BENCH_WRITE_EVERY + 1;
+	}
+	counter->Ops = ops;
+	bench->Sink ^= sink;
+	return 0;
+}
+
+double BenchRun(BENCH *bench, unsigned int Threads)
+{
+	bench->NextThread = 0;
+	for(unsigned int i = 0; i < WORKERS_MAX; i++) {
+		bench->Counters[i].Ops = 0;
+	}
+	double start = TimeSeconds();
+	bench->Deadline = start + BENCH_SECONDS;
+	WorkersRun(Threads, BenchWorker, bench);
+	double seconds = TimeSeconds() - start;
+	LONGLONG ops = 0;
+	for(unsigned int i = 0; i < WORKERS_MAX; i++) {
+		ops += bench->Counters[i].Ops;
+	}
+	return (ops / seconds) / 1000000.0;
+}
+
+int BenchMap(unsigned int max_threads)
+{
+	ARENA arena = {0};
+	BENCH *bench = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(BENCH));
+	RCU_MAP *map = HeapAlloc(GetProcessHeap(), 0, sizeof(RCU_MAP));
+	BENCH_LOCKED_MAP *locked = HeapAlloc(
+		GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(BENCH_LOCKED_MAP)
+	);
+	int ret = 0;
+	if(!bench || !map || !locked) {
+		fwprintf(stderr, L"**Error** Out of memory.\n");
+		ret = -5;
+		goto end;
+	}
+	InitializeSRWLock(&locked->Lock);
+	RcuMapInit(map, &arena);
+	for(uint64_t key = 0; key < BENCH_KEYS; key++) {
+		BenchLockedReinsert(locked, &arena, key);
+		if(!RcuMapInsert(map, key, (void*)(uintptr_t)(key + 1))) {
+			fwprintf(stderr, L"**Error** Out of memory.\n");
+			ret = -5;
+			goto end;
+		}
+	}
+	bench->Map = map;
+	bench->Locked = locked;
+	bench->Arena = &arena;
+
+	fwprintf(stdout,
+		L"%u keys, one write per %u lookups, %.1f s per run.\n"
+		L"Threads  Locked Mops/s  RCU Mops/s\n",
+		BENCH_KEYS, BENCH_WRITE_EVERY, BENCH_SECONDS
+	);
+	// Doubling the thread count, but always ending with the full one.
+	for(unsigned int threads = 1;; threads = min(threads * 2, max_threads)) {
+		bench->RCU = false;
+		double locked_mops = BenchRun(bench, threads);
+		bench->RCU = true;
+		double rcu_mops = BenchRun(bench, threads);
+		fwprintf(stdout, L"%7u  %13.2f  %10.2f\n", threads, locked_mops, rcu_mops);
+		if(threads == max_threads) {
+			break;
+		}
+	}
+end:
+	HeapFree(GetProcessHeap(), 0, locked);
+	HeapFree(GetProcessHeap(), 0, map);
+	HeapFree(GetProcessHeap(), 0, bench);
+	ArenaFree(&arena);
+	return ret;
+}
+/// --------------
+
+/// Copy engine
+/// -----------
+// Size of each bulk read
+#define BENCH_COPY_READ 0x100000
+// Data that the bulk reads cycle through
+#define BENCH_COPY_SOURCE 0x4000000
+// Table that the latency threads walk, comparable to a FAT
+#define BENCH_COPY_META 0x100000
+// Dependent random accesses per latency sample
+#define BENCH_COPY_CHASE 256
+// Latency samples kept per thread
+#define BENCH_COPY_SAMPLES 0x10000
+
+typedef struct {
+	COPY_FUNC Copy;
+	const uint8_t *Source;
+	const uint32_t *Meta;
+	unsigned int BulkThreads;
+	double Deadline;
+	volatile LONG NextThread;
+	volatile uint32_t Sink;
+	volatile LONGLONG BulkBytes;
+	LONGLONG *Samples[WORKERS_MAX];
+	size_t SampleCount[WORKERS_MAX];
+} BENCH_COPY;
+
+void BenchCopyBulk(BENCH_COPY *Bench)
+{
+	uint8_t *dst = VirtualAlloc(NULL, BENCH_COPY_READ, MEM_COMMIT, PAGE_READWRITE);
+	size_t offset = 0;
+	LONGLONG bytes = 0;
+	if(!dst) {
+		return;
+	}
+	while(TimeSeconds() < Bench->Deadline) {
+		Bench->Copy(dst, Bench->Source + offset, BENCH_COPY_READ);
+		offset = (offset + BENCH_COPY_READ) % BENCH_COPY_SOURCE;
+		bytes += BENCH_COPY_READ;
+	}
+	InterlockedExchangeAdd64(&Bench->BulkBytes, bytes);
+	VirtualFree(dst, 0, MEM_RELEASE);
+}
+
+void BenchCopyLatency(BENCH_COPY *Bench, LONG Thread)
+{
+	LONGLONG *samples = Bench->Samples[Thread];
+	size_t count = 0;
+	uint32_t i = (uint32_t)Thread;
+	while(TimeSeconds() < Bench->Deadline) {
+		LARGE_INTEGER start;
+		LARGE_INTEGER end;
+		QueryPerformanceCounter(&start);
+		for(int c = 0; c < BENCH_COPY_CHASE; c++) {
+			i = Bench->Meta[i];
+		}
+		QueryPerformanceCounter(&end);
+		samples[count++ % BENCH_COPY_SAMPLES] = end.QuadPart - start.QuadPart;
+	}
+	Bench->SampleCount[Thread] = min(count, BENCH_COPY_SAMPLES);
+	Bench->Sink ^= i;
+}
+
+DWORD WINAPI BenchCopyWorker(void *Param)
+{
+	BENCH_COPY *bench = (BENCH_COPY*)Param;
+	LONG thread = InterlockedIncrement(&bench->NextThread) - 1;
+	if((unsigned int)thread < bench->BulkThreads) {
+		BenchCopyBulk(bench);
+	} else if(bench->Samples[thread]) {
+		BenchCopyLatency(bench, thread);
+	}
+	return 0;
+}
+
+int BenchCompareTicks(const void *A, const void *B)
+{
+	LONGLONG a = *(const LONGLONG*)A;
+	LONGLONG b = *(const LONGLONG*)B;
+	return (a > b) - (a < b);
+}
+
+void BenchCopyRun(BENCH_COPY *Bench, unsigned int Threads, const wchar_t *Name)
+{
+	LARGE_INTEGER freq;
+	LONGLONG *all = Bench->Samples[WORKERS_MAX - 1];
+	size_t count = 0;
+
+	Bench->NextThread = 0;
+	Bench->BulkBytes = 0;
+	ZeroMemory(Bench->SampleCount, sizeof(Bench->SampleCount));
+	double start = TimeSeconds();
+	Bench->Deadline = start + BENCH_SECONDS;
+	WorkersRun(Threads, BenchCopyWorker, Bench);
+	double seconds = TimeSeconds() - start;
+
+	for(unsigned int t = Bench->BulkThreads; t < Threads; t++) {
+		memmove(all + count, Bench->Samples[t], Bench->SampleCount[t] * sizeof(LONGLONG));
+		count += Bench->SampleCount[t];
+	}
+	if(count == 0) {
+		return;
+	}
+	qsort(all, count, sizeof(LONGLONG), BenchCompareTicks);
+	QueryPerformanceFrequency(&freq);
+	double us = 1000000.0 / (double)freq.QuadPart;
+	fwprintf(stdout, L"%-16s  %8.2f  %8.2f  %8.2f  %8.2f  %9.0f\n",
+		Name,
+		all[count / 2] * us,
+		all[(count * 99) / 100] * us,
+		all[(count * 999) / 1000] * us,
+		all[count - 1] * us,
+		(Bench->BulkBytes / seconds) / (1024.0 * 1024.0)
+	);
+}
+
+int BenchCopy(unsigned int max_threads)
+{
+	int ret = 0;
+	BENCH_COPY *bench = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(BENCH_COPY));
+	uint8_t *source = VirtualAlloc(NULL, BENCH_COPY_SOURCE, MEM_COMMIT, PAGE_READWRITE);
+	uint32_t *meta = VirtualAlloc(NULL, BENCH_COPY_META, MEM_COMMIT, PAGE_READWRITE);
+	// The last sample buffer is reserved for merging.
+	unsigned int threads = min(max(max_threads, 2), WORKERS_MAX - 1);
+	unsigned int latency_threads = threads / 2;
+
+	if(!CopyEngine.Stream) {
+		fwprintf(stderr, L"**Error** No streaming copy available on this CPU.\n");
+		ret = 1;
+		goto end;
+	}
+	if(!bench || !source || !meta) {
+		fwprintf(stderr, L"**Error** Out of memory.\n");
+		ret = -5;
+		goto end;
+	}
+	bench->BulkThreads = threads - latency_threads;
+	for(unsigned int t = bench->BulkThreads; t < threads; t++) {
+		bench->Samples[t] = HeapAlloc(
+			GetProcessHeap(), 0, BENCH_COPY_SAMPLES * sizeof(LONGLONG)
+		);
+		if(!bench->Samples[t]) {
+			fwprintf(stderr, L"**Error** Out of memory.\n");
+			ret = -5;
+			goto end;
+		}
+	}
+	bench->Samples[WORKERS_MAX - 1] = HeapAlloc(
+		GetProcessHeap(), 0, latency_threads * BENCH_COPY_SAMPLES * sizeof(LONGLONG)
+	);
+	if(!bench->Samples[WORKERS_MAX - 1]) {
+		fwprintf(stderr, L"**Error** Out of memory.\n");
+		ret = -5;
+		goto end;
+	}
+	for(size_t i = 0; i < BENCH_COPY_SOURCE; i += 4096) {
+		source[i] = (uint8_t)i;
+	}
+
+	// A single random cycle through the whole table (Sattolo's algorithm),
+	// so that every access depends on the previous one and can't be
+	// predicted by the hardware prefetcher.
+	const uint32_t entries = BENCH_COPY_META / sizeof(uint32_t);
+	uint64_t rng = 0x9E3779B97F4A7C15ULL;
+	for(uint32_t i = 0; i < entries; i++) {
+		meta[i] = i;
+	}
+	for(uint32_t i = entries - 1; i > 0; i--) {
+		rng ^= rng << 13;
+		rng ^= rng >> 7;
+		rng ^= rng << 17;
+		uint32_t j = (uint32_t)(rng % i);
+		uint32_t tmp = meta[i];
+		meta[i] = meta[j];
+		meta[j] = tmp;
+	}
+	bench->Source = source;
+	bench->Meta = meta;
+
+	fwprintf(stdout,
+		L"%u threads copying %u KiB reads, %u threads walking a %u KiB table, %.1f s per run.\n"
+		L"Latency of %u dependent table accesses, in microseconds:\n"
+		L"Copy                   p50       p99     p99.9       max  Bulk MiB/s\n",
+		bench->BulkThreads, BENCH_COPY_READ / 1024,
+		latency_threads, BENCH_COPY_META / 1024, BENCH_SECONDS,
+		BENCH_COPY_CHASE
+	);
+	bench->Copy = CopyMemcpy;
+	BenchCopyRun(bench, threads, L"memcpy");
+	bench->Copy = CopyEngine.Stream;
+	BenchCopyRun(bench, threads, CopyEngine.Name);
+end:
+	if(bench) {
+		for(unsigned int t = 0; t < WORKERS_MAX; t++) {
+			HeapFree(GetProcessHeap(), 0, bench->Samples[t]);
+		}
+	}
+	VirtualFree(meta, 0, MEM_RELEASE);
+	VirtualFree(source, 0, MEM_RELEASE);
+	HeapFree(GetProcessHeap(), 0, bench);
+	return ret;
+}
+/// -----------
+
+/// Asynchronous I/O
+/// ----------------
+// Size of each read, matching the pages of a block source
+#define BENCH_AIO_READ 0x10000
+#define BENCH_AIO_BATCH 256
+
+// Returns the throughput of random reads from [FN] in MiB/s, or a negative
+// value on failure.
+double BenchAioRun(const wchar_t *FN, uint64_t Blocks, uint8_t *Buf, unsigned int Depth, bool Threads)
+{
+	BLOCK_REQUEST reqs[BENCH_AIO_BATCH];
+	AIO aio;
+	uint64_t rng = 0x9E3779B97F4A7C15ULL;
+	LONGLONG bytes = 0;
+	bool ok = true;
+
+	if(AioOpen(&aio, FN, Depth, Threads)) {
+		return -1;
+	}
+	double start = TimeSeconds();
+	double deadline = start + BENCH_SECONDS;
+	while(ok && TimeSeconds() < deadline) {
+		for(size_t i = 0; i < BENCH_AIO_BATCH; i++) {
+			rng ^= rng << 13;
+			rng ^= rng >> 7;
+			rng ^= rng << 17;
+			reqs[i].Offset = (rng % Blocks) * BENCH_AIO_READ;
+			reqs[i].Buf = Buf + (i * BENCH_AIO_READ);
+			reqs[i].Size = BENCH_AIO_READ;
+		}
+		ok = AioRead(&aio, reqs, BENCH_AIO_BATCH);
+		bytes += BENCH_AIO_BATCH * BENCH_AIO_READ;
+	}
+	double seconds = TimeSeconds() - start;
+	AioClose(&aio);
+	return ok ? ((bytes / seconds) / (1024.0 * 1024.0)) : -1;
+}
+
+int BenchAio(const wchar_t *FN)
+{
+	int ret = 0;
+	WIN32_FILE_ATTRIBUTE_DATA attr;
+	uint8_t *buf = VirtualAlloc(
+		NULL, BENCH_AIO_BATCH * BENCH_AIO_READ, MEM_COMMIT, PAGE_READWRITE
+	);
+	if(!buf) {
+		fwprintf(stderr, L"**Error** Out of memory.\n");
+		return -5;
+	}
+	if(!GetFileAttributesExW(FN, GetFileExInfoStandard, &attr)) {
+		ret = ReportError(-2, GetLastError(), L"Error opening %s", FN);
+		goto end;
+	}
+	uint64_t size = ((uint64_t)attr.nFileSizeHigh << 32) | attr.nFileSizeLow;
+	uint64_t blocks = size / BENCH_AIO_READ;
+	if(blocks == 0) {
+		fwprintf(stderr, L"**Error** %s is smaller than a single read.\n", FN);
+		ret = 1;
+		goto end;
+	}
+	fwprintf(stdout,
+		L"Unbuffered random %u KiB reads from %llu bytes, %.1f s per run.\n"
+		L"Depth  Completion port MiB/s  Threads MiB/s\n",
+		BENCH_AIO_READ / 1024, blocks * BENCH_AIO_READ, BENCH_SECONDS
+	);
+	for(unsigned int depth = 1; depth <= AIO_DEPTH_MAX; depth *= 2) {
+		double port = BenchAioRun(FN, blocks, buf, depth, false);
+		double threads = BenchAioRun(FN, blocks, buf, depth, true);
+		if(port < 0 || threads < 0) {
+			fwprintf(stderr, L"**Error** Could not read %s.\n", FN);
+			ret = 1;
+			break;
+		}
+		fwprintf(stdout, L"%5u  %21.1f  %13.1f\n", depth, port, threads);
+	}
+end:
+	VirtualFree(buf, 0, MEM_RELEASE);
+	return ret;
+}
+/// ----------------
+
+/// Direct reads
+/// ------------
+// Size of each read, matching the largest ones Windows usually sends
+#define BENCH_READ_SIZE 0x100000
+#define BENCH_READ_PASSES 2
+
+// Reads all of [File] sequentially, either directly or by copying from the
+// view. Returns the throughput in MiB/s, or a negative value on failure.
+double BenchReadRun(FILESYSTEM *FS, ULONG64 File, uint64_t Size, uint8_t *Buf, bool Direct)
+{
+	double start = TimeSeconds();
+	for(uint64_t offset = 0; offset < Size; offset += BENCH_READ_SIZE) {
+		DWORD len = (DWORD)min(BENCH_READ_SIZE, Size - offset);
+		DWORD read = 0;
+		NTSTATUS status = Direct
+			? FSReadFileDirect(FS, File, Buf, len, &read, offset)
+			: FS->FSFormat->ReadFile(FS, File, Buf, len, &read, offset);
+		if(status != STATUS_SUCCESS || read != len) {
+			return -1;
+		}
+	}
+	double seconds = TimeSeconds() - start;
+	return (Size / seconds) / (1024.0 * 1024.0);
+}
+
+int BenchRead(const wchar_t *ImageFN, const wchar_t *Path)
+{
+	CONTAINER image = {0};
+	FILESYSTEM *fs = NULL;
+	BY_HANDLE_FILE_INFORMATION info;
+	uint8_t *buf = NULL;
+
+	DirectReads = true;
+	int ret = ImageOpen(&image, ImageFN);
+	if(!ret) {
+		ret = ImageProbe(&image, &fs, stderr);
+	}
+	if(ret) {
+		goto end;
+	}
+	if(!image.DirectFile) {
+		fwprintf(stderr, L"**Error** Direct reads need a plain image file.\n");
+		ret = 1;
+		goto end;
+	}
+	ULONG64 file = FSFileLookupW(fs, Path);
+	if(!file || fs->FSFormat->GetFileInformation(fs, file, &info) != STATUS_SUCCESS) {
+		fwprintf(stderr, L"**Error** File not found: %s\n", Path);
+		ret = ERROR_FILE_NOT_FOUND;
+		goto end;
+	}
+	uint64_t size = ((uint64_t)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+	buf = VirtualAlloc(NULL, BENCH_READ_SIZE, MEM_COMMIT, PAGE_READWRITE);
+	if(!buf) {
+		fwprintf(stderr, L"**Error** Out of memory.\n");
+		ret = -5;
+		goto end;
+	}
+	fwprintf(stdout,
+		L"Sequential %u KiB reads of %llu bytes.\n"
+		L"Pass  Copy MiB/s  Direct MiB/s\n",
+		BENCH_READ_SIZE / 1024, size
+	);
+	// The first pass also shows the cost of cold pages for both paths.
+	for(unsigned int pass = 1; pass <= BENCH_READ_PASSES; pass++) {
+		double copy = BenchReadRun(fs, file, size, buf, false);
+		double direct = BenchReadRun(fs, file, size, buf, true);
+		if(copy < 0 || direct < 0) {
+			fwprintf(stderr, L"**Error** Could not read %s.\n", Path);
+			ret = 1;
+			break;
+		}
+		fwprintf(stdout, L"%4u  %10.1f  %12.1f\n", pass, copy, direct);
+	}
+end:
+	if(buf) {
+		VirtualFree(buf, 0, MEM_RELEASE);
+	}
+	ImageClose(&image);
+	return ret;
+}
+/// ------------
+
+int CMD_Bench_Main(int argc, const wchar_t *argv[])
+{
+	unsigned int max_threads = 0;
+	int arg = WorkersArg(argc, argv, &max_threads);
+	if(max_threads == 0) {
+		max_threads = ProcessorCount();
+	}
+	max_threads = min(max_threads, WORKERS_MAX);
+
+	if(arg >= argc || !wcscmp(argv[arg], L"map")) {
+		return BenchMap(max_threads);
+	} else if(!wcscmp(argv[arg], L"copy")) {
+		return BenchCopy(max_threads);
+	} else if(!wcscmp(argv[arg], L"aio") && (arg + 1) < argc) {
+		return BenchAio(argv[arg + 1]);
+	} else if(!wcscmp(argv[arg], L"read") && (arg + 2) < argc) {
+		return BenchRead(argv[arg + 1], argv[arg + 2]);
+	}
+	fwprintf(stderr, L"**Error** Unknown benchmark: %s\n", argv[arg]);
+	return 1;
+}
+
+NEW_COMMAND(Bench, L"bench", L"[-j threads] [map|copy|aio file|read imagefile path]", 0);
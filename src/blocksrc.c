@@ -0,0 +1,360 @@
+/*
+ * Dokan Image Mounter
+ *
+ * Demand-filled views for images that aren't stored as a single file.
+ */
+
+// Granularity in which the pages of a view are filled.
+#define BLOCK_SOURCE_PAGE 0x10000
+// Maximum number of requests passed to a single ReadBatch() call, and of
+// adjacent pages coalesced into a single request.
+#define BLOCK_SOURCE_BATCH 64
+#define BLOCK_SOURCE_COALESCE 16
+
+// The view is a read-only alias of a pagefile-backed section, which starts
+// out inaccessible. The first read of a page raises an access violation,
+// which our vectored exception handler resolves by filling the page through
+// the writable alias, and only then making it readable. The lock of the
+// source only guards the bitmaps, and is released while the page is read.
+// Other threads that touch the same page in the meantime fault as well, see
+// it in [Pending], and wait on [Done] until the page is complete, while
+// faults on other pages go ahead with their own reads.
+// Filled pages are entries of the process-wide cache. To tell the cache
+// manager whether a page was read since its last visit, the page is turned
+// into a guard page, whose next access raises a one-time exception that the
+// same handler records in the [Referenced] bitmap. Evicted pages are
+// discarded and made inaccessible again.
+typedef struct {
+	SRWLOCK Lock;
+	BLOCK_SOURCE *Sources;
+	PVOID Handler;
+} BLOCK_SOURCES;
+
+BLOCK_SOURCES BlockSources = {SRWLOCK_INIT};
+
+bool BlockSourceFill(BLOCK_SOURCE *Source, uint64_t Offset)
+{
+	uint64_t page = Offset / BLOCK_SOURCE_PAGE;
+	uint64_t start = page * BLOCK_SOURCE_PAGE;
+	size_t size = (size_t)min(BLOCK_SOURCE_PAGE, Source->View.Size - start);
+	uint8_t bit = 1 << (page % 8);
+	bool ret = true;
+	bool filled = false;
+	DWORD old;
+
+	AcquireSRWLockExclusive(&Source->Lock);
+	while(Source->Pending[page / 8] & bit) {
+		SleepConditionVariableSRW(&Source->Done, &Source->Lock, INFINITE, 0);
+	}
+	if(!(Source->Filled[page / 8] & bit)) {
+		Source->Pending[page / 8] |= bit;
+		ReleaseSRWLockExclusive(&Source->Lock);
+		if(!Source->Read(Source, start, Source->Fill + start, size)) {
+			// Crashing the whole mount over one bad block would be worse.
+			fwprintf(stderr,
+				L"**Warning** Could not read %Iu bytes at offset %llu of a block source, returning zeroes.\n",
+				size, start
+			);
+			ZeroMemory(Source->Fill + start, size);
+		}
+		ret = VirtualProtect(Source->View.Memory + start, size, PAGE_READONLY, &old);
+		AcquireSRWLockExclusive(&Source->Lock);
+		if(ret) {
+			Source->Filled[page / 8] |= bit;
+			InterlockedOr8((char*)&Source->Referenced[page / 8], bit);
+			InterlockedIncrement64(&Source->PagesFilled);
+			filled = true;
+		}
+		Source->Pending[page / 8] &= ~bit;
+		WakeAllConditionVariable(&Source->Done);
+	}
+	ReleaseSRWLockExclusive(&Source->Lock);
+	if(filled) {
+		InterlockedIncrement64(&Source->Cache.Misses);
+		CacheInsert(&Source->Cache, page, (uint32_t)size, Source->Cost);
+	}
+	return ret;
+}
+
+bool BlockSourceReferenced(CACHE *Cache, uint64_t Key)
+{
+	BLOCK_SOURCE *source = CONTAINING_RECORD(Cache, BLOCK_SOURCE, Cache);
+	uint64_t start = Key * BLOCK_SOURCE_PAGE;
+	size_t size = (size_t)min(BLOCK_SOURCE_PAGE, source->View.Size - start);
+	uint8_t bit = 1 << (Key % 8);
+	DWORD old;
+	bool ret = (InterlockedAnd8((char*)&source->Referenced[Key / 8], ~bit) & bit) != 0;
+	if(ret) {
+		VirtualProtect(source->View.Memory + start, size, PAGE_READONLY | PAGE_GUARD, &old);
+	}
+	return ret;
+}
+
+void BlockSourceEvict(CACHE *Cache, uint64_t Key)
+{
+	BLOCK_SOURCE *source = CONTAINING_RECORD(Cache, BLOCK_SOURCE, Cache);
+	uint64_t start = Key * BLOCK_SOURCE_PAGE;
+	size_t size = (size_t)min(BLOCK_SOURCE_PAGE, source->View.Size - start);
+	uint8_t bit = 1 << (Key % 8);
+	DWORD old;
+
+	AcquireSRWLockExclusive(&source->Lock);
+	// Readers that still hold a pointer into the page just fault and refill
+	// it once we're done.
+	if(VirtualProtect(source->View.Memory + start, size, PAGE_NOACCESS, &old)) {
+		VirtualAlloc(source->Fill + start, size, MEM_RESET, PAGE_READWRITE);
+		source->Filled[Key / 8] &= ~bit;
+		InterlockedDecrement64(&source->PagesFilled);
+	}
+	ReleaseSRWLockExclusive(&source->Lock);
+}
+
+LONG CALLBACK BlockSourceFault(PEXCEPTION_POINTERS Exception)
+{
+	const EXCEPTION_RECORD *er = Exception->ExceptionRecord;
+	LONG ret = EXCEPTION_CONTINUE_SEARCH;
+	bool guard = (er->ExceptionCode == EXCEPTION_GUARD_PAGE);
+	// The first parameter is 0 for reads. Writes to the view are bugs that
+	// should still crash.
+	if(
+		(er->ExceptionCode != EXCEPTION_ACCESS_VIOLATION && !guard)
+		|| er->NumberParameters < 2
+		|| er->ExceptionInformation[0] != 0
+	) {
+		return ret;
+	}
+	uint8_t *addr = (uint8_t*)er->ExceptionInformation[1];
+	AcquireSRWLockShared(&BlockSources.Lock);
+	for(BLOCK_SOURCE *s = BlockSources.Sources; s; s = s->Next) {
+		if(addr >= s->View.Memory && addr < s->View.Memory + s->View.Size) {
+			uint64_t page = (addr - s->View.Memory) / BLOCK_SOURCE_PAGE;
+			if(guard) {
+				// The system already removed the guard.
+				InterlockedOr8((char*)&s->Referenced[page / 8], 1 << (page % 8));
+				InterlockedIncrement64(&s->Cache.Hits);
+				ret = EXCEPTION_CONTINUE_EXECUTION;
+			} else if(BlockSourceFill(s, addr - s->View.Memory)) {
+				ret = EXCEPTION_CONTINUE_EXECUTION;
+			}
+			break;
+		}
+	}
+	ReleaseSRWLockShared(&BlockSources.Lock);
+	return ret;
+}
+
+// Releases everything BlockSourceOpen() created for [Source], without
+// calling its Free() function.
+void BlockSourceRelease(BLOCK_SOURCE *Source)
+{
+	if(Source->View.Memory) {
+		UnmapViewOfFile(Source->View.Memory);
+	}
+	if(Source->Fill) {
+		UnmapViewOfFile(Source->Fill);
+	}
+	if(Source->Section) {
+		CloseHandle(Source->Section);
+	}
+	HeapFree(GetProcessHeap(), 0, Source->Filled);
+	HeapFree(GetProcessHeap(), 0, Source->Pending);
+	HeapFree(GetProcessHeap(), 0, Source->Referenced);
+	Source->View.Memory = NULL;
+	Source->View.Size = 0;
+	Source->Fill = NULL;
+	Source->Section = NULL;
+	Source->Filled = NULL;
+	Source->Pending = NULL;
+	Source->Referenced = NULL;
+}
+
+DWORD BlockSourceOpen(BLOCK_SOURCE *Source, uint64_t Size, const wchar_t *Name)
+{
+	uint64_t section_size = (Size + BLOCK_SOURCE_PAGE - 1) & ~(uint64_t)(BLOCK_SOURCE_PAGE - 1);
+	DWORD old;
+	DWORD err = 0;
+
+	assert(Source);
+	assert(Source->Read);
+	if(Size == 0 || section_size > SIZE_MAX) {
+		return ERROR_INVALID_PARAMETER;
+	}
+	Source->Next = NULL;
+	Source->PagesFilled = 0;
+	InitializeSRWLock(&Source->Lock);
+	InitializeConditionVariable(&Source->Done);
+	Source->Section = CreateFileMappingW(
+		INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+		(DWORD)(section_size >> 32), (DWORD)section_size, NULL
+	);
+	if(!Source->Section) {
+		goto fail;
+	}
+	Source->View.Memory = MapViewOfFile(Source->Section, FILE_MAP_READ, 0, 0, 0);
+	Source->Fill = MapViewOfFile(Source->Section, FILE_MAP_WRITE, 0, 0, 0);
+	if(
+		!Source->View.Memory || !Source->Fill
+		|| !VirtualProtect(Source->View.Memory, (size_t)section_size, PAGE_NOACCESS, &old)
+	) {
+		goto fail;
+	}
+	size_t bitmap_size = (size_t)(section_size / BLOCK_SOURCE_PAGE + 7) / 8;
+	Source->Filled = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, bitmap_size);
+	Source->Pending = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, bitmap_size);
+	Source->Referenced = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, bitmap_size);
+	if(!Source->Filled || !Source->Pending || !Source->Referenced) {
+		err = ERROR_OUTOFMEMORY;
+		goto fail;
+	}
+	Source->View.Size = Size;
+	Source->Cache.Referenced = BlockSourceReferenced;
+	Source->Cache.Evict = BlockSourceEvict;
+	CacheRegister(&Source->Cache, Name);
+
+	AcquireSRWLockExclusive(&BlockSources.Lock);
+	if(!BlockSources.Handler) {
+		BlockSources.Handler = AddVectoredExceptionHandler(1, BlockSourceFault);
+	}
+	bool registered = BlockSources.Handler != NULL;
+	if(registered) {
+		Source->Next = BlockSources.Sources;
+		BlockSources.Sources = Source;
+	}
+	ReleaseSRWLockExclusive(&BlockSources.Lock);
+	if(!registered) {
+		CacheUnregister(&Source->Cache);
+		goto fail;
+	}
+	return 0;
+fail:
+	if(!err) {
+		err = GetLastError();
+	}
+	BlockSourceRelease(Source);
+	return err;
+}
+
+void BlockSourceClose(BLOCK_SOURCE *Source)
+{
+	assert(Source);
+	AcquireSRWLockExclusive(&BlockSources.Lock);
+	BLOCK_SOURCE **link = &BlockSources.Sources;
+	while(*link && *link != Source) {
+		link = &(*link)->Next;
+	}
+	if(*link) {
+		*link = Source->Next;
+	}
+	if(!BlockSources.Sources && BlockSources.Handler) {
+		RemoveVectoredExceptionHandler(BlockSources.Handler);
+		BlockSources.Handler = NULL;
+	}
+	ReleaseSRWLockExclusive(&BlockSources.Lock);
+	CacheUnregister(&Source->Cache);
+	BlockSourceRelease(Source);
+	if(Source->Free) {
+		Source->Free(Source);
+	}
+}
+
+// Reads [Count] requests for pages that were marked as pending while
+// collecting them, without holding the lock, then marks the pages that could
+// be read as filled and wakes up any fault that waits for them. The others
+// are left for the fault handler, which will retry and report them.
+void BlockSourcePrefetchBatch(BLOCK_SOURCE *Source, BLOCK_REQUEST *Requests, size_t Count)
+{
+	DWORD old;
+	Source->ReadBatch(Source, Requests, Count);
+	for(size_t i = 0; i < Count; i++) {
+		BLOCK_REQUEST *req = &Requests[i];
+		req->OK = req->OK && VirtualProtect(
+			Source->View.Memory + req->Offset, req->Size, PAGE_READONLY, &old
+		);
+	}
+	AcquireSRWLockExclusive(&Source->Lock);
+	for(size_t i = 0; i < Count; i++) {
+		const BLOCK_REQUEST *req = &Requests[i];
+		for(uint64_t p = req->Offset; p < req->Offset + req->Size; p += BLOCK_SOURCE_PAGE) {
+			uint64_t page = p / BLOCK_SOURCE_PAGE;
+			uint8_t bit = 1 << (page % 8);
+			if(req->OK) {
+				Source->Filled[page / 8] |= bit;
+				InterlockedOr8((char*)&Source->Referenced[page / 8], bit);
+				InterlockedIncrement64(&Source->PagesFilled);
+			}
+			Source->Pending[page / 8] &= ~bit;
+		}
+	}
+	ReleaseSRWLockExclusive(&Source->Lock);
+	WakeAllConditionVariable(&Source->Done);
+	for(size_t i = 0; i < Count; i++) {
+		const BLOCK_REQUEST *req = &Requests[i];
+		if(!req->OK) {
+			continue;
+		}
+		for(uint64_t p = req->Offset; p < req->Offset + req->Size; p += BLOCK_SOURCE_PAGE) {
+			size_t size = (size_t)min(BLOCK_SOURCE_PAGE, Source->View.Size - p);
+			CacheInsert(&Source->Cache, p / BLOCK_SOURCE_PAGE, (uint32_t)size, Source->Cost);
+		}
+	}
+}
+
+void BlockSourcePrefetch(BLOCK_SOURCE *Source, const BLOCK_RANGE *Ranges, size_t Count)
+{
+	BLOCK_REQUEST reqs[BLOCK_SOURCE_BATCH];
+	size_t req_count = 0;
+	uint64_t last_page = UINT64_MAX;
+
+	assert(Source);
+	if(!Source->ReadBatch) {
+		return;
+	}
+	AcquireSRWLockExclusive(&Source->Lock);
+	for(size_t r = 0; r < Count; r++) {
+		uint64_t end = min(Ranges[r].Offset + Ranges[r].Length, Source->View.Size);
+		if(Ranges[r].Offset >= end) {
+			continue;
+		}
+		uint64_t page = Ranges[r].Offset / BLOCK_SOURCE_PAGE;
+		uint64_t page_end = (end + BLOCK_SOURCE_PAGE - 1) / BLOCK_SOURCE_PAGE;
+		for(; page < page_end; page++) {
+			BLOCK_REQUEST *req = req_count ? &reqs[req_count - 1] : NULL;
+			uint8_t bit = 1 << (page % 8);
+			// Also skips pages that were already requested for an earlier
+			// range, or that another thread is reading right now.
+			if((Source->Filled[page / 8] | Source->Pending[page / 8]) & bit) {
+				continue;
+			}
+			uint64_t start = page * BLOCK_SOURCE_PAGE;
+			size_t size = (size_t)min(BLOCK_SOURCE_PAGE, Source->View.Size - start);
+			if(
+				req && (page == last_page + 1)
+				&& (req->Size < (BLOCK_SOURCE_COALESCE * BLOCK_SOURCE_PAGE))
+			) {
+				req->Size += size;
+			} else {
+				if(req_count == BLOCK_SOURCE_BATCH) {
+					ReleaseSRWLockExclusive(&Source->Lock);
+					BlockSourcePrefetchBatch(Source, reqs, req_count);
+					AcquireSRWLockExclusive(&Source->Lock);
+					req_count = 0;
+					// The page might have been filled in the meantime.
+					if((Source->Filled[page / 8] | Source->Pending[page / 8]) & bit) {
+						continue;
+					}
+				}
+				req = &reqs[req_count++];
+				req->Offset = start;
+				req->Buf = Source->Fill + start;
+				req->Size = size;
+				req->OK = false;
+			}
+			Source->Pending[page / 8] |= bit;
+			last_page = page;
+		}
+	}
+	ReleaseSRWLockExclusive(&Source->Lock);
+	if(req_count) {
+		BlockSourcePrefetchBatch(Source, reqs, req_count);
+	}
+}
@@ -0,0 +1,175 @@
+/*
+ * Dokan Image Mounter
+ *
+ * Process-wide cache budget.
+ */
+
+typedef struct {
+	CACHE *Cache;
+	uint64_t Key;
+	uint32_t Size;
+	uint8_t Cost;
+	// Sweeps left before the entry can be evicted without being referenced
+	uint8_t Credit;
+} CACHE_ENTRY;
+
+// All entries form a single clock, so that recency is compared across
+// caches. Each sweep of the hand either finds an entry referenced, which
+// restores its credit to its cost, or takes one credit away. Entries are
+// evicted once they run out, so that expensive ones survive longer.
+typedef struct {
+	SRWLOCK Lock;
+	CACHE *Caches;
+	uint64_t Budget;
+	uint64_t Bytes;
+	CACHE_ENTRY *Ring;
+	size_t RingCap;
+	size_t RingCount;
+	size_t Hand;
+} CACHES;
+
+CACHES Caches = {SRWLOCK_INIT};
+
+uint64_t CacheBudgetDefault(void)
+{
+	MEMORYSTATUSEX ms = {.dwLength = sizeof(ms)};
+	if(!GlobalMemoryStatusEx(&ms)) {
+		return 256 * 1024 * 1024;
+	}
+	return ms.ullTotalPhys / CACHE_BUDGET_DIVISOR;
+}
+
+// Evicts entries until we're within the budget, or only [Keep] is left.
+// Caller must hold the lock.
+void CacheShrink(const CACHE_ENTRY *Keep)
+{
+	// Entries that keep getting referenced could otherwise hold the hand
+	// forever. In that case, we just stay over budget until the next call.
+	size_t steps = Caches.RingCount * 8;
+	while(Caches.Bytes > Caches.Budget && Caches.RingCount > 1 && steps--) {
+		if(Caches.Hand >= Caches.RingCount) {
+			Caches.Hand = 0;
+		}
+		CACHE_ENTRY *e = &Caches.Ring[Caches.Hand];
+		if(
+			(Keep && e->Cache == Keep->Cache && e->Key == Keep->Key)
+			|| e->Cache->Referenced(e->Cache, e->Key)
+		) {
+			e->Credit = e->Cost;
+			Caches.Hand++;
+			continue;
+		}
+		if(e->Credit > 1) {
+			e->Credit--;
+			Caches.Hand++;
+			continue;
+		}
+		e->Cache->Evict(e->Cache, e->Key);
+		e->Cache->Bytes -= e->Size;
+		e->Cache->Evictions++;
+		Caches.Bytes -= e->Size;
+		// The last entry takes the place of the evicted one, and gets
+		// looked at next.
+		*e = Caches.Ring[--Caches.RingCount];
+	}
+}
+
+void CacheBudgetSet(uint64_t Bytes)
+{
+	AcquireSRWLockExclusive(&Caches.Lock);
+	Caches.Budget = Bytes ? Bytes : CacheBudgetDefault();
+	CacheShrink(NULL);
+	ReleaseSRWLockExclusive(&Caches.Lock);
+}
+
+void CacheRegister(CACHE *Cache, const wchar_t *Name)
+{
+	assert(Cache);
+	assert(Cache->Referenced);
+	assert(Cache->Evict);
+	wcscpy_s(Cache->Name, elementsof(Cache->Name), Name ? Name : L"");
+	Cache->Bytes = 0;
+	Cache->Hits = 0;
+	Cache->Misses = 0;
+	Cache->Evictions = 0;
+	AcquireSRWLockExclusive(&Caches.Lock);
+	if(!Caches.Budget) {
+		Caches.Budget = CacheBudgetDefault();
+	}
+	Cache->Next = Caches.Caches;
+	Caches.Caches = Cache;
+	ReleaseSRWLockExclusive(&Caches.Lock);
+}
+
+void CacheUnregister(CACHE *Cache)
+{
+	assert(Cache);
+	AcquireSRWLockExclusive(&Caches.Lock);
+	CACHE **link = &Caches.Caches;
+	while(*link && *link != Cache) {
+		link = &(*link)->Next;
+	}
+	if(*link) {
+		*link = Cache->Next;
+	}
+	size_t kept = 0;
+	for(size_t i = 0; i < Caches.RingCount; i++) {
+		if(Caches.Ring[i].Cache == Cache) {
+			Caches.Bytes -= Caches.Ring[i].Size;
+		} else {
+			Caches.Ring[kept++] = Caches.Ring[i];
+		}
+	}
+	Caches.RingCount = kept;
+	if(!Caches.Caches) {
+		HeapFree(GetProcessHeap(), 0, Caches.Ring);
+		Caches.Ring = NULL;
+		Caches.RingCap = 0;
+	}
+	ReleaseSRWLockExclusive(&Caches.Lock);
+	Cache->Bytes = 0;
+}
+
+void CacheInsert(CACHE *Cache, uint64_t Key, uint32_t Size, uint8_t Cost)
+{
+	assert(Cache);
+	CACHE_ENTRY entry = {
+		.Cache = Cache,
+		.Key = Key,
+		.Size = Size,
+		.Cost = max(Cost, 1),
+		.Credit = max(Cost, 1),
+	};
+	AcquireSRWLockExclusive(&Caches.Lock);
+	if(ArrayReserve(
+		(void**)&Caches.Ring, &Caches.RingCap, sizeof(CACHE_ENTRY), Caches.RingCount + 1
+	)) {
+		Caches.Ring[Caches.RingCount++] = entry;
+		Caches.Bytes += Size;
+		Cache->Bytes += Size;
+	}
+	// Otherwise, the entry simply stays around untracked.
+	CacheShrink(&entry);
+	ReleaseSRWLockExclusive(&Caches.Lock);
+}
+
+void CacheReport(FILE *Out)
+{
+	AcquireSRWLockShared(&Caches.Lock);
+	if(!Caches.Caches) {
+		ReleaseSRWLockShared(&Caches.Lock);
+		return;
+	}
+	fwprintf(Out,
+		L"Cache: %llu of %llu bytes used.\n", Caches.Bytes, Caches.Budget
+	);
+	for(CACHE *c = Caches.Caches; c; c = c->Next) {
+		LONGLONG lookups = c->Hits + c->Misses;
+		fwprintf(Out,
+			L"\t%s: %lld bytes, %.1f%% hits, %lld evictions\n",
+			c->Name, c->Bytes,
+			lookups ? (100.0 * c->Hits / lookups) : 0.0, c->Evictions
+		);
+	}
+	ReleaseSRWLockShared(&Caches.Lock);
+}
@@ -0,0 +1,219 @@
+/*
+ * Dokan Image Mounter
+ *
+ * File listings as JSON Lines or CSV records.
+ */
+
+typedef enum {
+	CATALOG_JSONL,
+	CATALOG_CSV
+} CATALOG_FORMAT;
+
+typedef struct {
+	FILESYSTEM *FS;
+	OUTBUF *Out;
+	CATALOG_FORMAT Format;
+	// Prefixed to every record, together with [Part], if not NULL
+	const wchar_t *Image;
+	unsigned int Part;
+	uint64_t Records;
+} CATALOG;
+
+void OutJSONStringW(OUTBUF *Out, const wchar_t *Str, size_t Len)
+{
+	size_t run = 0;
+	OutWrite(Out, "\"", 1);
+	for(size_t i = 0; i < Len; i++) {
+		wchar_t c = Str[i];
+		if(c == L'"' || c == L'\\' || c < 0x20) {
+			OutWriteW(Out, Str + run, i - run);
+			if(c == L'"') {
+				OutWrite(Out, "\\\"", 2);
+			} else if(c == L'\\') {
+				OutWrite(Out, "\\\\", 2);
+			} else {
+				OutPrintf(Out, "\\u%04x", c);
+			}
+			run = i + 1;
+		}
+	}
+	OutWriteW(Out, Str + run, Len - run);
+	OutWrite(Out, "\"", 1);
+}
+
+void OutCSVStringW(OUTBUF *Out, const wchar_t *Str, size_t Len)
+{
+	size_t run = 0;
+	OutWrite(Out, "\"", 1);
+	for(size_t i = 0; i < Len; i++) {
+		if(Str[i] == L'"') {
+			OutWriteW(Out, Str + run, i + 1 - run);
+			OutWrite(Out, "\"", 1);
+			run = i + 1;
+		}
+	}
+	OutWriteW(Out, Str + run, Len - run);
+	OutWrite(Out, "\"", 1);
+}
+
+void CatalogString(CATALOG *Cat, const wchar_t *Str, size_t Len)
+{
+	if(Cat->Format == CATALOG_CSV) {
+		OutCSVStringW(Cat->Out, Str, Len);
+	} else {
+		OutJSONStringW(Cat->Out, Str, Len);
+	}
+}
+
+void CatalogTime(CATALOG *Cat, const FILETIME *Time)
+{
+	SYSTEMTIME st;
+	if(!FileTimeToSystemTime(Time, &st)) {
+		OutWrite(Cat->Out, "\"\"", 2);
+		return;
+	}
+	OutPrintf(Cat->Out, "\"%04u-%02u-%02uT%02u:%02u:%02u\"",
+		st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond
+	);
+}
+
+int CatalogCountExtent(void *Param, uint64_t Offset, uint64_t Length)
+{
+	if(Offset == FS_EXTENT_ZERO) {
+		return 1;
+	}
+	(*(uint32_t*)Param)++;
+	return 0;
+}
+
+void CatalogHeader(CATALOG *Cat)
+{
+	if(Cat->Format != CATALOG_CSV) {
+		return;
+	}
+	if(Cat->Image) {
+		OutWrite(Cat->Out, "image,part,", 11);
+	}
+	const char HEADER[] =
+		"path,alt,size,created,accessed,modified,attributes,cluster,fragments\r\n";
+	OutWrite(Cat->Out, HEADER, sizeof(HEADER) - 1);
+}
+
+void CatalogField(CATALOG *Cat, const char *Name, bool First)
+{
+	if(Cat->Format == CATALOG_CSV) {
+		if(!First) {
+			OutWrite(Cat->Out, ",", 1);
+		}
+		return;
+	}
+	OutWrite(Cat->Out, First ? "{\"" : ",\"", 2);
+	OutWrite(Cat->Out, Name, strlen(Name));
+	OutWrite(Cat->Out, "\":", 2);
+}
+
+// Writes one record for the file [FD] at [Path].
+void CatalogRecord(CATALOG *Cat, const wchar_t *Path, size_t PathLen, WIN32_FIND_DATAW *FD, ULONG64 File)
+{
+	const FSFORMAT *fmt = Cat->FS->FSFormat;
+	uint32_t fragments = 0;
+	fmt->FileExtents(Cat->FS, File, CatalogCountExtent, &fragments);
+
+	if(Cat->Image) {
+		CatalogField(Cat, "image", true);
+		CatalogString(Cat, Cat->Image, wcslen(Cat->Image));
+		CatalogField(Cat, "part", false);
+		OutPrintf(Cat->Out, "%u", Cat->Part);
+	}
+	CatalogField(Cat, "path", !Cat->Image);
+	CatalogString(Cat, Path, PathLen);
+	CatalogField(Cat, "alt", false);
+	CatalogString(Cat, FD->cAlternateFileName, wcsnlen(
+		FD->cAlternateFileName, elementsof(FD->cAlternateFileName)
+	));
+	CatalogField(Cat, "size", false);
+	OutPrintf(Cat->Out, "%llu", ((uint64_t)FD->nFileSizeHigh << 32) | FD->nFileSizeLow);
+	CatalogField(Cat, "created", false);
+	CatalogTime(Cat, &FD->ftCreationTime);
+	CatalogField(Cat, "accessed", false);
+	CatalogTime(Cat, &FD->ftLastAccessTime);
+	CatalogField(Cat, "modified", false);
+	CatalogTime(Cat, &FD->ftLastWriteTime);
+	CatalogField(Cat, "attributes", false);
+	OutPrintf(Cat->Out, "%lu", FD->dwFileAttributes);
+	CatalogField(Cat, "cluster", false);
+	OutPrintf(Cat->Out, "%llu", fmt->FileFirstCluster(Cat->FS, File));
+	CatalogField(Cat, "fragments", false);
+	OutPrintf(Cat->Out, "%u", fragments);
+	if(Cat->Format == CATALOG_CSV) {
+		OutWrite(Cat->Out, "\r\n", 2);
+	} else {
+		OutWrite(Cat->Out, "}\n", 2);
+	}
+	Cat->Records++;
+}
+
+int CatalogAddFile(void *Param, const wchar_t *Path, size_t PathLen, WIN32_FIND_DATAW *FD, ULONG64 File)
+{
+	CatalogRecord((CATALOG*)Param, Path, PathLen, FD, File);
+	return 0;
+}
+
+extern const COMMAND CMD_Ls;
+
+int CMD_Ls_Main(int argc, const wchar_t *argv[])
+{
+	CONTAINER image = {0};
+	FILESYSTEM *fs = NULL;
+	CATALOG cat = {.Format = CATALOG_JSONL};
+	bool recurse = false;
+	int ret = 0;
+	int arg = 0;
+
+	for(; arg < argc && argv[arg][0] == L'-'; arg++) {
+		if(!wcscmp(argv[arg], L"-R")) {
+			recurse = true;
+		} else if(!wcscmp(argv[arg], L"--csv")) {
+			cat.Format = CATALOG_CSV;
+		} else if(!wcscmp(argv[arg], L"--jsonl")) {
+			cat.Format = CATALOG_JSONL;
+		} else {
+			break;
+		}
+	}
+	if(arg >= argc) {
+		fwprintf(stderr, L"Usage: dimount %s %s\n", CMD_Ls.Name, CMD_Ls.Usage);
+		return -1;
+	}
+	const wchar_t *image_fn = argv[arg++];
+	const wchar_t *dir = arg < argc ? argv[arg] : L"\\";
+
+	cat.Out = HeapAlloc(GetProcessHeap(), 0, sizeof(OUTBUF));
+	if(!cat.Out) {
+		return ERROR_OUTOFMEMORY;
+	}
+	cat.Out->Handle = GetStdHandle(STD_OUTPUT_HANDLE);
+	cat.Out->Failed = false;
+	cat.Out->Len = 0;
+
+	ret = ImageOpen(&image, image_fn);
+	if(!ret) {
+		ret = ImageProbe(&image, &fs, stderr);
+	}
+	if(!ret) {
+		IndexAttach(fs, image_fn);
+		cat.FS = fs;
+		CatalogHeader(&cat);
+		ret = FSWalkDir(fs, dir, recurse, CatalogAddFile, &cat);
+		if(ret == ERROR_PATH_NOT_FOUND) {
+			fwprintf(stderr, L"**Error** Directory not found: %s\n", dir);
+		}
+		OutFlush(cat.Out);
+		IndexDetach(fs);
+	}
+	ImageClose(&image);
+	HeapFree(GetProcessHeap(), 0, cat.Out);
+	return ret;
+}
+
+NEW_COMMAND(Ls, L"ls", L"[-R] [--jsonl|--csv] imagefile [dir]", 1);
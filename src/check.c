@@ -0,0 +1,360 @@
+/*
+ * Dokan Image Mounter
+ *
+ * FAT consistency checker.
+ */
+
+// Number of clusters handled by one work item of the FAT scans.
+#define CHECK_RANGE 0x10000
+
+// Number of problems of each type that are reported individually.
+#define CHECK_REPORT_MAX 100
+
+#define FAT_BAD_CLUSTER 0x0FFFFFF7
+
+typedef enum {
+	CHECK_OUT_OF_RANGE,
+	CHECK_CROSS_LINKED,
+	CHECK_CYCLIC,
+	CHECK_LOST,
+	CHECK_SIZE_MISMATCH,
+	CHECK_MIRROR,
+	CHECK_ERROR_COUNT
+} CHECK_ERROR;
+
+const wchar_t *CHECK_ERROR_NAMES[CHECK_ERROR_COUNT] = {
+	L"invalid cluster links",
+	L"cross-linked chains",
+	L"cyclic chains",
+	L"lost chains",
+	L"size mismatches",
+	L"differing FAT mirror entries",
+};
+
+typedef struct {
+	FILESYSTEM *FS;
+	FAT_INFO *FI;
+	unsigned int Threads;
+	uint8_t FATs;
+	// Bitmaps indexed by cluster number. Used marks every cluster reached
+	// from a directory entry, Linked every cluster that some FAT entry
+	// points to.
+	volatile LONG *Used;
+	volatile LONG *Linked;
+	size_t BitmapSize;
+	volatile LONG NextRange;
+	SRWLOCK ReportLock;
+
+	volatile LONGLONG Files;
+	volatile LONGLONG Dirs;
+	volatile LONGLONG Allocated;
+	volatile LONGLONG Free;
+	volatile LONGLONG Bad;
+	volatile LONGLONG LostClusters;
+	volatile LONG Errors[CHECK_ERROR_COUNT];
+} CHECK;
+
+void CheckReport(CHECK *Check, CHECK_ERROR Type, const wchar_t *Format, ...)
+{
+	LONG count = InterlockedIncrement(&Check->Errors[Type]);
+	if(count > CHECK_REPORT_MAX) {
+		return;
+	}
+	va_list va;
+	va_start(va, Format);
+	AcquireSRWLockExclusive(&Check->ReportLock);
+	vfwprintf(stdout, Format, va);
+	if(count == CHECK_REPORT_MAX) {
+		fwprintf(stdout, L"(not reporting any further %s)\n", CHECK_ERROR_NAMES[Type]);
+	}
+	ReleaseSRWLockExclusive(&Check->ReportLock);
+	va_end(va);
+}
+
+bool CheckBitSet(volatile LONG *Bitmap, fat_cluster_t Cluster)
+{
+	return InterlockedBitTestAndSet(&Bitmap[Cluster >> 5], Cluster & 31) != 0;
+}
+
+bool CheckBit(volatile LONG *Bitmap, fat_cluster_t Cluster)
+{
+	return (Bitmap[Cluster >> 5] >> (Cluster & 31)) & 1;
+}
+
+// Returns the next range of clusters to scan in [First] and [Last], or false
+// if the whole FAT has been handed out.
+bool CheckNextRange(CHECK *Check, fat_cluster_t *First, fat_cluster_t *Last)
+{
+	fat_cluster_t end = Check->FI->Clusters + 2;
+	LONG range = InterlockedIncrement(&Check->NextRange) - 1;
+	if(range >= (end - 2 + CHECK_RANGE - 1) / CHECK_RANGE) {
+		return false;
+	}
+	*First = 2 + range * CHECK_RANGE;
+	*Last = min(*First + CHECK_RANGE, end);
+	return true;
+}
+
+void CheckMirrors(CHECK *Check, fat_cluster_t First, fat_cluster_t Last)
+{
+	FAT_INFO *fi = Check->FI;
+	size_t start, end;
+	FAT_EntryBytes(fi, First, Last, &start, &end);
+	bool hole = ImageIsHole(Check->FS->Image, fi->FATs[0] + start, end - start);
+	for(uint8_t i = 1; i < Check->FATs; i++) {
+		if(
+			(hole && ImageIsHole(Check->FS->Image, fi->FATs[i] + start, end - start))
+			|| !memcmp(fi->FATs[0] + start, fi->FATs[i] + start, end - start)
+		) {
+			continue;
+		}
+		for(fat_cluster_t c = First; c < Last; c++) {
+			fat_cluster_t v0 = fi->Lookup(fi->FATs[0], c);
+			fat_cluster_t v = fi->Lookup(fi->FATs[i], c);
+			if(v0 != v) {
+				CheckReport(Check, CHECK_MIRROR,
+					L"FAT #%u: cluster %d links to %d, FAT #1 to %d\n", i + 1, c, v, v0
+				);
+			}
+		}
+	}
+}
+
+// Classifies every FAT entry, and marks the targets of all links.
+DWORD WINAPI CheckFATWorker(void *Param)
+{
+	CHECK *check = (CHECK*)Param;
+	FAT_INFO *fi = check->FI;
+	fat_cluster_t first, last;
+	while(CheckNextRange(check, &first, &last)) {
+		LONGLONG allocated = 0, unused = 0, bad = 0;
+		size_t start, end;
+		FAT_EntryBytes(fi, first, last, &start, &end);
+		// A FAT range in a hole of a sparse image is all zeroes, and thus
+		// entirely free, without having to read it.
+		bool hole = ImageIsHole(check->FS->Image, fi->FATs[0] + start, end - start);
+		if(hole) {
+			unused = last - first;
+		}
+		for(fat_cluster_t c = first; !hole && c < last; c++) {
+			fat_cluster_t v = fi->Lookup(fi->FATs[0], c);
+			if(v == 0) {
+				unused++;
+			} else if(v == FAT_BAD_CLUSTER) {
+				bad++;
+			} else {
+				allocated++;
+				if(FAT_ClusterValid(fi, v)) {
+					CheckBitSet(check->Linked, v);
+				} else if(!FAT_ClusterChainEnd(fi, v)) {
+					CheckReport(check, CHECK_OUT_OF_RANGE,
+						L"Cluster %d links to invalid cluster %d\n", c, v
+					);
+				}
+			}
+		}
+		CheckMirrors(check, first, last);
+		InterlockedExchangeAdd64(&check->Allocated, allocated);
+		InterlockedExchangeAdd64(&check->Free, unused);
+		InterlockedExchangeAdd64(&check->Bad, bad);
+	}
+	return 0;
+}
+
+// Returns whether [Cluster] is among the first [Length] clusters of the
+// chain starting at [First].
+bool CheckChainContains(FAT_INFO *FI, fat_cluster_t First, fat_cluster_t Cluster, fat_cluster_t Length)
+{
+	fat_cluster_t c = First;
+	for(fat_cluster_t i = 0; i < Length; i++) {
+		if(c == Cluster) {
+			return true;
+		}
+		c = FAT_ClusterLookup(FI, c);
+	}
+	return false;
+}
+
+// Marks the chain starting at [First] as used, and returns its length in
+// [Length]. Returns false if the chain is broken or overlaps any cluster
+// that was marked before.
+bool CheckChain(CHECK *Check, const wchar_t *Path, fat_cluster_t First, fat_cluster_t *Length)
+{
+	FAT_INFO *fi = Check->FI;
+	fat_cluster_t c = First;
+	*Length = 0;
+	if(First == 0) {
+		return true;
+	}
+	while(!FAT_ClusterChainEnd(fi, c)) {
+		if(!FAT_ClusterValid(fi, c)) {
+			CheckReport(Check, CHECK_OUT_OF_RANGE,
+				L"%s: chain leads to %s cluster %d after %d clusters\n",
+				Path, c ? L"invalid" : L"free", c, *Length
+			);
+			return false;
+		}
+		if(CheckBitSet(Check->Used, c)) {
+			if(CheckChainContains(fi, First, c, *Length)) {
+				CheckReport(Check, CHECK_CYCLIC,
+					L"%s: chain loops back to cluster %d after %d clusters\n",
+					Path, c, *Length
+				);
+			} else {
+				CheckReport(Check, CHECK_CROSS_LINKED,
+					L"%s: cluster %d is also used by another file\n", Path, c
+				);
+			}
+			return false;
+		}
+		(*Length)++;
+		c = FAT_ClusterLookup(fi, c);
+	}
+	return true;
+}
+
+int CheckFile(void *Param, const wchar_t *Path, size_t PathLen, WIN32_FIND_DATAW *FD, ULONG64 File)
+{
+	CHECK *check = (CHECK*)Param;
+	FAT_INFO *fi = check->FI;
+	FAT_DIR_ENTRY *dentry = (FAT_DIR_ENTRY*)File;
+	fat_cluster_t first = FAT_DEntryCluster(fi, dentry);
+	fat_cluster_t length;
+	bool chain_ok = CheckChain(check, Path, first, &length);
+
+	if(FD->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+		InterlockedIncrement64(&check->Dirs);
+		if(first == 0) {
+			// Would be read as the root directory.
+			CheckReport(check, CHECK_OUT_OF_RANGE, L"%s: directory without clusters\n", Path);
+			chain_ok = false;
+		}
+		// Never descend into a chain we've already seen, so that
+		// directory cycles end here.
+		return chain_ok ? 0 : FS_WALK_PRUNE;
+	}
+	InterlockedIncrement64(&check->Files);
+	uint64_t expected = ((uint64_t)dentry->Size + fi->ClusterSize - 1) / fi->ClusterSize;
+	if(chain_ok && length != expected) {
+		CheckReport(check, CHECK_SIZE_MISMATCH,
+			L"%s: %lu bytes need %llu clusters, but the chain has %d\n",
+			Path, dentry->Size, expected, length
+		);
+	}
+	return 0;
+}
+
+// Finds all allocated clusters that no file reaches.
+DWORD WINAPI CheckLostWorker(void *Param)
+{
+	CHECK *check = (CHECK*)Param;
+	FAT_INFO *fi = check->FI;
+	fat_cluster_t first, last;
+	while(CheckNextRange(check, &first, &last)) {
+		LONGLONG lost = 0;
+		for(fat_cluster_t c = first; c < last; c++) {
+			fat_cluster_t v = fi->Lookup(fi->FATs[0], c);
+			if(v == 0 || v == FAT_BAD_CLUSTER || CheckBit(check->Used, c)) {
+				continue;
+			}
+			lost++;
+			// Only report the heads of lost chains. Lost cycles don't have
+			// one, but still count as lost clusters.
+			if(!CheckBit(check->Linked, c)) {
+				CheckReport(check, CHECK_LOST, L"Lost chain starting at cluster %d\n", c);
+			}
+		}
+		InterlockedExchangeAdd64(&check->LostClusters, lost);
+	}
+	return 0;
+}
+
+// Checks [FS] and prints all problems to stdout. Returns the number of
+// problems found.
+int Check(FILESYSTEM *FS, unsigned int Threads)
+{
+	FBR_GET_ASSERT;
+	int ret = 0;
+	CHECK check = {
+		.FS = FS,
+		.FI = FS->FSData,
+		.Threads = Threads,
+		.FATs = fbr->FATs,
+		.ReportLock = SRWLOCK_INIT,
+	};
+	FAT_INFO *fi = check.FI;
+	fwprintf(stdout, L"Checking %s file system, %d clusters of %u bytes...\n",
+		FS->FSFormat->Name(FS), fi->Clusters, fi->ClusterSize
+	);
+	if(fi->Type == FAT32 && (fbr->FAT32.Flags & 0x80)) {
+		// Mirroring is disabled, and only the active FAT is maintained.
+		check.FATs = 1;
+	}
+	check.BitmapSize = (((size_t)fi->Clusters + 2 + 31) / 32) * sizeof(LONG);
+	check.Used = VirtualAlloc(NULL, check.BitmapSize * 2, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if(!check.Used) {
+		fwprintf(stderr, L"**Error** Out of memory.\n");
+		return ERROR_OUTOFMEMORY;
+	}
+	check.Linked = check.Used + (check.BitmapSize / sizeof(LONG));
+
+	double start = TimeSeconds();
+	WorkersRun(Threads, CheckFATWorker, &check);
+
+	fat_cluster_t root_length;
+	if(fi->RootDirCluster) {
+		CheckChain(&check, L"\\", fi->RootDirCluster, &root_length);
+		check.Dirs++;
+	}
+	ret = FSWalkParallel(FS, Threads, CheckFile, &check);
+	if(ret) {
+		ReportError(0, ret, L"Error walking the directory tree");
+		goto end;
+	}
+
+	check.NextRange = 0;
+	WorkersRun(Threads, CheckLostWorker, &check);
+	double elapsed = TimeSeconds() - start;
+
+	fwprintf(stdout,
+		L"%lld files, %lld directories\n"
+		L"%lld clusters allocated, %lld free, %lld bad, %lld lost\n",
+		check.Files, check.Dirs,
+		check.Allocated, check.Free, check.Bad, check.LostClusters
+	);
+	for(int i = 0; i < CHECK_ERROR_COUNT; i++) {
+		if(check.Errors[i]) {
+			fwprintf(stdout, L"%ld %s\n", check.Errors[i], CHECK_ERROR_NAMES[i]);
+			ret += check.Errors[i];
+		}
+	}
+	fwprintf(stdout, L"%s in %.3f s.\n", ret ? L"Problems found" : L"No problems found", elapsed);
+end:
+	VirtualFree((void*)check.Used, 0, MEM_RELEASE);
+	return ret;
+}
+
+int CMD_Check_Main(int argc, const wchar_t *argv[])
+{
+	unsigned int threads = 0;
+	CONTAINER image = {0};
+	FILESYSTEM *fs = NULL;
+
+	WorkersArg(argc - 1, argv + 1, &threads);
+	int ret = ImageOpen(&image, argv[0]);
+	if(!ret) {
+		ret = ImageProbe(&image, &fs, stderr);
+	}
+	if(!ret) {
+		if(fs->FSFormat != &FS_FAT) {
+			fwprintf(stderr, L"**Error** Only FAT file systems can be checked.\n");
+			ret = -1;
+		} else {
+			ret = Check(fs, threads);
+		}
+	}
+	ImageClose(&image);
+	return ret;
+}
+
+NEW_COMMAND(Check, L"check", L"imagefile [-j threads]", 1);
@@ -0,0 +1,134 @@
+/*
+ * Dokan Image Mounter
+ *
+ * Copy engine for the read path.
+ */
+
+#if defined(_M_IX86) || defined(_M_X64)
+# include <emmintrin.h>
+# define COPY_SSE2
+#endif
+
+// Used if the cache size can't be determined.
+#define COPY_THRESHOLD_DEFAULT 0x40000
+// How far ahead of the current position the source is prefetched.
+#define COPY_PREFETCH_DISTANCE 512
+
+typedef void(*COPY_FUNC)(void *Dst, const void *Src, size_t Size);
+
+// Large reads would otherwise push the FAT, directories and everything else
+// other threads need right now out of the caches, just to place data there
+// that only the kernel will read once more when handing it to the caller.
+// Above [Threshold], we therefore copy with non-temporal stores, which
+// bypass the caches, while prefetching the source ahead of them.
+typedef struct {
+	INIT_ONCE Once;
+	// NULL if the CPU has no suitable instructions
+	COPY_FUNC Stream;
+	const wchar_t *Name;
+	size_t Threshold;
+} COPY_ENGINE;
+
+COPY_ENGINE CopyEngine = {INIT_ONCE_STATIC_INIT, NULL, L"memcpy", SIZE_MAX};
+
+void CopyMemcpy(void *Dst, const void *Src, size_t Size)
+{
+	memcpy(Dst, Src, Size);
+}
+
+#ifdef COPY_SSE2
+void CopyStreamSSE2(void *Dst, const void *Src, size_t Size)
+{
+	uint8_t *dst = (uint8_t*)Dst;
+	const uint8_t *src = (const uint8_t*)Src;
+
+	// Streaming stores need an aligned destination.
+	size_t head = (16 - ((uintptr_t)dst & 15)) & 15;
+	head = min(head, Size);
+	memcpy(dst, src, head);
+	dst += head;
+	src += head;
+	Size -= head;
+
+	while(Size >= 64) {
+		_mm_prefetch((const char*)src + COPY_PREFETCH_DISTANCE, _MM_HINT_NTA);
+		__m128i a = _mm_loadu_si128((const __m128i*)(src + 0));
+		__m128i b = _mm_loadu_si128((const __m128i*)(src + 16));
+		__m128i c = _mm_loadu_si128((const __m128i*)(src + 32));
+		__m128i d = _mm_loadu_si128((const __m128i*)(src + 48));
+		_mm_stream_si128((__m128i*)(dst + 0), a);
+		_mm_stream_si128((__m128i*)(dst + 16), b);
+		_mm_stream_si128((__m128i*)(dst + 32), c);
+		_mm_stream_si128((__m128i*)(dst + 48), d);
+		dst += 64;
+		src += 64;
+		Size -= 64;
+	}
+	// Makes the streamed data visible to other threads before we return.
+	_mm_sfence();
+	memcpy(dst, src, Size);
+}
+#endif
+
+// Returns the size of the largest cache that is private to a core, usually
+// the L2 cache.
+size_t CopyCacheSize(void)
+{
+	SYSTEM_LOGICAL_PROCESSOR_INFORMATION *info = NULL;
+	DWORD len = 0;
+	size_t ret = 0;
+	GetLogicalProcessorInformation(NULL, &len);
+	if(GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+		return 0;
+	}
+	info = HeapAlloc(GetProcessHeap(), 0, len);
+	if(info && GetLogicalProcessorInformation(info, &len)) {
+		for(DWORD i = 0; i < len / sizeof(*info); i++) {
+			if(info[i].Relationship == RelationCache && info[i].Cache.Level == 2) {
+				ret = max(ret, info[i].Cache.Size);
+			}
+		}
+	}
+	HeapFree(GetProcessHeap(), 0, info);
+	return ret;
+}
+
+BOOL CALLBACK CopyInitOnce(PINIT_ONCE Once, PVOID Param, PVOID *Context)
+{
+#ifdef COPY_SSE2
+	if(IsProcessorFeaturePresent(PF_XMMI64_INSTRUCTIONS_AVAILABLE)) {
+		CopyEngine.Stream = CopyStreamSSE2;
+		CopyEngine.Name = L"SSE2 streaming";
+	}
+#endif
+	size_t cache = CopyCacheSize();
+	CopyEngine.Threshold = cache ? cache : COPY_THRESHOLD_DEFAULT;
+	return TRUE;
+}
+
+// Selects the copy functions for this CPU. Safe to call more than once.
+void CopyInit(void)
+{
+	InitOnceExecuteOnce(&CopyEngine.Once, CopyInitOnce, NULL, NULL);
+}
+
+// Returns the function to use for all copies of a read of [Size] bytes.
+COPY_FUNC CopyFor(size_t Size)
+{
+	return (CopyEngine.Stream && Size >= CopyEngine.Threshold)
+		? CopyEngine.Stream
+		: CopyMemcpy;
+}
+
+// Hints that [Size] bytes at [Src] will be copied with [Copy] next.
+void CopyPrefetch(COPY_FUNC Copy, const void *Src, size_t Size)
+{
+#ifdef COPY_SSE2
+	if(Copy != CopyMemcpy && Src) {
+		Size = min(Size, COPY_PREFETCH_DISTANCE);
+		for(size_t i = 0; i < Size; i += 64) {
+			_mm_prefetch((const char*)Src + i, _MM_HINT_NTA);
+		}
+	}
+#endif
+}
@@ -0,0 +1,313 @@
+/*
+ * Dokan Image Mounter
+ *
+ * File-level comparison of two images.
+ */
+
+// File data is hashed in blocks of this size, independent of how it's
+// split into extents, so that the same content hashes identically on
+// differently fragmented images.
+#define DIFF_BLOCK 0x1000
+
+typedef struct {
+	size_t Path; // offset into DIFF_SIDE::Paths
+	ULONG64 File;
+	uint64_t Size;
+	DWORD Attributes;
+	FILETIME CreationTime;
+	FILETIME LastWriteTime;
+} DIFF_FILE;
+
+typedef struct {
+	const wchar_t *FN;
+	CONTAINER Image;
+	FILESYSTEM *FS;
+	DIFF_FILE *Files;
+	size_t FileCount;
+	size_t FileCap;
+	wchar_t *Paths;
+	size_t PathsLength;
+	size_t PathsCap;
+	bool OutOfMemory;
+} DIFF_SIDE;
+
+typedef enum {
+	DIFF_UNCHANGED,
+	DIFF_ADDED,
+	DIFF_REMOVED,
+	DIFF_MODIFIED,
+	DIFF_METADATA,
+} DIFF_STATUS;
+
+const wchar_t *DIFF_STATUS_NAMES[] = {
+	L"unchanged", L"added", L"removed", L"modified", L"metadata"
+};
+
+// One path from either or both images, in path order. Files with the same
+// path and size on both sides need their contents compared by the workers.
+typedef struct {
+	DIFF_FILE *File[2];
+	DIFF_STATUS Status;
+	bool Hash;
+} DIFF_JOB;
+
+typedef struct {
+	DIFF_SIDE Side[2];
+	DIFF_JOB *Jobs;
+	size_t JobCount;
+	size_t JobCap;
+	volatile LONG NextJob;
+	volatile LONGLONG BytesHashed;
+} DIFF;
+
+typedef struct {
+	FILESYSTEM *FS;
+	uint64_t Hash;
+	uint64_t Remaining;
+	size_t BufLen;
+	uint8_t Buf[DIFF_BLOCK];
+} DIFF_HASH;
+
+int DiffAddFile(void *Param, const wchar_t *Path, size_t PathLen, WIN32_FIND_DATAW *FD, ULONG64 File)
+{
+	DIFF_SIDE *side = (DIFF_SIDE*)Param;
+	if(
+		!ArrayReserve((void**)&side->Files, &side->FileCap, sizeof(DIFF_FILE), side->FileCount + 1)
+		|| !ArrayReserve((void**)&side->Paths, &side->PathsCap, sizeof(wchar_t), side->PathsLength + PathLen + 1)
+	) {
+		side->OutOfMemory = true;
+		return ERROR_OUTOFMEMORY;
+	}
+	DIFF_FILE *file = &side->Files[side->FileCount++];
+	file->Path = side->PathsLength;
+	file->File = File;
+	file->Size = ((uint64_t)FD->nFileSizeHigh << 32) | FD->nFileSizeLow;
+	file->Attributes = FD->dwFileAttributes;
+	file->CreationTime = FD->ftCreationTime;
+	file->LastWriteTime = FD->ftLastWriteTime;
+	memcpy(&side->Paths[side->PathsLength], Path, (PathLen + 1) * sizeof(wchar_t));
+	side->PathsLength += PathLen + 1;
+	return 0;
+}
+
+int DiffFileCompare(void *Context, const void *A, const void *B)
+{
+	const wchar_t *paths = (const wchar_t*)Context;
+	return CompareStringOrdinal(
+		paths + ((const DIFF_FILE*)A)->Path, -1,
+		paths + ((const DIFF_FILE*)B)->Path, -1, TRUE
+	) - CSTR_EQUAL;
+}
+
+// Hashed in place of FS_EXTENT_ZERO extents, so that they hash the same as
+// zeroes stored in the image.
+const uint8_t DiffZeroes[DIFF_BLOCK] = {0};
+
+int DiffHashExtent(void *Param, uint64_t Offset, uint64_t Length)
+{
+	DIFF_HASH *h = (DIFF_HASH*)Param;
+	bool zero = (Offset == FS_EXTENT_ZERO);
+	Length = min(Length, h->Remaining);
+	h->Remaining -= Length;
+	while(Length) {
+		UINT chunk = (UINT)min(Length, DIFF_BLOCK - h->BufLen);
+		const uint8_t *data = zero ? DiffZeroes : LAt(h->FS, Offset, chunk);
+		if(!data) {
+			return 1;
+		}
+		if(h->BufLen == 0 && chunk == DIFF_BLOCK) {
+			h->Hash = Hash64(data, DIFF_BLOCK, h->Hash);
+		} else {
+			// Block spans two extents.
+			memcpy(h->Buf + h->BufLen, data, chunk);
+			h->BufLen += chunk;
+			if(h->BufLen == DIFF_BLOCK) {
+				h->Hash = Hash64(h->Buf, DIFF_BLOCK, h->Hash);
+				h->BufLen = 0;
+			}
+		}
+		Offset += zero ? 0 : chunk;
+		Length -= chunk;
+	}
+	return h->Remaining == 0;
+}
+
+// Returns the hash of the contents of [File], or 0 if its data couldn't be
+// read completely.
+uint64_t DiffHashFile(DIFF_SIDE *Side, DIFF_FILE *File, DIFF_HASH *H)
+{
+	H->FS = Side->FS;
+	H->Hash = File->Size;
+	H->Remaining = File->Size;
+	H->BufLen = 0;
+	NTSTATUS status = Side->FS->FSFormat->FileExtents(Side->FS, File->File, DiffHashExtent, H);
+	if(status != STATUS_SUCCESS || H->Remaining) {
+		fwprintf(stderr,
+			L"**Warning** %s: could not read all data from %s\n",
+			&Side->Paths[File->Path], Side->FN
+		);
+		return 0;
+	}
+	if(H->BufLen) {
+		H->Hash = Hash64(H->Buf, H->BufLen, H->Hash);
+	}
+	return H->Hash;
+}
+
+DWORD WINAPI DiffWorker(void *Param)
+{
+	DIFF *diff = (DIFF*)Param;
+	DIFF_HASH *h = HeapAlloc(GetProcessHeap(), 0, sizeof(DIFF_HASH));
+	if(!h) {
+		return ERROR_OUTOFMEMORY;
+	}
+	size_t i;
+	while((i = (size_t)InterlockedIncrement(&diff->NextJob) - 1) < diff->JobCount) {
+		DIFF_JOB *job = &diff->Jobs[i];
+		if(!job->Hash) {
+			continue;
+		}
+		uint64_t a = DiffHashFile(&diff->Side[0], job->File[0], h);
+		uint64_t b = DiffHashFile(&diff->Side[1], job->File[1], h);
+		if(a != b || a == 0) {
+			job->Status = DIFF_MODIFIED;
+		}
+		InterlockedExchangeAdd64(&diff->BytesHashed, job->File[0]->Size * 2);
+	}
+	HeapFree(GetProcessHeap(), 0, h);
+	return 0;
+}
+
+bool DiffMetadataEqual(const DIFF_FILE *A, const DIFF_FILE *B)
+{
+	return A->Attributes == B->Attributes
+		&& !CompareFileTime(&A->CreationTime, &B->CreationTime)
+		&& !CompareFileTime(&A->LastWriteTime, &B->LastWriteTime);
+}
+
+int DiffOpen(DIFF_SIDE *Side, const wchar_t *FN)
+{
+	Side->FN = FN;
+	int ret = ImageOpen(&Side->Image, FN);
+	if(!ret) {
+		ret = ImageProbe(&Side->Image, &Side->FS, stderr);
+	}
+	if(!ret) {
+		IndexAttach(Side->FS, FN);
+		FSWalk(Side->FS, DiffAddFile, Side);
+		if(Side->OutOfMemory) {
+			fwprintf(stderr, L"**Error** Out of memory while collecting files.\n");
+			return ERROR_OUTOFMEMORY;
+		}
+		qsort_s(Side->Files, Side->FileCount, sizeof(DIFF_FILE), DiffFileCompare, Side->Paths);
+	}
+	return ret;
+}
+
+void DiffClose(DIFF_SIDE *Side)
+{
+	if(Side->FS) {
+		IndexDetach(Side->FS);
+	}
+	ImageClose(&Side->Image);
+	HeapFree(GetProcessHeap(), 0, Side->Files);
+	HeapFree(GetProcessHeap(), 0, Side->Paths);
+}
+
+// Compares the files on the images [FN_A] and [FN_B] and prints every
+// difference to stdout. Returns 1 if the images differ, 0 if they don't, or
+// an error code.
+int Diff(const wchar_t *FN_A, const wchar_t *FN_B, unsigned int Threads)
+{
+	int ret = 0;
+	DIFF *diff = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(DIFF));
+	if(!diff) {
+		return ERROR_OUTOFMEMORY;
+	}
+	DIFF_SIDE *a = &diff->Side[0];
+	DIFF_SIDE *b = &diff->Side[1];
+	double start = TimeSeconds();
+	ret = DiffOpen(a, FN_A);
+	if(!ret) {
+		ret = DiffOpen(b, FN_B);
+	}
+	if(ret) {
+		goto end;
+	}
+
+	// Match both sorted lists by path.
+	size_t i = 0, j = 0;
+	while(i < a->FileCount || j < b->FileCount) {
+		if(!ArrayReserve((void**)&diff->Jobs, &diff->JobCap, sizeof(DIFF_JOB), diff->JobCount + 1)) {
+			fwprintf(stderr, L"**Error** Out of memory while matching files.\n");
+			ret = ERROR_OUTOFMEMORY;
+			goto end;
+		}
+		DIFF_JOB *job = &diff->Jobs[diff->JobCount++];
+		int cmp;
+		if(i == a->FileCount) {
+			cmp = 1;
+		} else if(j == b->FileCount) {
+			cmp = -1;
+		} else {
+			cmp = CompareStringOrdinal(
+				&a->Paths[a->Files[i].Path], -1, &b->Paths[b->Files[j].Path], -1, TRUE
+			) - CSTR_EQUAL;
+		}
+		job->File[0] = (cmp <= 0) ? &a->Files[i++] : NULL;
+		job->File[1] = (cmp >= 0) ? &b->Files[j++] : NULL;
+		job->Hash = false;
+		if(cmp < 0) {
+			job->Status = DIFF_REMOVED;
+			continue;
+		} else if(cmp > 0) {
+			job->Status = DIFF_ADDED;
+			continue;
+		}
+		DIFF_FILE *fa = job->File[0];
+		DIFF_FILE *fb = job->File[1];
+		bool dir = (fa->Attributes & fb->Attributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+		job->Status = DiffMetadataEqual(fa, fb) ? DIFF_UNCHANGED : DIFF_METADATA;
+		if(!dir && fa->Size != fb->Size) {
+			job->Status = DIFF_MODIFIED;
+		} else if(!dir && fa->Size != 0) {
+			job->Hash = true;
+		}
+	}
+
+	WorkersRun(Threads, DiffWorker, diff);
+	size_t changes = 0;
+	for(size_t k = 0; k < diff->JobCount; k++) {
+		DIFF_JOB *job = &diff->Jobs[k];
+		if(job->Status != DIFF_UNCHANGED) {
+			DIFF_SIDE *side = job->File[1] ? b : a;
+			DIFF_FILE *file = job->File[1] ? job->File[1] : job->File[0];
+			fwprintf(stdout, L"%s\t%s\n",
+				DIFF_STATUS_NAMES[job->Status], &side->Paths[file->Path]
+			);
+			changes++;
+		}
+	}
+	double elapsed = TimeSeconds() - start;
+	fwprintf(stderr,
+		L"%Iu differences; hashed %lld bytes in %.3f s (%.1f MiB/s).\n",
+		changes, diff->BytesHashed, elapsed,
+		elapsed > 0 ? (diff->BytesHashed / (1024.0 * 1024.0)) / elapsed : 0.0
+	);
+	ret = changes != 0;
+end:
+	DiffClose(a);
+	DiffClose(b);
+	HeapFree(GetProcessHeap(), 0, diff->Jobs);
+	HeapFree(GetProcessHeap(), 0, diff);
+	return ret;
+}
+
+int CMD_Diff_Main(int argc, const wchar_t *argv[])
+{
+	unsigned int threads = 0;
+	WorkersArg(argc - 2, argv + 2, &threads);
+	return Diff(argv[0], argv[1], threads);
+}
+
+NEW_COMMAND(Diff, L"diff", L"imagefile_a imagefile_b [-j threads]", 2);
@@ -0,0 +1,119 @@
+/*
+ * Dokan Image Mounter
+ *
+ * Reads of file data straight from the image file into the caller's buffer.
+ */
+
+// Set from the command line. Only plain image files support this, everything
+// else keeps copying from the view.
+bool DirectReads = false;
+
+typedef struct {
+	HANDLE File;
+	HANDLE Event;
+	// Offset of the view of the file system in the image file
+	uint64_t Base;
+	uint64_t Skip;
+	uint8_t *Buf;
+	DWORD Length;
+	DWORD Read;
+	bool Failed;
+} DIRECT_READ;
+
+// Opens the overlapped handle to the plain image file [FN] that direct reads
+// go through. Failure simply leaves them disabled for [Image].
+void DirectOpen(CONTAINER *Image, const wchar_t *FN)
+{
+	if(!DirectReads) {
+		return;
+	}
+	Image->DirectFile = CreateFileW(
+		FN, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL
+	);
+	if(Image->DirectFile == INVALID_HANDLE_VALUE) {
+		Image->DirectFile = NULL;
+		fwprintf(stderr,
+			L"**Warning** Could not open %s for direct reads, copying from the mapping instead.\n", FN
+		);
+	}
+}
+
+void DirectClose(CONTAINER *Image)
+{
+	if(Image->DirectFile) {
+		CloseHandle(Image->DirectFile);
+		Image->DirectFile = NULL;
+	}
+}
+
+int DirectReadExtent(void *Param, uint64_t Offset, uint64_t Length)
+{
+	DIRECT_READ *dr = (DIRECT_READ*)Param;
+	if(dr->Skip >= Length) {
+		dr->Skip -= Length;
+		return 0;
+	}
+	// Past the valid data length of the file, which the image doesn't store.
+	bool zero = (Offset == FS_EXTENT_ZERO);
+	Offset += dr->Skip;
+	Length -= dr->Skip;
+	dr->Skip = 0;
+
+	DWORD len = (DWORD)min(Length, dr->Length);
+	if(zero) {
+		ZeroMemory(dr->Buf, len);
+	} else {
+		DWORD bytes = 0;
+		uint64_t pos = dr->Base + Offset;
+		OVERLAPPED ov = {
+			.Offset = (DWORD)pos,
+			.OffsetHigh = (DWORD)(pos >> 32),
+			.hEvent = dr->Event,
+		};
+		if(
+			(!ReadFile(dr->File, dr->Buf, len, NULL, &ov) && GetLastError() != ERROR_IO_PENDING)
+			|| !GetOverlappedResult(dr->File, &ov, &bytes, TRUE)
+			|| bytes != len
+		) {
+			dr->Failed = true;
+			return 1;
+		}
+	}
+	dr->Buf += len;
+	dr->Read += len;
+	dr->Length -= len;
+	return dr->Length == 0;
+}
+
+// Reads like FSFORMAT::ReadFile(), but has the kernel fill [Buffer] straight
+// from the image file with one read per extent, instead of copying the data
+// out of the view. Returns STATUS_NOT_SUPPORTED if the caller has to fall
+// back on ReadFile(), with [ReadLength] untouched.
+NTSTATUS FSReadFileDirect(FILESYSTEM *FS, ULONG64 File, uint8_t *Buffer, DWORD BufferLength, LPDWORD ReadLength, LONGLONG Offset)
+{
+	assert(FS);
+	DIRECT_READ dr = {
+		.File = FS->Image->DirectFile,
+		.Base = FSImageOffset(FS, 0),
+		.Skip = Offset,
+		.Buf = Buffer,
+		.Length = BufferLength,
+	};
+	if(!dr.File) {
+		return STATUS_NOT_SUPPORTED;
+	}
+	dr.Event = CreateEventW(NULL, TRUE, FALSE, NULL);
+	if(!dr.Event) {
+		return STATUS_NOT_SUPPORTED;
+	}
+	FS->FSFormat->FileExtents(FS, File, DirectReadExtent, &dr);
+	CloseHandle(dr.Event);
+	// Broken chains and reads past the end of the image are left to
+	// ReadFile(), which already knows how to report them.
+	if(dr.Failed || dr.Length) {
+		return STATUS_NOT_SUPPORTED;
+	}
+	*ReadLength += dr.Read;
+	return STATUS_SUCCESS;
+}
@@ -0,0 +1,59 @@
+/*
+ * Dokan Image Mounter
+ *
+ * Physical layout of files, for tools that read their data straight from the
+ * image file.
+ */
+
+int CMD_Extents_Main(int argc, const wchar_t *argv[])
+{
+	CONTAINER image = {0};
+	FILESYSTEM *fs = NULL;
+	int ret = ImageOpen(&image, argv[0]);
+	if(!ret) {
+		ret = ImageProbe(&image, &fs, stderr);
+	}
+	if(ret) {
+		goto end;
+	}
+	OUTBUF *out = HeapAlloc(GetProcessHeap(), 0, sizeof(OUTBUF));
+	if(!out) {
+		ret = ERROR_OUTOFMEMORY;
+		goto end;
+	}
+	out->Handle = GetStdHandle(STD_OUTPUT_HANDLE);
+	out->Failed = false;
+	out->Len = 0;
+	for(int arg = 1; arg < argc; arg++) {
+		const wchar_t *path = argv[arg];
+		ULONG64 file = FSFileLookupW(fs, path);
+		if(!file) {
+			fwprintf(stderr, L"**Error** File not found: %s\n", path);
+			ret = ERROR_FILE_NOT_FOUND;
+			continue;
+		}
+		size_t len;
+		NTSTATUS status;
+		char *text = FSFileLayoutText(fs, file, &len, &status);
+		if(!text) {
+			ret = ReportError(ERROR_OUTOFMEMORY, ERROR_OUTOFMEMORY, L"%s", path);
+			break;
+		}
+		OutWrite(out, "# ", 2);
+		OutWriteW(out, path, wcslen(path));
+		OutWrite(out, "\n", 1);
+		OutWrite(out, text, len);
+		HeapFree(GetProcessHeap(), 0, text);
+		if(status != STATUS_SUCCESS) {
+			fwprintf(stderr, L"**Warning** %s: broken cluster chain, extents are incomplete.\n", path);
+			ret = ERROR_FILE_CORRUPT;
+		}
+	}
+	OutFlush(out);
+	HeapFree(GetProcessHeap(), 0, out);
+end:
+	ImageClose(&image);
+	return ret;
+}
+
+NEW_COMMAND(Extents, L"extents", L"imagefile path [path ...]", 2);
@@ -0,0 +1,322 @@
+/*
+ * Dokan Image Mounter
+ *
+ * Offline extraction of all files on a file system into a directory.
+ */
+
+// Maximum number of bytes passed to a single WriteFile() call.
+#define EXTRACT_WRITE_MAX 0x1000000
+// Size of the per-worker buffer that data from block sources is copied into
+// before writing it.
+#define EXTRACT_BOUNCE_SIZE 0x100000
+
+typedef struct {
+	size_t Path; // offset into EXTRACT::Paths
+	ULONG64 File;
+	uint64_t Size;
+	DWORD Attributes;
+	FILETIME CreationTime;
+	FILETIME LastAccessTime;
+	FILETIME LastWriteTime;
+} EXTRACT_JOB;
+
+typedef struct {
+	FILESYSTEM *FS;
+	// Absolute destination path, with the "\\?\" prefix for long paths
+	wchar_t Dest[MAX_PATH + 4];
+	size_t DestLen;
+	bool OutOfMemory;
+
+	EXTRACT_JOB *Jobs;
+	size_t JobCount;
+	size_t JobCap;
+
+	wchar_t *Paths;
+	size_t PathsLength;
+	size_t PathsCap;
+
+	volatile LONG NextJob;
+	volatile LONG Errors;
+	volatile LONGLONG FilesWritten;
+	volatile LONGLONG BytesWritten;
+} EXTRACT;
+
+typedef struct {
+	FILESYSTEM *FS;
+	HANDLE Out;
+	uint64_t Remaining;
+	DWORD Error;
+	// Pages of a block source are only filled, and kept from being evicted,
+	// by user-mode accesses, which the kernel's copy in WriteFile() isn't.
+	// Their data therefore goes through this buffer. NULL for mapped files.
+	uint8_t *Bounce;
+} EXTRACT_WRITE;
+
+// Destination file name buffer, large enough for any path from FSWalk().
+typedef wchar_t EXTRACT_FN[elementsof(((EXTRACT*)0)->Dest) + FS_PATH_MAX];
+
+void ExtractDestPath(EXTRACT *Ex, wchar_t *Buf, const wchar_t *Path)
+{
+	memcpy(Buf, Ex->Dest, Ex->DestLen * sizeof(wchar_t));
+	wcscpy_s(Buf + Ex->DestLen, FS_PATH_MAX, Path);
+}
+
+void ExtractSetTimes(HANDLE Handle, EXTRACT_JOB *Job)
+{
+	SetFileTime(Handle, &Job->CreationTime, &Job->LastAccessTime, &Job->LastWriteTime);
+}
+
+int ExtractAddFile(void *Param, const wchar_t *Path, size_t PathLen, WIN32_FIND_DATAW *FD, ULONG64 File)
+{
+	EXTRACT *ex = (EXTRACT*)Param;
+	if(
+		!ArrayReserve((void**)&ex->Jobs, &ex->JobCap, sizeof(EXTRACT_JOB), ex->JobCount + 1)
+		|| !ArrayReserve((void**)&ex->Paths, &ex->PathsCap, sizeof(wchar_t), ex->PathsLength + PathLen + 1)
+	) {
+		ex->OutOfMemory = true;
+		return ERROR_OUTOFMEMORY;
+	}
+	EXTRACT_JOB *job = &ex->Jobs[ex->JobCount++];
+	job->Path = ex->PathsLength;
+	job->File = File;
+	job->Size = ((uint64_t)FD->nFileSizeHigh << 32) | FD->nFileSizeLow;
+	job->Attributes = FD->dwFileAttributes;
+	job->CreationTime = FD->ftCreationTime;
+	job->LastAccessTime = FD->ftLastAccessTime;
+	job->LastWriteTime = FD->ftLastWriteTime;
+	memcpy(&ex->Paths[ex->PathsLength], Path, (PathLen + 1) * sizeof(wchar_t));
+	ex->PathsLength += PathLen + 1;
+
+	// Directories have to exist before any worker writes into them, so we
+	// might as well create them right here.
+	if(FD->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+		EXTRACT_FN fn;
+		ExtractDestPath(ex, fn, Path);
+		if(!CreateDirectoryW(fn, NULL) && GetLastError() != ERROR_ALREADY_EXISTS) {
+			ReportError(0, GetLastError(), L"Error creating %s", fn);
+			ex->Errors++;
+		}
+	}
+	return 0;
+}
+
+int ExtractWriteExtent(void *Param, uint64_t Offset, uint64_t Length)
+{
+	EXTRACT_WRITE *w = (EXTRACT_WRITE*)Param;
+	Length = min(Length, w->Remaining);
+	while(Length) {
+		DWORD chunk = (DWORD)min(Length, w->Bounce ? EXTRACT_BOUNCE_SIZE : EXTRACT_WRITE_MAX);
+		DWORD written;
+		bool hole = (Offset == FS_EXTENT_ZERO);
+		uint8_t *data = NULL;
+		if(!hole) {
+			data = LAt(w->FS, Offset, chunk);
+			if(!data) {
+				w->Error = ERROR_FILE_CORRUPT;
+				return 1;
+			}
+			chunk = (DWORD)ImageHoleRun(w->FS->Image, data, chunk, &hole);
+		}
+		if(!hole) {
+			FSPrefetch(w->FS, Offset, chunk);
+		}
+		if(!hole && w->Bounce) {
+			CopyFor(chunk)(w->Bounce, data, chunk);
+			data = w->Bounce;
+		}
+		if(hole) {
+			// The output was already extended to its full size, so skipping
+			// leaves zeroes, or a hole if it's sparse.
+			LARGE_INTEGER skip = {.QuadPart = chunk};
+			if(!SetFilePointerEx(w->Out, skip, NULL, FILE_CURRENT)) {
+				w->Error = GetLastError();
+				return 1;
+			}
+		} else if(!WriteFile(w->Out, data, chunk, &written, NULL) || written != chunk) {
+			w->Error = GetLastError();
+			return 1;
+		}
+		Offset += (Offset == FS_EXTENT_ZERO) ? 0 : chunk;
+		Length -= chunk;
+		w->Remaining -= chunk;
+	}
+	return w->Remaining == 0;
+}
+
+void ExtractFile(EXTRACT *Ex, EXTRACT_JOB *Job, uint8_t *Bounce)
+{
+	EXTRACT_FN fn;
+	EXTRACT_WRITE w = {
+		.FS = Ex->FS,
+		.Remaining = Job->Size,
+		.Bounce = Bounce,
+	};
+	ExtractDestPath(Ex, fn, &Ex->Paths[Job->Path]);
+	w.Out = CreateFileW(
+		fn, GENERIC_WRITE, 0, NULL,
+		CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL
+	);
+	if(w.Out == INVALID_HANDLE_VALUE) {
+		ReportError(0, GetLastError(), L"Error creating %s", fn);
+		InterlockedIncrement(&Ex->Errors);
+		return;
+	}
+	// Holes in the image become holes in the output. Since this has to
+	// happen before the file is extended, we can't know whether the file
+	// will actually contain any, but sparse files without holes behave just
+	// like regular ones.
+	if(Ex->FS->Image->Holes.Sparse) {
+		DWORD bytes;
+		DeviceIoControl(w.Out, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &bytes, NULL);
+	}
+	// Allocating the whole file up front keeps it contiguous on the
+	// destination as well.
+	LARGE_INTEGER size = {.QuadPart = (LONGLONG)Job->Size};
+	LARGE_INTEGER zero = {0};
+	if(Job->Size && SetFilePointerEx(w.Out, size, NULL, FILE_BEGIN)) {
+		SetEndOfFile(w.Out);
+		SetFilePointerEx(w.Out, zero, NULL, FILE_BEGIN);
+	}
+	NTSTATUS status = Ex->FS->FSFormat->FileExtents(
+		Ex->FS, Job->File, ExtractWriteExtent, &w
+	);
+	if(status != STATUS_SUCCESS && !w.Error) {
+		w.Error = ERROR_FILE_CORRUPT;
+	}
+	if(w.Error || w.Remaining) {
+		ReportError(0, w.Error ? w.Error : ERROR_HANDLE_EOF,
+			L"Error extracting %s", &Ex->Paths[Job->Path]
+		);
+		InterlockedIncrement(&Ex->Errors);
+	} else {
+		InterlockedIncrement64(&Ex->FilesWritten);
+	}
+	InterlockedExchangeAdd64(&Ex->BytesWritten, Job->Size - w.Remaining);
+	ExtractSetTimes(w.Out, Job);
+	CloseHandle(w.Out);
+}
+
+DWORD WINAPI ExtractWorker(void *Param)
+{
+	EXTRACT *ex = (EXTRACT*)Param;
+	uint8_t *bounce = NULL;
+	size_t i;
+	if(ex->FS->Image->Source) {
+		bounce = VirtualAlloc(NULL, EXTRACT_BOUNCE_SIZE, MEM_COMMIT, PAGE_READWRITE);
+		if(!bounce) {
+			fwprintf(stderr, L"**Error** Out of memory for the copy buffer of a worker.\n");
+			InterlockedIncrement(&ex->Errors);
+			return ERROR_OUTOFMEMORY;
+		}
+	}
+	while((i = (size_t)InterlockedIncrement(&ex->NextJob) - 1) < ex->JobCount) {
+		if(!(ex->Jobs[i].Attributes & FILE_ATTRIBUTE_DIRECTORY)) {
+			ExtractFile(ex, &ex->Jobs[i], bounce);
+		}
+	}
+	if(bounce) {
+		VirtualFree(bounce, 0, MEM_RELEASE);
+	}
+	return 0;
+}
+
+// Writing files into a directory changes its timestamps, so we can only
+// restore them once everything has been extracted.
+void ExtractDirTimes(EXTRACT *Ex)
+{
+	EXTRACT_FN fn;
+	for(size_t i = 0; i < Ex->JobCount; i++) {
+		EXTRACT_JOB *job = &Ex->Jobs[i];
+		if(!(job->Attributes & FILE_ATTRIBUTE_DIRECTORY)) {
+			continue;
+		}
+		ExtractDestPath(Ex, fn, &Ex->Paths[job->Path]);
+		HANDLE dir = CreateFileW(
+			fn, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+			OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL
+		);
+		if(dir != INVALID_HANDLE_VALUE) {
+			ExtractSetTimes(dir, job);
+			CloseHandle(dir);
+		}
+	}
+}
+
+// Extracts all files on [FS] into [Dest], using [Threads] worker threads.
+// Returns the number of files that could not be extracted.
+int Extract(FILESYSTEM *FS, const wchar_t *Dest, unsigned int Threads)
+{
+	int ret = 0;
+	EXTRACT *ex = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(EXTRACT));
+	if(!ex) {
+		return ERROR_OUTOFMEMORY;
+	}
+	ex->FS = FS;
+	wcscpy_s(ex->Dest, elementsof(ex->Dest), L"\\\\?\\");
+	DWORD full_len = GetFullPathNameW(Dest, elementsof(ex->Dest) - 4, ex->Dest + 4, NULL);
+	W32_ERR_REPORT(full_len == 0 || full_len >= elementsof(ex->Dest) - 4,
+		-2, L"Invalid destination path %s", Dest
+	);
+	ex->DestLen = 4 + full_len;
+	if(IsDirSepW(ex->Dest[ex->DestLen - 1])) {
+		ex->Dest[--ex->DestLen] = L'\0';
+	}
+	W32_ERR_REPORT(
+		!CreateDirectoryW(ex->Dest, NULL) && GetLastError() != ERROR_ALREADY_EXISTS,
+		-3, L"Error creating %s", Dest
+	);
+
+	double start = TimeSeconds();
+	FSWalk(FS, ExtractAddFile, ex);
+	if(ex->OutOfMemory) {
+		fwprintf(stderr, L"**Error** Out of memory while collecting files.\n");
+		ret = ERROR_OUTOFMEMORY;
+		goto end;
+	}
+	WorkersRun(Threads, ExtractWorker, ex);
+	ExtractDirTimes(ex);
+	double elapsed = TimeSeconds() - start;
+
+	fwprintf(stdout,
+		L"Extracted %lld files, %lld bytes in %.3f s (%.1f MiB/s).\n",
+		ex->FilesWritten, ex->BytesWritten, elapsed,
+		elapsed > 0 ? (ex->BytesWritten / (1024.0 * 1024.0)) / elapsed : 0.0
+	);
+	if(ex->Errors) {
+		fwprintf(stderr, L"%ld errors.\n", ex->Errors);
+	}
+	ret = ex->Errors;
+end:
+	HeapFree(GetProcessHeap(), 0, ex->Jobs);
+	HeapFree(GetProcessHeap(), 0, ex->Paths);
+	HeapFree(GetProcessHeap(), 0, ex);
+	return ret;
+}
+
+int CMD_Extract_Main(int argc, const wchar_t *argv[])
+{
+	unsigned int threads = 0;
+	CONTAINER image = {0};
+	FILESYSTEM *fs = NULL;
+
+	for(int arg = 2; arg < argc; arg++) {
+		if(!wcscmp(argv[arg], L"--aio") && (arg + 1) < argc) {
+			AioImageDepth = wcstoul(argv[++arg], NULL, 10);
+		} else {
+			arg += max(WorkersArg(argc - arg, argv + arg, &threads), 1) - 1;
+		}
+	}
+	int ret = ImageOpen(&image, argv[0]);
+	if(!ret) {
+		ret = ImageProbe(&image, &fs, stdout);
+	}
+	if(!ret) {
+		IndexAttach(fs, argv[0]);
+		ret = Extract(fs, argv[1], threads);
+		IndexDetach(fs);
+	}
+	ImageClose(&image);
+	return ret;
+}
+
+NEW_COMMAND(Extract, L"extract", L"imagefile destdir [-j threads] [--aio depth]", 2);
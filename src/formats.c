@@ -0,0 +1,21 @@
+/*
+ * Dokan Image Mounter
+ *
+ * Supported formats, in probing order. Shared by dimount and libdimount.
+ */
+
+const FSFORMAT *FSFormats[] = {
+	&FS_FAT,
+	&FS_EXFAT,
+	NULL
+};
+const PTFORMAT *PTFormats[] = {
+	&PT_NEC,
+	&PT_None,
+	NULL
+};
+const CFORMAT *CFormats[] = {
+	&C_HDI,
+	&C_None,
+	NULL
+};
@@ -62,42 +62,18 @@ void DokanExit(void)
 }
 /// ------------------------
 
-/// Error reporting
-/// ---------------
-#define W32_ERR_REPORT(FailCondition, ReturnValue, Prefix, ...) \
-	if(FailCondition) { \
-		ret = ReportError(ReturnValue, GetLastError(), Prefix, __VA_ARGS__); \
-		goto end; \
-	}
-
-int ReportError(int ReturnValue, DWORD Error, const wchar_t *Prefix, ...)
-{
-	va_list va;
-	wchar_t *msg_str = NULL;
-
-	va_start(va, Prefix);
-
-	FormatMessageW(
-		FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_ALLOCATE_BUFFER,
-		NULL, Error, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
-		(LPWSTR)&msg_str, 0, NULL
-	);
-
-	vfwprintf(stderr, Prefix, va);
-	fwprintf(stderr, L": %s", msg_str);
-	LocalFree(msg_str);
-	va_end(va);
-	return ReturnValue;
-}
-/// ---------------
-
 /// Dokan callbacks
 /// ---------------
 #define PrintEnter fprintf(stderr, __FUNCTION__);
 #define PrintEnterln fprintf(stderr, "%s\n", __FUNCTION__);
+// Only one file system is mounted per process.
+PREWARM DIMPrewarm;
+HEAT DIMHeat;
+
 #define DIMCallbackEnter \
 	FILESYSTEM *fs = (FILESYSTEM*)DokanFileInfo->DokanOptions->GlobalContext; \
-	const FSFORMAT *fmt = fs->FSFormat;
+	const FSFORMAT *fmt = fs->FSFormat; \
+	PrewarmNotify(&DIMPrewarm);
 
 #define DIMCodePageCall(Func, ...) \
 	bool unicode = fmt->Func##W != NULL; \
@@ -119,16 +95,181 @@ int ReportError(int ReturnValue, DWORD Error, const wchar_t *Prefix, ...)
 #define DIMFileShouldBeOpen \
 	assert(DokanFileInfo->Context);
 
+// The image can't change while it's mounted, so every path that was looked up
+// once, or listed as part of its directory, keeps resolving to the same file,
+// or to none at all. Windows opens every file by its path before doing
+// anything else with it, which would otherwise scan all directories along
+// that path again every time.
+typedef struct {
+	ULONG64 File; // 0 if the path doesn't exist
+	uint64_t Key;
+	volatile LONG Referenced;
+	size_t PathLen;
+	wchar_t Path[]; // case-folded
+} DIM_LOOKUP;
+
+typedef struct {
+	RCU_MAP Map;
+	ARENA *Arena;
+	// Budget registration of [Map], keyed by the DIM_LOOKUP pointer
+	CACHE Cache;
+} DIM_LOOKUPS;
+
+DIM_LOOKUPS DIMLookups;
+
+size_t DIMLookupSize(size_t PathLen)
+{
+	return sizeof(DIM_LOOKUP) + PathLen * sizeof(wchar_t);
+}
+
+// Both called with the cache manager locked.
+bool DIMLookupReferenced(CACHE *Cache, uint64_t Key)
+{
+	DIM_LOOKUP *lookup = (DIM_LOOKUP*)Key;
+	return InterlockedExchange(&lookup->Referenced, 0) != 0;
+}
+
+void DIMLookupEvict(CACHE *Cache, uint64_t Key)
+{
+	DIM_LOOKUP *lookup = (DIM_LOOKUP*)Key;
+	// Readers still inside the map keep it alive until they leave.
+	RcuMapRemove(&DIMLookups.Map, lookup->Key, DIMLookupSize(lookup->PathLen));
+}
+
+// Case-folds the [Len] characters of [Path] into [Folded], which must hold
+// FS_PATH_MAX characters. Returns the key of [Path] in the cache, or 0 if it
+// can't be cached.
+uint64_t DIMLookupKey(wchar_t *Folded, const wchar_t *Path, size_t Len)
+{
+	if(!DIMLookups.Arena || Len == 0 || Len >= FS_PATH_MAX) {
+		return 0;
+	}
+	int folded = LCMapStringEx(
+		LOCALE_NAME_INVARIANT, LCMAP_UPPERCASE,
+		Path, (int)Len, Folded, FS_PATH_MAX, NULL, NULL, 0
+	);
+	if(folded != (int)Len) {
+		return 0;
+	}
+	return Hash64(Folded, Len * sizeof(wchar_t), 0);
+}
+
+// Must be called inside the map.
+DIM_LOOKUP* DIMLookupFind(uint64_t Key, const wchar_t *Folded, size_t Len)
+{
+	DIM_LOOKUP *lookup = RcuMapLookup(&DIMLookups.Map, Key);
+	// On a hash collision, the path that came first keeps the slot.
+	if(
+		lookup && lookup->PathLen == Len
+		&& !memcmp(lookup->Path, Folded, Len * sizeof(wchar_t))
+	) {
+		return lookup;
+	}
+	return NULL;
+}
+
+void DIMLookupAdd(uint64_t Key, const wchar_t *Folded, size_t Len, ULONG64 File)
+{
+	size_t size = DIMLookupSize(Len);
+	DIM_LOOKUP *lookup = PoolAlloc(DIMLookups.Arena, size);
+	if(!lookup) {
+		return;
+	}
+	lookup->File = File;
+	lookup->Key = Key;
+	lookup->PathLen = Len;
+	memcpy(lookup->Path, Folded, Len * sizeof(wchar_t));
+	if(RcuMapInsert(&DIMLookups.Map, Key, lookup) == lookup) {
+		CacheInsert(&DIMLookups.Cache, (uint64_t)lookup, (uint32_t)size, 1);
+	} else {
+		PoolFree(DIMLookups.Arena, lookup, size);
+	}
+}
+
 ULONG64 DOKAN_CALLBACK DIMFileLookup(
 	LPCWSTR FileNameW,
 	PDOKAN_FILE_INFO DokanFileInfo
 )
 {
 	DIMCallbackEnter;
+	wchar_t folded[FS_PATH_MAX];
+	size_t len = wcslen(FileNameW);
+	uint64_t key = DIMLookupKey(folded, FileNameW, len);
+	if(key) {
+		// Keeps [lookup] from being freed if it gets evicted meanwhile.
+		EPOCH_SLOT *slot = RcuEnter(&DIMLookups.Map);
+		DIM_LOOKUP *lookup = DIMLookupFind(key, folded, len);
+		if(lookup) {
+			ULONG64 file = lookup->File;
+			if(!lookup->Referenced) {
+				InterlockedExchange(&lookup->Referenced, 1);
+			}
+			RcuLeave(slot);
+			InterlockedIncrement64(&DIMLookups.Cache.Hits);
+			return file;
+		}
+		RcuLeave(slot);
+	}
+	InterlockedIncrement64(&DIMLookups.Cache.Misses);
 	DIMCodePageCall(FileLookup);
+	if(key) {
+		DIMLookupAdd(key, folded, len, ret);
+	}
 	return ret;
 }
 
+// Every file has a virtual alternate data stream that describes where its
+// data is stored in the image file, in the format of FSFileLayoutText().
+#define DIM_EXTENTS_STREAM L":dimount.extents"
+
+// Returns the length of the file name part of [FileName] if it names the
+// extents stream of a file, or 0 otherwise.
+size_t DIMExtentsStream(const wchar_t *FileName)
+{
+	const wchar_t *colon = wcschr(FileName, L':');
+	size_t stream_len = wcslen(DIM_EXTENTS_STREAM);
+	if(!colon || _wcsnicmp(colon, DIM_EXTENTS_STREAM, stream_len)) {
+		return 0;
+	}
+	const wchar_t *type = colon + stream_len;
+	if(*type && _wcsicmp(type, L":$DATA")) {
+		return 0;
+	}
+	return colon - FileName;
+}
+
+NTSTATUS DIMExtentsStreamInfo(FILESYSTEM *fs, ULONG64 File, LPBY_HANDLE_FILE_INFORMATION HandleFileInfo)
+{
+	size_t len;
+	NTSTATUS status;
+	char *text = FSFileLayoutText(fs, File, &len, &status);
+	if(!text) {
+		return STATUS_NO_MEMORY;
+	}
+	HeapFree(GetProcessHeap(), 0, text);
+	HandleFileInfo->nFileSizeHigh = (DWORD)((uint64_t)len >> 32);
+	HandleFileInfo->nFileSizeLow = (DWORD)len;
+	HandleFileInfo->dwFileAttributes &= ~FILE_ATTRIBUTE_DIRECTORY;
+	return status;
+}
+
+NTSTATUS DIMExtentsStreamRead(FILESYSTEM *fs, ULONG64 File, LPVOID Buffer, DWORD BufferLength, LPDWORD ReadLength, LONGLONG Offset)
+{
+	size_t len;
+	NTSTATUS status;
+	// Cheap enough to regenerate, since the extents themselves are cached.
+	char *text = FSFileLayoutText(fs, File, &len, &status);
+	if(!text) {
+		return STATUS_NO_MEMORY;
+	}
+	if(status == STATUS_SUCCESS && (uint64_t)Offset < len) {
+		*ReadLength = (DWORD)min(BufferLength, len - Offset);
+		memcpy(Buffer, text + Offset, *ReadLength);
+	}
+	HeapFree(GetProcessHeap(), 0, text);
+	return status;
+}
+
 NTSTATUS DOKAN_CALLBACK DIMCreateFile(
 	LPCWSTR FileNameW,
 	DWORD AccessMode,
@@ -162,8 +303,72 @@ NTSTATUS DOKAN_CALLBACK DIMCreateFile(
 	}
 	HANDLE handle = pDokanOpenRequestorToken(DokanFileInfo);
 	CloseHandle(handle);
-	DIMCodePageCall(CreateFile, AccessMode, CreationDisposition, FlagsAndAttributes, DokanFileInfo);
-	return (NTSTATUS)ret;
+	wchar_t base_fn[MAX_PATH];
+	size_t base_len = DIMExtentsStream(FileNameW);
+	if(base_len) {
+		if(base_len >= elementsof(base_fn)) {
+			return -ERROR_FILE_NOT_FOUND;
+		}
+		memcpy(base_fn, FileNameW, base_len * sizeof(wchar_t));
+		base_fn[base_len] = L'\0';
+		FileNameW = base_fn;
+	}
+	ULONG64 file = DIMFileLookup(FileNameW, DokanFileInfo);
+	if(!file) {
+		return -ERROR_FILE_NOT_FOUND;
+	}
+	BY_HANDLE_FILE_INFORMATION info;
+	NTSTATUS status = fmt->GetFileInformation(fs, file, &info);
+	if(status != STATUS_SUCCESS) {
+		return status;
+	}
+	DokanFileInfo->IsDirectory = (
+		!base_len && (info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0
+	);
+	DokanFileInfo->Context = file;
+	return STATUS_SUCCESS;
+}
+
+// Forwards the files found by the backend to Dokan, and adds their paths to
+// the lookup cache, since they are usually opened right after the listing.
+typedef struct {
+	PFillFindData FillFindData;
+	PDOKAN_FILE_INFO DokanFileInfo;
+	const wchar_t *Dir;
+	size_t DirLen;
+} DIM_FIND_PARAM;
+
+void DIMFindCache(DIM_FIND_PARAM *Param, const wchar_t *Name, ULONG64 File)
+{
+	wchar_t path[FS_PATH_MAX];
+	wchar_t folded[FS_PATH_MAX];
+	if(!wcscmp(Name, L".") || !wcscmp(Name, L"..")) {
+		return;
+	}
+	bool sep = Param->DirLen && !IsDirSepW(Param->Dir[Param->DirLen - 1]);
+	if(swprintf_s(
+		path, elementsof(path), L"%s%s%s", Param->Dir, sep ? L"\\" : L"", Name
+	) <= 0) {
+		return;
+	}
+	size_t len = wcslen(path);
+	uint64_t key = DIMLookupKey(folded, path, len);
+	if(!key) {
+		return;
+	}
+	EPOCH_SLOT *slot = RcuEnter(&DIMLookups.Map);
+	bool known = DIMLookupFind(key, folded, len) != NULL;
+	RcuLeave(slot);
+	if(!known) {
+		DIMLookupAdd(key, folded, len, File);
+	}
+}
+
+int DIMFindAddFile(FIND_CALLBACK_DATA *FCD, WIN32_FIND_DATAW *FD, ULONG64 File)
+{
+	DIM_FIND_PARAM *param = (DIM_FIND_PARAM*)FCD->Param;
+	DIMFindCache(param, FD->cFileName, File);
+	return param->FillFindData(FD, param->DokanFileInfo);
 }
 
 NTSTATUS DOKAN_CALLBACK DIMFindFiles(
@@ -177,10 +382,17 @@ NTSTATUS DOKAN_CALLBACK DIMFindFiles(
 	PrintEnter;
 	fwprintf(stderr, L"(%s)\n", FileNameW);
 #endif
-	FIND_CALLBACK_DATA fcd;
-	fcd.FS = fs;
-	fcd.FillFindData = FillFindData;
-	fcd.DokanFileInfo = DokanFileInfo;
+	DIM_FIND_PARAM param = {
+		.FillFindData = FillFindData,
+		.DokanFileInfo = DokanFileInfo,
+		.Dir = FileNameW,
+		.DirLen = wcslen(FileNameW),
+	};
+	FIND_CALLBACK_DATA fcd = {
+		.FS = fs,
+		.AddFile = DIMFindAddFile,
+		.Param = &param,
+	};
 	return fmt->FindFiles(fs, DIMFileLookup(FileNameW, DokanFileInfo), &fcd);
 }
 
@@ -213,7 +425,11 @@ NTSTATUS DOKAN_CALLBACK DIMGetFileInformation(
 #endif
 	DIMFileShouldBeOpen;
 	HandleFileInfo->dwVolumeSerialNumber = fs->Serial;
-	return fmt->GetFileInformation(fs, HandleFileInfo, DokanFileInfo);
+	NTSTATUS status = fmt->GetFileInformation(fs, DokanFileInfo->Context, HandleFileInfo);
+	if(status == STATUS_SUCCESS && DIMExtentsStream(FileName)) {
+		status = DIMExtentsStreamInfo(fs, DokanFileInfo->Context, HandleFileInfo);
+	}
+	return status;
 }
 
 NTSTATUS DOKAN_CALLBACK DIMGetVolumeInformation(
@@ -266,6 +482,11 @@ NTSTATUS DOKAN_CALLBACK DIMReadFile(
 		return STATUS_SUCCESS;
 	}
 	DIMFileShouldBeOpen;
+	if(DIMExtentsStream(FileName)) {
+		return DIMExtentsStreamRead(
+			fs, DokanFileInfo->Context, Buffer, BufferLength, ReadLength, Offset
+		);
+	}
 	LONGLONG size = fmt->FileSize((void*)DokanFileInfo->Context);
 	LONGLONG end = Offset + BufferLength;
 	if(Offset >= size) {
@@ -273,7 +494,17 @@ NTSTATUS DOKAN_CALLBACK DIMReadFile(
 	} else if(end > size || end < Offset) {
 		BufferLength = (DWORD)(size - Offset);
 	}
-	return fmt->ReadFile(fs, Buffer, BufferLength, ReadLength, Offset, DokanFileInfo);
+	FSPrefetchFile(fs, DokanFileInfo->Context, Offset, BufferLength);
+	NTSTATUS ret = FSReadFileDirect(
+		fs, DokanFileInfo->Context, Buffer, BufferLength, ReadLength, Offset
+	);
+	if(ret == STATUS_NOT_SUPPORTED) {
+		ret = fmt->ReadFile(
+			fs, DokanFileInfo->Context, Buffer, BufferLength, ReadLength, Offset
+		);
+	}
+	HeatRecord(&DIMHeat, DokanFileInfo->Context, Offset, *ReadLength);
+	return ret;
 }
 
 // This is the magical required function that makes everything else work in
@@ -301,83 +532,47 @@ DOKAN_OPERATIONS operations = {
 };
 /// ---------------
 
-int dimount(const wchar_t *Mountpoint, const wchar_t *ImageFN)
+int dimount(const wchar_t *Mountpoint, const wchar_t *ImageFN, bool Prewarm, uint64_t PinBudget, uint64_t MetadataLimit)
 {
-	int ret = 0;
-	HANDLE image_map = NULL;
-	HANDLE image_file = NULL;
-
 	CONTAINER image = {0};
+	FILESYSTEM *fs_to_mount = NULL;
 
-	// TODO: Open writable.
-	// TODO: Don't lock the image file.
-	image_file = CreateFileW(
-		ImageFN, GENERIC_READ, 0, NULL,
-		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL
-	);
-	W32_ERR_REPORT(image_file == INVALID_HANDLE_VALUE,
-		-2, L"Error opening %s", ImageFN
-	);
-	LARGE_INTEGER image_size;
-	W32_ERR_REPORT(!GetFileSizeEx(image_file, &image_size),
-		-3, L"Error retrieving the file size of %s", ImageFN
-	);
-	if(image_size.QuadPart == 0) {
-		fwprintf(stderr, L"Not mounting an empty file.\n");
-		ret = -4;
-		goto end;
-	}
-	// TODO: Writable, again.
-	image_map = CreateFileMapping(
-		image_file, NULL, PAGE_READONLY, 0, 0, NULL
-	);
-	W32_ERR_REPORT(
-		!image_map, -5, L"Error mapping %s", ImageFN
-	);
-
-	// TODO: Writable, again.
-	image.View.Memory = MapViewOfFile(image_map, FILE_MAP_READ, 0, 0, 0);
-	image.View.Size = image_size.QuadPart;
-	W32_ERR_REPORT(
-		!image.View.Memory, -6, L"Error mapping %s into memory", ImageFN
-	);
-	if(ImageCFormatProbe(&image)) {
-		fwprintf(stdout, L"Container format: %s\n", image.CFormat->Name);
-	} else {
-		fwprintf(stderr, L"Unknown container format.\n");
-		ret = -7;
+	image.MetadataLimit = MetadataLimit;
+	int ret = ImageOpen(&image, ImageFN);
+	if(ret) {
 		goto end;
 	}
-	int partitions_found = ImagePTFormatProbe(&image);
-	if(partitions_found > 0) {
-		fwprintf(stdout, L"Partition table format: %s\n", image.PTFormat->Name);
-	} else if(partitions_found == 0) {
-		fwprintf(stderr, L"No partitions in image.\n");
-		ret = -8;
-		goto end;
-	} else if(partitions_found < 0) {
-		fwprintf(stderr, L"Unknown partition table format.\n");
-		ret = -9;
+	ret = ImageProbe(&image, &fs_to_mount, stdout);
+	if(ret) {
 		goto end;
 	}
-
-	FILESYSTEM *fs_to_mount = NULL;
-	int i;
-	for(i = 0; i < partitions_found; i++) {
-		if(!ImageFSFormatProbe(&image.Partitions[i])) {
-			fs_to_mount = &image.Partitions[i];
-		}
+	fwprintf(stdout,
+		L"Mounting partition #%d. File system format: %s\n",
+		(int)(fs_to_mount - image.Partitions) + 1,
+		fs_to_mount->FSFormat->Name(fs_to_mount)
+	);
+	if(IndexAttach(fs_to_mount, ImageFN)) {
+		fwprintf(stdout, L"Using metadata index.\n");
 	}
-
-	if(fs_to_mount) {
+	// Lookups return handles of whichever format is attached now.
+	RcuMapInit(&DIMLookups.Map, &fs_to_mount->Arena);
+	DIMLookups.Cache.Referenced = DIMLookupReferenced;
+	DIMLookups.Cache.Evict = DIMLookupEvict;
+	CacheRegister(&DIMLookups.Cache, L"Path lookups");
+	DIMLookups.Arena = &fs_to_mount->Arena;
+	if(image.DirectFile) {
+		fwprintf(stdout, L"Reading file data straight from the image file.\n");
+	} else if(CopyEngine.Stream) {
 		fwprintf(stdout,
-			L"Mounting partition #%d. File system format: %s\n",
-			i, fs_to_mount->FSFormat->Name(fs_to_mount)
+			L"Copying reads of %Iu bytes or more with %s.\n",
+			CopyEngine.Threshold, CopyEngine.Name
 		);
-	} else {
-		fwprintf(stderr, L"Found no supported file system on any partition.\n");
-		ret = -10;
-		goto end;
+	}
+	if(Prewarm && !PrewarmStart(&DIMPrewarm, fs_to_mount)) {
+		fwprintf(stderr, L"**Warning** Could not start prewarming the metadata.\n");
+	}
+	if(PinBudget && !HeatStart(&DIMHeat, fs_to_mount, PinBudget)) {
+		fwprintf(stderr, L"**Warning** Could not start tracking hot files for pinning.\n");
 	}
 
 	DOKAN_OPTIONS options = {
@@ -391,6 +586,8 @@ int dimount(const wchar_t *Mountpoint, const wchar_t *ImageFN)
 		.GlobalContext = (ULONG64)fs_to_mount,
 	};
 	ret = pDokanMain(&options, &operations);
+	PrewarmStop(&DIMPrewarm);
+	HeatStop(&DIMHeat, stdout);
 	switch(ret) {
 		case DOKAN_MOUNT_POINT_ERROR:
 		case DOKAN_DRIVE_LETTER_ERROR:
@@ -416,23 +613,81 @@ int dimount(const wchar_t *Mountpoint, const wchar_t *ImageFN)
 			fwprintf(stderr, L"**Error** Something inside Dokan went wrong?\n");
 			break;
 	}
+	ARENA_STATS mem;
+	ArenaStats(&fs_to_mount->Arena, &mem);
+	fwprintf(stdout,
+		L"Metadata memory: %llu bytes used (%llu in pool objects), %llu bytes reserved.\n",
+		mem.BytesUsed, mem.PoolBytesLive, mem.BytesReserved
+	);
+	fwprintf(stdout,
+		L"Path lookups: %lld of %lld answered from the lookup cache.\n",
+		DIMLookups.Cache.Hits, DIMLookups.Cache.Hits + DIMLookups.Cache.Misses
+	);
+	CacheReport(stdout);
+	TierReport(&image, stdout);
 
 end:
-	UnmapViewOfFile(image.View.Memory);
-	CloseHandle(image_map);
-	CloseHandle(image_file);
+	if(DIMLookups.Arena) {
+		CacheUnregister(&DIMLookups.Cache);
+		DIMLookups.Arena = NULL;
+	}
+	IndexDetach(fs_to_mount);
+	ImageClose(&image);
 	return ret;
 }
 
 int __cdecl wmain(ULONG argc, const wchar_t *argv[])
 {
 	int ret = -1;
-	if(argc < 3) {
-		fwprintf(stderr, L"Usage: %s mountpoint imagefile\n", argv[0]);
+	CopyInit();
+	if(argc >= 2) {
+		for(const COMMAND **c = Commands; *c; c++) {
+			if(wcscmp(argv[1], (*c)->Name)) {
+				continue;
+			}
+			if(argc - 2 < (ULONG)(*c)->MinArgs) {
+				fwprintf(stderr, L"Usage: %s %s %s\n", argv[0], (*c)->Name, (*c)->Usage);
+				return ret;
+			}
+			return (*c)->Main(argc - 2, argv + 2);
+		}
+	}
+	ULONG arg = 1;
+	bool prewarm = false;
+	uint64_t pin_budget = 0;
+	uint64_t meta_limit = 0;
+	for(; arg < argc; arg++) {
+		if(!wcscmp(argv[arg], L"--prewarm")) {
+			prewarm = true;
+		} else if(!wcscmp(argv[arg], L"--pin") && (arg + 1) < argc) {
+			pin_budget = wcstoull(argv[++arg], NULL, 10) * 1024 * 1024;
+		} else if(!wcscmp(argv[arg], L"--cache") && (arg + 1) < argc) {
+			CacheBudgetSet(wcstoull(argv[++arg], NULL, 10) * 1024 * 1024);
+		} else if(!wcscmp(argv[arg], L"--meta-limit") && (arg + 1) < argc) {
+			meta_limit = wcstoull(argv[++arg], NULL, 10) * 1024 * 1024;
+		} else if(!wcscmp(argv[arg], L"--aio") && (arg + 1) < argc) {
+			AioImageDepth = wcstoul(argv[++arg], NULL, 10);
+		} else if(!wcscmp(argv[arg], L"--zero-copy")) {
+			DirectReads = true;
+		} else if(!wcscmp(argv[arg], L"--tier") && (arg + 1) < argc) {
+			TierCacheFN = argv[++arg];
+		} else if(!wcscmp(argv[arg], L"--tier-size") && (arg + 1) < argc) {
+			TierCacheBudget = wcstoull(argv[++arg], NULL, 10) * 1024 * 1024;
+		} else {
+			break;
+		}
+	}
+	if(argc - arg < 2) {
+		fwprintf(stderr,
+			L"Usage: %s [--prewarm] [--cache MiB] [--meta-limit MiB] [--pin MiB] [--aio depth] [--zero-copy] [--tier cachefile [--tier-size MiB]] mountpoint imagefile\n", argv[0]
+		);
+		for(const COMMAND **c = Commands; *c; c++) {
+			fwprintf(stderr, L"       %s %s %s\n", argv[0], (*c)->Name, (*c)->Usage);
+		}
 		return ret;
 	}
 	if(DokanInit()) {
-		ret = dimount(argv[1], argv[2]);
+		ret = dimount(argv[arg], argv[arg + 1], prewarm, pin_budget, meta_limit);
 	}
 	DokanExit();
 	return ret;
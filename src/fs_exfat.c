@@ -0,0 +1,776 @@
+/*
+ * Dokan Image Mounter
+ *
+ * exFAT file system.
+ */
+
+#define EXFAT_CLUSTER_END 0xFFFFFFFF
+
+// Directory entry types, with the InUse bit set
+#define EXFAT_ENTRY_END 0x00
+#define EXFAT_ENTRY_BITMAP 0x81
+#define EXFAT_ENTRY_UPCASE 0x82
+#define EXFAT_ENTRY_LABEL 0x83
+#define EXFAT_ENTRY_FILE 0x85
+#define EXFAT_ENTRY_STREAM 0xC0
+#define EXFAT_ENTRY_NAME 0xC1
+
+#define EXFAT_ENTRY_SIZE 32
+#define EXFAT_NAME_MAX 255
+
+// GeneralSecondaryFlags of the stream extension entry
+#define EXFAT_FLAG_NO_FAT_CHAIN 0x02
+
+#pragma pack(push, 1)
+typedef struct {
+	uint8_t Jump[3];
+	char FSName[8]; // "EXFAT   "
+	uint8_t MustBeZero[53];
+	uint64_t PartitionOffset;
+	uint64_t VolumeLength; // in sectors
+	uint32_t FATOffset; // in sectors
+	uint32_t FATLength; // in sectors
+	uint32_t ClusterHeapOffset; // in sectors
+	uint32_t ClusterCount;
+	uint32_t RootDirCluster;
+	uint32_t Serial;
+	uint16_t Revision;
+	uint16_t VolumeFlags; // bit 0: second FAT is active
+	uint8_t SecSizeShift;
+	uint8_t SecsPerClusShift;
+	uint8_t FATs;
+	uint8_t DriveSelect;
+	uint8_t PercentInUse;
+	uint8_t Reserved[7];
+} EXFAT_BOOT_RECORD;
+
+// Allocation bitmap and up-case table entries.
+typedef struct {
+	uint8_t Type;
+	uint8_t Flags; // bitmap only; bit 0: second bitmap
+	uint8_t Reserved[18];
+	uint32_t FirstCluster;
+	uint64_t DataLength;
+} EXFAT_DATA_ENTRY;
+
+typedef struct {
+	uint8_t Type;
+	uint8_t CharacterCount;
+	wchar_t Label[11];
+	uint8_t Reserved[8];
+} EXFAT_LABEL_ENTRY;
+
+typedef struct {
+	uint8_t Type;
+	uint8_t SecondaryCount;
+	uint16_t SetChecksum;
+	uint16_t Attributes;
+	uint16_t Reserved1;
+	// DOS date in the high and DOS time in the low word
+	uint32_t CreateTime;
+	uint32_t ModifyTime;
+	uint32_t AccessTime;
+	uint8_t Create10ms;
+	uint8_t Modify10ms;
+	// Offsets from UTC in 15-minute units, valid if bit 7 is set
+	uint8_t CreateUTCOffset;
+	uint8_t ModifyUTCOffset;
+	uint8_t AccessUTCOffset;
+	uint8_t Reserved2[7];
+} EXFAT_FILE_ENTRY;
+
+typedef struct {
+	uint8_t Type;
+	uint8_t Flags;
+	uint8_t Reserved1;
+	uint8_t NameLength;
+	uint16_t NameHash;
+	uint16_t Reserved2;
+	uint64_t ValidDataLength;
+	uint32_t Reserved3;
+	uint32_t FirstCluster;
+	uint64_t DataLength;
+} EXFAT_STREAM_ENTRY;
+
+typedef struct {
+	uint8_t Type;
+	uint8_t Flags;
+	wchar_t Name[15];
+} EXFAT_NAME_ENTRY;
+#pragma pack(pop)
+
+// Everything we need to know about a file, decoded from its entry set. These
+// are the handles returned by FileLookup(), and are kept for the lifetime of
+// the file system, so that every file only ever gets a single one.
+typedef struct EXFAT_NODE {
+	// Offset of the File entry within the file system, 0 for the root
+	uint64_t Offset;
+	uint64_t Size;
+	uint64_t ValidSize;
+	uint32_t FirstCluster;
+	// All clusters are contiguous, and the FAT isn't used
+	bool NoFatChain;
+	uint16_t Attributes;
+	FILETIME CreationTime;
+	FILETIME LastAccessTime;
+	FILETIME LastWriteTime;
+} EXFAT_NODE;
+
+// A File entry set, as read from a directory.
+typedef struct {
+	uint64_t Offset;
+	EXFAT_FILE_ENTRY File;
+	EXFAT_STREAM_ENTRY Stream;
+	size_t NameLength;
+	wchar_t Name[EXFAT_NAME_MAX + 1];
+} EXFAT_SET;
+
+typedef struct {
+	EXFAT_NODE Root;
+	// The cluster heap, starting at cluster 2
+	VIEW Heap;
+	uint32_t *FAT;
+	const uint8_t *Bitmap;
+	uint32_t Clusters;
+	uint32_t ClusterSize;
+	uint8_t ClusterShift;
+	uint16_t *UpCase;
+	// Nodes by the offset of their File entry, except for the root
+	RCU_MAP Nodes;
+} EXFAT_INFO;
+
+#define EBR_GET \
+	const EXFAT_BOOT_RECORD *ebr = LStructAt(EXFAT_BOOT_RECORD, FS, 0);
+#define EXFAT_INFO_GET \
+	EXFAT_INFO *exfat_info = FS->FSData;
+
+// Used for both WIN32_FIND_DATA and BY_HANDLE_FILE_INFORMATION structures.
+#define EXFAT_FILL_FILE_INFO(Obj) \
+	(Obj)->nFileSizeHigh = (DWORD)(node->Size >> 32); \
+	(Obj)->nFileSizeLow = (DWORD)node->Size; \
+	(Obj)->ftCreationTime = node->CreationTime; \
+	(Obj)->ftLastAccessTime = node->LastAccessTime; \
+	(Obj)->ftLastWriteTime = node->LastWriteTime; \
+	(Obj)->dwFileAttributes = node->Attributes;
+
+/// Clusters
+/// --------
+bool EXFAT_ClusterValid(EXFAT_INFO *EI, uint32_t Cluster)
+{
+	return Cluster >= 2 && (Cluster - 2) < EI->Clusters;
+}
+
+uint64_t EXFAT_ClusterOffset(EXFAT_INFO *EI, uint32_t Cluster)
+{
+	return (uint64_t)(Cluster - 2) << EI->ClusterShift;
+}
+
+uint8_t* EXFAT_AtCluster(EXFAT_INFO *EI, uint32_t Cluster)
+{
+	if(!EXFAT_ClusterValid(EI, Cluster)) {
+		return NULL;
+	}
+	return At(&EI->Heap, EXFAT_ClusterOffset(EI, Cluster), EI->ClusterSize);
+}
+
+// Returns the cluster following [Cluster] in the data of [Node].
+uint32_t EXFAT_NextCluster(EXFAT_INFO *EI, const EXFAT_NODE *Node, uint32_t Cluster)
+{
+	if(Node->NoFatChain) {
+		return Cluster + 1;
+	}
+	return EXFAT_ClusterValid(EI, Cluster) ? EI->FAT[Cluster] : EXFAT_CLUSTER_END;
+}
+
+// Number of 32-bit words of the allocation bitmap that are checked for lying
+// in a hole of a sparse image at once.
+#define EXFAT_HOLE_WORDS 0x400
+
+// Returns the number of allocated clusters, according to the allocation
+// bitmap.
+uint32_t EXFAT_UsedClusters(FILESYSTEM *FS, EXFAT_INFO *EI)
+{
+	uint32_t ret = 0;
+	uint32_t words = EI->Clusters / 32;
+	for(uint32_t i = 0; i < words; i++) {
+		uint32_t word;
+		// Bitmap pages in a hole of a sparse image only contain free
+		// clusters, so there's no need to read them.
+		if((i % EXFAT_HOLE_WORDS) == 0) {
+			uint32_t run = min(EXFAT_HOLE_WORDS, words - i);
+			if(ImageIsHole(FS->Image, EI->Bitmap + (i * 4), run * 4)) {
+				i += run - 1;
+				continue;
+			}
+		}
+		memcpy(&word, EI->Bitmap + (i * 4), sizeof(word));
+		ret += __popcnt(word);
+	}
+	for(uint32_t c = words * 32; c < EI->Clusters; c++) {
+		ret += (EI->Bitmap[c / 8] >> (c % 8)) & 1;
+	}
+	return ret;
+}
+/// --------
+
+/// Names
+/// -----
+wchar_t EXFAT_UpCase(EXFAT_INFO *EI, wchar_t C)
+{
+	return (wchar_t)EI->UpCase[(uint16_t)C];
+}
+
+uint16_t EXFAT_NameHash(EXFAT_INFO *EI, const wchar_t *Name, size_t Len)
+{
+	uint16_t hash = 0;
+	for(size_t i = 0; i < Len; i++) {
+		uint16_t c = EXFAT_UpCase(EI, Name[i]);
+		hash = ((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (c & 0xFF);
+		hash = ((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (c >> 8);
+	}
+	return hash;
+}
+
+bool EXFAT_NameEqual(EXFAT_INFO *EI, const wchar_t *A, const wchar_t *B, size_t Len)
+{
+	for(size_t i = 0; i < Len; i++) {
+		if(EXFAT_UpCase(EI, A[i]) != EXFAT_UpCase(EI, B[i])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Decompresses the up-case table described by [Entry]. Runs of unchanged
+// characters are stored as 0xFFFF, followed by the length of the run.
+bool EXFAT_UpCaseLoad(FILESYSTEM *FS, const EXFAT_DATA_ENTRY *Entry)
+{
+	EXFAT_INFO_GET;
+	uint16_t *upcase = exfat_info->UpCase;
+	if(Entry->DataLength > 0x20000 || !EXFAT_ClusterValid(exfat_info, Entry->FirstCluster)) {
+		return false;
+	}
+	const uint16_t *table = (const uint16_t*)At(
+		&exfat_info->Heap,
+		EXFAT_ClusterOffset(exfat_info, Entry->FirstCluster),
+		(UINT)Entry->DataLength
+	);
+	if(!table) {
+		return false;
+	}
+	size_t entries = (size_t)Entry->DataLength / 2;
+	uint32_t c = 0;
+	for(size_t i = 0; i < entries && c < 0x10000; i++) {
+		if(table[i] == 0xFFFF && i + 1 < entries) {
+			c += table[++i];
+		} else {
+			upcase[c++] = table[i];
+		}
+	}
+	return true;
+}
+/// -----
+
+/// Timestamps
+/// ----------
+FILETIME EXFAT_Time(uint32_t Timestamp, uint8_t Increment10ms, uint8_t UTCOffset)
+{
+	FILETIME ret = {0};
+	if(!DosDateTimeToFileTime(Timestamp >> 16, Timestamp & 0xFFFF, &ret)) {
+		return ret;
+	}
+	int64_t time = (int64_t)FileTimeToU64(&ret) + Increment10ms * 100000LL;
+	if(UTCOffset & 0x80) {
+		// Sign-extend the 7-bit value.
+		int8_t quarters = (int8_t)(UTCOffset << 1) >> 1;
+		time -= quarters * (15 * 60 * 10000000LL);
+	}
+	return U64ToFileTime((uint64_t)time);
+}
+/// ----------
+
+/// Directory iteration
+/// -------------------
+typedef struct {
+	const EXFAT_NODE *Dir;
+	uint32_t Cluster;
+	// Number of clusters left, including the current one
+	uint32_t Clusters;
+	uint8_t *Base;
+	uint32_t Index;
+	uint32_t Limit;
+} EXFAT_DIR_ITERATOR;
+
+void EXFAT_DirIterateInit(FILESYSTEM *FS, EXFAT_DIR_ITERATOR *Iter, const EXFAT_NODE *Dir)
+{
+	EXFAT_INFO_GET;
+	assert(Iter);
+	assert(Dir);
+	Iter->Dir = Dir;
+	Iter->Cluster = Dir->FirstCluster;
+	Iter->Index = 0;
+	Iter->Limit = exfat_info->ClusterSize / EXFAT_ENTRY_SIZE;
+	// The root directory has no size and simply ends with its chain, which
+	// can't be longer than the number of clusters unless it's cyclic.
+	Iter->Clusters = exfat_info->Clusters;
+	if(Dir->Size) {
+		uint64_t clusters = (
+			(Dir->Size + exfat_info->ClusterSize - 1) >> exfat_info->ClusterShift
+		);
+		Iter->Clusters = (uint32_t)min(clusters, Iter->Clusters);
+	}
+	Iter->Base = EXFAT_AtCluster(exfat_info, Iter->Cluster);
+}
+
+uint8_t* EXFAT_DirIterate(FILESYSTEM *FS, EXFAT_DIR_ITERATOR *Iter)
+{
+	EXFAT_INFO_GET;
+	assert(Iter);
+	if(Iter->Base == NULL) {
+		return NULL;
+	}
+	uint8_t *ret = Iter->Base + (Iter->Index * EXFAT_ENTRY_SIZE);
+	Iter->Index++;
+	if(Iter->Index == Iter->Limit) {
+		if(--Iter->Clusters == 0) {
+			Iter->Base = NULL;
+		} else {
+			Iter->Cluster = EXFAT_NextCluster(exfat_info, Iter->Dir, Iter->Cluster);
+			Iter->Base = EXFAT_AtCluster(exfat_info, Iter->Cluster);
+		}
+		Iter->Index = 0;
+	}
+	return ret;
+}
+
+// Reads the next complete File entry set from [Iter] into [Set]. Returns
+// false at the end of the directory.
+bool EXFAT_DirNextSet(FILESYSTEM *FS, EXFAT_DIR_ITERATOR *Iter, EXFAT_SET *Set)
+{
+	uint8_t *entry;
+	while((entry = EXFAT_DirIterate(FS, Iter))) {
+		if(entry[0] == EXFAT_ENTRY_END) {
+			return false;
+		} else if(entry[0] != EXFAT_ENTRY_FILE) {
+			continue;
+		}
+		Set->Offset = entry - FS->View.Memory;
+		memcpy(&Set->File, entry, sizeof(Set->File));
+		Set->NameLength = 0;
+		bool stream = false;
+		for(uint8_t i = 0; i < Set->File.SecondaryCount; i++) {
+			if(!(entry = EXFAT_DirIterate(FS, Iter))) {
+				return false;
+			}
+			if(i == 0) {
+				// The stream extension always comes first.
+				stream = (entry[0] == EXFAT_ENTRY_STREAM);
+				if(!stream) {
+					break;
+				}
+				memcpy(&Set->Stream, entry, sizeof(Set->Stream));
+			} else if(entry[0] == EXFAT_ENTRY_NAME) {
+				EXFAT_NAME_ENTRY *name = (EXFAT_NAME_ENTRY*)entry;
+				size_t len = min(
+					elementsof(name->Name), Set->Stream.NameLength - Set->NameLength
+				);
+				memcpy(&Set->Name[Set->NameLength], name->Name, len * sizeof(wchar_t));
+				Set->NameLength += len;
+			}
+		}
+		if(stream && Set->NameLength && Set->NameLength == Set->Stream.NameLength) {
+			Set->Name[Set->NameLength] = L'\0';
+			return true;
+		}
+		fwprintf(stderr,
+			L"**Warning** ignoring malformed directory entry set at offset 0x%I64x\n",
+			Set->Offset
+		);
+	}
+	return false;
+}
+/// -------------------
+
+/// Nodes
+/// -----
+void EXFAT_NodeInit(EXFAT_NODE *Node, const EXFAT_SET *Set)
+{
+	const EXFAT_FILE_ENTRY *file = &Set->File;
+	Node->Offset = Set->Offset;
+	Node->Size = Set->Stream.DataLength;
+	Node->ValidSize = min(Set->Stream.ValidDataLength, Node->Size);
+	Node->FirstCluster = Set->Stream.FirstCluster;
+	Node->NoFatChain = (Set->Stream.Flags & EXFAT_FLAG_NO_FAT_CHAIN) != 0;
+	Node->Attributes = file->Attributes;
+	Node->CreationTime = EXFAT_Time(
+		file->CreateTime, file->Create10ms, file->CreateUTCOffset
+	);
+	Node->LastWriteTime = EXFAT_Time(
+		file->ModifyTime, file->Modify10ms, file->ModifyUTCOffset
+	);
+	Node->LastAccessTime = EXFAT_Time(file->AccessTime, 0, file->AccessUTCOffset);
+}
+
+// Returns the node for the file described by [Set], creating it if
+// necessary. Returns NULL if we're out of memory.
+EXFAT_NODE* EXFAT_Node(FILESYSTEM *FS, const EXFAT_SET *Set)
+{
+	EXFAT_INFO_GET;
+	EXFAT_NODE *node = RcuMapFind(&exfat_info->Nodes, Set->Offset);
+	if(node) {
+		return node;
+	}
+	EXFAT_NODE *new_node = PoolAlloc(&FS->Arena, sizeof(EXFAT_NODE));
+	if(!new_node) {
+		return NULL;
+	}
+	EXFAT_NodeInit(new_node, Set);
+	node = RcuMapInsert(&exfat_info->Nodes, Set->Offset, new_node);
+	// Another thread might have been faster.
+	if(node != new_node) {
+		PoolFree(&FS->Arena, new_node, sizeof(EXFAT_NODE));
+	}
+	return node;
+}
+/// -----
+
+const wchar_t* FS_EXFAT_Name(FILESYSTEM *FS)
+{
+	return L"exFAT";
+}
+
+int FS_EXFAT_Probe(FILESYSTEM *FS)
+{
+	EBR_GET;
+	if(!ebr || memcmp(ebr->FSName, "EXFAT   ", sizeof(ebr->FSName))) {
+		return 1;
+	}
+	if(
+		ebr->SecSizeShift < 9 || ebr->SecSizeShift > 12
+		|| ebr->SecsPerClusShift > (25 - ebr->SecSizeShift)
+		|| ebr->FATs == 0 || ebr->FATs > 2
+	) {
+		return 1;
+	}
+	FS->SectorSize = 1 << ebr->SecSizeShift;
+	uint64_t size = ebr->VolumeLength << ebr->SecSizeShift;
+	if(!LAt(FS, size, 0)) {
+		return 1;
+	}
+	FS->View.Size = size;
+
+	EXFAT_INFO *ei = ArenaAlloc(&FS->Arena, sizeof(EXFAT_INFO));
+	if(!ei) {
+		return ERROR_OUTOFMEMORY;
+	}
+	RcuMapInit(&ei->Nodes, &FS->Arena);
+	ei->Clusters = ebr->ClusterCount;
+	ei->ClusterShift = ebr->SecSizeShift + ebr->SecsPerClusShift;
+	ei->ClusterSize = 1 << ei->ClusterShift;
+
+	uint8_t active_fat = (ebr->VolumeFlags & 1) && ebr->FATs > 1;
+	ei->FAT = (uint32_t*)FSAtSector(
+		FS, ebr->FATOffset + (active_fat * ebr->FATLength), ebr->FATLength
+	);
+	if(!ei->FAT || (ebr->FATLength * FS->SectorSize) / 4 < (uint64_t)ei->Clusters + 2) {
+		return 1;
+	}
+	uint64_t heap_offset = (uint64_t)ebr->ClusterHeapOffset << ebr->SecSizeShift;
+	ei->Heap.Size = (uint64_t)ei->Clusters << ei->ClusterShift;
+	if(heap_offset + ei->Heap.Size > FS->View.Size) {
+		return 1;
+	}
+	ei->Heap.Memory = FS->View.Memory + heap_offset;
+
+	ei->UpCase = ArenaAlloc(&FS->Arena, 0x10000 * sizeof(uint16_t));
+	if(!ei->UpCase) {
+		return ERROR_OUTOFMEMORY;
+	}
+	for(uint32_t c = 0; c < 0x10000; c++) {
+		ei->UpCase[c] = (uint16_t)((c >= 'a' && c <= 'z') ? (c - 'a' + 'A') : c);
+	}
+
+	ei->Root.FirstCluster = ebr->RootDirCluster;
+	ei->Root.Attributes = FILE_ATTRIBUTE_DIRECTORY;
+	if(!EXFAT_ClusterValid(ei, ei->Root.FirstCluster)) {
+		return 1;
+	}
+	FS->FSData = ei;
+	FS->Serial = ebr->Serial;
+
+	// The allocation bitmap, the up-case table and the volume label are
+	// stored as special entries in the root directory.
+	EXFAT_DIR_ITERATOR iter;
+	uint8_t *entry;
+	EXFAT_DirIterateInit(FS, &iter, &ei->Root);
+	while((entry = EXFAT_DirIterate(FS, &iter)) && entry[0] != EXFAT_ENTRY_END) {
+		EXFAT_DATA_ENTRY *data = (EXFAT_DATA_ENTRY*)entry;
+		if(entry[0] == EXFAT_ENTRY_BITMAP && !(data->Flags & 1)) {
+			uint64_t bitmap_len = ((uint64_t)ei->Clusters + 7) / 8;
+			if(data->DataLength >= bitmap_len && EXFAT_ClusterValid(ei, data->FirstCluster)) {
+				ei->Bitmap = At(
+					&ei->Heap, EXFAT_ClusterOffset(ei, data->FirstCluster), (UINT)bitmap_len
+				);
+			}
+		} else if(entry[0] == EXFAT_ENTRY_UPCASE) {
+			if(!EXFAT_UpCaseLoad(FS, data)) {
+				fwprintf(stderr, L"**Warning** invalid up-case table, falling back on ASCII\n");
+			}
+		} else if(entry[0] == EXFAT_ENTRY_LABEL) {
+			EXFAT_LABEL_ENTRY *label = (EXFAT_LABEL_ENTRY*)entry;
+			size_t len = min(label->CharacterCount, elementsof(label->Label));
+			memcpy(FS->Label, label->Label, len * sizeof(wchar_t));
+			FS->Label[len] = L'\0';
+		}
+	}
+	if(!ei->Bitmap) {
+		FS->FSData = NULL;
+		return 1;
+	}
+	return 0;
+}
+
+void FS_EXFAT_DiskSizes(FILESYSTEM *FS, uint64_t *Total, uint64_t *Available)
+{
+	EXFAT_INFO_GET;
+	*Total = (uint64_t)exfat_info->Clusters << exfat_info->ClusterShift;
+	*Available = (uint64_t)(
+		exfat_info->Clusters - EXFAT_UsedClusters(FS, exfat_info)
+	) << exfat_info->ClusterShift;
+}
+
+EXFAT_NODE* EXFAT_FileLookup(FILESYSTEM *FS, const wchar_t *FileName)
+{
+	EXFAT_INFO_GET;
+	assert(FileName);
+	EXFAT_NODE *node = &exfat_info->Root;
+	EXFAT_SET set;
+	for(;;) {
+		while(IsDirSepW(*FileName)) {
+			FileName++;
+		}
+		if(*FileName == L'\0') {
+			return node;
+		}
+		if(!(node->Attributes & FILE_ATTRIBUTE_DIRECTORY)) {
+			return NULL;
+		}
+		size_t fn_len = 0;
+		while(FileName[fn_len] != L'\0' && !IsDirSepW(FileName[fn_len])) {
+			fn_len++;
+		}
+		if(fn_len > EXFAT_NAME_MAX) {
+			return NULL;
+		}
+		// Every stream extension entry stores the hash of its up-cased
+		// name, which rules out nearly all non-matching entries without
+		// having to compare their names.
+		uint16_t hash = EXFAT_NameHash(exfat_info, FileName, fn_len);
+		EXFAT_NODE *found = NULL;
+		EXFAT_DIR_ITERATOR iter;
+		EXFAT_DirIterateInit(FS, &iter, node);
+		while(EXFAT_DirNextSet(FS, &iter, &set)) {
+			if(
+				set.Stream.NameHash == hash
+				&& set.NameLength == fn_len
+				&& EXFAT_NameEqual(exfat_info, set.Name, FileName, fn_len)
+			) {
+				found = EXFAT_Node(FS, &set);
+				break;
+			}
+		}
+		if(!found) {
+			return NULL;
+		}
+		node = found;
+		FileName += fn_len;
+	}
+}
+
+ULONG64 FS_EXFAT_FileLookupW(FILESYSTEM *FS, const wchar_t *FileName)
+{
+	return (ULONG64)EXFAT_FileLookup(FS, FileName);
+}
+
+NTSTATUS FS_EXFAT_FindFiles(FILESYSTEM *FS, ULONG64 Dir, FIND_CALLBACK_DATA *FCD)
+{
+	EXFAT_DIR_ITERATOR iter;
+	EXFAT_SET set;
+	EXFAT_DirIterateInit(FS, &iter, (EXFAT_NODE*)Dir);
+	while(EXFAT_DirNextSet(FS, &iter, &set)) {
+		WIN32_FIND_DATAW fd_w = {0};
+		EXFAT_NODE *node = EXFAT_Node(FS, &set);
+		if(!node) {
+			return STATUS_NO_MEMORY;
+		}
+		EXFAT_FILL_FILE_INFO(&fd_w);
+		memcpy(fd_w.cFileName, set.Name, (set.NameLength + 1) * sizeof(wchar_t));
+		FindAddFileW(FCD, &fd_w, (ULONG64)node);
+	}
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS FS_EXFAT_GetFileInformation(FILESYSTEM *FS, ULONG64 File, LPBY_HANDLE_FILE_INFORMATION HandleFileInfo)
+{
+	EXFAT_NODE *node = (EXFAT_NODE*)File;
+	EXFAT_FILL_FILE_INFO(HandleFileInfo);
+	HandleFileInfo->nNumberOfLinks = 1;
+	HandleFileInfo->nFileIndexHigh = (DWORD)(node->Offset >> 32);
+	HandleFileInfo->nFileIndexLow = (DWORD)node->Offset;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS FS_EXFAT_ReadFile(FILESYSTEM *FS, ULONG64 File, uint8_t *Buffer, DWORD BufferLength, LPDWORD ReadLength, LONGLONG Offset)
+{
+	EXFAT_INFO_GET;
+	EXFAT_NODE *node = (EXFAT_NODE*)File;
+
+	// Everything past the valid data length reads as zeroes.
+	uint64_t end = (uint64_t)Offset + BufferLength;
+	if(end > node->ValidSize) {
+		DWORD zero_len = (DWORD)(end - max(node->ValidSize, (uint64_t)Offset));
+		BufferLength -= zero_len;
+		ZeroMemory(Buffer + BufferLength, zero_len);
+		*ReadLength += zero_len;
+	}
+	if(BufferLength == 0) {
+		return STATUS_SUCCESS;
+	}
+
+	if(node->NoFatChain) {
+		// Contiguous, so no need to look at the FAT at all.
+		uint8_t *data = NULL;
+		if(EXFAT_ClusterValid(exfat_info, node->FirstCluster)) {
+			data = At(&exfat_info->Heap,
+				EXFAT_ClusterOffset(exfat_info, node->FirstCluster) + Offset, BufferLength
+			);
+		}
+		if(!data) {
+			return STATUS_DISK_CORRUPT_ERROR;
+		}
+		ImageHoleCopy(FS->Image, CopyFor(BufferLength), Buffer, data, BufferLength);
+		*ReadLength += BufferLength;
+		return STATUS_SUCCESS;
+	}
+
+	uint32_t cluster = node->FirstCluster;
+	for(uint64_t skip = (uint64_t)Offset >> exfat_info->ClusterShift; skip; skip--) {
+		cluster = EXFAT_NextCluster(exfat_info, node, cluster);
+	}
+	DWORD in_cluster = (DWORD)(Offset & (exfat_info->ClusterSize - 1));
+	COPY_FUNC copy = CopyFor(BufferLength);
+	uint8_t *data = EXFAT_AtCluster(exfat_info, cluster);
+	while(BufferLength) {
+		if(!data) {
+			return STATUS_DISK_CORRUPT_ERROR;
+		}
+		DWORD copy_length = min(exfat_info->ClusterSize - in_cluster, BufferLength);
+		uint8_t *next = NULL;
+		cluster = EXFAT_NextCluster(exfat_info, node, cluster);
+		if(BufferLength > copy_length) {
+			next = EXFAT_AtCluster(exfat_info, cluster);
+			CopyPrefetch(copy, next, exfat_info->ClusterSize);
+		}
+		ImageHoleCopy(FS->Image, copy, Buffer, data + in_cluster, copy_length);
+		BufferLength -= copy_length;
+		Buffer += copy_length;
+		*ReadLength += copy_length;
+		in_cluster = 0;
+		data = next;
+	}
+	return STATUS_SUCCESS;
+}
+
+// Like ReadFile(), this stops the clusters at the valid data length, and
+// reports the rest of the file as an FS_EXTENT_ZERO extent.
+NTSTATUS FS_EXFAT_FileExtents(FILESYSTEM *FS, ULONG64 File, FILE_EXTENT_FUNC Func, void *Param)
+{
+	EXFAT_INFO_GET;
+	EXFAT_NODE *node = (EXFAT_NODE*)File;
+	uint64_t heap_offset = exfat_info->Heap.Memory - FS->View.Memory;
+	uint64_t zero_len = node->Size - node->ValidSize;
+	if(node->FirstCluster == 0) {
+		return STATUS_SUCCESS;
+	} else if(!EXFAT_ClusterValid(exfat_info, node->FirstCluster)) {
+		return STATUS_DISK_CORRUPT_ERROR;
+	}
+	uint64_t first_offset = EXFAT_ClusterOffset(exfat_info, node->FirstCluster);
+	if(node->NoFatChain) {
+		if(first_offset + node->Size > exfat_info->Heap.Size) {
+			return STATUS_DISK_CORRUPT_ERROR;
+		}
+		if(node->ValidSize && Func(Param, heap_offset + first_offset, node->ValidSize)) {
+			return STATUS_SUCCESS;
+		}
+		if(zero_len) {
+			Func(Param, FS_EXTENT_ZERO, zero_len);
+		}
+		return STATUS_SUCCESS;
+	}
+
+	// Only the root directory has no size, and ends with its chain.
+	bool chained = (node->Size == 0);
+	uint64_t remaining = chained ? UINT64_MAX : node->ValidSize;
+	uint64_t ext_offset = 0;
+	uint64_t ext_len = 0;
+	uint32_t cluster = node->FirstCluster;
+	uint32_t steps = exfat_info->Clusters;
+	while(remaining) {
+		if(!EXFAT_ClusterValid(exfat_info, cluster)) {
+			if(chained && cluster == EXFAT_CLUSTER_END) {
+				break;
+			}
+			return STATUS_DISK_CORRUPT_ERROR;
+		}
+		if(steps-- == 0) {
+			return STATUS_DISK_CORRUPT_ERROR;
+		}
+		uint64_t offset = heap_offset + EXFAT_ClusterOffset(exfat_info, cluster);
+		uint64_t len = min(remaining, exfat_info->ClusterSize);
+		if(ext_len && ext_offset + ext_len == offset) {
+			ext_len += len;
+		} else {
+			if(ext_len && Func(Param, ext_offset, ext_len)) {
+				return STATUS_SUCCESS;
+			}
+			ext_offset = offset;
+			ext_len = len;
+		}
+		remaining -= len;
+		if(remaining) {
+			cluster = exfat_info->FAT[cluster];
+		}
+	}
+	if(ext_len && Func(Param, ext_offset, ext_len)) {
+		return STATUS_SUCCESS;
+	}
+	if(zero_len) {
+		Func(Param, FS_EXTENT_ZERO, zero_len);
+	}
+	return STATUS_SUCCESS;
+}
+
+uint64_t FS_EXFAT_FileFirstCluster(FILESYSTEM *FS, ULONG64 File)
+{
+	return ((EXFAT_NODE*)File)->FirstCluster;
+}
+
+void FS_EXFAT_MetadataExtents(FILESYSTEM *FS, FILE_EXTENT_FUNC Func, void *Param)
+{
+	EXFAT_INFO_GET;
+	uint64_t fat_len = ((uint64_t)exfat_info->Clusters + 2) * sizeof(uint32_t);
+	if(Func(Param, (uint8_t*)exfat_info->FAT - FS->View.Memory, fat_len)) {
+		return;
+	}
+	Func(Param,
+		exfat_info->Bitmap - FS->View.Memory,
+		((uint64_t)exfat_info->Clusters + 7) / 8
+	);
+}
+
+LONGLONG FS_EXFAT_FileSize(const void *DEntry)
+{
+	return ((EXFAT_NODE*)DEntry)->Size;
+}
+
+NEW_FSFORMAT(EXFAT, EXFAT_NAME_MAX, W);
@@ -67,7 +67,8 @@ typedef struct {
 	char BaseName[8];
 	char Extension[3];
 	uint8_t Attribute;
-	uint8_t Reserved[10];
+	uint8_t Reserved[8];
+	uint16_t FirstClusterHigh; // FAT32 only
 	uint16_t Time;
 	uint16_t Date;
 	uint16_t FirstCluster;
@@ -93,6 +94,7 @@ typedef fat_cluster_t FAT_Lookup_t(void *fat, fat_cluster_t Num);
 // Some precalculated filesystem constants
 typedef struct {
 	FAT_DIR_ENTRY *RootDir;
+	fat_cluster_t RootDirCluster; // FAT32 only
 	VIEW Data;
 	FAT_Lookup_t *Lookup;
 	uint8_t **FATs;
@@ -103,8 +105,42 @@ typedef struct {
 	uint32_t DataSectors;
 	fat_cluster_t Clusters;
 	uint32_t ClusterSize;
+	// FAT_EXTENTS of every file whose extents were requested, keyed by its
+	// directory entry
+	RCU_MAP Extents;
+	// Budget registration of [Extents], keyed by the FAT_EXTENTS pointer
+	CACHE ExtentsCache;
 } FAT_INFO;
 
+// Physical layout of a file, computed from its cluster chain once.
+typedef struct {
+	ULONG64 File;
+	volatile LONG Referenced;
+	size_t Count;
+	BLOCK_RANGE Runs[];
+} FAT_EXTENTS;
+
+size_t FAT_ExtentsSize(size_t Count)
+{
+	return sizeof(FAT_EXTENTS) + Count * sizeof(BLOCK_RANGE);
+}
+
+// Both called with the cache manager locked, which also keeps [Key] from
+// being evicted by anyone else in the meantime.
+bool FAT_ExtentsReferenced(CACHE *Cache, uint64_t Key)
+{
+	FAT_EXTENTS *ext = (FAT_EXTENTS*)Key;
+	return InterlockedExchange(&ext->Referenced, 0) != 0;
+}
+
+void FAT_ExtentsEvict(CACHE *Cache, uint64_t Key)
+{
+	FAT_INFO *fat_info = CONTAINING_RECORD(Cache, FAT_INFO, ExtentsCache);
+	FAT_EXTENTS *ext = (FAT_EXTENTS*)Key;
+	// Readers still inside the map keep it alive until they leave.
+	RcuMapRemove(&fat_info->Extents, ext->File, FAT_ExtentsSize(ext->Count));
+}
+
 #define FBR_GET \
 	const FAT_BOOT_RECORD *fbr = LStructAt(FAT_BOOT_RECORD, FS, 0);
 #define FAT_INFO_GET \
@@ -126,13 +162,38 @@ typedef struct {
 	(Obj)->ftLastWriteTime = timestamp; \
 	(Obj)->dwFileAttributes = dentry->Attribute;
 
+// Returns the first cluster of [DEntry].
+fat_cluster_t FAT_DEntryCluster(FAT_INFO *FATInfo, const FAT_DIR_ENTRY *DEntry)
+{
+	fat_cluster_t ret = DEntry->FirstCluster;
+	if(FATInfo->Type == FAT32) {
+		ret |= (fat_cluster_t)DEntry->FirstClusterHigh << 16;
+	}
+	return ret;
+}
+
+// Returns whether [Cluster] refers to a cluster in the data area.
+bool FAT_ClusterValid(FAT_INFO *FATInfo, fat_cluster_t Cluster)
+{
+	return Cluster >= 2 && (Cluster - 2) < FATInfo->Clusters;
+}
+
+// Returns whether [Cluster] is an end-of-chain marker.
+bool FAT_ClusterChainEnd(FAT_INFO *FATInfo, fat_cluster_t Cluster)
+{
+	return Cluster == FATInfo->ClusterChainEnd || Cluster >= 0x0FFFFFF8;
+}
+
 uint8_t* FAT_AtCluster(FAT_INFO *FATInfo, fat_cluster_t Cluster)
 {
-	Cluster -= 2;
-	if(Cluster < 2 || Cluster >= FATInfo->Clusters || Cluster == FATInfo->ClusterChainEnd) {
+	if(!FAT_ClusterValid(FATInfo, Cluster)) {
 		return NULL;
 	}
-	return At(&FATInfo->Data, Cluster * FATInfo->ClusterSize, FATInfo->ClusterSize);
+	return At(
+		&FATInfo->Data,
+		(uint64_t)(Cluster - 2) * FATInfo->ClusterSize,
+		FATInfo->ClusterSize
+	);
 }
 
 int FAT_ValidMedia(uint8_t media)
@@ -227,16 +288,76 @@ fat_cluster_t FAT32_ClusterLookup(uint32_t *fat, fat_cluster_t Num)
 fat_cluster_t FAT_ClusterLookup(FAT_INFO *FI, fat_cluster_t Num)
 {
 	uint8_t *fat = FI->FATs[0];
-	if(Num < FI->Clusters) {
+	if(Num < FI->Clusters + 2) {
 		return FI->Lookup(fat, Num);
 	}
 	return 0;
 }
 
+// Number of clusters whose FAT entries are checked for lying in a hole of a
+// sparse image at once.
+#define FAT_HOLE_RANGE 0x1000
+
+// Returns the byte range covered by the FAT entries of [First] to [Last].
+void FAT_EntryBytes(FAT_INFO *FI, fat_cluster_t First, fat_cluster_t Last, size_t *Start, size_t *End)
+{
+	switch(FI->Type) {
+	case FAT12:
+		*Start = (First * 3) / 2;
+		*End = ((Last - 1) * 3) / 2 + 2;
+		break;
+	case FAT16:
+		*Start = First * 2;
+		*End = Last * 2;
+		break;
+	default:
+		*Start = First * 4;
+		*End = Last * 4;
+		break;
+	}
+}
+
+// End-of-chain marker written by FAT_ClusterSet(), truncated to the width of
+// the FAT.
+#define FAT_CHAIN_END 0x0FFFFFFF
+
+// Sets the entry of cluster [Num] in [FAT], which must be a FAT of the same
+// type as [FI], to [Value].
+void FAT_ClusterSet(FAT_INFO *FI, uint8_t *FAT, fat_cluster_t Num, fat_cluster_t Value)
+{
+	switch(FI->Type) {
+	case FAT12: {
+		uint8_t *p = FAT + ((Num * 3) / 2);
+		if(Num & 1) {
+			p[0] = (p[0] & 0x0F) | (uint8_t)((Value & 0xF) << 4);
+			p[1] = (uint8_t)(Value >> 4);
+		} else {
+			p[0] = (uint8_t)Value;
+			p[1] = (p[1] & 0xF0) | (uint8_t)((Value >> 8) & 0xF);
+		}
+		break;
+	}
+	case FAT16:
+		((uint16_t*)FAT)[Num] = (uint16_t)Value;
+		break;
+	case FAT32: {
+		// The upper 4 bits are reserved and have to be preserved.
+		uint32_t *p = &((uint32_t*)FAT)[Num];
+		*p = (*p & 0xF0000000) | (Value & 0x0FFFFFFF);
+		break;
+	}
+	default:
+		assert(NULL);
+		break;
+	}
+}
+
 /// Directory iteration
 /// -------------------
 typedef struct {
 	fat_cluster_t Cluster;
+	// Number of clusters we've moved through, to stop at cyclic chains
+	fat_cluster_t Steps;
 	FAT_DIR_ENTRY *Base;
 	uint32_t Index;
 	uint32_t Limit;
@@ -251,8 +372,12 @@ void FAT_DirIterateInit(FILESYSTEM *FS, FAT_DIR_ITERATOR *Iter, FAT_DIR_ENTRY *D
 		Iter->Base = NULL;
 		return;
 	}
-	Iter->Cluster = DPointer->FirstCluster;
+	Iter->Cluster = FAT_DEntryCluster(fat_info, DPointer);
+	Iter->Steps = 0;
 	Iter->Index = 0;
+	if(Iter->Cluster == 0 && fat_info->RootDirCluster) {
+		Iter->Cluster = fat_info->RootDirCluster;
+	}
 	if(Iter->Cluster == 0) {
 		Iter->Base = fat_info->RootDir;
 		Iter->Limit = fbr->RootDirEntries;
@@ -277,8 +402,12 @@ FAT_DIR_ENTRY* FAT_DirIterate(FILESYSTEM *FS, FAT_DIR_ITERATOR *Iter)
 			Iter->Base = NULL;
 		} else {
 			// Subdirectory
-			Iter->Cluster = FAT_ClusterLookup(fat_info, Iter->Cluster);
-			Iter->Base = (FAT_DIR_ENTRY*)FAT_AtCluster(fat_info, Iter->Cluster);
+			if(++Iter->Steps >= fat_info->Clusters) {
+				Iter->Base = NULL;
+			} else {
+				Iter->Cluster = FAT_ClusterLookup(fat_info, Iter->Cluster);
+				Iter->Base = (FAT_DIR_ENTRY*)FAT_AtCluster(fat_info, Iter->Cluster);
+			}
 		}
 		Iter->Index = 0;
 	}
@@ -393,6 +522,7 @@ int FS_FAT_Probe(FILESYSTEM *FS)
 	case FAT32:
 		fi.Lookup = (FAT_Lookup_t*)FAT32_ClusterLookup;
 		max_clusters /= 4;
+		fi.RootDirCluster = fbr->FAT32.RootDirCluster;
 		FS->Serial = fbr->FAT32.EBPB.Serial;
 		break;
 	}
@@ -401,7 +531,7 @@ int FS_FAT_Probe(FILESYSTEM *FS)
 		return 1;
 	}
 
-	fi.FATs = HeapAlloc(GetProcessHeap(), 0, sizeof(uint8_t*) * fbr->FATs);
+	fi.FATs = ArenaAlloc(&FS->Arena, sizeof(uint8_t*) * fbr->FATs);
 	if(!fi.FATs) {
 		return ERROR_OUTOFMEMORY;
 	}
@@ -411,12 +541,18 @@ int FS_FAT_Probe(FILESYSTEM *FS)
 		);
 	}
 
-	FS->FSData = HeapAlloc(GetProcessHeap(), 0, sizeof(FAT_INFO));
+	FS->FSData = ArenaAlloc(&FS->Arena, sizeof(FAT_INFO));
 	if(!FS->FSData) {
 		return ERROR_OUTOFMEMORY;
 	}
 	fi.ClusterChainEnd = FAT_ClusterLookup(&fi, 1);
 	memcpy(FS->FSData, &fi, sizeof(FAT_INFO));
+	FAT_INFO *fat_info = (FAT_INFO*)FS->FSData;
+	RcuMapInit(&fat_info->Extents, &FS->Arena);
+	fat_info->ExtentsCache.Referenced = FAT_ExtentsReferenced;
+	fat_info->ExtentsCache.Evict = FAT_ExtentsEvict;
+	CacheRegister(&fat_info->ExtentsCache, L"FAT extents");
+	FS->MetaCache = &fat_info->ExtentsCache;
 	return 0;
 }
 
@@ -425,9 +561,18 @@ void FS_FAT_DiskSizes(FILESYSTEM *FS, uint64_t *Total, uint64_t *Available)
 	FAT_INFO_GET;
 	*Total = fat_info->DataSectors * FS->SectorSize;
 	*Available = 0;
-	for(fat_cluster_t i = 2; i < fat_info->Clusters; i++) {
-		if(FAT_ClusterLookup(fat_info, i) == 0) {
-			*Available += fat_info->ClusterSize;
+	for(fat_cluster_t first = 2; first < fat_info->Clusters; first += FAT_HOLE_RANGE) {
+		fat_cluster_t last = min(first + FAT_HOLE_RANGE, fat_info->Clusters);
+		size_t start, end;
+		FAT_EntryBytes(fat_info, first, last, &start, &end);
+		if(ImageIsHole(FS->Image, fat_info->FATs[0] + start, end - start)) {
+			*Available += (uint64_t)(last - first) * fat_info->ClusterSize;
+			continue;
+		}
+		for(fat_cluster_t i = first; i < last; i++) {
+			if(FAT_ClusterLookup(fat_info, i) == 0) {
+				*Available += fat_info->ClusterSize;
+			}
 		}
 	}
 }
@@ -583,44 +728,46 @@ NTSTATUS FS_FAT_FindFiles(FILESYSTEM *FS, ULONG64 Dir, FIND_CALLBACK_DATA *FCD)
 				MultiByteToWideChar(
 					FS->CodePage, 0, fd_a.cFileName, 14, fd_w.cAlternateFileName, sizeof(fd_w.cAlternateFileName)
 				);
-				FindAddFileW(FCD, &fd_w);
+				FindAddFileW(FCD, &fd_w, (ULONG64)dentry);
 				lfn_length = 0;
 			} else {
 				FAT_FILL_FILE_INFO(&fd_a);
-				FindAddFileA(FCD, &fd_a);
+				FindAddFileA(FCD, &fd_a, (ULONG64)dentry);
 			}
 		}
 	}
 	return STATUS_SUCCESS;
 }
 
-NTSTATUS FS_FAT_CreateFileW(FILESYSTEM *FS, LPCWSTR FileName, DWORD AccessMode, DWORD CreationDisposition, DWORD FlagsAndAttributes, PDOKAN_FILE_INFO DokanFileInfo)
+// Returns a stable ID for [DEntry], given by its byte offset in the view.
+// Cluster numbers can't be used, since all empty files share cluster 0. The
+// fake root entry lies outside the view and gets 0, which no real entry can
+// have, since the boot sector comes first.
+uint64_t FAT_FileID(FILESYSTEM *FS, const FAT_DIR_ENTRY *DEntry)
 {
-	FAT_DIR_ENTRY *dentry = FAT_FileLookup(FS, FileName, NULL);
-	if(dentry == NULL) {
-		return -ERROR_FILE_NOT_FOUND;
+	const uint8_t *p = (const uint8_t*)DEntry;
+	if(p < FS->View.Memory || p >= FS->View.Memory + FS->View.Size) {
+		return 0;
 	}
-	DokanFileInfo->IsDirectory = (dentry->Attribute & FILE_ATTRIBUTE_DIRECTORY) != 0;
-	DokanFileInfo->Context = (ULONG64)dentry;
-	return STATUS_SUCCESS;
+	return p - FS->View.Memory;
 }
 
-NTSTATUS FS_FAT_GetFileInformation(FILESYSTEM *FS, LPBY_HANDLE_FILE_INFORMATION HandleFileInfo, PDOKAN_FILE_INFO DokanFileInfo)
+NTSTATUS FS_FAT_GetFileInformation(FILESYSTEM *FS, ULONG64 File, LPBY_HANDLE_FILE_INFORMATION HandleFileInfo)
 {
-	FAT_DIR_ENTRY *dentry = (FAT_DIR_ENTRY*)DokanFileInfo->Context;
+	FAT_DIR_ENTRY *dentry = (FAT_DIR_ENTRY*)File;
+	uint64_t id = FAT_FileID(FS, dentry);
 	FAT_FILL_FILE_INFO(HandleFileInfo);
 	HandleFileInfo->nNumberOfLinks = 1;
-	// TODO: Will have to be changed for FAT32.
-	HandleFileInfo->nFileIndexHigh = 0;
-	HandleFileInfo->nFileIndexLow = dentry->FirstCluster;
+	HandleFileInfo->nFileIndexHigh = (DWORD)(id >> 32);
+	HandleFileInfo->nFileIndexLow = (DWORD)id;
 	return STATUS_SUCCESS;
 }
 
-NTSTATUS FS_FAT_ReadFile(FILESYSTEM *FS, uint8_t *Buffer, DWORD BufferLength, LPDWORD ReadLength, LONGLONG Offset, PDOKAN_FILE_INFO DokanFileInfo)
+NTSTATUS FS_FAT_ReadFile(FILESYSTEM *FS, ULONG64 File, uint8_t *Buffer, DWORD BufferLength, LPDWORD ReadLength, LONGLONG Offset)
 {
 	FAT_INFO_GET;
-	FAT_DIR_ENTRY *dentry = (FAT_DIR_ENTRY*)DokanFileInfo->Context;
-	fat_cluster_t cluster = dentry->FirstCluster;
+	FAT_DIR_ENTRY *dentry = (FAT_DIR_ENTRY*)File;
+	fat_cluster_t cluster = FAT_DEntryCluster(fat_info, dentry);
 	while(Offset > fat_info->ClusterSize) {
 		if(cluster == fat_info->ClusterChainEnd || cluster < 2) {
 			return STATUS_DISK_CORRUPT_ERROR;
@@ -634,20 +781,30 @@ NTSTATUS FS_FAT_ReadFile(FILESYSTEM *FS, uint8_t *Buffer, DWORD BufferLength, LP
 	}
 	data += Offset;
 	DWORD remaining_in_cluster = fat_info->ClusterSize - (DWORD)Offset;
+	COPY_FUNC copy = CopyFor(BufferLength);
 	while(BufferLength) {
 		DWORD copy_length = min(remaining_in_cluster, BufferLength);
-		memcpy(Buffer, data, copy_length);
+		bool chain_valid = (cluster != fat_info->ClusterChainEnd && cluster >= 2);
+		uint8_t *next = NULL;
+
+		// Look up the next cluster first, so that it can already be on its
+		// way while we copy this one.
+		if(BufferLength > copy_length && chain_valid) {
+			cluster = FAT_ClusterLookup(fat_info, cluster);
+			next = FAT_AtCluster(fat_info, cluster);
+			CopyPrefetch(copy, next, fat_info->ClusterSize);
+		}
+		ImageHoleCopy(FS->Image, copy, Buffer, data, copy_length);
 		BufferLength -= copy_length;
 		Buffer += copy_length;
 		*ReadLength += copy_length;
 
 		if(BufferLength != 0) {
 			remaining_in_cluster = fat_info->ClusterSize;
-			if(cluster == fat_info->ClusterChainEnd || cluster < 2) {
+			if(!chain_valid) {
 				return STATUS_DISK_CORRUPT_ERROR;
 			}
-			cluster = FAT_ClusterLookup(fat_info, cluster);
-			data = FAT_AtCluster(fat_info, cluster);
+			data = next;
 			if(!data) {
 				return STATUS_DISK_CORRUPT_ERROR;
 			}
@@ -656,6 +813,144 @@ NTSTATUS FS_FAT_ReadFile(FILESYSTEM *FS, uint8_t *Buffer, DWORD BufferLength, LP
 	return STATUS_SUCCESS;
 }
 
+// Appends the data runs of [DEntry], with adjacent clusters merged, to
+// [Runs].
+NTSTATUS FAT_ExtentsWalk(FILESYSTEM *FS, FAT_DIR_ENTRY *DEntry, BLOCK_RANGE **Runs, size_t *Cap, size_t *Count)
+{
+	FBR_GET_ASSERT;
+	FAT_INFO_GET;
+	bool dir = (DEntry->Attribute & FILE_ATTRIBUTE_DIRECTORY) != 0;
+	fat_cluster_t cluster = FAT_DEntryCluster(fat_info, DEntry);
+	if(dir && cluster == 0) {
+		cluster = fat_info->RootDirCluster;
+	}
+	if(dir && cluster == 0) {
+		uint64_t root_len = fbr->RootDirEntries * sizeof(FAT_DIR_ENTRY);
+		if(root_len) {
+			if(!ArrayReserve((void**)Runs, Cap, sizeof(BLOCK_RANGE), *Count + 1)) {
+				return STATUS_NO_MEMORY;
+			}
+			(*Runs)[*Count].Offset = (uint8_t*)fat_info->RootDir - FS->View.Memory;
+			(*Runs)[*Count].Length = root_len;
+			(*Count)++;
+		}
+		return STATUS_SUCCESS;
+	}
+	uint64_t data_offset = fat_info->Data.Memory - FS->View.Memory;
+	// Directories don't store a size and simply end with their chain.
+	uint64_t remaining = dir ? UINT64_MAX : DEntry->Size;
+	// A chain can't be longer than the number of clusters, unless it's cyclic.
+	fat_cluster_t steps = fat_info->Clusters;
+	while(remaining) {
+		if(!FAT_ClusterValid(fat_info, cluster)) {
+			if(dir && FAT_ClusterChainEnd(fat_info, cluster)) {
+				break;
+			}
+			return STATUS_DISK_CORRUPT_ERROR;
+		}
+		if(steps-- == 0) {
+			return STATUS_DISK_CORRUPT_ERROR;
+		}
+		uint64_t offset = data_offset + (uint64_t)(cluster - 2) * fat_info->ClusterSize;
+		uint64_t len = min(remaining, fat_info->ClusterSize);
+		BLOCK_RANGE *last = *Count ? &(*Runs)[*Count - 1] : NULL;
+		if(last && last->Offset + last->Length == offset) {
+			last->Length += len;
+		} else {
+			if(!ArrayReserve((void**)Runs, Cap, sizeof(BLOCK_RANGE), *Count + 1)) {
+				return STATUS_NO_MEMORY;
+			}
+			(*Runs)[*Count].Offset = offset;
+			(*Runs)[*Count].Length = len;
+			(*Count)++;
+		}
+		remaining -= len;
+		if(remaining) {
+			cluster = FAT_ClusterLookup(fat_info, cluster);
+		}
+	}
+	return STATUS_SUCCESS;
+}
+
+// Caches the [Count] [Runs] of [DEntry]. Returns the cached extents, or NULL
+// if we're out of metadata memory. Must be called inside the map.
+FAT_EXTENTS* FAT_ExtentsCache(FILESYSTEM *FS, FAT_DIR_ENTRY *DEntry, const BLOCK_RANGE *Runs, size_t Count)
+{
+	FAT_INFO_GET;
+	size_t size = FAT_ExtentsSize(Count);
+	bool pooled = size <= POOL_MAX_SIZE;
+	FAT_EXTENTS *new_ext = pooled ? PoolAlloc(&FS->Arena, size) : ArenaAlloc(&FS->Arena, size);
+	if(!new_ext) {
+		return NULL;
+	}
+	new_ext->File = (ULONG64)DEntry;
+	new_ext->Count = Count;
+	memcpy(new_ext->Runs, Runs, Count * sizeof(BLOCK_RANGE));
+	FAT_EXTENTS *ext = RcuMapInsert(&fat_info->Extents, (ULONG64)DEntry, new_ext);
+	if(ext == new_ext) {
+		CacheInsert(&fat_info->ExtentsCache, (uint64_t)ext, (uint32_t)min(size, UINT32_MAX), 1);
+	} else if(pooled) {
+		// Another thread was faster. Arena allocations stay around until the
+		// file system is closed, but fragmented files are rare enough.
+		PoolFree(&FS->Arena, new_ext, size);
+	}
+	return ext;
+}
+
+NTSTATUS FS_FAT_FileExtents(FILESYSTEM *FS, ULONG64 File, FILE_EXTENT_FUNC Func, void *Param)
+{
+	FAT_INFO_GET;
+	FAT_DIR_ENTRY *dentry = (FAT_DIR_ENTRY*)File;
+	BLOCK_RANGE *runs = NULL;
+	size_t cap = 0;
+	size_t count = 0;
+	NTSTATUS status = STATUS_SUCCESS;
+	// Keeps [ext] from being freed if it gets evicted while we replay it.
+	EPOCH_SLOT *slot = RcuEnter(&fat_info->Extents);
+	FAT_EXTENTS *ext = RcuMapLookup(&fat_info->Extents, File);
+	if(ext) {
+		InterlockedIncrement64(&fat_info->ExtentsCache.Hits);
+		if(!ext->Referenced) {
+			InterlockedExchange(&ext->Referenced, 1);
+		}
+	} else {
+		InterlockedIncrement64(&fat_info->ExtentsCache.Misses);
+		status = FAT_ExtentsWalk(FS, dentry, &runs, &cap, &count);
+		// Broken chains are reported up to the break every time.
+		if(status == STATUS_SUCCESS) {
+			ext = FAT_ExtentsCache(FS, dentry, runs, count);
+		}
+	}
+	const BLOCK_RANGE *replay = ext ? ext->Runs : runs;
+	if(ext) {
+		count = ext->Count;
+	}
+	for(size_t i = 0; i < count; i++) {
+		if(Func(Param, replay[i].Offset, replay[i].Length)) {
+			break;
+		}
+	}
+	RcuLeave(slot);
+	HeapFree(GetProcessHeap(), 0, runs);
+	return status;
+}
+
+uint64_t FS_FAT_FileFirstCluster(FILESYSTEM *FS, ULONG64 File)
+{
+	FAT_INFO_GET;
+	return FAT_DEntryCluster(fat_info, (FAT_DIR_ENTRY*)File);
+}
+
+void FS_FAT_MetadataExtents(FILESYSTEM *FS, FILE_EXTENT_FUNC Func, void *Param)
+{
+	FAT_INFO_GET;
+	// Lookups only ever go to the first FAT.
+	Func(Param,
+		fat_info->FATs[0] - FS->View.Memory,
+		(uint64_t)fat_info->FATSectors * FS->SectorSize
+	);
+}
+
 LONGLONG FS_FAT_FileSize(const void *DEntry)
 {
 	return ((FAT_DIR_ENTRY*)DEntry)->Size;
@@ -0,0 +1,424 @@
+/*
+ * Dokan Image Mounter
+ *
+ * Access heat tracking, and pinning of the hottest file data in memory.
+ */
+
+// Files are tracked in ranges of this many bytes.
+#define HEAT_GRANULE 0x100000
+// Further ranges are not tracked.
+#define HEAT_MAX_RANGES 65536
+// Initial number of slots in the page reference count table.
+#define HEAT_PAGES_MIN 1024
+// Interval between re-evaluations of the pinned set. Every re-evaluation
+// also halves all counters, so that old accesses fade out.
+#define HEAT_INTERVAL_MS 10000
+
+typedef struct {
+	ULONG64 File;
+	uint64_t Granule;
+	volatile LONGLONG Reads;
+	volatile LONGLONG Bytes;
+	// Bytes that were read while the range was pinned
+	volatile LONGLONG PinnedBytes;
+	// Bytes of the range that are currently locked in memory
+	uint64_t Pinned;
+} HEAT_RANGE;
+
+// Number of pinned ranges that share a page of the image view. Windows
+// doesn't count locks, so a page can only be unlocked once none is left.
+typedef struct {
+	uint64_t Page; // page number + 1, or 0 if the slot is free
+	uint32_t Count;
+} HEAT_PAGE;
+
+typedef struct {
+	FILESYSTEM *FS;
+	uint64_t Budget;
+	ARENA Arena;
+	// Ranges by a hash of their file and granule
+	RCU_MAP Map;
+	// All ranges, in the order they were first read
+	SRWLOCK Lock;
+	HEAT_RANGE **Ranges;
+	size_t RangeCap;
+	size_t RangeCount;
+
+	// Only used by the pinning thread, and by HeatStop() after it's gone.
+	// Slots whose count dropped to 0 are only reused after a rehash.
+	HEAT_PAGE *Pages;
+	size_t PageCap;
+	size_t PageSlots;
+	uint64_t PageSize;
+
+	HANDLE Thread;
+	HANDLE Cancel;
+
+	// Statistics
+	volatile LONGLONG Reads;
+	volatile LONGLONG Bytes;
+	volatile LONGLONG PinnedBytes;
+	uint64_t Pinned;
+	size_t PinnedRanges;
+} HEAT;
+
+uint64_t HeatKey(ULONG64 File, uint64_t Granule)
+{
+	const uint64_t key[2] = {File, Granule};
+	return Hash64(key, sizeof(key), 0);
+}
+
+HEAT_RANGE* HeatRange(HEAT *Heat, ULONG64 File, uint64_t Granule)
+{
+	uint64_t key = HeatKey(File, Granule);
+	HEAT_RANGE *range = RcuMapFind(&Heat->Map, key);
+	if(range || Heat->RangeCount >= HEAT_MAX_RANGES) {
+		return range;
+	}
+	HEAT_RANGE *new_range = PoolAlloc(&Heat->Arena, sizeof(HEAT_RANGE));
+	if(!new_range) {
+		return NULL;
+	}
+	new_range->File = File;
+	new_range->Granule = Granule;
+	range = RcuMapInsert(&Heat->Map, key, new_range);
+	if(range != new_range) {
+		PoolFree(&Heat->Arena, new_range, sizeof(HEAT_RANGE));
+		return range;
+	}
+	AcquireSRWLockExclusive(&Heat->Lock);
+	if(ArrayReserve(
+		(void**)&Heat->Ranges, &Heat->RangeCap, sizeof(HEAT_RANGE*), Heat->RangeCount + 1
+	)) {
+		Heat->Ranges[Heat->RangeCount++] = range;
+	}
+	ReleaseSRWLockExclusive(&Heat->Lock);
+	return range;
+}
+
+// Records a read of [Length] bytes at [Offset] of [File].
+void HeatRecord(HEAT *Heat, ULONG64 File, uint64_t Offset, uint64_t Length)
+{
+	if(!Heat || !Heat->Thread || !Length) {
+		return;
+	}
+	InterlockedIncrement64(&Heat->Reads);
+	InterlockedExchangeAdd64(&Heat->Bytes, Length);
+	uint64_t end = Offset + Length;
+	for(uint64_t g = Offset / HEAT_GRANULE; g <= (end - 1) / HEAT_GRANULE; g++) {
+		HEAT_RANGE *range = HeatRange(Heat, File, g);
+		// A hash collision, which we'd rather miss than miscount.
+		if(!range || range->File != File || range->Granule != g) {
+			continue;
+		}
+		uint64_t start = max(Offset, g * HEAT_GRANULE);
+		uint64_t len = min(end, (g + 1) * HEAT_GRANULE) - start;
+		InterlockedIncrement64(&range->Reads);
+		InterlockedExchangeAdd64(&range->Bytes, len);
+		if(range->Pinned) {
+			InterlockedExchangeAdd64(&range->PinnedBytes, len);
+			InterlockedExchangeAdd64(&Heat->PinnedBytes, len);
+		}
+	}
+}
+
+/// Pinning
+/// -------
+HEAT_PAGE* HeatPageSlot(HEAT_PAGE *Pages, size_t Cap, uint64_t Key)
+{
+	size_t i = (size_t)RcuHash(Key) & (Cap - 1);
+	while(Pages[i].Page && Pages[i].Page != Key) {
+		i = (i + 1) & (Cap - 1);
+	}
+	return &Pages[i];
+}
+
+// Makes room for [More] new pages. Returns false if we're out of memory.
+bool HeatPageReserve(HEAT *Heat, uint64_t More)
+{
+	if((Heat->PageSlots + More) * 2 <= Heat->PageCap) {
+		return true;
+	}
+	size_t live = 0;
+	for(size_t i = 0; i < Heat->PageCap; i++) {
+		live += (Heat->Pages[i].Count != 0);
+	}
+	size_t cap = HEAT_PAGES_MIN;
+	while((live + More) * 2 > cap) {
+		cap *= 2;
+	}
+	HEAT_PAGE *pages = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, cap * sizeof(HEAT_PAGE));
+	if(!pages) {
+		return false;
+	}
+	for(size_t i = 0; i < Heat->PageCap; i++) {
+		if(Heat->Pages[i].Count) {
+			*HeatPageSlot(pages, cap, Heat->Pages[i].Page) = Heat->Pages[i];
+		}
+	}
+	HeapFree(GetProcessHeap(), 0, Heat->Pages);
+	Heat->Pages = pages;
+	Heat->PageCap = cap;
+	Heat->PageSlots = live;
+	return true;
+}
+
+// Locks the pages [First] to [Last] of the image view, and counts another
+// reference to each of them.
+bool HeatPageLock(HEAT *Heat, uint64_t First, uint64_t Last)
+{
+	VIEW *view = &Heat->FS->View;
+	if(
+		!HeatPageReserve(Heat, Last - First + 1)
+		|| !VirtualLock(view->Memory + First * Heat->PageSize, (SIZE_T)((Last - First + 1) * Heat->PageSize))
+	) {
+		return false;
+	}
+	for(uint64_t p = First; p <= Last; p++) {
+		HEAT_PAGE *page = HeatPageSlot(Heat->Pages, Heat->PageCap, p + 1);
+		if(!page->Page) {
+			page->Page = p + 1;
+			Heat->PageSlots++;
+		}
+		page->Count++;
+	}
+	return true;
+}
+
+// Drops a reference to each of the pages [First] to [Last] of the image
+// view, and unlocks every run of pages that no pinned range uses anymore.
+void HeatPageUnlock(HEAT *Heat, uint64_t First, uint64_t Last)
+{
+	VIEW *view = &Heat->FS->View;
+	uint64_t run = UINT64_MAX;
+	for(uint64_t p = First; p <= Last + 1; p++) {
+		bool unused = false;
+		if(p <= Last && Heat->PageCap) {
+			HEAT_PAGE *page = HeatPageSlot(Heat->Pages, Heat->PageCap, p + 1);
+			unused = (page->Count && --page->Count == 0);
+		}
+		if(unused && run == UINT64_MAX) {
+			run = p;
+		} else if(!unused && run != UINT64_MAX) {
+			VirtualUnlock(view->Memory + run * Heat->PageSize, (SIZE_T)((p - run) * Heat->PageSize));
+			run = UINT64_MAX;
+		}
+	}
+}
+
+typedef struct {
+	HEAT *Heat;
+	// Remaining part of the granule to skip and to process
+	uint64_t Skip;
+	uint64_t Length;
+	bool Lock;
+	uint64_t Done;
+} HEAT_PIN;
+
+int HeatPinExtent(void *Param, uint64_t Offset, uint64_t Length)
+{
+	HEAT_PIN *pin = (HEAT_PIN*)Param;
+	VIEW *view = &pin->Heat->FS->View;
+	if(pin->Skip >= Length) {
+		pin->Skip -= Length;
+		return 0;
+	}
+	if(Offset == FS_EXTENT_ZERO) {
+		// Not in the image, so there's nothing to pin.
+		return 1;
+	}
+	Offset += pin->Skip;
+	Length = min(Length - pin->Skip, pin->Length);
+	pin->Skip = 0;
+	if(Offset + Length > view->Size) {
+		return 1;
+	}
+	// Clusters don't have to be page-aligned, so neighboring ranges can
+	// share the pages at either end.
+	uint64_t first = Offset / pin->Heat->PageSize;
+	uint64_t last = (Offset + Length - 1) / pin->Heat->PageSize;
+	if(pin->Lock) {
+		if(!HeatPageLock(pin->Heat, first, last)) {
+			return 1;
+		}
+	} else {
+		HeatPageUnlock(pin->Heat, first, last);
+	}
+	pin->Done += Length;
+	pin->Length -= Length;
+	return pin->Length == 0;
+}
+
+// Locks or unlocks the data of [Range]. Returns the number of bytes that
+// were processed.
+uint64_t HeatPin(HEAT *Heat, HEAT_RANGE *Range, bool Lock)
+{
+	FILESYSTEM *fs = Heat->FS;
+	LONGLONG size = fs->FSFormat->FileSize((void*)Range->File);
+	uint64_t start = Range->Granule * HEAT_GRANULE;
+	if(start >= (uint64_t)size) {
+		return 0;
+	}
+	HEAT_PIN pin = {
+		.Heat = Heat,
+		.Skip = start,
+		.Length = Lock ? min(HEAT_GRANULE, size - start) : Range->Pinned,
+		.Lock = Lock,
+	};
+	fs->FSFormat->FileExtents(fs, Range->File, HeatPinExtent, &pin);
+	return pin.Done;
+}
+
+typedef struct {
+	HEAT_RANGE *Range;
+	LONGLONG Bytes;
+} HEAT_SCORE;
+
+int HeatCompare(const void *A, const void *B)
+{
+	LONGLONG a = ((const HEAT_SCORE*)A)->Bytes;
+	LONGLONG b = ((const HEAT_SCORE*)B)->Bytes;
+	return (a < b) - (a > b);
+}
+
+// Pins the hottest ranges up to the budget, and unpins the rest.
+void HeatEvaluate(HEAT *Heat)
+{
+	AcquireSRWLockShared(&Heat->Lock);
+	size_t count = Heat->RangeCount;
+	HEAT_SCORE *scores = HeapAlloc(GetProcessHeap(), 0, count * sizeof(HEAT_SCORE));
+	if(scores) {
+		// The counters keep changing, so we sort a snapshot.
+		for(size_t i = 0; i < count; i++) {
+			scores[i].Range = Heat->Ranges[i];
+			scores[i].Bytes = Heat->Ranges[i]->Bytes;
+		}
+	}
+	ReleaseSRWLockShared(&Heat->Lock);
+	if(!scores) {
+		return;
+	}
+	qsort(scores, count, sizeof(HEAT_SCORE), HeatCompare);
+
+	uint64_t budget = Heat->Budget;
+	size_t keep = 0;
+	for(; keep < count && scores[keep].Bytes > 0; keep++) {
+		if(budget < HEAT_GRANULE) {
+			break;
+		}
+		budget -= HEAT_GRANULE;
+	}
+	// Unpin first, so that the newly pinned set fits into the working set.
+	for(size_t i = keep; i < count; i++) {
+		HEAT_RANGE *range = scores[i].Range;
+		if(range->Pinned) {
+			HeatPin(Heat, range, false);
+			Heat->Pinned -= range->Pinned;
+			Heat->PinnedRanges--;
+			range->Pinned = 0;
+		}
+	}
+	for(size_t i = 0; i < keep; i++) {
+		HEAT_RANGE *range = scores[i].Range;
+		if(!range->Pinned) {
+			range->Pinned = HeatPin(Heat, range, true);
+			if(range->Pinned) {
+				Heat->Pinned += range->Pinned;
+				Heat->PinnedRanges++;
+			}
+		}
+	}
+	// Not atomic with the increments in HeatRecord(), but a few lost
+	// accesses don't matter here.
+	for(size_t i = 0; i < count; i++) {
+		scores[i].Range->Reads /= 2;
+		scores[i].Range->Bytes /= 2;
+	}
+	HeapFree(GetProcessHeap(), 0, scores);
+}
+
+DWORD WINAPI HeatThread(void *Param)
+{
+	HEAT *Heat = (HEAT*)Param;
+	while(WaitForSingleObject(Heat->Cancel, HEAT_INTERVAL_MS) == WAIT_TIMEOUT) {
+		HeatEvaluate(Heat);
+	}
+	return 0;
+}
+/// -------
+
+// Starts tracking reads from [FS], pinning up to [Budget] bytes of the
+// hottest file data.
+bool HeatStart(HEAT *Heat, FILESYSTEM *FS, uint64_t Budget)
+{
+	SIZE_T ws_min;
+	SIZE_T ws_max;
+	assert(Heat);
+	assert(FS);
+	ZeroMemory(Heat, sizeof(HEAT));
+	Heat->FS = FS;
+	Heat->Budget = Budget;
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	Heat->PageSize = si.dwPageSize;
+	InitializeSRWLock(&Heat->Lock);
+	RcuMapInit(&Heat->Map, &Heat->Arena);
+
+	// VirtualLock() can only lock as much as the minimum working set allows.
+	if(
+		!GetProcessWorkingSetSize(GetCurrentProcess(), &ws_min, &ws_max)
+		|| !SetProcessWorkingSetSize(
+			GetCurrentProcess(), ws_min + (SIZE_T)Budget, ws_max + (SIZE_T)Budget
+		)
+	) {
+		fwprintf(stderr,
+			L"**Warning** Could not grow the working set for pinning (error %u).\n",
+			GetLastError()
+		);
+	}
+	Heat->Cancel = CreateEventW(NULL, TRUE, FALSE, NULL);
+	if(!Heat->Cancel) {
+		return false;
+	}
+	Heat->Thread = CreateThread(NULL, 0, HeatThread, Heat, 0, NULL);
+	if(!Heat->Thread) {
+		CloseHandle(Heat->Cancel);
+		Heat->Cancel = NULL;
+		return false;
+	}
+	return true;
+}
+
+void HeatReport(HEAT *Heat, FILE *Out)
+{
+	fwprintf(Out,
+		L"Pinned: %llu bytes in %Iu of %Iu tracked ranges, serving %.1f%% of %llu bytes read.\n",
+		Heat->Pinned, Heat->PinnedRanges, Heat->RangeCount,
+		Heat->Bytes ? (100.0 * Heat->PinnedBytes / Heat->Bytes) : 0.0, Heat->Bytes
+	);
+}
+
+void HeatStop(HEAT *Heat, FILE *Out)
+{
+	assert(Heat);
+	if(!Heat->Thread) {
+		return;
+	}
+	SetEvent(Heat->Cancel);
+	WaitForSingleObject(Heat->Thread, INFINITE);
+	CloseHandle(Heat->Thread);
+	CloseHandle(Heat->Cancel);
+	Heat->Thread = NULL;
+	Heat->Cancel = NULL;
+	if(Out) {
+		HeatReport(Heat, Out);
+	}
+	for(size_t i = 0; i < Heat->RangeCount; i++) {
+		if(Heat->Ranges[i]->Pinned) {
+			HeatPin(Heat, Heat->Ranges[i], false);
+		}
+	}
+	HeapFree(GetProcessHeap(), 0, Heat->Ranges);
+	HeapFree(GetProcessHeap(), 0, Heat->Pages);
+	ArenaFree(&Heat->Arena);
+}
@@ -0,0 +1,128 @@
+/*
+ * Dokan Image Mounter
+ *
+ * Holes in sparse image files.
+ */
+
+// Ranges returned by a single FSCTL_QUERY_ALLOCATED_RANGES call.
+#define HOLES_QUERY_BATCH 256
+
+void HolesFree(HOLES *Holes)
+{
+	assert(Holes);
+	HeapFree(GetProcessHeap(), 0, Holes->Ranges);
+	ZeroMemory(Holes, sizeof(HOLES));
+}
+
+void HolesQuery(HOLES *Holes, HANDLE File, uint64_t Size)
+{
+	BY_HANDLE_FILE_INFORMATION info;
+	FILE_ALLOCATED_RANGE_BUFFER query = {0};
+	assert(Holes);
+	ZeroMemory(Holes, sizeof(HOLES));
+	if(
+		!GetFileInformationByHandle(File, &info)
+		|| !(info.dwFileAttributes & FILE_ATTRIBUTE_SPARSE_FILE)
+	) {
+		return;
+	}
+	query.Length.QuadPart = Size;
+	for(;;) {
+		DWORD bytes = 0;
+		if(!ArrayReserve(
+			(void**)&Holes->Ranges, &Holes->RangeCap,
+			sizeof(FILE_ALLOCATED_RANGE_BUFFER), Holes->RangeCount + HOLES_QUERY_BATCH
+		)) {
+			HolesFree(Holes);
+			return;
+		}
+		BOOL ok = DeviceIoControl(
+			File, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query),
+			Holes->Ranges + Holes->RangeCount,
+			HOLES_QUERY_BATCH * sizeof(FILE_ALLOCATED_RANGE_BUFFER), &bytes, NULL
+		);
+		if(!ok && GetLastError() != ERROR_MORE_DATA) {
+			HolesFree(Holes);
+			return;
+		}
+		size_t count = bytes / sizeof(FILE_ALLOCATED_RANGE_BUFFER);
+		Holes->RangeCount += count;
+		if(ok || count == 0) {
+			break;
+		}
+		// Continue after the last range we got.
+		const FILE_ALLOCATED_RANGE_BUFFER *last = &Holes->Ranges[Holes->RangeCount - 1];
+		query.FileOffset.QuadPart = last->FileOffset.QuadPart + last->Length.QuadPart;
+		query.Length.QuadPart = Size - query.FileOffset.QuadPart;
+	}
+	Holes->Sparse = true;
+}
+
+// Returns the length of the leading run of [Size] bytes at byte [Offset]
+// of the file that is either entirely allocated or entirely a hole.
+uint64_t HolesRun(const HOLES *Holes, uint64_t Offset, uint64_t Size, bool *Hole)
+{
+	*Hole = false;
+	if(!Holes->Sparse) {
+		return Size;
+	}
+	// First range that ends past [Offset]
+	size_t lo = 0;
+	size_t hi = Holes->RangeCount;
+	while(lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		const FILE_ALLOCATED_RANGE_BUFFER *r = &Holes->Ranges[mid];
+		if((uint64_t)(r->FileOffset.QuadPart + r->Length.QuadPart) <= Offset) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if(lo == Holes->RangeCount) {
+		*Hole = true;
+		return Size;
+	}
+	const FILE_ALLOCATED_RANGE_BUFFER *r = &Holes->Ranges[lo];
+	uint64_t start = r->FileOffset.QuadPart;
+	if(start <= Offset) {
+		return min(Size, start + r->Length.QuadPart - Offset);
+	}
+	*Hole = true;
+	return min(Size, start - Offset);
+}
+
+uint64_t ImageHoleRun(const CONTAINER *Image, const void *Ptr, uint64_t Size, bool *Hole)
+{
+	const uint8_t *p = (const uint8_t*)Ptr;
+	const VIEW *view = &Image->FileView;
+	if(!Image->Holes.Sparse || p < view->Memory || p >= view->Memory + view->Size) {
+		*Hole = false;
+		return Size;
+	}
+	return HolesRun(&Image->Holes, p - view->Memory, Size, Hole);
+}
+
+bool ImageIsHole(const CONTAINER *Image, const void *Ptr, uint64_t Size)
+{
+	bool hole;
+	return ImageHoleRun(Image, Ptr, Size, &hole) == Size && hole;
+}
+
+// Copies [Size] bytes from [Src] in the view of [Image] to [Dst] using
+// [Copy], but zero-fills all parts that lie in holes instead of touching
+// their pages.
+void ImageHoleCopy(const CONTAINER *Image, COPY_FUNC Copy, uint8_t *Dst, const uint8_t *Src, size_t Size)
+{
+	while(Size) {
+		bool hole;
+		size_t run = (size_t)ImageHoleRun(Image, Src, Size, &hole);
+		if(hole) {
+			ZeroMemory(Dst, run);
+		} else {
+			Copy(Dst, Src, run);
+		}
+		Dst += run;
+		Src += run;
+		Size -= run;
+	}
+}
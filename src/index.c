@@ -0,0 +1,701 @@
+/*
+ * Dokan Image Mounter
+ *
+ * Persistent metadata index. A sidecar file next to the image that stores the
+ * directory tree, decoded file names, extent lists and free space of one file
+ * system in a pointer-free layout. Mounts of an unchanged image map this file
+ * and answer lookups and listings from it, without parsing the file system's
+ * own structures again.
+ */
+
+#define INDEX_MAGIC "DIMIDX5"
+#define INDEX_EXT L".dimidx"
+// Number of bytes at the start of the image and the file system that go into
+// INDEX_HEADER::HeaderHash.
+#define INDEX_HASHED_SIZE 0x10000
+
+typedef struct {
+	char Magic[8];
+	uint32_t HeaderSize;
+	uint32_t PartNum;
+
+	// Key of the image this index was built from
+	uint64_t ImageSize;
+	uint64_t ImageMTime;
+	uint64_t HeaderHash;
+	uint64_t FSOffset;
+	uint64_t FSSize;
+
+	uint64_t TotalBytes;
+	uint64_t AvailableBytes;
+
+	uint32_t NodeCount;
+	uint32_t ExtentCount;
+	uint64_t NamesLength; // in characters
+	// File offsets of the three arrays below
+	uint64_t NodesOffset;
+	uint64_t ExtentsOffset;
+	uint64_t NamesOffset;
+} INDEX_HEADER;
+
+// Node 0 is the root directory. The children of every directory are stored
+// contiguously and sorted by their case-folded names.
+typedef struct {
+	uint32_t Parent;
+	uint32_t FirstChild;
+	uint32_t ChildCount;
+	uint32_t FirstExtent;
+	uint32_t ExtentCount;
+	// Offset into the name array. The long name is immediately followed by
+	// the alternate (8.3) name, both are null-terminated.
+	uint32_t Name;
+	uint16_t NameLen;
+	uint16_t AltNameLen;
+	uint32_t Attributes;
+	uint64_t FirstCluster;
+	// File ID returned by the file system, so that it doesn't change when
+	// the index is attached
+	uint64_t ID;
+	uint64_t Size;
+	uint64_t CreationTime;
+	uint64_t LastAccessTime;
+	uint64_t LastWriteTime;
+} INDEX_NODE;
+
+typedef struct {
+	uint64_t Offset; // into the VIEW of the file system
+	uint64_t Length;
+} INDEX_EXTENT;
+
+typedef struct INDEX {
+	HANDLE File;
+	HANDLE Map;
+	const INDEX_HEADER *Header;
+	const INDEX_NODE *Nodes;
+	const INDEX_EXTENT *Extents;
+	const wchar_t *Names;
+	// Format of the file system the index was built from
+	const FSFORMAT *FSFormat;
+} INDEX;
+
+bool IndexFileName(wchar_t *Buf, size_t BufLen, const wchar_t *ImageFN)
+{
+	return swprintf_s(Buf, BufLen, L"%s%s", ImageFN, INDEX_EXT) > 0;
+}
+
+// Fills the key fields of [Header] from the current state of [FS].
+void IndexKey(INDEX_HEADER *Header, FILESYSTEM *FS)
+{
+	CONTAINER *image = FS->Image;
+	Header->PartNum = (uint32_t)(FS - image->Partitions);
+	Header->ImageSize = image->FileView.Size;
+	Header->ImageMTime = FileTimeToU64(&image->MTime);
+	Header->FSOffset = FS->View.Memory - image->FileView.Memory;
+	Header->FSSize = FS->View.Size;
+	Header->HeaderHash = Hash64(
+		FS->View.Memory, (size_t)min(FS->View.Size, INDEX_HASHED_SIZE),
+		Hash64(
+			image->FileView.Memory,
+			(size_t)min(image->FileView.Size, INDEX_HASHED_SIZE),
+			0
+		)
+	);
+}
+
+const wchar_t* IndexNodeName(const INDEX *Index, const INDEX_NODE *Node)
+{
+	return Index->Names + Node->Name;
+}
+
+const wchar_t* IndexNodeAltName(const INDEX *Index, const INDEX_NODE *Node)
+{
+	return Index->Names + Node->Name + Node->NameLen + 1;
+}
+
+// Returns whether every array index in the nodes of [Index] stays within
+// the bounds given by [Header].
+bool IndexValid(const INDEX *Index, const INDEX_HEADER *Header)
+{
+	for(uint32_t i = 0; i < Header->NodeCount; i++) {
+		const INDEX_NODE *node = &Index->Nodes[i];
+		uint64_t alt_end = (uint64_t)node->Name + node->NameLen + 1 + node->AltNameLen;
+		if(
+			node->Parent >= Header->NodeCount
+			|| (uint64_t)node->FirstChild + node->ChildCount > Header->NodeCount
+			|| (uint64_t)node->FirstExtent + node->ExtentCount > Header->ExtentCount
+			|| alt_end >= Header->NamesLength
+			|| Index->Names[node->Name + node->NameLen] != L'\0'
+			|| Index->Names[alt_end] != L'\0'
+		) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/// Building
+/// --------
+typedef struct {
+	INDEX_NODE Node;
+	ULONG64 File;
+} INDEX_BUILD_NODE;
+
+typedef struct {
+	FILESYSTEM *FS;
+	uint32_t Parent;
+	bool OutOfMemory;
+
+	INDEX_BUILD_NODE *Nodes;
+	size_t NodeCount;
+	size_t NodeCap;
+
+	INDEX_EXTENT *Extents;
+	size_t ExtentCount;
+	size_t ExtentCap;
+
+	wchar_t *Names;
+	size_t NamesLength;
+	size_t NamesCap;
+} INDEX_BUILD;
+
+uint32_t IndexBuildName(INDEX_BUILD *Build, const wchar_t *Name, size_t Len)
+{
+	if(!ArrayReserve(
+		(void**)&Build->Names, &Build->NamesCap, sizeof(wchar_t), Build->NamesLength + Len + 1
+	)) {
+		Build->OutOfMemory = true;
+		return 0;
+	}
+	uint32_t ret = (uint32_t)Build->NamesLength;
+	memcpy(&Build->Names[ret], Name, Len * sizeof(wchar_t));
+	Build->Names[ret + Len] = L'\0';
+	Build->NamesLength += Len + 1;
+	return ret;
+}
+
+int IndexBuildExtent(void *Param, uint64_t Offset, uint64_t Length)
+{
+	INDEX_BUILD *build = (INDEX_BUILD*)Param;
+	if(!ArrayReserve(
+		(void**)&build->Extents, &build->ExtentCap, sizeof(INDEX_EXTENT), build->ExtentCount + 1
+	)) {
+		build->OutOfMemory = true;
+		return 1;
+	}
+	build->Extents[build->ExtentCount].Offset = Offset;
+	build->Extents[build->ExtentCount].Length = Length;
+	build->ExtentCount++;
+	return 0;
+}
+
+uint64_t IndexBuildID(FILESYSTEM *FS, ULONG64 File)
+{
+	BY_HANDLE_FILE_INFORMATION info;
+	if(FS->FSFormat->GetFileInformation(FS, File, &info) != STATUS_SUCCESS) {
+		return 0;
+	}
+	return ((uint64_t)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+}
+
+// Stores the extents of [File] for [Node]. Directories get theirs as well, so
+// that everything reading them sees the same layout as without the index.
+void IndexBuildExtents(INDEX_BUILD *Build, INDEX_NODE *Node, ULONG64 File, const wchar_t *Name)
+{
+	Node->FirstExtent = (uint32_t)Build->ExtentCount;
+	NTSTATUS status = Build->FS->FSFormat->FileExtents(
+		Build->FS, File, IndexBuildExtent, Build
+	);
+	if(status != STATUS_SUCCESS) {
+		fwprintf(stderr,
+			L"**Warning** %s: broken allocation chain, indexing only the readable part\n",
+			Name
+		);
+	}
+	Node->ExtentCount = (uint32_t)Build->ExtentCount - Node->FirstExtent;
+}
+
+int IndexBuildAddFile(FIND_CALLBACK_DATA *FCD, WIN32_FIND_DATAW *FD, ULONG64 File)
+{
+	INDEX_BUILD *build = (INDEX_BUILD*)FCD->Param;
+	if(build->OutOfMemory || IsDotEntryW(FD->cFileName)) {
+		return 0;
+	}
+	if(!ArrayReserve(
+		(void**)&build->Nodes, &build->NodeCap, sizeof(INDEX_BUILD_NODE), build->NodeCount + 1
+	)) {
+		build->OutOfMemory = true;
+		return 0;
+	}
+	INDEX_BUILD_NODE *bn = &build->Nodes[build->NodeCount++];
+	INDEX_NODE *node = &bn->Node;
+	ZeroMemory(bn, sizeof(*bn));
+	bn->File = File;
+	size_t name_len = wcsnlen(FD->cFileName, elementsof(FD->cFileName));
+	size_t alt_len = wcsnlen(FD->cAlternateFileName, elementsof(FD->cAlternateFileName));
+	node->Parent = build->Parent;
+	node->Name = IndexBuildName(build, FD->cFileName, name_len);
+	IndexBuildName(build, FD->cAlternateFileName, alt_len);
+	node->NameLen = (uint16_t)name_len;
+	node->AltNameLen = (uint16_t)alt_len;
+	node->Attributes = FD->dwFileAttributes;
+	node->FirstCluster = FCD->FS->FSFormat->FileFirstCluster(FCD->FS, File);
+	node->ID = IndexBuildID(FCD->FS, File);
+	node->Size = ((uint64_t)FD->nFileSizeHigh << 32) | FD->nFileSizeLow;
+	node->CreationTime = FileTimeToU64(&FD->ftCreationTime);
+	node->LastAccessTime = FileTimeToU64(&FD->ftLastAccessTime);
+	node->LastWriteTime = FileTimeToU64(&FD->ftLastWriteTime);
+	IndexBuildExtents(build, node, File, FD->cFileName);
+	return 0;
+}
+
+int IndexBuildNodeCompare(void *Context, const void *A, const void *B)
+{
+	const wchar_t *names = (const wchar_t*)Context;
+	const INDEX_NODE *a = &((const INDEX_BUILD_NODE*)A)->Node;
+	const INDEX_NODE *b = &((const INDEX_BUILD_NODE*)B)->Node;
+	return CompareStringOrdinal(
+		names + a->Name, a->NameLen, names + b->Name, b->NameLen, TRUE
+	) - CSTR_EQUAL;
+}
+
+// Builds the directory tree breadth-first, which automatically stores the
+// children of every directory contiguously.
+bool IndexBuild(INDEX_BUILD *Build, FILESYSTEM *FS)
+{
+	Build->FS = FS;
+	if(!ArrayReserve((void**)&Build->Nodes, &Build->NodeCap, sizeof(INDEX_BUILD_NODE), 1)) {
+		return false;
+	}
+	INDEX_BUILD_NODE *root = &Build->Nodes[0];
+	ZeroMemory(root, sizeof(*root));
+	root->File = FSFileLookupW(FS, L"\\");
+	root->Node.Attributes = FILE_ATTRIBUTE_DIRECTORY;
+	root->Node.ID = IndexBuildID(FS, root->File);
+	root->Node.Name = IndexBuildName(Build, L"", 0);
+	IndexBuildName(Build, L"", 0);
+	IndexBuildExtents(Build, &root->Node, root->File, L"\\");
+	Build->NodeCount = 1;
+
+	FIND_CALLBACK_DATA fcd = {
+		.FS = FS,
+		.AddFile = IndexBuildAddFile,
+		.Param = Build
+	};
+	for(size_t i = 0; i < Build->NodeCount && !Build->OutOfMemory; i++) {
+		if(!(Build->Nodes[i].Node.Attributes & FILE_ATTRIBUTE_DIRECTORY)) {
+			continue;
+		}
+		size_t first = Build->NodeCount;
+		Build->Parent = (uint32_t)i;
+		FS->FSFormat->FindFiles(FS, Build->Nodes[i].File, &fcd);
+		size_t count = Build->NodeCount - first;
+		Build->Nodes[i].Node.FirstChild = (uint32_t)first;
+		Build->Nodes[i].Node.ChildCount = (uint32_t)count;
+		qsort_s(
+			&Build->Nodes[first], count, sizeof(INDEX_BUILD_NODE),
+			IndexBuildNodeCompare, Build->Names
+		);
+	}
+	return !Build->OutOfMemory;
+}
+
+void IndexBuildFree(INDEX_BUILD *Build)
+{
+	HeapFree(GetProcessHeap(), 0, Build->Nodes);
+	HeapFree(GetProcessHeap(), 0, Build->Extents);
+	HeapFree(GetProcessHeap(), 0, Build->Names);
+}
+
+bool IndexWriteArray(HANDLE File, const void *Data, uint64_t Size)
+{
+	const uint8_t *p = (const uint8_t*)Data;
+	while(Size) {
+		DWORD chunk = (DWORD)min(Size, 0x10000000);
+		DWORD written;
+		if(!WriteFile(File, p, chunk, &written, NULL) || written != chunk) {
+			return false;
+		}
+		p += chunk;
+		Size -= chunk;
+	}
+	return true;
+}
+
+// Builds an index of [FS] and writes it next to [ImageFN].
+// Returns 0 on success.
+int IndexWrite(FILESYSTEM *FS, const wchar_t *ImageFN)
+{
+	int ret = 0;
+	INDEX_BUILD build = {0};
+	INDEX_HEADER header = {0};
+	INDEX_NODE *nodes = NULL;
+	HANDLE file = INVALID_HANDLE_VALUE;
+	wchar_t index_fn[MAX_PATH];
+	wchar_t temp_fn[MAX_PATH];
+
+	assert(FS);
+	if(
+		!IndexFileName(index_fn, elementsof(index_fn), ImageFN)
+		|| swprintf_s(temp_fn, elementsof(temp_fn), L"%s.tmp", index_fn) <= 0
+	) {
+		fwprintf(stderr, L"**Error** Image file name too long: %s\n", ImageFN);
+		return -1;
+	}
+	if(!IndexBuild(&build, FS)) {
+		fwprintf(stderr, L"**Error** Out of memory while building the index.\n");
+		ret = ERROR_OUTOFMEMORY;
+		goto end;
+	}
+	nodes = HeapAlloc(GetProcessHeap(), 0, build.NodeCount * sizeof(INDEX_NODE));
+	if(!nodes) {
+		ret = ERROR_OUTOFMEMORY;
+		goto end;
+	}
+	for(size_t i = 0; i < build.NodeCount; i++) {
+		nodes[i] = build.Nodes[i].Node;
+	}
+
+	memcpy(header.Magic, INDEX_MAGIC, sizeof(header.Magic));
+	header.HeaderSize = sizeof(header);
+	IndexKey(&header, FS);
+	FS->FSFormat->DiskSizes(FS, &header.TotalBytes, &header.AvailableBytes);
+	header.NodeCount = (uint32_t)build.NodeCount;
+	header.ExtentCount = (uint32_t)build.ExtentCount;
+	header.NamesLength = build.NamesLength;
+	header.NodesOffset = sizeof(header);
+	header.ExtentsOffset = header.NodesOffset + build.NodeCount * sizeof(INDEX_NODE);
+	header.NamesOffset = header.ExtentsOffset + build.ExtentCount * sizeof(INDEX_EXTENT);
+
+	file = CreateFileW(
+		temp_fn, GENERIC_WRITE, 0, NULL,
+		CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL
+	);
+	W32_ERR_REPORT(file == INVALID_HANDLE_VALUE,
+		-2, L"Error creating %s", temp_fn
+	);
+	W32_ERR_REPORT(
+		!IndexWriteArray(file, &header, sizeof(header))
+		|| !IndexWriteArray(file, nodes, build.NodeCount * sizeof(INDEX_NODE))
+		|| !IndexWriteArray(file, build.Extents, build.ExtentCount * sizeof(INDEX_EXTENT))
+		|| !IndexWriteArray(file, build.Names, build.NamesLength * sizeof(wchar_t)),
+		-3, L"Error writing %s", temp_fn
+	);
+	CloseHandle(file);
+	file = INVALID_HANDLE_VALUE;
+	W32_ERR_REPORT(!MoveFileExW(temp_fn, index_fn, MOVEFILE_REPLACE_EXISTING),
+		-4, L"Error replacing %s", index_fn
+	);
+	fwprintf(stdout,
+		L"Indexed %u files and directories with %u extents into %s.\n",
+		header.NodeCount - 1, header.ExtentCount, index_fn
+	);
+end:
+	if(file != INVALID_HANDLE_VALUE) {
+		CloseHandle(file);
+		DeleteFileW(temp_fn);
+	}
+	HeapFree(GetProcessHeap(), 0, nodes);
+	IndexBuildFree(&build);
+	return ret;
+}
+/// --------
+
+/// Mounting
+/// --------
+extern const FSFORMAT FS_Index;
+
+// Maps the index of [ImageFN], and makes [FS] use it if it matches the
+// current state of [FS]. Returns false if there is no usable index.
+bool IndexAttach(FILESYSTEM *FS, const wchar_t *ImageFN)
+{
+	wchar_t index_fn[MAX_PATH];
+	INDEX index = {0};
+	INDEX_HEADER key = {0};
+	LARGE_INTEGER size;
+
+	assert(FS);
+	if(!IndexFileName(index_fn, elementsof(index_fn), ImageFN)) {
+		return false;
+	}
+	index.File = CreateFileW(
+		index_fn, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL
+	);
+	if(index.File == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	if(!GetFileSizeEx(index.File, &size) || size.QuadPart < sizeof(INDEX_HEADER)) {
+		goto fail;
+	}
+	index.Map = CreateFileMapping(index.File, NULL, PAGE_READONLY, 0, 0, NULL);
+	if(!index.Map) {
+		goto fail;
+	}
+	index.Header = MapViewOfFile(index.Map, FILE_MAP_READ, 0, 0, 0);
+	if(!index.Header) {
+		goto fail;
+	}
+	const INDEX_HEADER *h = index.Header;
+	IndexKey(&key, FS);
+	if(
+		memcmp(h->Magic, INDEX_MAGIC, sizeof(h->Magic))
+		|| h->HeaderSize != sizeof(INDEX_HEADER)
+		|| h->PartNum != key.PartNum
+		|| h->ImageSize != key.ImageSize
+		|| h->ImageMTime != key.ImageMTime
+		|| h->HeaderHash != key.HeaderHash
+		|| h->FSOffset != key.FSOffset
+		|| h->FSSize != key.FSSize
+	) {
+		fwprintf(stderr, L"*Warning* Ignoring outdated metadata index %s.\n", index_fn);
+		goto fail;
+	}
+	if(
+		h->NodeCount == 0
+		|| h->NodesOffset + (uint64_t)h->NodeCount * sizeof(INDEX_NODE) > (uint64_t)size.QuadPart
+		|| h->ExtentsOffset + (uint64_t)h->ExtentCount * sizeof(INDEX_EXTENT) > (uint64_t)size.QuadPart
+		|| h->NamesOffset + h->NamesLength * sizeof(wchar_t) > (uint64_t)size.QuadPart
+	) {
+		fwprintf(stderr, L"*Warning* Ignoring truncated metadata index %s.\n", index_fn);
+		goto fail;
+	}
+	index.Nodes = (const INDEX_NODE*)((const uint8_t*)h + h->NodesOffset);
+	index.Extents = (const INDEX_EXTENT*)((const uint8_t*)h + h->ExtentsOffset);
+	index.Names = (const wchar_t*)((const uint8_t*)h + h->NamesOffset);
+	index.FSFormat = FS->FSFormat;
+	if(!IndexValid(&index, h)) {
+		fwprintf(stderr, L"*Warning* Ignoring corrupt metadata index %s.\n", index_fn);
+		goto fail;
+	}
+
+	FS->Index = PoolAlloc(&FS->Arena, sizeof(INDEX));
+	if(!FS->Index) {
+		goto fail;
+	}
+	memcpy(FS->Index, &index, sizeof(INDEX));
+	FS->FSFormat = &FS_Index;
+	return true;
+
+fail:
+	if(index.Header) {
+		UnmapViewOfFile(index.Header);
+	}
+	if(index.Map) {
+		CloseHandle(index.Map);
+	}
+	CloseHandle(index.File);
+	return false;
+}
+
+void IndexDetach(FILESYSTEM *FS)
+{
+	if(!FS || !FS->Index) {
+		return;
+	}
+	INDEX *index = FS->Index;
+	FS->FSFormat = index->FSFormat;
+	FS->Index = NULL;
+	UnmapViewOfFile(index->Header);
+	CloseHandle(index->Map);
+	CloseHandle(index->File);
+	PoolFree(&FS->Arena, index, sizeof(INDEX));
+}
+/// --------
+
+/// File system format
+/// ------------------
+// Looks up a single path component among the children of [Dir].
+const INDEX_NODE* IndexChildLookup(const INDEX *Index, const INDEX_NODE *Dir, const wchar_t *Name, size_t NameLen)
+{
+	const INDEX_NODE *children = &Index->Nodes[Dir->FirstChild];
+	uint32_t lo = 0;
+	uint32_t hi = Dir->ChildCount;
+	while(lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		int cmp = CompareStringOrdinal(
+			IndexNodeName(Index, &children[mid]), children[mid].NameLen,
+			Name, (int)NameLen, TRUE
+		);
+		if(cmp == CSTR_EQUAL) {
+			return &children[mid];
+		} else if(cmp == CSTR_LESS_THAN) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	// Not sorted by those, so we have to do this linearly.
+	for(uint32_t i = 0; i < Dir->ChildCount; i++) {
+		if(children[i].AltNameLen && CompareStringOrdinal(
+			IndexNodeAltName(Index, &children[i]), children[i].AltNameLen,
+			Name, (int)NameLen, TRUE
+		) == CSTR_EQUAL) {
+			return &children[i];
+		}
+	}
+	return NULL;
+}
+
+const INDEX_NODE* IndexLookup(const INDEX *Index, const wchar_t *FileName)
+{
+	const INDEX_NODE *node = &Index->Nodes[0];
+	while(node && *FileName) {
+		while(IsDirSepW(*FileName)) {
+			FileName++;
+		}
+		size_t len = 0;
+		while(FileName[len] != L'\0' && !IsDirSepW(FileName[len])) {
+			len++;
+		}
+		if(len) {
+			node = IndexChildLookup(Index, node, FileName, len);
+		}
+		FileName += len;
+	}
+	return node;
+}
+
+#define INDEX_FILL_FILE_INFO(Obj) \
+	(Obj)->nFileSizeHigh = (DWORD)(node->Size >> 32); \
+	(Obj)->nFileSizeLow = (DWORD)node->Size; \
+	(Obj)->ftCreationTime = U64ToFileTime(node->CreationTime); \
+	(Obj)->ftLastAccessTime = U64ToFileTime(node->LastAccessTime); \
+	(Obj)->ftLastWriteTime = U64ToFileTime(node->LastWriteTime); \
+	(Obj)->dwFileAttributes = node->Attributes;
+
+const wchar_t* FS_Index_Name(FILESYSTEM *FS)
+{
+	if(!FS) {
+		return L"Index";
+	}
+	return FS->Index->FSFormat->Name(FS);
+}
+
+int FS_Index_Probe(FILESYSTEM *FS)
+{
+	// Only ever attached explicitly.
+	return 1;
+}
+
+void FS_Index_DiskSizes(FILESYSTEM *FS, uint64_t *Total, uint64_t *Available)
+{
+	*Total = FS->Index->Header->TotalBytes;
+	*Available = FS->Index->Header->AvailableBytes;
+}
+
+ULONG64 FS_Index_FileLookupW(FILESYSTEM *FS, const wchar_t *FileName)
+{
+	return (ULONG64)IndexLookup(FS->Index, FileName);
+}
+
+NTSTATUS FS_Index_FindFiles(FILESYSTEM *FS, ULONG64 Dir, FIND_CALLBACK_DATA *FCD)
+{
+	const INDEX *index = FS->Index;
+	const INDEX_NODE *dir = (const INDEX_NODE*)Dir;
+	if(!dir) {
+		return STATUS_SUCCESS;
+	}
+	for(uint32_t i = 0; i < dir->ChildCount; i++) {
+		const INDEX_NODE *node = &index->Nodes[dir->FirstChild + i];
+		WIN32_FIND_DATAW fd = {0};
+		INDEX_FILL_FILE_INFO(&fd);
+		memcpy(fd.cFileName, IndexNodeName(index, node), (node->NameLen + 1) * sizeof(wchar_t));
+		memcpy(fd.cAlternateFileName, IndexNodeAltName(index, node), (node->AltNameLen + 1) * sizeof(wchar_t));
+		FindAddFileW(FCD, &fd, (ULONG64)node);
+	}
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS FS_Index_GetFileInformation(FILESYSTEM *FS, ULONG64 File, LPBY_HANDLE_FILE_INFORMATION HandleFileInfo)
+{
+	const INDEX_NODE *node = (const INDEX_NODE*)File;
+	INDEX_FILL_FILE_INFO(HandleFileInfo);
+	HandleFileInfo->nNumberOfLinks = 1;
+	HandleFileInfo->nFileIndexHigh = (DWORD)(node->ID >> 32);
+	HandleFileInfo->nFileIndexLow = (DWORD)node->ID;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS FS_Index_ReadFile(FILESYSTEM *FS, ULONG64 File, uint8_t *Buffer, DWORD BufferLength, LPDWORD ReadLength, LONGLONG Offset)
+{
+	const INDEX_NODE *node = (const INDEX_NODE*)File;
+	const INDEX_EXTENT *ext = &FS->Index->Extents[node->FirstExtent];
+	const INDEX_EXTENT *ext_end = ext + node->ExtentCount;
+	while(ext < ext_end && (uint64_t)Offset >= ext->Length) {
+		Offset -= ext->Length;
+		ext++;
+	}
+	COPY_FUNC copy = CopyFor(BufferLength);
+	while(BufferLength && ext < ext_end) {
+		DWORD copy_length = (DWORD)min(ext->Length - Offset, BufferLength);
+		if(ext->Offset == FS_EXTENT_ZERO) {
+			ZeroMemory(Buffer, copy_length);
+		} else {
+			uint8_t *data = LAt(FS, ext->Offset + Offset, copy_length);
+			if(!data) {
+				return STATUS_DISK_CORRUPT_ERROR;
+			}
+			ImageHoleCopy(FS->Image, copy, Buffer, data, copy_length);
+		}
+		BufferLength -= copy_length;
+		Buffer += copy_length;
+		*ReadLength += copy_length;
+		Offset = 0;
+		ext++;
+	}
+	return BufferLength ? STATUS_DISK_CORRUPT_ERROR : STATUS_SUCCESS;
+}
+
+NTSTATUS FS_Index_FileExtents(FILESYSTEM *FS, ULONG64 File, FILE_EXTENT_FUNC Func, void *Param)
+{
+	const INDEX_NODE *node = (const INDEX_NODE*)File;
+	const INDEX_EXTENT *ext = &FS->Index->Extents[node->FirstExtent];
+	for(uint32_t i = 0; i < node->ExtentCount; i++) {
+		if(Func(Param, ext[i].Offset, ext[i].Length)) {
+			break;
+		}
+	}
+	return STATUS_SUCCESS;
+}
+
+uint64_t FS_Index_FileFirstCluster(FILESYSTEM *FS, ULONG64 File)
+{
+	return ((const INDEX_NODE*)File)->FirstCluster;
+}
+
+// Everything we need is in the index itself.
+void FS_Index_MetadataExtents(FILESYSTEM *FS, FILE_EXTENT_FUNC Func, void *Param)
+{
+}
+
+LONGLONG FS_Index_FileSize(const void *DEntry)
+{
+	return ((const INDEX_NODE*)DEntry)->Size;
+}
+
+NEW_FSFORMAT(Index, 260, W);
+/// ------------------
+
+/// Command
+/// -------
+int CMD_Index_Main(int argc, const wchar_t *argv[])
+{
+	CONTAINER image = {0};
+	FILESYSTEM *fs = NULL;
+	int ret = ImageOpen(&image, argv[0]);
+	if(!ret) {
+		ret = ImageProbe(&image, &fs, stdout);
+	}
+	if(!ret) {
+		double start = TimeSeconds();
+		ret = IndexWrite(fs, argv[0]);
+		if(!ret) {
+			fwprintf(stdout, L"Done in %.3f s.\n", TimeSeconds() - start);
+		}
+	}
+	ImageClose(&image);
+	return ret;
+}
+
+NEW_COMMAND(Index, L"index", L"imagefile", 1);
+/// -------
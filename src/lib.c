@@ -0,0 +1,297 @@
+/*
+ * Dokan Image Mounter
+ *
+ * Implementation of the library interface in libdimount.h.
+ */
+
+struct DIM_IMAGE {
+	CONTAINER Image;
+	unsigned int Partitions;
+};
+
+struct DIM_FILE {
+	FILESYSTEM *FS;
+	ULONG64 File;
+	uint64_t Size;
+	bool Directory;
+};
+
+typedef struct {
+	DIM_DIR_FUNC Func;
+	void *Param;
+} DIM_DIR;
+
+typedef struct {
+	uint64_t Skip;
+	uint64_t Offset;
+	uint64_t Length;
+	bool Found;
+	bool Zero;
+} DIM_BORROW;
+
+void DimStatFromInfo(DIM_STAT *Stat, const BY_HANDLE_FILE_INFORMATION *Info)
+{
+	Stat->Size = ((uint64_t)Info->nFileSizeHigh << 32) | Info->nFileSizeLow;
+	Stat->Attributes = Info->dwFileAttributes;
+	Stat->ID = ((uint64_t)Info->nFileIndexHigh << 32) | Info->nFileIndexLow;
+	Stat->CreationTime = FileTimeToU64(&Info->ftCreationTime);
+	Stat->LastAccessTime = FileTimeToU64(&Info->ftLastAccessTime);
+	Stat->LastWriteTime = FileTimeToU64(&Info->ftLastWriteTime);
+}
+
+// Returns the partition [Part] of [Image] if it has a supported file system.
+FILESYSTEM* DimFS(DIM_IMAGE *Image, unsigned int Part)
+{
+	if(!Image || Part >= Image->Partitions) {
+		return NULL;
+	}
+	FILESYSTEM *fs = &Image->Image.Partitions[Part];
+	return fs->FSFormat ? fs : NULL;
+}
+
+DIM_API int DimVersion(void)
+{
+	return LIBDIMOUNT_VERSION;
+}
+
+DIM_API void DimCacheBudget(uint64_t Bytes)
+{
+	CacheBudgetSet(Bytes);
+}
+
+DIM_API int DimImageOpen(DIM_IMAGE **Image, const wchar_t *FN, uint64_t MetadataLimit)
+{
+	if(!Image || !FN) {
+		return ERROR_INVALID_PARAMETER;
+	}
+	*Image = NULL;
+	CopyInit();
+	DIM_IMAGE *image = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(DIM_IMAGE));
+	if(!image) {
+		return ERROR_OUTOFMEMORY;
+	}
+	image->Image.MetadataLimit = MetadataLimit;
+	int ret = ImageOpen(&image->Image, FN);
+	if(ret) {
+		ret = ERROR_OPEN_FAILED;
+		goto fail;
+	}
+	if(!ImageCFormatProbe(&image->Image)) {
+		ret = ERROR_UNRECOGNIZED_MEDIA;
+		goto fail;
+	}
+	int partitions = ImagePTFormatProbe(&image->Image);
+	if(partitions < 0) {
+		ret = ERROR_UNRECOGNIZED_MEDIA;
+		goto fail;
+	}
+	image->Partitions = (unsigned int)partitions;
+	for(unsigned int i = 0; i < image->Partitions; i++) {
+		FILESYSTEM *fs = &image->Image.Partitions[i];
+		if(!ImageFSFormatProbe(fs)) {
+			IndexAttach(fs, FN);
+		}
+	}
+	*Image = image;
+	return 0;
+fail:
+	ImageClose(&image->Image);
+	HeapFree(GetProcessHeap(), 0, image);
+	return ret;
+}
+
+DIM_API void DimImageClose(DIM_IMAGE *Image)
+{
+	if(!Image) {
+		return;
+	}
+	for(unsigned int i = 0; i < Image->Partitions; i++) {
+		IndexDetach(&Image->Image.Partitions[i]);
+	}
+	ImageClose(&Image->Image);
+	HeapFree(GetProcessHeap(), 0, Image);
+}
+
+DIM_API unsigned int DimPartitionCount(const DIM_IMAGE *Image)
+{
+	return Image ? Image->Partitions : 0;
+}
+
+DIM_API int DimPartitionInfo(DIM_IMAGE *Image, unsigned int Part, DIM_PARTITION *Info)
+{
+	if(!Image || !Info || Part >= Image->Partitions) {
+		return ERROR_INVALID_PARAMETER;
+	}
+	FILESYSTEM *fs = &Image->Image.Partitions[Part];
+	ZeroMemory(Info, sizeof(DIM_PARTITION));
+	Info->Offset = fs->View.Memory - Image->Image.FileView.Memory;
+	Info->Size = fs->View.Size;
+	Info->Label = fs->Label;
+	if(fs->FSFormat) {
+		Info->Format = fs->FSFormat->Name(fs);
+		fs->FSFormat->DiskSizes(fs, &Info->TotalBytes, &Info->AvailableBytes);
+	}
+	return 0;
+}
+
+DIM_API int DimFileOpen(DIM_IMAGE *Image, unsigned int Part, const wchar_t *Path, DIM_FILE **File)
+{
+	BY_HANDLE_FILE_INFORMATION info;
+	FILESYSTEM *fs = DimFS(Image, Part);
+	if(!fs || !Path || !File) {
+		return ERROR_INVALID_PARAMETER;
+	}
+	*File = NULL;
+	ULONG64 handle = FSFileLookupW(fs, Path);
+	if(!handle) {
+		return ERROR_FILE_NOT_FOUND;
+	}
+	if(fs->FSFormat->GetFileInformation(fs, handle, &info) != STATUS_SUCCESS) {
+		return ERROR_FILE_CORRUPT;
+	}
+	DIM_FILE *file = HeapAlloc(GetProcessHeap(), 0, sizeof(DIM_FILE));
+	if(!file) {
+		return ERROR_OUTOFMEMORY;
+	}
+	file->FS = fs;
+	file->File = handle;
+	file->Size = ((uint64_t)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+	file->Directory = (info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+	*File = file;
+	return 0;
+}
+
+DIM_API void DimFileClose(DIM_FILE *File)
+{
+	HeapFree(GetProcessHeap(), 0, File);
+}
+
+DIM_API int DimFileStat(DIM_FILE *File, DIM_STAT *Stat)
+{
+	BY_HANDLE_FILE_INFORMATION info;
+	if(!File || !Stat) {
+		return ERROR_INVALID_PARAMETER;
+	}
+	if(File->FS->FSFormat->GetFileInformation(File->FS, File->File, &info) != STATUS_SUCCESS) {
+		return ERROR_FILE_CORRUPT;
+	}
+	DimStatFromInfo(Stat, &info);
+	return 0;
+}
+
+DIM_API int DimFileRead(DIM_FILE *File, void *Buf, size_t Size, uint64_t Offset, size_t *Read)
+{
+	if(!File || !Read || (!Buf && Size)) {
+		return ERROR_INVALID_PARAMETER;
+	}
+	*Read = 0;
+	if(File->Directory) {
+		return ERROR_DIRECTORY;
+	}
+	if(Offset >= File->Size) {
+		return 0;
+	}
+	Size = (size_t)min(Size, File->Size - Offset);
+	uint8_t *buf = (uint8_t*)Buf;
+	while(Size) {
+		DWORD chunk = (DWORD)min(Size, 0x40000000);
+		DWORD read = 0;
+		NTSTATUS status = File->FS->FSFormat->ReadFile(
+			File->FS, File->File, buf, chunk, &read, (LONGLONG)Offset
+		);
+		*Read += read;
+		if(status != STATUS_SUCCESS) {
+			return ERROR_FILE_CORRUPT;
+		}
+		buf += chunk;
+		Offset += chunk;
+		Size -= chunk;
+	}
+	return 0;
+}
+
+int DimDirAddFile(FIND_CALLBACK_DATA *FCD, WIN32_FIND_DATAW *FD, ULONG64 File)
+{
+	DIM_DIR *dir = (DIM_DIR*)FCD->Param;
+	BY_HANDLE_FILE_INFORMATION info;
+	DIM_STAT stat;
+	if(IsDotEntryW(FD->cFileName)) {
+		return 0;
+	}
+	if(FCD->FS->FSFormat->GetFileInformation(FCD->FS, File, &info) == STATUS_SUCCESS) {
+		DimStatFromInfo(&stat, &info);
+	} else {
+		ZeroMemory(&stat, sizeof(stat));
+		stat.Size = ((uint64_t)FD->nFileSizeHigh << 32) | FD->nFileSizeLow;
+		stat.Attributes = FD->dwFileAttributes;
+	}
+	dir->Func(dir->Param, FD->cFileName, &stat);
+	return 0;
+}
+
+DIM_API int DimDirRead(DIM_FILE *Dir, DIM_DIR_FUNC Func, void *Param)
+{
+	if(!Dir || !Func) {
+		return ERROR_INVALID_PARAMETER;
+	}
+	if(!Dir->Directory) {
+		return ERROR_DIRECTORY;
+	}
+	DIM_DIR dir = {.Func = Func, .Param = Param};
+	FIND_CALLBACK_DATA fcd = {
+		.FS = Dir->FS,
+		.AddFile = DimDirAddFile,
+		.Param = &dir,
+	};
+	NTSTATUS status = Dir->FS->FSFormat->FindFiles(Dir->FS, Dir->File, &fcd);
+	return status == STATUS_SUCCESS ? 0 : ERROR_FILE_CORRUPT;
+}
+
+// Lent out for data that doesn't come from the image.
+const uint8_t DimZeroes[0x10000] = {0};
+
+int DimBorrowExtent(void *Param, uint64_t Offset, uint64_t Length)
+{
+	DIM_BORROW *b = (DIM_BORROW*)Param;
+	if(b->Skip >= Length) {
+		b->Skip -= Length;
+		return 0;
+	}
+	b->Zero = (Offset == FS_EXTENT_ZERO);
+	b->Offset = b->Zero ? 0 : (Offset + b->Skip);
+	b->Length = Length - b->Skip;
+	b->Found = true;
+	return 1;
+}
+
+DIM_API int DimFileBorrow(DIM_FILE *File, uint64_t Offset, const void **Data, size_t *Length)
+{
+	if(!File || !Data || !Length) {
+		return ERROR_INVALID_PARAMETER;
+	}
+	*Data = NULL;
+	*Length = 0;
+	if(File->Directory) {
+		return ERROR_DIRECTORY;
+	}
+	if(Offset >= File->Size) {
+		return ERROR_HANDLE_EOF;
+	}
+	DIM_BORROW b = {.Skip = Offset};
+	File->FS->FSFormat->FileExtents(File->FS, File->File, DimBorrowExtent, &b);
+	if(!b.Found) {
+		return ERROR_FILE_CORRUPT;
+	}
+	uint64_t length = min(b.Length, File->Size - Offset);
+	if(b.Zero) {
+		*Data = DimZeroes;
+		*Length = (size_t)min(length, sizeof(DimZeroes));
+		return 0;
+	}
+	if(b.Offset + length > File->FS->View.Size) {
+		return ERROR_FILE_CORRUPT;
+	}
+	*Data = File->FS->View.Memory + b.Offset;
+	*Length = (size_t)min(length, SIZE_MAX);
+	return 0;
+}
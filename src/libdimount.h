@@ -0,0 +1,111 @@
+/*
+ * Dokan Image Mounter - Library interface
+ *
+ * In-process access to the files inside disk images, without mounting them.
+ * All state lives in the returned handles, so different images can be used
+ * from different threads at the same time, and every call on an image is
+ * safe to make concurrently.
+ *
+ * Unless noted otherwise, functions return 0 on success or a Win32 error
+ * code on failure.
+ */
+
+#ifndef LIBDIMOUNT_H
+#define LIBDIMOUNT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <wchar.h>
+
+// Incremented whenever the interface changes incompatibly.
+#define LIBDIMOUNT_VERSION 1
+
+#ifndef DIM_API
+# if defined(LIBDIMOUNT_DLL) && defined(LIBDIMOUNT_BUILD)
+#  define DIM_API __declspec(dllexport)
+# elif defined(LIBDIMOUNT_DLL)
+#  define DIM_API __declspec(dllimport)
+# else
+#  define DIM_API
+# endif
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct DIM_IMAGE DIM_IMAGE;
+typedef struct DIM_FILE DIM_FILE;
+
+typedef struct {
+	// Name of the file system format, or NULL if the partition doesn't
+	// contain a supported one. Valid until DimImageClose().
+	const wchar_t *Format;
+	const wchar_t *Label;
+	// Location within the image file, in bytes
+	uint64_t Offset;
+	uint64_t Size;
+	uint64_t TotalBytes;
+	uint64_t AvailableBytes;
+} DIM_PARTITION;
+
+typedef struct {
+	uint64_t Size;
+	// FILE_ATTRIBUTE_* flags
+	uint32_t Attributes;
+	// Identifies the file within its partition, like the file index
+	// returned by GetFileInformationByHandle().
+	uint64_t ID;
+	// FILETIME values, in 100-nanosecond intervals since 1601
+	uint64_t CreationTime;
+	uint64_t LastAccessTime;
+	uint64_t LastWriteTime;
+} DIM_STAT;
+
+// Receives every entry of a directory, without "." and "..".
+typedef void(*DIM_DIR_FUNC)(void *Param, const wchar_t *Name, const DIM_STAT *Stat);
+
+// Returns LIBDIMOUNT_VERSION of the library itself.
+DIM_API int DimVersion(void);
+
+// Limits the memory used by the caches of all open images in the process to
+// [Bytes], or a quarter of physical memory if 0, which is the default.
+DIM_API void DimCacheBudget(uint64_t Bytes);
+
+// Opens [FN], identifies its container format and partition table, and
+// probes the file system of every partition. The metadata memory of each
+// partition is limited to [MetadataLimit] bytes, or unlimited if 0. Once a
+// partition reaches its limit, calls that need more metadata fail.
+DIM_API int DimImageOpen(DIM_IMAGE **Image, const wchar_t *FN, uint64_t MetadataLimit);
+// Also invalidates all files opened from [Image] and all borrowed data.
+DIM_API void DimImageClose(DIM_IMAGE *Image);
+
+DIM_API unsigned int DimPartitionCount(const DIM_IMAGE *Image);
+DIM_API int DimPartitionInfo(DIM_IMAGE *Image, unsigned int Part, DIM_PARTITION *Info);
+
+// Opens the file or directory at [Path], with backslashes as separators,
+// on partition [Part].
+DIM_API int DimFileOpen(DIM_IMAGE *Image, unsigned int Part, const wchar_t *Path, DIM_FILE **File);
+DIM_API void DimFileClose(DIM_FILE *File);
+DIM_API int DimFileStat(DIM_FILE *File, DIM_STAT *Stat);
+
+// Reads up to [Size] bytes at [Offset], returning the number of bytes read
+// in [Read]. Reading past the end of the file is not an error.
+DIM_API int DimFileRead(DIM_FILE *File, void *Buf, size_t Size, uint64_t Offset, size_t *Read);
+
+// Calls [Func] for every entry of the directory [Dir].
+DIM_API int DimDirRead(DIM_FILE *Dir, DIM_DIR_FUNC Func, void *Param);
+
+// Borrows the file data at [Offset] straight from the mapped image,
+// without copying it. Returns a pointer to it in [Data], and in [Length]
+// the number of bytes that are contiguous in the image from there on, which
+// may be less than the rest of the file if it's fragmented. The data stays
+// valid until DimImageClose(). Like DimFileRead(), this returns zeroes past
+// the valid data length of an exFAT file, in pieces of up to 64 KiB.
+DIM_API int DimFileBorrow(DIM_FILE *File, uint64_t Offset, const void **Data, size_t *Length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBDIMOUNT_H */
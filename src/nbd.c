@@ -0,0 +1,772 @@
+/*
+ * Dokan Image Mounter
+ *
+ * Network Block Device server, exporting one partition of an image to the
+ * block layer of a client kernel, which then mounts it with its own file
+ * system driver.
+ */
+
+#pragma comment(lib, "ws2_32.lib")
+
+// Registered with IANA
+#define NBD_PORT 10809
+// Largest read or write we accept, matching what clients send at most.
+#define NBD_MAX_REQUEST 0x2000000
+// Largest option we accept during the handshake.
+#define NBD_MAX_OPTION 0x1000
+// Replies gathered into a single send, as long as further requests have
+// already arrived.
+#define NBD_BATCH 32
+#define NBD_IN_SIZE 0x10000
+// Granularity of the copy-on-write overlay.
+#define NBD_OVERLAY_BLOCK 0x1000
+
+#define NBD_MAGIC 0x4E42444D41474943ULL // "NBDMAGIC"
+#define NBD_OPTS_MAGIC 0x49484156454F5054ULL // "IHAVEOPT"
+#define NBD_REP_MAGIC 0x3E889045565A9ULL
+#define NBD_REQUEST_MAGIC 0x25609513
+#define NBD_SIMPLE_REPLY_MAGIC 0x67446698
+
+#define NBD_FLAG_FIXED_NEWSTYLE 0x1
+#define NBD_FLAG_NO_ZEROES 0x2
+#define NBD_FLAG_C_FIXED_NEWSTYLE 0x1
+#define NBD_FLAG_C_NO_ZEROES 0x2
+
+#define NBD_FLAG_HAS_FLAGS 0x1
+#define NBD_FLAG_READ_ONLY 0x2
+#define NBD_FLAG_SEND_FLUSH 0x4
+#define NBD_FLAG_CAN_MULTI_CONN 0x100
+
+#define NBD_OPT_EXPORT_NAME 1
+#define NBD_OPT_ABORT 2
+#define NBD_OPT_LIST 3
+#define NBD_OPT_INFO 6
+#define NBD_OPT_GO 7
+
+#define NBD_REP_ACK 1
+#define NBD_REP_SERVER 2
+#define NBD_REP_INFO 3
+#define NBD_REP_ERR_UNSUP 0x80000001
+#define NBD_INFO_EXPORT 0
+
+#define NBD_CMD_READ 0
+#define NBD_CMD_WRITE 1
+#define NBD_CMD_DISC 2
+#define NBD_CMD_FLUSH 3
+
+#define NBD_EPERM 1
+#define NBD_EIO 5
+#define NBD_ENOMEM 12
+#define NBD_EINVAL 22
+
+// Everything on the wire is big-endian.
+#pragma pack(push, 1)
+typedef struct {
+	uint32_t Magic;
+	uint16_t Flags;
+	uint16_t Type;
+	uint64_t Handle;
+	uint64_t Offset;
+	uint32_t Length;
+} NBD_REQUEST;
+
+typedef struct {
+	uint32_t Magic;
+	uint32_t Error;
+	uint64_t Handle;
+} NBD_REPLY;
+
+typedef struct {
+	uint64_t Magic;
+	uint32_t Option;
+	uint32_t Length;
+} NBD_OPTION;
+
+typedef struct {
+	uint64_t Magic;
+	uint32_t Option;
+	uint32_t Type;
+	uint32_t Length;
+} NBD_OPTION_REPLY;
+#pragma pack(pop)
+
+uint16_t NbdBE16(uint16_t V)
+{
+	return htons(V);
+}
+
+uint32_t NbdBE32(uint32_t V)
+{
+	return htonl(V);
+}
+
+uint64_t NbdBE64(uint64_t V)
+{
+	return ((uint64_t)htonl((uint32_t)V) << 32) | htonl((uint32_t)(V >> 32));
+}
+
+/// Overlay
+/// -------
+// Written blocks go to a sparse temporary file, which is deleted once the
+// server stops. Everything else still comes from the image.
+typedef struct {
+	HANDLE File;
+	SRWLOCK Lock;
+	uint8_t *Written; // one bit per NBD_OVERLAY_BLOCK
+	uint64_t Blocks;
+} NBD_OVERLAY;
+
+bool NbdOverlayWritten(const NBD_OVERLAY *Overlay, uint64_t Block)
+{
+	return Overlay->Written && ((Overlay->Written[Block / 8] >> (Block % 8)) & 1);
+}
+
+// Returns whether any block touched by the [Size] bytes at [Offset] was
+// written.
+bool NbdOverlayTouched(const NBD_OVERLAY *Overlay, uint64_t Offset, uint64_t Size)
+{
+	if(!Overlay->Written || !Size) {
+		return false;
+	}
+	uint64_t last = (Offset + Size - 1) / NBD_OVERLAY_BLOCK;
+	for(uint64_t block = Offset / NBD_OVERLAY_BLOCK; block <= last; block++) {
+		if(NbdOverlayWritten(Overlay, block)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool NbdOverlayIO(HANDLE File, uint64_t Offset, void *Buf, DWORD Size, bool Write)
+{
+	DWORD bytes = 0;
+	OVERLAPPED ov = {
+		.Offset = (DWORD)Offset,
+		.OffsetHigh = (DWORD)(Offset >> 32),
+	};
+	BOOL ok = Write
+		? WriteFile(File, Buf, Size, &bytes, &ov)
+		: ReadFile(File, Buf, Size, &bytes, &ov);
+	return ok && bytes == Size;
+}
+
+void NbdOverlayClose(NBD_OVERLAY *Overlay)
+{
+	if(Overlay->File && Overlay->File != INVALID_HANDLE_VALUE) {
+		CloseHandle(Overlay->File);
+	}
+	HeapFree(GetProcessHeap(), 0, Overlay->Written);
+	ZeroMemory(Overlay, sizeof(NBD_OVERLAY));
+}
+
+// Returns 0 on success, or a Win32 error code.
+DWORD NbdOverlayOpen(NBD_OVERLAY *Overlay, const wchar_t *FN, uint64_t Size)
+{
+	DWORD bytes;
+	LARGE_INTEGER end = {.QuadPart = (LONGLONG)Size};
+	ZeroMemory(Overlay, sizeof(NBD_OVERLAY));
+	InitializeSRWLock(&Overlay->Lock);
+	Overlay->Blocks = (Size + NBD_OVERLAY_BLOCK - 1) / NBD_OVERLAY_BLOCK;
+	Overlay->Written = HeapAlloc(
+		GetProcessHeap(), HEAP_ZERO_MEMORY, (size_t)((Overlay->Blocks + 7) / 8)
+	);
+	if(!Overlay->Written) {
+		return ERROR_OUTOFMEMORY;
+	}
+	Overlay->File = CreateFileW(
+		FN, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+		FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL
+	);
+	if(Overlay->File == INVALID_HANDLE_VALUE) {
+		DWORD err = GetLastError();
+		NbdOverlayClose(Overlay);
+		return err;
+	}
+	// Without sparse support, the file simply takes up its full size.
+	DeviceIoControl(Overlay->File, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &bytes, NULL);
+	if(
+		!SetFilePointerEx(Overlay->File, end, NULL, FILE_BEGIN)
+		|| !SetEndOfFile(Overlay->File)
+	) {
+		DWORD err = GetLastError();
+		NbdOverlayClose(Overlay);
+		return err;
+	}
+	return 0;
+}
+
+// Copies [Block] of [View] into the overlay, unless it's already there.
+bool NbdOverlayFill(NBD_OVERLAY *Overlay, const VIEW *View, uint64_t Block)
+{
+	uint8_t buf[NBD_OVERLAY_BLOCK];
+	uint64_t start = Block * NBD_OVERLAY_BLOCK;
+	DWORD len = (DWORD)min(NBD_OVERLAY_BLOCK, View->Size - start);
+	if(NbdOverlayWritten(Overlay, Block)) {
+		return true;
+	}
+	// Pages of a block source can only be filled from user mode.
+	memcpy(buf, View->Memory + start, len);
+	return NbdOverlayIO(Overlay->File, start, buf, len, true);
+}
+
+// Writes the [Size] bytes at [Buf] to [Offset] of the overlay. Blocks that
+// are only partly covered are copied from [View] first.
+bool NbdOverlayWrite(NBD_OVERLAY *Overlay, const VIEW *View, uint64_t Offset, uint8_t *Buf, DWORD Size)
+{
+	uint64_t first = Offset / NBD_OVERLAY_BLOCK;
+	uint64_t last = (Offset + Size - 1) / NBD_OVERLAY_BLOCK;
+	bool ret = false;
+	AcquireSRWLockExclusive(&Overlay->Lock);
+	if(
+		NbdOverlayFill(Overlay, View, first)
+		&& NbdOverlayFill(Overlay, View, last)
+		&& NbdOverlayIO(Overlay->File, Offset, Buf, Size, true)
+	) {
+		for(uint64_t block = first; block <= last; block++) {
+			Overlay->Written[block / 8] |= 1 << (block % 8);
+		}
+		ret = true;
+	}
+	ReleaseSRWLockExclusive(&Overlay->Lock);
+	return ret;
+}
+
+// Reads the [Size] bytes at [Offset] into [Buf], from the overlay where it
+// has them and from [View] everywhere else.
+bool NbdOverlayRead(NBD_OVERLAY *Overlay, const VIEW *View, uint64_t Offset, uint8_t *Buf, DWORD Size)
+{
+	bool ret = true;
+	if(Overlay->Written) {
+		AcquireSRWLockShared(&Overlay->Lock);
+	}
+	while(ret && Size) {
+		uint64_t block = Offset / NBD_OVERLAY_BLOCK;
+		bool written = NbdOverlayWritten(Overlay, block);
+		DWORD run = 0;
+		// Extend the run over all following blocks in the same place.
+		do {
+			uint64_t block_end = (block + 1) * NBD_OVERLAY_BLOCK;
+			run = (DWORD)min(block_end - Offset, Size);
+			block++;
+		} while(run < Size && NbdOverlayWritten(Overlay, block) == written);
+		if(written) {
+			ret = NbdOverlayIO(Overlay->File, Offset, Buf, run, false);
+		} else {
+			CopyFor(run)(Buf, View->Memory + Offset, run);
+		}
+		Buf += run;
+		Offset += run;
+		Size -= run;
+	}
+	if(Overlay->Written) {
+		ReleaseSRWLockShared(&Overlay->Lock);
+	}
+	return ret;
+}
+/// -------
+
+/// Server
+/// ------
+typedef struct {
+	VIEW View;
+	// Pages of a block source are filled from user mode, so the socket can't
+	// send them directly.
+	bool Bounce;
+	NBD_OVERLAY Overlay;
+	uint16_t Flags;
+	volatile LONG Connections;
+} NBD_SERVER;
+
+typedef struct {
+	NBD_SERVER *Server;
+	SOCKET Socket;
+	bool Failed;
+	// Received bytes that haven't been parsed yet
+	uint8_t In[NBD_IN_SIZE];
+	size_t InPos;
+	size_t InLen;
+	// Replies that haven't been sent yet
+	NBD_REPLY Replies[NBD_BATCH];
+	WSABUF Bufs[NBD_BATCH * 2];
+	size_t ReplyCount;
+	DWORD BufCount;
+	uint64_t PendingBytes;
+	// Allocated for the first request that needs it
+	uint8_t *Bounce;
+} NBD_CONN;
+
+bool NbdSend(NBD_CONN *Conn, const void *Buf, size_t Size)
+{
+	const char *p = (const char*)Buf;
+	while(!Conn->Failed && Size) {
+		int sent = send(Conn->Socket, p, (int)min(Size, NBD_MAX_REQUEST), 0);
+		if(sent <= 0) {
+			Conn->Failed = true;
+			break;
+		}
+		p += sent;
+		Size -= sent;
+	}
+	return !Conn->Failed;
+}
+
+bool NbdRecv(NBD_CONN *Conn, void *Buf, size_t Size)
+{
+	uint8_t *p = (uint8_t*)Buf;
+	while(!Conn->Failed && Size) {
+		if(Conn->InPos == Conn->InLen) {
+			int got = recv(Conn->Socket, (char*)Conn->In, sizeof(Conn->In), 0);
+			if(got <= 0) {
+				Conn->Failed = true;
+				break;
+			}
+			Conn->InPos = 0;
+			Conn->InLen = got;
+		}
+		size_t chunk = min(Size, Conn->InLen - Conn->InPos);
+		if(p) {
+			memcpy(p, Conn->In + Conn->InPos, chunk);
+			p += chunk;
+		}
+		Conn->InPos += chunk;
+		Size -= chunk;
+	}
+	return !Conn->Failed;
+}
+
+// Sends all queued replies, together with the data they point to, in a
+// single call.
+bool NbdFlush(NBD_CONN *Conn)
+{
+	DWORD sent = 0;
+	if(Conn->BufCount && !Conn->Failed) {
+		if(
+			WSASend(Conn->Socket, Conn->Bufs, Conn->BufCount, &sent, 0, NULL, NULL)
+			|| sent != Conn->PendingBytes
+		) {
+			Conn->Failed = true;
+		}
+	}
+	Conn->ReplyCount = 0;
+	Conn->BufCount = 0;
+	Conn->PendingBytes = 0;
+	return !Conn->Failed;
+}
+
+// Queues a reply, followed by the [Size] bytes at [Data]. These have to stay
+// unchanged until the next NbdFlush().
+void NbdReply(NBD_CONN *Conn, uint64_t Handle, uint32_t Error, const uint8_t *Data, uint32_t Size)
+{
+	if(Conn->ReplyCount == NBD_BATCH) {
+		NbdFlush(Conn);
+	}
+	NBD_REPLY *reply = &Conn->Replies[Conn->ReplyCount++];
+	reply->Magic = NbdBE32(NBD_SIMPLE_REPLY_MAGIC);
+	reply->Error = NbdBE32(Error);
+	reply->Handle = Handle;
+	Conn->Bufs[Conn->BufCount].buf = (char*)reply;
+	Conn->Bufs[Conn->BufCount].len = sizeof(NBD_REPLY);
+	Conn->BufCount++;
+	Conn->PendingBytes += sizeof(NBD_REPLY);
+	if(Size) {
+		Conn->Bufs[Conn->BufCount].buf = (char*)Data;
+		Conn->Bufs[Conn->BufCount].len = Size;
+		Conn->BufCount++;
+		Conn->PendingBytes += Size;
+	}
+}
+
+bool NbdBounceAlloc(NBD_CONN *Conn)
+{
+	if(!Conn->Bounce) {
+		Conn->Bounce = VirtualAlloc(NULL, NBD_MAX_REQUEST, MEM_COMMIT, PAGE_READWRITE);
+	}
+	return Conn->Bounce != NULL;
+}
+
+void NbdRead(NBD_CONN *Conn, const NBD_REQUEST *Req)
+{
+	NBD_SERVER *server = Conn->Server;
+	const uint8_t *data = server->View.Memory + Req->Offset;
+	if(server->Bounce || NbdOverlayTouched(&server->Overlay, Req->Offset, Req->Length)) {
+		// The bounce buffer is reused by the next request that needs it.
+		NbdFlush(Conn);
+		if(!NbdBounceAlloc(Conn)) {
+			NbdReply(Conn, Req->Handle, NBD_ENOMEM, NULL, 0);
+			return;
+		}
+		if(!NbdOverlayRead(
+			&server->Overlay, &server->View, Req->Offset, Conn->Bounce, Req->Length
+		)) {
+			NbdReply(Conn, Req->Handle, NBD_EIO, NULL, 0);
+			return;
+		}
+		NbdReply(Conn, Req->Handle, 0, Conn->Bounce, Req->Length);
+		NbdFlush(Conn);
+		return;
+	}
+	// Straight from the mapping of the image
+	NbdReply(Conn, Req->Handle, 0, data, Req->Length);
+}
+
+void NbdWrite(NBD_CONN *Conn, const NBD_REQUEST *Req)
+{
+	NBD_SERVER *server = Conn->Server;
+	uint32_t error = 0;
+	// Replies that are still queued might point to the blocks we overwrite.
+	NbdFlush(Conn);
+	if(!(server->Flags & NBD_FLAG_READ_ONLY) && NbdBounceAlloc(Conn)) {
+		if(!NbdRecv(Conn, Conn->Bounce, Req->Length)) {
+			return;
+		}
+		if(Req->Length && !NbdOverlayWrite(
+			&server->Overlay, &server->View, Req->Offset, Conn->Bounce, Req->Length
+		)) {
+			error = NBD_EIO;
+		}
+	} else {
+		// The data still has to be consumed.
+		if(!NbdRecv(Conn, NULL, Req->Length)) {
+			return;
+		}
+		error = (server->Flags & NBD_FLAG_READ_ONLY) ? NBD_EPERM : NBD_ENOMEM;
+	}
+	NbdReply(Conn, Req->Handle, error, NULL, 0);
+}
+
+bool NbdOptionReply(NBD_CONN *Conn, uint32_t Option, uint32_t Type, const void *Data, uint32_t Size)
+{
+	NBD_OPTION_REPLY reply = {
+		.Magic = NbdBE64(NBD_REP_MAGIC),
+		.Option = NbdBE32(Option),
+		.Type = NbdBE32(Type),
+		.Length = NbdBE32(Size),
+	};
+	return NbdSend(Conn, &reply, sizeof(reply)) && (!Size || NbdSend(Conn, Data, Size));
+}
+
+// Runs the fixed newstyle handshake. Every export name refers to the one
+// partition we serve. Returns true once the client moves on to the
+// transmission phase.
+bool NbdHandshake(NBD_CONN *Conn)
+{
+	NBD_SERVER *server = Conn->Server;
+#pragma pack(push, 1)
+	struct {
+		uint64_t Magic;
+		uint64_t OptsMagic;
+		uint16_t Flags;
+	} hello = {
+		.Magic = NbdBE64(NBD_MAGIC),
+		.OptsMagic = NbdBE64(NBD_OPTS_MAGIC),
+		.Flags = NbdBE16(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES),
+	};
+	struct {
+		uint64_t Size;
+		uint16_t Flags;
+		uint8_t Zeroes[124];
+	} export_info = {
+		.Size = NbdBE64(server->View.Size),
+		.Flags = NbdBE16(server->Flags),
+	};
+	struct {
+		uint16_t Type;
+		uint64_t Size;
+		uint16_t Flags;
+	} info = {
+		.Type = NbdBE16(NBD_INFO_EXPORT),
+		.Size = NbdBE64(server->View.Size),
+		.Flags = NbdBE16(server->Flags),
+	};
+#pragma pack(pop)
+	uint8_t data[NBD_MAX_OPTION];
+	uint32_t client_flags;
+
+	if(!NbdSend(Conn, &hello, sizeof(hello)) || !NbdRecv(Conn, &client_flags, 4)) {
+		return false;
+	}
+	client_flags = NbdBE32(client_flags);
+	if(!(client_flags & NBD_FLAG_C_FIXED_NEWSTYLE)) {
+		return false;
+	}
+	for(;;) {
+		NBD_OPTION opt;
+		if(!NbdRecv(Conn, &opt, sizeof(opt))) {
+			return false;
+		}
+		uint32_t option = NbdBE32(opt.Option);
+		uint32_t len = NbdBE32(opt.Length);
+		if(NbdBE64(opt.Magic) != NBD_OPTS_MAGIC || len > sizeof(data)) {
+			return false;
+		}
+		if(!NbdRecv(Conn, data, len)) {
+			return false;
+		}
+		switch(option) {
+		case NBD_OPT_EXPORT_NAME: {
+			size_t size = sizeof(export_info);
+			if(client_flags & NBD_FLAG_C_NO_ZEROES) {
+				size -= sizeof(export_info.Zeroes);
+			}
+			return NbdSend(Conn, &export_info, size);
+		}
+		case NBD_OPT_ABORT:
+			NbdOptionReply(Conn, option, NBD_REP_ACK, NULL, 0);
+			return false;
+		case NBD_OPT_LIST: {
+			// A single export with an empty name
+			uint32_t name_len = 0;
+			if(
+				!NbdOptionReply(Conn, option, NBD_REP_SERVER, &name_len, sizeof(name_len))
+				|| !NbdOptionReply(Conn, option, NBD_REP_ACK, NULL, 0)
+			) {
+				return false;
+			}
+			break;
+		}
+		case NBD_OPT_INFO:
+		case NBD_OPT_GO:
+			if(
+				!NbdOptionReply(Conn, option, NBD_REP_INFO, &info, sizeof(info))
+				|| !NbdOptionReply(Conn, option, NBD_REP_ACK, NULL, 0)
+			) {
+				return false;
+			}
+			if(option == NBD_OPT_GO) {
+				return true;
+			}
+			break;
+		default:
+			if(!NbdOptionReply(Conn, option, NBD_REP_ERR_UNSUP, NULL, 0)) {
+				return false;
+			}
+			break;
+		}
+	}
+}
+
+DWORD WINAPI NbdConnection(void *Param)
+{
+	NBD_CONN *conn = (NBD_CONN*)Param;
+	NBD_SERVER *server = conn->Server;
+	fwprintf(stdout, L"Client connected, %ld active.\n",
+		InterlockedIncrement(&server->Connections)
+	);
+	bool open = NbdHandshake(conn);
+	while(open && !conn->Failed) {
+		NBD_REQUEST req;
+		if(!NbdRecv(conn, &req, sizeof(req))) {
+			break;
+		}
+		req.Type = NbdBE16(req.Type);
+		req.Offset = NbdBE64(req.Offset);
+		req.Length = NbdBE32(req.Length);
+		// [Handle] is opaque, and goes back in the same byte order.
+		if(NbdBE32(req.Magic) != NBD_REQUEST_MAGIC) {
+			break;
+		}
+		bool in_range = (
+			req.Length <= NBD_MAX_REQUEST
+			&& req.Offset <= server->View.Size
+			&& req.Length <= server->View.Size - req.Offset
+		);
+		switch(req.Type) {
+		case NBD_CMD_READ:
+			if(!in_range) {
+				NbdReply(conn, req.Handle, NBD_EINVAL, NULL, 0);
+			} else {
+				NbdRead(conn, &req);
+			}
+			break;
+		case NBD_CMD_WRITE:
+			if(!in_range) {
+				NbdRecv(conn, NULL, req.Length);
+				NbdReply(conn, req.Handle, NBD_EINVAL, NULL, 0);
+			} else {
+				NbdWrite(conn, &req);
+			}
+			break;
+		case NBD_CMD_FLUSH:
+			// The overlay doesn't outlive the server anyway.
+			NbdReply(conn, req.Handle, 0, NULL, 0);
+			break;
+		case NBD_CMD_DISC:
+			open = false;
+			break;
+		default:
+			NbdReply(conn, req.Handle, NBD_EINVAL, NULL, 0);
+			break;
+		}
+		// Batch the replies of all requests that arrived together.
+		if(conn->InPos == conn->InLen || !open) {
+			NbdFlush(conn);
+		}
+	}
+	closesocket(conn->Socket);
+	if(conn->Bounce) {
+		VirtualFree(conn->Bounce, 0, MEM_RELEASE);
+	}
+	HeapFree(GetProcessHeap(), 0, conn);
+	fwprintf(stdout, L"Client disconnected, %ld active.\n",
+		InterlockedDecrement(&server->Connections)
+	);
+	return 0;
+}
+
+// Creates the listening socket, on the Unix socket at [UnixPath] if given,
+// and on [Port] of the loopback interface otherwise.
+SOCKET NbdListen(const wchar_t *UnixPath, unsigned short Port)
+{
+	SOCKET s;
+	int ret;
+	if(UnixPath) {
+		SOCKADDR_UN addr = {.sun_family = AF_UNIX};
+		if(!WideCharToMultiByte(
+			CP_UTF8, 0, UnixPath, -1, addr.sun_path, sizeof(addr.sun_path), NULL, NULL
+		)) {
+			return INVALID_SOCKET;
+		}
+		// A socket file left over from a previous run would fail the bind.
+		DeleteFileW(UnixPath);
+		s = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(s == INVALID_SOCKET) {
+			return s;
+		}
+		ret = bind(s, (struct sockaddr*)&addr, sizeof(addr));
+	} else {
+		struct sockaddr_in addr = {
+			.sin_family = AF_INET,
+			.sin_port = htons(Port),
+			.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+		};
+		s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if(s == INVALID_SOCKET) {
+			return s;
+		}
+		ret = bind(s, (struct sockaddr*)&addr, sizeof(addr));
+	}
+	if(ret == SOCKET_ERROR || listen(s, SOMAXCONN) == SOCKET_ERROR) {
+		closesocket(s);
+		return INVALID_SOCKET;
+	}
+	return s;
+}
+
+extern const COMMAND CMD_ServeNBD;
+
+int CMD_ServeNBD_Main(int argc, const wchar_t *argv[])
+{
+	CONTAINER image = {0};
+	FILESYSTEM *fs = NULL;
+	NBD_SERVER server = {0};
+	WSADATA wsa;
+	SOCKET listener = INVALID_SOCKET;
+	const wchar_t *unix_path = NULL;
+	const wchar_t *overlay_fn = NULL;
+	unsigned short port = NBD_PORT;
+	unsigned int part = 0;
+
+	for(int arg = 1; arg < argc; arg++) {
+		if(!wcscmp(argv[arg], L"-p") && (arg + 1) < argc) {
+			part = wcstoul(argv[++arg], NULL, 10);
+		} else if(!wcscmp(argv[arg], L"--port") && (arg + 1) < argc) {
+			port = (unsigned short)wcstoul(argv[++arg], NULL, 10);
+		} else if(!wcscmp(argv[arg], L"--unix") && (arg + 1) < argc) {
+			unix_path = argv[++arg];
+		} else if(!wcscmp(argv[arg], L"--overlay") && (arg + 1) < argc) {
+			overlay_fn = argv[++arg];
+		} else {
+			fwprintf(stderr, L"Usage: dimount %s %s\n", CMD_ServeNBD.Name, CMD_ServeNBD.Usage);
+			return -1;
+		}
+	}
+	int ret = ImageOpen(&image, argv[0]);
+	if(ret) {
+		goto end;
+	}
+	// Partitions without a supported file system can still be exported.
+	ret = ImageProbe(&image, &fs, stdout);
+	if(ret && ret != -10) {
+		goto end;
+	}
+	if(part) {
+		fs = (part <= elementsof(image.Partitions)) ? &image.Partitions[part - 1] : NULL;
+	}
+	if(!fs || !fs->View.Memory) {
+		fwprintf(stderr, L"**Error** No partition to export. Pick one with -p.\n");
+		ret = -10;
+		goto end;
+	}
+	ret = 0;
+	server.View = fs->View;
+	server.Bounce = image.Source != NULL;
+	server.Flags = NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH | NBD_FLAG_CAN_MULTI_CONN;
+	if(overlay_fn) {
+		DWORD err = NbdOverlayOpen(&server.Overlay, overlay_fn, server.View.Size);
+		if(err) {
+			ret = ReportError(-2, err, L"Error creating the overlay %s", overlay_fn);
+			goto end;
+		}
+	} else {
+		server.Flags |= NBD_FLAG_READ_ONLY;
+	}
+
+	if(WSAStartup(MAKEWORD(2, 2), &wsa)) {
+		fwprintf(stderr, L"**Error** Could not initialize Winsock.\n");
+		ret = 1;
+		goto end;
+	}
+	listener = NbdListen(unix_path, port);
+	if(listener == INVALID_SOCKET) {
+		ret = ReportError(1, WSAGetLastError(), L"Error listening for NBD clients");
+		goto cleanup;
+	}
+	fwprintf(stdout,
+		L"Exporting partition #%d (%llu bytes, %s) on ",
+		(int)(fs - image.Partitions) + 1, server.View.Size,
+		overlay_fn ? L"writes go to the overlay" : L"read-only"
+	);
+	if(unix_path) {
+		fwprintf(stdout, L"%s.\n", unix_path);
+	} else {
+		fwprintf(stdout, L"port %u of the loopback interface.\n", port);
+	}
+	for(;;) {
+		SOCKET s = accept(listener, NULL, NULL);
+		if(s == INVALID_SOCKET) {
+			ret = ReportError(1, WSAGetLastError(), L"Error accepting an NBD client");
+			break;
+		}
+		if(!unix_path) {
+			// Replies are batched already.
+			BOOL nodelay = TRUE;
+			setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&nodelay, sizeof(nodelay));
+		}
+		NBD_CONN *conn = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(NBD_CONN));
+		HANDLE thread = NULL;
+		if(conn) {
+			conn->Server = &server;
+			conn->Socket = s;
+			thread = CreateThread(NULL, 0, NbdConnection, conn, 0, NULL);
+		}
+		if(!thread) {
+			fwprintf(stderr, L"**Warning** Out of resources, dropping a client.\n");
+			closesocket(s);
+			HeapFree(GetProcessHeap(), 0, conn);
+			continue;
+		}
+		CloseHandle(thread);
+	}
+	// Only reached if accept() fails, in which case connections might still
+	// use [server], so we leave everything open until the process exits.
+	return ret;
+cleanup:
+	WSACleanup();
+end:
+	NbdOverlayClose(&server.Overlay);
+	ImageClose(&image);
+	return ret;
+}
+
+NEW_COMMAND(ServeNBD, L"serve-nbd", L"imagefile [-p partition] [--port port | --unix path] [--overlay file]", 1);
+/// ------
@@ -0,0 +1,294 @@
+/*
+ * Dokan Image Mounter
+ *
+ * Background prewarming of file system metadata after mounting.
+ */
+
+// The walk pauses while the foreground served a request within this many
+// milliseconds...
+#define PREWARM_IDLE_MS 50
+// ...and after every batch of this many directories, for this long.
+#define PREWARM_BATCH 64
+#define PREWARM_PAUSE_MS 5
+// Number of ranges passed to PrefetchVirtualMemory() at once.
+#define PREWARM_RANGES 64
+// Initial number of slots in the set of visited directories.
+#define PREWARM_SEEN_MIN 1024
+
+typedef BOOL WINAPI PrefetchVirtualMemory_t(HANDLE, ULONG_PTR, PWIN32_MEMORY_RANGE_ENTRY, ULONG);
+
+typedef struct {
+	FILESYSTEM *FS;
+	HANDLE Thread;
+	// Signaled to cancel the walk.
+	HANDLE Cancel;
+	// GetTickCount64() of the last foreground request.
+	volatile ULONGLONG Foreground;
+	PrefetchVirtualMemory_t *Prefetch;
+
+	// Breadth-first queue of directory handles, holding the level that is
+	// currently being read, followed by the directories found in it.
+	ULONG64 *Queue;
+	size_t QueueCap;
+	size_t Count;
+
+	// Open-addressing set of the first clusters of all queued directories,
+	// stored + 1 so that 0 marks an empty slot. Corrupted file systems can
+	// link a directory into its own subtree, which would otherwise keep the
+	// walk going forever.
+	uint64_t *Seen;
+	size_t SeenCap;
+	size_t SeenCount;
+
+	WIN32_MEMORY_RANGE_ENTRY Ranges[PREWARM_RANGES];
+	ULONG RangeCount;
+
+	// Statistics
+	uint64_t Dirs;
+	uint64_t Files;
+	uint64_t BytesPrefetched;
+	double Seconds;
+	bool Cancelled;
+} PREWARM;
+
+// Called by the foreground at the start of every request.
+void PrewarmNotify(PREWARM *PW)
+{
+	if(PW && PW->Thread) {
+		ULONGLONG now = GetTickCount64();
+		// Avoids bouncing the cache line on every single request.
+		if(PW->Foreground != now) {
+			PW->Foreground = now;
+		}
+	}
+}
+
+// Waits until the foreground is idle, for at least [Pause] milliseconds.
+// Returns false if the walk was cancelled in the meantime.
+bool PrewarmYield(PREWARM *PW, DWORD Pause)
+{
+	for(;;) {
+		if(WaitForSingleObject(PW->Cancel, Pause) == WAIT_OBJECT_0) {
+			PW->Cancelled = true;
+			return false;
+		}
+		ULONGLONG idle = GetTickCount64() - PW->Foreground;
+		if(idle >= PREWARM_IDLE_MS) {
+			return true;
+		}
+		Pause = (DWORD)(PREWARM_IDLE_MS - idle);
+	}
+}
+
+void PrewarmFlush(PREWARM *PW)
+{
+	if(!PW->RangeCount) {
+		return;
+	}
+	if(
+		!PW->Prefetch
+		|| !PW->Prefetch(GetCurrentProcess(), PW->RangeCount, PW->Ranges, 0)
+	) {
+		// No asynchronous read-ahead before Windows 8, and none for block
+		// sources, whose pages are filled on access. Touch them ourselves.
+		for(ULONG i = 0; i < PW->RangeCount; i++) {
+			volatile const uint8_t *p = PW->Ranges[i].VirtualAddress;
+			for(size_t j = 0; j < PW->Ranges[i].NumberOfBytes; j += 0x1000) {
+				(void)p[j];
+			}
+		}
+	}
+	PW->RangeCount = 0;
+}
+
+int PrewarmAddExtent(void *Param, uint64_t Offset, uint64_t Length)
+{
+	PREWARM *PW = (PREWARM*)Param;
+	VIEW *view = &PW->FS->View;
+	if(Offset >= view->Size) {
+		return 0;
+	}
+	Length = min(Length, view->Size - Offset);
+	if(PW->RangeCount == PREWARM_RANGES) {
+		PrewarmFlush(PW);
+	}
+	PW->Ranges[PW->RangeCount].VirtualAddress = view->Memory + Offset;
+	PW->Ranges[PW->RangeCount].NumberOfBytes = (SIZE_T)Length;
+	PW->RangeCount++;
+	PW->BytesPrefetched += Length;
+	return 0;
+}
+
+void PrewarmSeenInsert(uint64_t *Slots, size_t Cap, uint64_t Key)
+{
+	size_t i = (size_t)RcuHash(Key) & (Cap - 1);
+	while(Slots[i] && Slots[i] != Key) {
+		i = (i + 1) & (Cap - 1);
+	}
+	Slots[i] = Key;
+}
+
+// Adds the directory [File] to the visited set. Returns false if it was
+// already visited, or if we're out of memory and should stop descending.
+bool PrewarmVisit(PREWARM *PW, ULONG64 File)
+{
+	uint64_t key = PW->FS->FSFormat->FileFirstCluster(PW->FS, File) + 1;
+	// Kept at most half full.
+	if((PW->SeenCount + 1) * 2 > PW->SeenCap) {
+		size_t cap = PW->SeenCap ? (PW->SeenCap * 2) : PREWARM_SEEN_MIN;
+		uint64_t *slots = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, cap * sizeof(uint64_t));
+		if(!slots) {
+			return false;
+		}
+		for(size_t i = 0; i < PW->SeenCap; i++) {
+			if(PW->Seen[i]) {
+				PrewarmSeenInsert(slots, cap, PW->Seen[i]);
+			}
+		}
+		HeapFree(GetProcessHeap(), 0, PW->Seen);
+		PW->Seen = slots;
+		PW->SeenCap = cap;
+	}
+	size_t i = (size_t)RcuHash(key) & (PW->SeenCap - 1);
+	while(PW->Seen[i]) {
+		if(PW->Seen[i] == key) {
+			return false;
+		}
+		i = (i + 1) & (PW->SeenCap - 1);
+	}
+	PW->Seen[i] = key;
+	PW->SeenCount++;
+	return true;
+}
+
+int PrewarmAddFile(FIND_CALLBACK_DATA *FCD, WIN32_FIND_DATAW *FD, ULONG64 File)
+{
+	PREWARM *PW = (PREWARM*)FCD->Param;
+	if(IsDotEntryW(FD->cFileName)) {
+		return 0;
+	}
+	if(!(FD->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+		PW->Files++;
+		return 0;
+	}
+	if(
+		PrewarmVisit(PW, File)
+		&& ArrayReserve((void**)&PW->Queue, &PW->QueueCap, sizeof(ULONG64), PW->Count + 1)
+	) {
+		PW->Queue[PW->Count++] = File;
+	}
+	return 0;
+}
+
+DWORD WINAPI PrewarmThread(void *Param)
+{
+	PREWARM *PW = (PREWARM*)Param;
+	FILESYSTEM *fs = PW->FS;
+	const FSFORMAT *fmt = fs->FSFormat;
+	double start = TimeSeconds();
+	FIND_CALLBACK_DATA fcd = {
+		.FS = fs,
+		.AddFile = PrewarmAddFile,
+		.Param = PW,
+	};
+
+	// Lowers both CPU and I/O priority.
+	SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+
+	fmt->MetadataExtents(fs, PrewarmAddExtent, PW);
+	PrewarmFlush(PW);
+
+	ULONG64 root = FSFileLookupW(fs, L"\\");
+	if(
+		root
+		&& PrewarmVisit(PW, root)
+		&& ArrayReserve((void**)&PW->Queue, &PW->QueueCap, sizeof(ULONG64), 1)
+	) {
+		PW->Queue[PW->Count++] = root;
+	}
+	while(PW->Count) {
+		size_t level_end = PW->Count;
+
+		// Request the clusters of the whole level first, so that the reads
+		// can overlap with parsing the directories that are already in.
+		for(size_t i = 0; i < level_end; i++) {
+			fmt->FileExtents(fs, PW->Queue[i], PrewarmAddExtent, PW);
+		}
+		PrewarmFlush(PW);
+
+		for(size_t i = 0; i < level_end; i++) {
+			DWORD pause = ((PW->Dirs % PREWARM_BATCH) == 0) ? PREWARM_PAUSE_MS : 0;
+			if(!PrewarmYield(PW, pause)) {
+				goto end;
+			}
+			fmt->FindFiles(fs, PW->Queue[i], &fcd);
+			PW->Dirs++;
+		}
+
+		// Reuse the space of the level we just finished.
+		PW->Count -= level_end;
+		memmove(PW->Queue, PW->Queue + level_end, PW->Count * sizeof(ULONG64));
+	}
+end:
+	PW->Seconds = TimeSeconds() - start;
+	if(!PW->Cancelled) {
+		fwprintf(stdout,
+			L"Prewarm finished in %.3f s: %llu directories, %llu files, %llu bytes prefetched.\n",
+			PW->Seconds, PW->Dirs, PW->Files, PW->BytesPrefetched
+		);
+	}
+	return 0;
+}
+
+// Starts prewarming [FS] on a background thread. [FS] must stay mounted
+// until PrewarmStop().
+bool PrewarmStart(PREWARM *PW, FILESYSTEM *FS)
+{
+	assert(PW);
+	assert(FS);
+	ZeroMemory(PW, sizeof(PREWARM));
+	PW->FS = FS;
+	PW->Prefetch = (PrefetchVirtualMemory_t*)GetProcAddress(
+		GetModuleHandleW(L"kernel32.dll"), "PrefetchVirtualMemory"
+	);
+	PW->Cancel = CreateEventW(NULL, TRUE, FALSE, NULL);
+	if(!PW->Cancel) {
+		return false;
+	}
+	PW->Thread = CreateThread(NULL, 0, PrewarmThread, PW, 0, NULL);
+	if(!PW->Thread) {
+		CloseHandle(PW->Cancel);
+		PW->Cancel = NULL;
+		return false;
+	}
+	return true;
+}
+
+// Cancels the walk if it's still running, and waits for it to end.
+void PrewarmStop(PREWARM *PW)
+{
+	assert(PW);
+	if(!PW->Thread) {
+		return;
+	}
+	SetEvent(PW->Cancel);
+	WaitForSingleObject(PW->Thread, INFINITE);
+	CloseHandle(PW->Thread);
+	CloseHandle(PW->Cancel);
+	PW->Thread = NULL;
+	PW->Cancel = NULL;
+	HeapFree(GetProcessHeap(), 0, PW->Queue);
+	HeapFree(GetProcessHeap(), 0, PW->Seen);
+	PW->Queue = NULL;
+	PW->QueueCap = 0;
+	PW->Count = 0;
+	PW->Seen = NULL;
+	PW->SeenCap = 0;
+	PW->SeenCount = 0;
+	if(PW->Cancelled) {
+		fwprintf(stdout,
+			L"Prewarm cancelled after %.3f s: %llu directories, %llu files.\n",
+			PW->Seconds, PW->Dirs, PW->Files
+		);
+	}
+}
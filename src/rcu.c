@@ -0,0 +1,260 @@
+/*
+ * Dokan Image Mounter
+ *
+ * Read-mostly concurrent hash map with epoch-based reclamation.
+ */
+
+typedef struct RCU_NODE {
+	struct RCU_NODE *Next;
+	uint64_t Key;
+	void *Value;
+} RCU_NODE;
+
+struct RCU_TABLE {
+	size_t Mask;
+	RCU_NODE *volatile Buckets[];
+};
+
+// Memory that was unlinked while the map's epoch was [Epoch].
+struct RCU_RETIRED {
+	struct RCU_RETIRED *Next;
+	void *Ptr;
+	size_t Size;
+	LONGLONG Epoch;
+};
+
+// Buckets per entry, before the table is doubled.
+#define RCU_LOAD_FACTOR 1
+#define RCU_MIN_BUCKETS 64
+
+uint64_t RcuHash(uint64_t Key)
+{
+	// Finalizer of SplitMix64
+	Key = (Key ^ (Key >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	Key = (Key ^ (Key >> 27)) * 0x94D049BB133111EBULL;
+	return Key ^ (Key >> 31);
+}
+
+size_t RcuTableSize(size_t Buckets)
+{
+	return sizeof(RCU_TABLE) + Buckets * sizeof(RCU_NODE*);
+}
+
+// Tables that don't fit into the pool simply stay in the arena.
+void* RcuAlloc(ARENA *Arena, size_t Size)
+{
+	return (Size <= POOL_MAX_SIZE) ? PoolAlloc(Arena, Size) : ArenaAlloc(Arena, Size);
+}
+
+void RcuFree(ARENA *Arena, void *Ptr, size_t Size)
+{
+	if(Size <= POOL_MAX_SIZE) {
+		PoolFree(Arena, Ptr, Size);
+	}
+}
+
+/// Readers
+/// -------
+// Claims a slot and publishes the current epoch in it. The interlocked
+// operation is a full barrier, so either a writer that unlinks something
+// afterwards sees this slot, or we don't see what it unlinked.
+EPOCH_SLOT* RcuEnter(RCU_MAP *Map)
+{
+	size_t i = (size_t)RcuHash(GetCurrentThreadId());
+	for(;;) {
+		EPOCH_SLOT *slot = &Map->Slots[i % EPOCH_SLOTS];
+		LONGLONG epoch = Map->Epoch;
+		if(
+			slot->Epoch == 0
+			&& InterlockedCompareExchange64(&slot->Epoch, epoch, 0) == 0
+		) {
+			return slot;
+		}
+		i++;
+		YieldProcessor();
+	}
+}
+
+void RcuLeave(EPOCH_SLOT *Slot)
+{
+	InterlockedExchange64(&Slot->Epoch, 0);
+}
+
+void* RcuMapLookup(RCU_MAP *Map, uint64_t Key)
+{
+	RCU_TABLE *table = Map->Table;
+	if(table) {
+		RCU_NODE *node = table->Buckets[RcuHash(Key) & table->Mask];
+		for(; node; node = node->Next) {
+			if(node->Key == Key) {
+				return node->Value;
+			}
+		}
+	}
+	return NULL;
+}
+
+void* RcuMapFind(RCU_MAP *Map, uint64_t Key)
+{
+	EPOCH_SLOT *slot = RcuEnter(Map);
+	void *ret = RcuMapLookup(Map, Key);
+	RcuLeave(slot);
+	return ret;
+}
+/// -------
+
+/// Writers
+/// -------
+// All of these must be called with [Map->WriteLock] held.
+
+void RcuReclaim(RCU_MAP *Map)
+{
+	LONGLONG oldest = MAXLONGLONG;
+	for(size_t i = 0; i < EPOCH_SLOTS; i++) {
+		LONGLONG epoch = Map->Slots[i].Epoch;
+		if(epoch && epoch < oldest) {
+			oldest = epoch;
+		}
+	}
+	RCU_RETIRED **link = &Map->Retired;
+	while(*link) {
+		RCU_RETIRED *r = *link;
+		if(r->Epoch < oldest) {
+			*link = r->Next;
+			RcuFree(Map->Arena, r->Ptr, r->Size);
+			PoolFree(Map->Arena, r, sizeof(RCU_RETIRED));
+		} else {
+			link = &r->Next;
+		}
+	}
+}
+
+// Frees [Ptr] once all current readers have left. Must be called after
+// [Ptr] has been unlinked.
+void RcuRetire(RCU_MAP *Map, void *Ptr, size_t Size)
+{
+	RCU_RETIRED *r = PoolAlloc(Map->Arena, sizeof(RCU_RETIRED));
+	if(!r) {
+		// Leaking it into the arena is better than freeing it too early.
+		return;
+	}
+	r->Ptr = Ptr;
+	r->Size = Size;
+	r->Epoch = InterlockedIncrement64(&Map->Epoch) - 1;
+	r->Next = Map->Retired;
+	Map->Retired = r;
+}
+
+// Publishes a copy of the map with twice the number of buckets.
+bool RcuGrow(RCU_MAP *Map)
+{
+	RCU_TABLE *old = Map->Table;
+	size_t buckets = old ? ((old->Mask + 1) * 2) : RCU_MIN_BUCKETS;
+	RCU_TABLE *table = RcuAlloc(Map->Arena, RcuTableSize(buckets));
+	if(!table) {
+		return false;
+	}
+	table->Mask = buckets - 1;
+	if(old) {
+		// Readers might still be walking the old chains, so the nodes have
+		// to be copied rather than relinked.
+		for(size_t b = 0; b <= old->Mask; b++) {
+			for(RCU_NODE *node = old->Buckets[b]; node; node = node->Next) {
+				RCU_NODE *copy = PoolAlloc(Map->Arena, sizeof(RCU_NODE));
+				if(!copy) {
+					// Everything copied so far will go with the arena.
+					return false;
+				}
+				size_t i = RcuHash(node->Key) & table->Mask;
+				copy->Key = node->Key;
+				copy->Value = node->Value;
+				copy->Next = table->Buckets[i];
+				table->Buckets[i] = copy;
+			}
+		}
+	}
+	InterlockedExchangePointer((void* volatile*)&Map->Table, table);
+	if(old) {
+		for(size_t b = 0; b <= old->Mask; b++) {
+			RCU_NODE *node = old->Buckets[b];
+			while(node) {
+				RCU_NODE *next = node->Next;
+				RcuRetire(Map, node, sizeof(RCU_NODE));
+				node = next;
+			}
+		}
+		RcuRetire(Map, old, RcuTableSize(old->Mask + 1));
+	}
+	return true;
+}
+/// -------
+
+void RcuMapInit(RCU_MAP *Map, ARENA *Arena)
+{
+	assert(Map);
+	assert(Arena);
+	ZeroMemory(Map, sizeof(RCU_MAP));
+	Map->Arena = Arena;
+	Map->Epoch = 1;
+	InitializeSRWLock(&Map->WriteLock);
+}
+
+void* RcuMapInsert(RCU_MAP *Map, uint64_t Key, void *Value)
+{
+	void *ret = NULL;
+	assert(Value);
+	AcquireSRWLockExclusive(&Map->WriteLock);
+	RCU_TABLE *table = Map->Table;
+	if(!table || Map->Count >= (table->Mask + 1) * RCU_LOAD_FACTOR) {
+		// A full table still works, just slower.
+		if(!RcuGrow(Map) && !table) {
+			goto end;
+		}
+		table = Map->Table;
+	}
+	size_t i = RcuHash(Key) & table->Mask;
+	for(RCU_NODE *node = table->Buckets[i]; node; node = node->Next) {
+		if(node->Key == Key) {
+			ret = node->Value;
+			goto end;
+		}
+	}
+	RCU_NODE *node = PoolAlloc(Map->Arena, sizeof(RCU_NODE));
+	if(node) {
+		node->Key = Key;
+		node->Value = Value;
+		node->Next = table->Buckets[i];
+		InterlockedExchangePointer((void* volatile*)&table->Buckets[i], node);
+		Map->Count++;
+		ret = Value;
+	}
+end:
+	RcuReclaim(Map);
+	ReleaseSRWLockExclusive(&Map->WriteLock);
+	return ret;
+}
+
+bool RcuMapRemove(RCU_MAP *Map, uint64_t Key, size_t ValueSize)
+{
+	bool ret = false;
+	AcquireSRWLockExclusive(&Map->WriteLock);
+	RCU_TABLE *table = Map->Table;
+	if(table) {
+		RCU_NODE *volatile *link = &table->Buckets[RcuHash(Key) & table->Mask];
+		for(RCU_NODE *node = *link; node; link = &node->Next, node = *link) {
+			if(node->Key == Key) {
+				InterlockedExchangePointer((void* volatile*)link, node->Next);
+				if(ValueSize) {
+					RcuRetire(Map, node->Value, ValueSize);
+				}
+				RcuRetire(Map, node, sizeof(RCU_NODE));
+				Map->Count--;
+				ret = true;
+				break;
+			}
+		}
+	}
+	RcuReclaim(Map);
+	ReleaseSRWLockExclusive(&Map->WriteLock);
+	return ret;
+}
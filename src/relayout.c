@@ -0,0 +1,310 @@
+/*
+ * Dokan Image Mounter
+ *
+ * Defragmenting copy of a FAT image.
+ */
+
+#define FAT32_FSINFO_SIGNATURE1 0x41615252
+#define FAT32_FSINFO_SIGNATURE2 0x61417272
+
+typedef struct {
+	FILESYSTEM *FS;
+	uint64_t Files;
+	uint64_t Fragmented;
+	uint64_t Extents;
+} RELAYOUT_STATS;
+
+typedef struct {
+	FILESYSTEM *FS;
+	FAT_INFO *FI;
+	// File system in the output image
+	uint8_t *Out;
+	uint8_t *OutData;
+	uint8_t *OutFAT;
+	// New number of every cluster we copied, indexed by the old one
+	fat_cluster_t *Remap;
+	// Next free cluster in the output image
+	fat_cluster_t Next;
+	uint64_t Warnings;
+} RELAYOUT;
+
+int RelayoutCountExtent(void *Param, uint64_t Offset, uint64_t Length)
+{
+	(*(uint64_t*)Param)++;
+	return 0;
+}
+
+int RelayoutStatsFile(void *Param, const wchar_t *Path, size_t PathLen, WIN32_FIND_DATAW *FD, ULONG64 File)
+{
+	RELAYOUT_STATS *stats = (RELAYOUT_STATS*)Param;
+	uint64_t extents = 0;
+	stats->FS->FSFormat->FileExtents(stats->FS, File, RelayoutCountExtent, &extents);
+	stats->Files++;
+	stats->Extents += extents;
+	stats->Fragmented += (extents > 1);
+	return 0;
+}
+
+void RelayoutStats(FILESYSTEM *FS, const wchar_t *Label)
+{
+	RELAYOUT_STATS stats = {.FS = FS};
+	FSWalk(FS, RelayoutStatsFile, &stats);
+	fwprintf(stdout,
+		L"%s: %llu files and directories, %llu fragmented, %llu extents (%.2f per file)\n",
+		Label, stats.Files, stats.Fragmented, stats.Extents,
+		stats.Files ? (double)stats.Extents / stats.Files : 0.0
+	);
+}
+
+uint8_t* RelayoutOutCluster(RELAYOUT *RL, fat_cluster_t Cluster)
+{
+	return RL->OutData + (uint64_t)(Cluster - 2) * RL->FI->ClusterSize;
+}
+
+// Returns the location of [DEntry] in the output image, or NULL if the
+// directory containing it wasn't copied.
+FAT_DIR_ENTRY* RelayoutOutDEntry(RELAYOUT *RL, FAT_DIR_ENTRY *DEntry)
+{
+	FAT_INFO *fi = RL->FI;
+	uint8_t *p = (uint8_t*)DEntry;
+	if(p < fi->Data.Memory || p >= fi->Data.Memory + fi->Data.Size) {
+		// Fixed root directory, which stays where it is.
+		return (FAT_DIR_ENTRY*)(RL->Out + (p - RL->FS->View.Memory));
+	}
+	uint64_t offset = p - fi->Data.Memory;
+	fat_cluster_t cluster = RL->Remap[2 + (offset / fi->ClusterSize)];
+	if(!cluster) {
+		return NULL;
+	}
+	return (FAT_DIR_ENTRY*)(RelayoutOutCluster(RL, cluster) + (offset % fi->ClusterSize));
+}
+
+void RelayoutSetCluster(RELAYOUT *RL, FAT_DIR_ENTRY *DEntry, fat_cluster_t Cluster)
+{
+	DEntry->FirstCluster = (uint16_t)Cluster;
+	if(RL->FI->Type == FAT32) {
+		DEntry->FirstClusterHigh = (uint16_t)(Cluster >> 16);
+	}
+}
+
+// Copies up to [Limit] clusters of the chain starting at [First] to the next
+// free clusters of the output image, and links them up in its FAT. Returns
+// the new first cluster, or 0 if there was nothing to copy.
+fat_cluster_t RelayoutChain(RELAYOUT *RL, const wchar_t *Path, fat_cluster_t First, fat_cluster_t Limit)
+{
+	FAT_INFO *fi = RL->FI;
+	fat_cluster_t new_first = RL->Next;
+	fat_cluster_t cluster = First;
+	fat_cluster_t count = 0;
+	Limit = min(Limit, fi->Clusters);
+	while(count < Limit && FAT_ClusterValid(fi, cluster)) {
+		// Can only happen with cross-linked files, which get their own copy
+		// of the shared clusters.
+		if(RL->Next - 2 >= fi->Clusters) {
+			fwprintf(stderr, L"**Warning** %s: out of space in the output image\n", Path);
+			RL->Warnings++;
+			break;
+		}
+		fat_cluster_t new_cluster = RL->Next++;
+		memcpy(
+			RelayoutOutCluster(RL, new_cluster),
+			FAT_AtCluster(fi, cluster),
+			fi->ClusterSize
+		);
+		if(!RL->Remap[cluster]) {
+			RL->Remap[cluster] = new_cluster;
+		}
+		if(count) {
+			FAT_ClusterSet(fi, RL->OutFAT, new_cluster - 1, new_cluster);
+		}
+		count++;
+		cluster = FAT_ClusterLookup(fi, cluster);
+	}
+	if(count == 0) {
+		return 0;
+	}
+	FAT_ClusterSet(fi, RL->OutFAT, RL->Next - 1, FAT_CHAIN_END);
+	return new_first;
+}
+
+// Points the "." and ".." entries of the copied directory at [Cluster] to
+// their new locations.
+void RelayoutDotEntries(RELAYOUT *RL, fat_cluster_t Cluster)
+{
+	FAT_DIR_ENTRY *dentry = (FAT_DIR_ENTRY*)RelayoutOutCluster(RL, Cluster);
+	for(int i = 0; i < 2; i++) {
+		if(!memcmp(dentry[i].BaseName, ".       ", 8)) {
+			RelayoutSetCluster(RL, &dentry[i], Cluster);
+		} else if(!memcmp(dentry[i].BaseName, "..      ", 8)) {
+			fat_cluster_t parent = FAT_DEntryCluster(RL->FI, &dentry[i]);
+			if(FAT_ClusterValid(RL->FI, parent)) {
+				RelayoutSetCluster(RL, &dentry[i], RL->Remap[parent]);
+			}
+		}
+	}
+}
+
+// Called in depth-first order, with every directory before its contents, so
+// the directory holding [File] has always been copied already.
+int RelayoutAddFile(void *Param, const wchar_t *Path, size_t PathLen, WIN32_FIND_DATAW *FD, ULONG64 File)
+{
+	RELAYOUT *rl = (RELAYOUT*)Param;
+	FAT_INFO *fi = rl->FI;
+	FAT_DIR_ENTRY *dentry = (FAT_DIR_ENTRY*)File;
+	bool dir = (dentry->Attribute & FILE_ATTRIBUTE_DIRECTORY) != 0;
+	fat_cluster_t limit = fi->Clusters;
+	if(!dir) {
+		limit = (fat_cluster_t)(((uint64_t)dentry->Size + fi->ClusterSize - 1) / fi->ClusterSize);
+	}
+	fat_cluster_t new_first = RelayoutChain(rl, Path, FAT_DEntryCluster(fi, dentry), limit);
+	FAT_DIR_ENTRY *out = RelayoutOutDEntry(rl, dentry);
+	if(!out) {
+		fwprintf(stderr, L"**Warning** %s: parent directory was not copied\n", Path);
+		rl->Warnings++;
+		return FS_WALK_PRUNE;
+	}
+	RelayoutSetCluster(rl, out, new_first);
+	if(dir && new_first) {
+		RelayoutDotEntries(rl, new_first);
+	}
+	return 0;
+}
+
+// Fills in the output file system at [RL->Out], which starts out as a copy
+// of the input.
+void RelayoutFS(RELAYOUT *RL)
+{
+	FILESYSTEM *fs = RL->FS;
+	FAT_INFO *fi = RL->FI;
+	FAT_BOOT_RECORD *out_fbr = (FAT_BOOT_RECORD*)RL->Out;
+	size_t fat_size = (size_t)fi->FATSectors * fs->SectorSize;
+	// Entries 0 and 1 hold the media byte and the end-of-chain marker.
+	size_t fat_start = (fi->Type == FAT12) ? 3 : (fi->Type == FAT16) ? 4 : 8;
+	ZeroMemory(RL->OutFAT + fat_start, fat_size - fat_start);
+	RL->Next = 2;
+
+	if(fi->RootDirCluster) {
+		fat_cluster_t root = RelayoutChain(RL, L"\\", fi->RootDirCluster, fi->Clusters);
+		out_fbr->FAT32.RootDirCluster = root;
+		if(out_fbr->FAT32.BootBackupSector) {
+			FAT_BOOT_RECORD *backup = (FAT_BOOT_RECORD*)(
+				RL->Out + out_fbr->FAT32.BootBackupSector * fs->SectorSize
+			);
+			backup->FAT32.RootDirCluster = root;
+		}
+	}
+	FSWalk(fs, RelayoutAddFile, RL);
+
+	// Zeroed free space compresses a lot better.
+	ZeroMemory(RelayoutOutCluster(RL, RL->Next),
+		(uint64_t)(fi->Clusters - (RL->Next - 2)) * fi->ClusterSize
+	);
+	for(uint8_t i = 1; i < out_fbr->FATs; i++) {
+		memcpy(RL->OutFAT + (i * fat_size), RL->OutFAT, fat_size);
+	}
+	if(fi->Type == FAT32 && out_fbr->FAT32.FSInfoSector) {
+		uint8_t *fsinfo = RL->Out + out_fbr->FAT32.FSInfoSector * fs->SectorSize;
+		uint32_t *sig1 = (uint32_t*)fsinfo;
+		uint32_t *sig2 = (uint32_t*)(fsinfo + 484);
+		if(*sig1 == FAT32_FSINFO_SIGNATURE1 && *sig2 == FAT32_FSINFO_SIGNATURE2) {
+			sig2[1] = fi->Clusters - (RL->Next - 2); // free clusters
+			sig2[2] = RL->Next; // next free cluster
+		}
+	}
+}
+
+// Writes a defragmented copy of [Image], whose file system is [FS], to
+// [OutFN].
+int Relayout(CONTAINER *Image, FILESYSTEM *FS, const wchar_t *OutFN)
+{
+	int ret = 0;
+	HANDLE out_file = INVALID_HANDLE_VALUE;
+	HANDLE out_map = NULL;
+	uint8_t *out_view = NULL;
+	RELAYOUT rl = {
+		.FS = FS,
+		.FI = FS->FSData,
+	};
+	FAT_INFO *fi = rl.FI;
+
+	rl.Remap = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY,
+		((size_t)fi->Clusters + 2) * sizeof(fat_cluster_t)
+	);
+	if(!rl.Remap) {
+		fwprintf(stderr, L"**Error** Out of memory.\n");
+		return ERROR_OUTOFMEMORY;
+	}
+
+	// Everything outside the file system, including the container header
+	// and the partition table, is copied verbatim.
+	out_file = CreateFileW(
+		OutFN, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL
+	);
+	W32_ERR_REPORT(out_file == INVALID_HANDLE_VALUE, -2, L"Error creating %s", OutFN);
+	LARGE_INTEGER size = {.QuadPart = (LONGLONG)Image->FileView.Size};
+	out_map = CreateFileMappingW(
+		out_file, NULL, PAGE_READWRITE, size.HighPart, size.LowPart, NULL
+	);
+	W32_ERR_REPORT(!out_map, -3, L"Error creating %s", OutFN);
+	out_view = MapViewOfFile(out_map, FILE_MAP_WRITE, 0, 0, 0);
+	W32_ERR_REPORT(!out_view, -4, L"Error mapping %s", OutFN);
+	memcpy(out_view, Image->FileView.Memory, (size_t)Image->FileView.Size);
+
+	rl.Out = out_view + (FS->View.Memory - Image->FileView.Memory);
+	rl.OutData = rl.Out + (fi->Data.Memory - FS->View.Memory);
+	rl.OutFAT = rl.Out + (fi->FATs[0] - FS->View.Memory);
+	RelayoutFS(&rl);
+	fwprintf(stdout, L"%d of %d clusters in use.\n", rl.Next - 2, fi->Clusters);
+	if(rl.Warnings) {
+		fwprintf(stderr, L"%llu warnings.\n", rl.Warnings);
+	}
+	W32_ERR_REPORT(!FlushViewOfFile(out_view, 0), -5, L"Error writing %s", OutFN);
+end:
+	if(out_view) {
+		UnmapViewOfFile(out_view);
+	}
+	if(out_map) {
+		CloseHandle(out_map);
+	}
+	if(out_file != INVALID_HANDLE_VALUE) {
+		CloseHandle(out_file);
+	}
+	HeapFree(GetProcessHeap(), 0, rl.Remap);
+	return ret;
+}
+
+int CMD_Relayout_Main(int argc, const wchar_t *argv[])
+{
+	CONTAINER image = {0};
+	CONTAINER out_image = {0};
+	FILESYSTEM *fs = NULL;
+	FILESYSTEM *out_fs = NULL;
+
+	int ret = ImageOpen(&image, argv[0]);
+	if(!ret) {
+		ret = ImageProbe(&image, &fs, stderr);
+	}
+	if(!ret && fs->FSFormat != &FS_FAT) {
+		fwprintf(stderr, L"**Error** Only FAT file systems can be relayouted.\n");
+		ret = -1;
+	}
+	if(!ret) {
+		RelayoutStats(fs, L"Before");
+		ret = Relayout(&image, fs, argv[1]);
+	}
+	ImageClose(&image);
+	if(ret) {
+		return ret;
+	}
+	ret = ImageOpen(&out_image, argv[1]);
+	if(!ret) {
+		ret = ImageProbe(&out_image, &out_fs, NULL);
+	}
+	if(!ret) {
+		RelayoutStats(out_fs, L"After");
+	}
+	ImageClose(&out_image);
+	return ret;
+}
+
+NEW_COMMAND(Relayout, L"relayout", L"imagefile outfile", 2);
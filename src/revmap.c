@@ -0,0 +1,254 @@
+/*
+ * Dokan Image Mounter
+ *
+ * Cluster-to-file reverse map for FAT file systems.
+ */
+
+typedef struct {
+	FILESYSTEM *FS;
+	FAT_INFO *FI;
+	// ID of the file owning each cluster, indexed by cluster number, or 0 if
+	// no file uses it. Cross-linked clusters belong to the first file that
+	// reached them.
+	volatile LONG *Owner;
+	// Full paths of all files, indexed by ID - 1
+	const wchar_t **Paths;
+	size_t PathsCap;
+	volatile LONG Files;
+	SRWLOCK Lock;
+	ARENA Arena;
+} REVMAP;
+
+// Receives every file that owns a cluster in the queried range, once per
+// file, in ascending order of their IDs. Returning nonzero stops the query.
+typedef int(*REVMAP_FUNC)(void *Param, LONG ID, const wchar_t *Path);
+
+typedef struct {
+	REVMAP *Map;
+	LONG ID;
+	uint64_t DataOffset;
+} REVMAP_CHAIN;
+
+// Assigns a new ID to [Path], or returns 0 if we're out of memory.
+LONG RevMapAddPath(REVMAP *Map, const wchar_t *Path, size_t PathLen)
+{
+	wchar_t *path = ArenaAlloc(&Map->Arena, (PathLen + 1) * sizeof(wchar_t));
+	if(!path) {
+		return 0;
+	}
+	memcpy(path, Path, (PathLen + 1) * sizeof(wchar_t));
+	AcquireSRWLockExclusive(&Map->Lock);
+	LONG id = Map->Files + 1;
+	if(ArrayReserve((void**)&Map->Paths, &Map->PathsCap, sizeof(wchar_t*), id)) {
+		Map->Paths[id - 1] = path;
+		Map->Files = id;
+	} else {
+		id = 0;
+	}
+	ReleaseSRWLockExclusive(&Map->Lock);
+	return id;
+}
+
+int RevMapExtent(void *Param, uint64_t Offset, uint64_t Length)
+{
+	REVMAP_CHAIN *chain = (REVMAP_CHAIN*)Param;
+	FAT_INFO *fi = chain->Map->FI;
+	// Skips the fixed root directory of FAT12 and FAT16, which comes before
+	// the data area.
+	if(Offset < chain->DataOffset) {
+		return 0;
+	}
+	fat_cluster_t first = 2 + (fat_cluster_t)((Offset - chain->DataOffset) / fi->ClusterSize);
+	fat_cluster_t count = (fat_cluster_t)((Length + fi->ClusterSize - 1) / fi->ClusterSize);
+	for(fat_cluster_t c = first; c < first + count; c++) {
+		InterlockedCompareExchange(&chain->Map->Owner[c], chain->ID, 0);
+	}
+	return 0;
+}
+
+int RevMapAddFile(void *Param, const wchar_t *Path, size_t PathLen, WIN32_FIND_DATAW *FD, ULONG64 File)
+{
+	REVMAP *map = (REVMAP*)Param;
+	REVMAP_CHAIN chain = {
+		.Map = map,
+		.ID = RevMapAddPath(map, Path, PathLen),
+		.DataOffset = map->FI->Data.Memory - map->FS->View.Memory,
+	};
+	if(!chain.ID) {
+		return ERROR_OUTOFMEMORY;
+	}
+	// FileExtents() stops at broken chains on its own.
+	map->FS->FSFormat->FileExtents(map->FS, File, RevMapExtent, &chain);
+	return 0;
+}
+
+void RevMapFree(REVMAP *Map)
+{
+	if(Map->Owner) {
+		VirtualFree((void*)Map->Owner, 0, MEM_RELEASE);
+	}
+	HeapFree(GetProcessHeap(), 0, (void*)Map->Paths);
+	ArenaFree(&Map->Arena);
+	ZeroMemory(Map, sizeof(REVMAP));
+}
+
+// Builds the reverse map of the FAT file system [FS] into [Map], walking
+// the directories on [Threads] worker threads.
+int RevMapBuild(REVMAP *Map, FILESYSTEM *FS, unsigned int Threads)
+{
+	assert(Map);
+	assert(FS);
+	if(FS->FSFormat != &FS_FAT) {
+		return ERROR_NOT_SUPPORTED;
+	}
+	ZeroMemory(Map, sizeof(REVMAP));
+	Map->FS = FS;
+	Map->FI = FS->FSData;
+	Map->Owner = VirtualAlloc(NULL,
+		((size_t)Map->FI->Clusters + 2) * sizeof(LONG),
+		MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE
+	);
+	if(!Map->Owner) {
+		return ERROR_OUTOFMEMORY;
+	}
+	WIN32_FIND_DATAW root = {.dwFileAttributes = FILE_ATTRIBUTE_DIRECTORY};
+	int ret = RevMapAddFile(Map, L"\\", 1, &root, FSFileLookupW(FS, L"\\"));
+	if(!ret) {
+		ret = FSWalkParallel(FS, Threads, RevMapAddFile, Map);
+	}
+	if(ret) {
+		RevMapFree(Map);
+	}
+	return ret;
+}
+
+int RevMapCompareID(void *Context, const void *A, const void *B)
+{
+	LONG a = *(const LONG*)A;
+	LONG b = *(const LONG*)B;
+	return (a > b) - (a < b);
+}
+
+// Calls [Func] for every file that owns any of the clusters from [First] to
+// [Last], inclusive.
+int RevMapQuery(REVMAP *Map, uint64_t First, uint64_t Last, REVMAP_FUNC Func, void *Param)
+{
+	assert(Map);
+	assert(Func);
+	LONG *ids = NULL;
+	size_t ids_count = 0;
+	size_t ids_cap = 0;
+	int ret = 0;
+	First = max(First, 2);
+	Last = min(Last, (uint64_t)Map->FI->Clusters + 1);
+	for(uint64_t c = First; c <= Last; c++) {
+		LONG id = Map->Owner[c];
+		// Files are mostly contiguous, so this already removes most
+		// duplicates.
+		if(!id || (ids_count && ids[ids_count - 1] == id)) {
+			continue;
+		}
+		if(!ArrayReserve((void**)&ids, &ids_cap, sizeof(LONG), ids_count + 1)) {
+			ret = ERROR_OUTOFMEMORY;
+			goto end;
+		}
+		ids[ids_count++] = id;
+	}
+	qsort_s(ids, ids_count, sizeof(LONG), RevMapCompareID, NULL);
+	for(size_t i = 0; i < ids_count && !ret; i++) {
+		if(i == 0 || ids[i] != ids[i - 1]) {
+			ret = Func(Param, ids[i], Map->Paths[ids[i] - 1]);
+		}
+	}
+end:
+	HeapFree(GetProcessHeap(), 0, ids);
+	return ret;
+}
+
+int RevMapPrintFile(void *Param, LONG ID, const wchar_t *Path)
+{
+	const wchar_t *range = (const wchar_t*)Param;
+	fwprintf(stdout, L"%s\t%s\n", range, Path);
+	return 0;
+}
+
+// Parses "cluster" or "first-last" into [First] and [Last].
+bool RevMapParseRange(const wchar_t *Str, uint64_t *First, uint64_t *Last)
+{
+	wchar_t *end;
+	*First = _wcstoui64(Str, &end, 0);
+	if(end == Str) {
+		return false;
+	}
+	*Last = *First;
+	if(*end == L'-') {
+		const wchar_t *last = end + 1;
+		*Last = _wcstoui64(last, &end, 0);
+		if(end == last) {
+			return false;
+		}
+	}
+	return *end == L'\0' && *First <= *Last;
+}
+
+int RevMapQueryStr(REVMAP *Map, const wchar_t *Range)
+{
+	uint64_t first, last;
+	if(!RevMapParseRange(Range, &first, &last)) {
+		fwprintf(stderr, L"**Warning** ignoring invalid cluster range: %s\n", Range);
+		return 0;
+	}
+	return RevMapQuery(Map, first, last, RevMapPrintFile, (void*)Range);
+}
+
+int CMD_Which_Main(int argc, const wchar_t *argv[])
+{
+	unsigned int threads = 0;
+	CONTAINER image = {0};
+	FILESYSTEM *fs = NULL;
+	REVMAP map;
+	int arg = 1 + WorkersArg(argc - 1, argv + 1, &threads);
+
+	int ret = ImageOpen(&image, argv[0]);
+	if(!ret) {
+		ret = ImageProbe(&image, &fs, stderr);
+	}
+	if(ret) {
+		goto end;
+	}
+	double start = TimeSeconds();
+	ret = RevMapBuild(&map, fs, threads);
+	if(ret == ERROR_NOT_SUPPORTED) {
+		fwprintf(stderr, L"**Error** Only FAT file systems are supported.\n");
+		goto end;
+	} else if(ret) {
+		ReportError(0, ret, L"Error building the reverse map");
+		goto end;
+	}
+	double built = TimeSeconds();
+
+	// Ranges are either given on the command line, or read from stdin, one
+	// per line.
+	if(arg < argc) {
+		for(; arg < argc && !ret; arg++) {
+			ret = RevMapQueryStr(&map, argv[arg]);
+		}
+	} else {
+		wchar_t line[64];
+		while(!ret && fgetws(line, elementsof(line), stdin)) {
+			line[wcscspn(line, L"\r\n")] = L'\0';
+			if(line[0]) {
+				ret = RevMapQueryStr(&map, line);
+			}
+		}
+	}
+	fwprintf(stderr, L"Mapped %ld files in %.3f s, queries took %.3f s.\n",
+		map.Files, built - start, TimeSeconds() - built
+	);
+	RevMapFree(&map);
+end:
+	ImageClose(&image);
+	return ret;
+}
+
+NEW_COMMAND(Which, L"which", L"imagefile [-j threads] [cluster[-cluster] ...]", 1);
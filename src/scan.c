@@ -0,0 +1,653 @@
+/*
+ * Dokan Image Mounter
+ *
+ * Batch cataloging of entire directory trees of images.
+ */
+
+// The catalog is a JSON Lines file with one block of lines per image, in
+// path order. Every block starts with a header record
+//
+//	{"image":"…","size":…,"mtime":…,"container":"…",…}
+//
+// followed by the catalog records of all files on all of its partitions.
+// Unchanged images are recognized by the "size" and "mtime" fields of their
+// header, which therefore always directly follow the "image" field.
+//
+// Each worker writes the blocks of the images it scanned into its own
+// temporary spill file, so that memory use only depends on the number of
+// workers, not on the size of the listings. The final catalog is then
+// assembled from the spill files and the previous catalog.
+
+const wchar_t *SCAN_EXTENSIONS[] = {
+	L".hdi", L".img", L".ima", L".hdd", STORE_RECIPE_EXT
+};
+
+typedef struct {
+	const wchar_t *Path;
+	uint64_t Size;
+	uint64_t MTime;
+	// Location of the image's block, either in the previous catalog
+	// ([Worker] == -1) or in the spill file of a worker
+	int Worker;
+	uint64_t Offset;
+	uint64_t Length;
+	bool Failed;
+} SCAN_IMAGE;
+
+// Range of SCAN::Jobs owned by a worker. The owner takes jobs from the
+// front, and idle workers steal the back half.
+typedef struct {
+	SRWLOCK Lock;
+	size_t Head;
+	size_t Tail;
+} SCAN_DEQUE;
+
+typedef struct {
+	HANDLE File;
+	HANDLE Map;
+	const uint8_t *Memory;
+	OUTBUF *Out;
+	uint64_t Written;
+	uint64_t Files;
+} SCAN_SPILL;
+
+typedef struct {
+	const wchar_t *CatalogFN;
+	ARENA Arena;
+	SCAN_IMAGE *Images;
+	size_t ImageCount;
+	size_t ImageCap;
+	// Previous catalog
+	HANDLE OldFile;
+	HANDLE OldMap;
+	const uint8_t *Old;
+	SCAN_IMAGE *OldImages;
+	size_t OldCount;
+	size_t OldCap;
+	// Indices of all [Images] that need to be scanned
+	size_t *Jobs;
+	size_t JobCount;
+	unsigned int Workers;
+	volatile LONG NextWorker;
+	SCAN_DEQUE Deques[WORKERS_MAX];
+	SCAN_SPILL Spills[WORKERS_MAX];
+	bool OutOfMemory;
+} SCAN;
+
+int ScanImageCompare(void *Context, const void *A, const void *B)
+{
+	return CompareStringOrdinal(
+		((const SCAN_IMAGE*)A)->Path, -1, ((const SCAN_IMAGE*)B)->Path, -1, TRUE
+	) - CSTR_EQUAL;
+}
+
+bool ScanIsImage(const wchar_t *FN)
+{
+	size_t len = wcslen(FN);
+	for(size_t i = 0; i < elementsof(SCAN_EXTENSIONS); i++) {
+		size_t ext_len = wcslen(SCAN_EXTENSIONS[i]);
+		if(len > ext_len && !_wcsicmp(FN + len - ext_len, SCAN_EXTENSIONS[i])) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Adds all images below [Dir] to [Scan]->Images.
+void ScanCollect(SCAN *Scan, const wchar_t *Dir)
+{
+	WIN32_FIND_DATAW fd;
+	wchar_t path[MAX_PATH];
+	if(swprintf_s(path, elementsof(path), L"%s\\*", Dir) <= 0) {
+		fwprintf(stderr, L"**Warning** Skipping directory with a too long path: %s\n", Dir);
+		return;
+	}
+	HANDLE find = FindFirstFileW(path, &fd);
+	if(find == INVALID_HANDLE_VALUE) {
+		return;
+	}
+	do {
+		bool dir = (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+		if(
+			IsDotEntryW(fd.cFileName)
+			|| (fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
+			|| (!dir && !ScanIsImage(fd.cFileName))
+		) {
+			continue;
+		}
+		int len = swprintf_s(path, elementsof(path), L"%s\\%s", Dir, fd.cFileName);
+		if(len <= 0) {
+			fwprintf(stderr, L"**Warning** Skipping %s\\%s: path too long\n", Dir, fd.cFileName);
+			continue;
+		}
+		if(dir) {
+			ScanCollect(Scan, path);
+			continue;
+		}
+		wchar_t *copy = ArenaAlloc(&Scan->Arena, (len + 1) * sizeof(wchar_t));
+		if(
+			!copy
+			|| !ArrayReserve((void**)&Scan->Images, &Scan->ImageCap, sizeof(SCAN_IMAGE), Scan->ImageCount + 1)
+		) {
+			Scan->OutOfMemory = true;
+			break;
+		}
+		memcpy(copy, path, (len + 1) * sizeof(wchar_t));
+		SCAN_IMAGE *image = &Scan->Images[Scan->ImageCount++];
+		ZeroMemory(image, sizeof(SCAN_IMAGE));
+		image->Path = copy;
+		image->Size = ((uint64_t)fd.nFileSizeHigh << 32) | fd.nFileSizeLow;
+		image->MTime = FileTimeToU64(&fd.ftLastWriteTime);
+		image->Worker = -1;
+	} while(FindNextFileW(find, &fd));
+	FindClose(find);
+}
+
+/// Previous catalog
+/// ----------------
+// Parses the JSON string at [P], as written by OutJSONStringW(), into [Buf].
+// Returns a pointer past its closing quote, or NULL on failure.
+const char* ScanParseString(const char *P, const char *End, wchar_t *Buf, size_t BufLen)
+{
+	char utf8[MAX_PATH * 3];
+	size_t len = 0;
+	if(P >= End || *P++ != '"') {
+		return NULL;
+	}
+	while(P < End && *P != '"' && len < sizeof(utf8)) {
+		char c = *P++;
+		if(c == '\\' && P < End) {
+			c = *P++;
+			if(c == 'u') {
+				if(End - P < 4) {
+					return NULL;
+				}
+				char hex[5] = {P[0], P[1], P[2], P[3], 0};
+				c = (char)strtoul(hex, NULL, 16);
+				P += 4;
+			}
+		}
+		utf8[len++] = c;
+	}
+	if(P >= End || *P != '"') {
+		return NULL;
+	}
+	int wlen = MultiByteToWideChar(CP_UTF8, 0, utf8, (int)len, Buf, (int)BufLen - 1);
+	if(wlen <= 0 && len) {
+		return NULL;
+	}
+	Buf[wlen] = L'\0';
+	return P + 1;
+}
+
+// Parses ","[Name]":" followed by a number at [P].
+const char* ScanParseNumber(const char *P, const char *End, const char *Name, uint64_t *Value)
+{
+	size_t name_len = strlen(Name);
+	if((size_t)(End - P) < name_len + 4 || memcmp(P, ",\"", 2)) {
+		return NULL;
+	}
+	P += 2;
+	if(memcmp(P, Name, name_len) || memcmp(P + name_len, "\":", 2)) {
+		return NULL;
+	}
+	P += name_len + 2;
+	uint64_t v = 0;
+	const char *start = P;
+	while(P < End && *P >= '0' && *P <= '9') {
+		v = v * 10 + (*P++ - '0');
+	}
+	*Value = v;
+	return P != start ? P : NULL;
+}
+
+// Maps the previous catalog and locates the block of every image in it.
+void ScanLoadOld(SCAN *Scan)
+{
+	const char IMAGE_KEY[] = "{\"image\":";
+	LARGE_INTEGER size;
+	wchar_t path[MAX_PATH];
+
+	Scan->OldFile = CreateFileW(
+		Scan->CatalogFN, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL
+	);
+	if(
+		Scan->OldFile == INVALID_HANDLE_VALUE
+		|| !GetFileSizeEx(Scan->OldFile, &size)
+		|| size.QuadPart == 0
+	) {
+		return;
+	}
+	Scan->OldMap = CreateFileMapping(Scan->OldFile, NULL, PAGE_READONLY, 0, 0, NULL);
+	if(Scan->OldMap) {
+		Scan->Old = MapViewOfFile(Scan->OldMap, FILE_MAP_READ, 0, 0, 0);
+	}
+	if(!Scan->Old) {
+		fwprintf(stderr, L"**Warning** Could not read %s, rescanning everything.\n", Scan->CatalogFN);
+		return;
+	}
+	const char *start = (const char*)Scan->Old;
+	const char *end = start + size.QuadPart;
+	SCAN_IMAGE *cur = NULL;
+	for(const char *line = start; line < end; ) {
+		const char *eol = memchr(line, '\n', end - line);
+		eol = eol ? eol + 1 : end;
+		const char *p = line + sizeof(IMAGE_KEY) - 1;
+		uint64_t file_size, mtime;
+		// Only header records are followed by "size".
+		if(
+			(size_t)(eol - line) > sizeof(IMAGE_KEY)
+			&& !memcmp(line, IMAGE_KEY, sizeof(IMAGE_KEY) - 1)
+			&& (p = ScanParseString(p, eol, path, elementsof(path)))
+			&& (p = ScanParseNumber(p, eol, "size", &file_size))
+			&& (p = ScanParseNumber(p, eol, "mtime", &mtime))
+		) {
+			size_t len = wcslen(path);
+			wchar_t *copy = ArenaAlloc(&Scan->Arena, (len + 1) * sizeof(wchar_t));
+			if(
+				!copy
+				|| !ArrayReserve((void**)&Scan->OldImages, &Scan->OldCap, sizeof(SCAN_IMAGE), Scan->OldCount + 1)
+			) {
+				Scan->OutOfMemory = true;
+				return;
+			}
+			memcpy(copy, path, (len + 1) * sizeof(wchar_t));
+			cur = &Scan->OldImages[Scan->OldCount++];
+			ZeroMemory(cur, sizeof(SCAN_IMAGE));
+			cur->Path = copy;
+			cur->Size = file_size;
+			cur->MTime = mtime;
+			cur->Worker = -1;
+			cur->Offset = line - start;
+		}
+		if(cur) {
+			cur->Length = (eol - start) - cur->Offset;
+		}
+		line = eol;
+	}
+	qsort_s(Scan->OldImages, Scan->OldCount, sizeof(SCAN_IMAGE), ScanImageCompare, NULL);
+}
+
+// Reuses the block of [Image] from the previous catalog if the image is
+// unchanged.
+bool ScanReuse(SCAN *Scan, SCAN_IMAGE *Image)
+{
+	const SCAN_IMAGE *old = bsearch_s(
+		Image, Scan->OldImages, Scan->OldCount, sizeof(SCAN_IMAGE), ScanImageCompare, NULL
+	);
+	if(!old || old->Size != Image->Size || old->MTime != Image->MTime) {
+		return false;
+	}
+	Image->Offset = old->Offset;
+	Image->Length = old->Length;
+	return true;
+}
+/// ----------------
+
+/// Scanning
+/// --------
+// Writes the header record and the file listings of [Image] to [Spill].
+// Returns false if it could not be probed.
+bool ScanImage(SCAN_SPILL *Spill, SCAN_IMAGE *Image)
+{
+	CONTAINER image = {0};
+	CATALOG cat = {.Out = Spill->Out, .Format = CATALOG_JSONL, .Image = Image->Path};
+	const char *error = NULL;
+	int partitions = 0;
+
+	OutWrite(Spill->Out, "{\"image\":", 9);
+	OutJSONStringW(Spill->Out, Image->Path, wcslen(Image->Path));
+	OutPrintf(Spill->Out, ",\"size\":%llu,\"mtime\":%llu", Image->Size, Image->MTime);
+	if(ImageOpen(&image, Image->Path)) {
+		error = "could not open image";
+	} else if(!ImageCFormatProbe(&image)) {
+		error = "unknown container format";
+	} else {
+		OutWrite(Spill->Out, ",\"container\":", 13);
+		OutJSONStringW(Spill->Out, image.CFormat->Name, wcslen(image.CFormat->Name));
+		partitions = ImagePTFormatProbe(&image);
+		if(partitions < 0) {
+			error = "unknown partition table format";
+			partitions = 0;
+		} else {
+			OutWrite(Spill->Out, ",\"partitions\":", 14);
+			OutJSONStringW(Spill->Out, image.PTFormat->Name, wcslen(image.PTFormat->Name));
+		}
+	}
+	OutWrite(Spill->Out, ",\"filesystems\":[", 16);
+	bool first = true;
+	for(int i = 0; i < partitions; i++) {
+		FILESYSTEM *fs = &image.Partitions[i];
+		if(ImageFSFormatProbe(fs)) {
+			continue;
+		}
+		uint64_t total, available;
+		const wchar_t *name = fs->FSFormat->Name(fs);
+		fs->FSFormat->DiskSizes(fs, &total, &available);
+		OutPrintf(Spill->Out, "%s{\"part\":%d,\"format\":", first ? "" : ",", i);
+		OutJSONStringW(Spill->Out, name, wcslen(name));
+		OutWrite(Spill->Out, ",\"label\":", 9);
+		OutJSONStringW(Spill->Out, fs->Label, wcsnlen(fs->Label, elementsof(fs->Label)));
+		OutPrintf(Spill->Out, ",\"total\":%llu,\"available\":%llu}", total, available);
+		first = false;
+	}
+	OutWrite(Spill->Out, "]", 1);
+	if(error) {
+		OutPrintf(Spill->Out, ",\"error\":\"%s\"", error);
+	}
+	OutWrite(Spill->Out, "}\n", 2);
+
+	for(int i = 0; i < partitions; i++) {
+		FILESYSTEM *fs = &image.Partitions[i];
+		if(!fs->FSFormat) {
+			continue;
+		}
+		IndexAttach(fs, Image->Path);
+		cat.FS = fs;
+		cat.Part = i;
+		FSWalk(fs, CatalogAddFile, &cat);
+		IndexDetach(fs);
+	}
+	Spill->Files += cat.Records;
+	ImageClose(&image);
+	return error == NULL;
+}
+
+// Returns the next job for worker [Self], stealing one if its own range is
+// exhausted, or (size_t)-1 if there is no work left anywhere.
+size_t ScanNextJob(SCAN *Scan, unsigned int Self)
+{
+	SCAN_DEQUE *own = &Scan->Deques[Self];
+	for(;;) {
+		size_t job = (size_t)-1;
+		AcquireSRWLockExclusive(&own->Lock);
+		if(own->Head < own->Tail) {
+			job = own->Head++;
+		}
+		ReleaseSRWLockExclusive(&own->Lock);
+		if(job != (size_t)-1) {
+			return job;
+		}
+
+		// Steal the back half of the largest remaining range.
+		unsigned int victim = Self;
+		size_t victim_left = 0;
+		for(unsigned int i = 0; i < Scan->Workers; i++) {
+			SCAN_DEQUE *d = &Scan->Deques[i];
+			size_t left = d->Tail - d->Head;
+			if(i != Self && d->Tail > d->Head && left > victim_left) {
+				victim = i;
+				victim_left = left;
+			}
+		}
+		if(victim == Self) {
+			return (size_t)-1;
+		}
+		SCAN_DEQUE *d = &Scan->Deques[victim];
+		size_t head = 0, tail = 0;
+		AcquireSRWLockExclusive(&d->Lock);
+		if(d->Head < d->Tail) {
+			size_t count = (d->Tail - d->Head + 1) / 2;
+			tail = d->Tail;
+			head = tail - count;
+			d->Tail = head;
+		}
+		ReleaseSRWLockExclusive(&d->Lock);
+		AcquireSRWLockExclusive(&own->Lock);
+		own->Head = head;
+		own->Tail = tail;
+		ReleaseSRWLockExclusive(&own->Lock);
+	}
+}
+
+DWORD WINAPI ScanWorker(void *Param)
+{
+	SCAN *scan = (SCAN*)Param;
+	unsigned int self = (unsigned int)InterlockedIncrement(&scan->NextWorker) - 1;
+	if(self >= scan->Workers) {
+		return 0;
+	}
+	SCAN_SPILL *spill = &scan->Spills[self];
+	const LARGE_INTEGER zero = {0};
+	LARGE_INTEGER pos;
+	size_t job;
+	while((job = ScanNextJob(scan, self)) != (size_t)-1) {
+		SCAN_IMAGE *image = &scan->Images[scan->Jobs[job]];
+		// The buffer is flushed after every image, so the file pointer is
+		// where the next block starts.
+		image->Worker = (int)self;
+		image->Offset = spill->Written;
+		image->Failed = !ScanImage(spill, image);
+		OutFlush(spill->Out);
+		if(SetFilePointerEx(spill->File, zero, &pos, FILE_CURRENT)) {
+			spill->Written = pos.QuadPart;
+		}
+		image->Length = spill->Written - image->Offset;
+	}
+	return 0;
+}
+
+int ScanOpenSpills(SCAN *Scan)
+{
+	int ret = 0;
+	wchar_t fn[MAX_PATH];
+	for(unsigned int i = 0; i < Scan->Workers; i++) {
+		SCAN_SPILL *spill = &Scan->Spills[i];
+		if(swprintf_s(fn, elementsof(fn), L"%s.%u.tmp", Scan->CatalogFN, i) <= 0) {
+			fwprintf(stderr, L"**Error** Catalog file name too long: %s\n", Scan->CatalogFN);
+			return -1;
+		}
+		spill->File = CreateFileW(
+			fn, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+			FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL
+		);
+		W32_ERR_REPORT(spill->File == INVALID_HANDLE_VALUE,
+			-2, L"Error creating %s", fn
+		);
+		spill->Out = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(OUTBUF));
+		if(!spill->Out) {
+			return ERROR_OUTOFMEMORY;
+		}
+		spill->Out->Handle = spill->File;
+	}
+end:
+	return ret;
+}
+
+// Writes the new catalog from the spill files and the previous catalog.
+int ScanAssemble(SCAN *Scan)
+{
+	int ret = 0;
+	wchar_t temp_fn[MAX_PATH];
+	OUTBUF *out = NULL;
+	HANDLE file = INVALID_HANDLE_VALUE;
+
+	for(unsigned int i = 0; i < Scan->Workers; i++) {
+		SCAN_SPILL *spill = &Scan->Spills[i];
+		if(spill->Out->Failed) {
+			fwprintf(stderr, L"**Error** Could not write the temporary catalog files.\n");
+			return -3;
+		}
+		if(spill->Written == 0) {
+			continue;
+		}
+		spill->Map = CreateFileMapping(spill->File, NULL, PAGE_READONLY, 0, 0, NULL);
+		if(spill->Map) {
+			spill->Memory = MapViewOfFile(spill->Map, FILE_MAP_READ, 0, 0, 0);
+		}
+		if(!spill->Memory) {
+			return ReportError(-3, GetLastError(), L"Error reading the temporary catalog files");
+		}
+	}
+	if(swprintf_s(temp_fn, elementsof(temp_fn), L"%s.tmp", Scan->CatalogFN) <= 0) {
+		fwprintf(stderr, L"**Error** Catalog file name too long: %s\n", Scan->CatalogFN);
+		return -1;
+	}
+	out = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(OUTBUF));
+	if(!out) {
+		return ERROR_OUTOFMEMORY;
+	}
+	file = CreateFileW(
+		temp_fn, GENERIC_WRITE, 0, NULL,
+		CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL
+	);
+	W32_ERR_REPORT(file == INVALID_HANDLE_VALUE,
+		-2, L"Error creating %s", temp_fn
+	);
+	out->Handle = file;
+	for(size_t i = 0; i < Scan->ImageCount; i++) {
+		const SCAN_IMAGE *image = &Scan->Images[i];
+		const uint8_t *src = (image->Worker < 0)
+			? Scan->Old
+			: Scan->Spills[image->Worker].Memory;
+		if(src && image->Length) {
+			OutWrite(out, (const char*)src + image->Offset, (size_t)image->Length);
+		}
+	}
+	OutFlush(out);
+	W32_ERR_REPORT(out->Failed,
+		-3, L"Error writing %s", temp_fn
+	);
+	CloseHandle(file);
+	file = INVALID_HANDLE_VALUE;
+
+	// The previous catalog has to be closed before we can replace it.
+	if(Scan->Old) {
+		UnmapViewOfFile(Scan->Old);
+		Scan->Old = NULL;
+	}
+	if(Scan->OldMap) {
+		CloseHandle(Scan->OldMap);
+		Scan->OldMap = NULL;
+	}
+	if(Scan->OldFile != INVALID_HANDLE_VALUE) {
+		CloseHandle(Scan->OldFile);
+		Scan->OldFile = INVALID_HANDLE_VALUE;
+	}
+	W32_ERR_REPORT(!MoveFileExW(temp_fn, Scan->CatalogFN, MOVEFILE_REPLACE_EXISTING),
+		-4, L"Error replacing %s", Scan->CatalogFN
+	);
+end:
+	if(file != INVALID_HANDLE_VALUE) {
+		CloseHandle(file);
+		DeleteFileW(temp_fn);
+	}
+	HeapFree(GetProcessHeap(), 0, out);
+	return ret;
+}
+
+void ScanFree(SCAN *Scan)
+{
+	for(unsigned int i = 0; i < Scan->Workers; i++) {
+		SCAN_SPILL *spill = &Scan->Spills[i];
+		if(spill->Memory) {
+			UnmapViewOfFile(spill->Memory);
+		}
+		if(spill->Map) {
+			CloseHandle(spill->Map);
+		}
+		if(spill->File && spill->File != INVALID_HANDLE_VALUE) {
+			CloseHandle(spill->File);
+		}
+		HeapFree(GetProcessHeap(), 0, spill->Out);
+	}
+	if(Scan->Old) {
+		UnmapViewOfFile(Scan->Old);
+	}
+	if(Scan->OldMap) {
+		CloseHandle(Scan->OldMap);
+	}
+	if(Scan->OldFile && Scan->OldFile != INVALID_HANDLE_VALUE) {
+		CloseHandle(Scan->OldFile);
+	}
+	HeapFree(GetProcessHeap(), 0, Scan->Images);
+	HeapFree(GetProcessHeap(), 0, Scan->OldImages);
+	HeapFree(GetProcessHeap(), 0, Scan->Jobs);
+	ArenaFree(&Scan->Arena);
+}
+
+// Catalogs all images below [Dir] into [CatalogFN], scanning them on
+// [Threads] worker threads, and only rescanning images whose size or
+// modification time differ from the existing catalog.
+int Scan(const wchar_t *CatalogFN, const wchar_t *Dir, unsigned int Threads)
+{
+	int ret = 0;
+	SCAN *scan = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(SCAN));
+	if(!scan) {
+		return ERROR_OUTOFMEMORY;
+	}
+	double start = TimeSeconds();
+	scan->CatalogFN = CatalogFN;
+	scan->OldFile = INVALID_HANDLE_VALUE;
+	scan->Workers = min(max(Threads ? Threads : ProcessorCount(), 1), WORKERS_MAX);
+
+	ScanCollect(scan, Dir);
+	ScanLoadOld(scan);
+	if(scan->OutOfMemory) {
+		fwprintf(stderr, L"**Error** Out of memory while collecting images.\n");
+		ret = ERROR_OUTOFMEMORY;
+		goto end;
+	}
+	qsort_s(scan->Images, scan->ImageCount, sizeof(SCAN_IMAGE), ScanImageCompare, NULL);
+	scan->Jobs = HeapAlloc(GetProcessHeap(), 0, (scan->ImageCount + 1) * sizeof(size_t));
+	if(!scan->Jobs) {
+		ret = ERROR_OUTOFMEMORY;
+		goto end;
+	}
+	for(size_t i = 0; i < scan->ImageCount; i++) {
+		if(!ScanReuse(scan, &scan->Images[i])) {
+			scan->Jobs[scan->JobCount++] = i;
+		}
+	}
+
+	// Neighboring images tend to be similar in size, so contiguous ranges
+	// are a good starting point before any stealing happens.
+	for(unsigned int i = 0; i < scan->Workers; i++) {
+		InitializeSRWLock(&scan->Deques[i].Lock);
+		scan->Deques[i].Head = scan->JobCount * i / scan->Workers;
+		scan->Deques[i].Tail = scan->JobCount * (i + 1) / scan->Workers;
+	}
+	ret = ScanOpenSpills(scan);
+	if(ret) {
+		goto end;
+	}
+	// The ranges of workers that couldn't be started are stolen by the
+	// others.
+	WorkersRun(scan->Workers, ScanWorker, scan);
+	ret = ScanAssemble(scan);
+
+	size_t failed = 0;
+	uint64_t files = 0;
+	for(size_t i = 0; i < scan->ImageCount; i++) {
+		failed += scan->Images[i].Failed;
+	}
+	for(unsigned int i = 0; i < scan->Workers; i++) {
+		files += scan->Spills[i].Files;
+	}
+	fwprintf(stderr,
+		L"Cataloged %Iu images (%Iu unchanged, %Iu unreadable) with %llu new file records in %.3f s.\n",
+		scan->ImageCount, scan->ImageCount - scan->JobCount, failed, files,
+		TimeSeconds() - start
+	);
+end:
+	ScanFree(scan);
+	HeapFree(GetProcessHeap(), 0, scan);
+	return ret;
+}
+
+extern const COMMAND CMD_Scan;
+
+int CMD_Scan_Main(int argc, const wchar_t *argv[])
+{
+	unsigned int threads = 0;
+	int arg = WorkersArg(argc, argv, &threads);
+	if(argc - arg < 2) {
+		fwprintf(stderr, L"Usage: dimount %s %s\n", CMD_Scan.Name, CMD_Scan.Usage);
+		return -1;
+	}
+	return Scan(argv[arg], argv[arg + 1], threads);
+}
+
+NEW_COMMAND(Scan, L"scan", L"[-j threads] catalogfile dir", 2);
+/// --------
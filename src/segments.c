@@ -0,0 +1,198 @@
+/*
+ * Dokan Image Mounter
+ *
+ * Images split into numbered segment files (.001, .002, ...).
+ */
+
+// Upper limit for the number of segments, given by the three-digit
+// extensions used by every common splitting tool.
+#define SEGMENTS_MAX 999
+
+typedef struct {
+	HANDLE File;
+	// Byte offset of the segment within the whole image
+	uint64_t Start;
+	uint64_t Size;
+} SEGMENT;
+
+typedef struct {
+	BLOCK_SOURCE Source;
+	SEGMENT *Segments;
+	size_t SegmentCap;
+	size_t SegmentCount;
+} SEGMENT_IMAGE;
+
+// Returns the position of the segment number in [FN], or NULL if [FN] doesn't
+// end in a numeric extension of at least three digits.
+const wchar_t* SegmentNumber(const wchar_t *FN)
+{
+	const wchar_t *ext = wcsrchr(FN, L'.');
+	if(!ext || wcslen(ext + 1) < 3) {
+		return NULL;
+	}
+	for(const wchar_t *p = ext + 1; *p; p++) {
+		if(*p < L'0' || *p > L'9') {
+			return NULL;
+		}
+	}
+	return ext + 1;
+}
+
+// Returns whether [FN] is the first file of a segment set.
+bool SegmentIsFirst(const wchar_t *FN)
+{
+	const wchar_t *num = SegmentNumber(FN);
+	return num && wcstoul(num, NULL, 10) == 1;
+}
+
+// Returns the index of the segment that contains [Offset].
+size_t SegmentFind(const SEGMENT_IMAGE *SI, uint64_t Offset)
+{
+	size_t lo = 0;
+	size_t hi = SI->SegmentCount;
+	while(hi - lo > 1) {
+		size_t mid = lo + (hi - lo) / 2;
+		if(SI->Segments[mid].Start <= Offset) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+bool SegmentImageRead(BLOCK_SOURCE *Source, uint64_t Offset, uint8_t *Buf, size_t Size)
+{
+	SEGMENT_IMAGE *si = (SEGMENT_IMAGE*)Source;
+	// Reads that cross a boundary continue in the next segment.
+	for(size_t i = SegmentFind(si, Offset); Size && i < si->SegmentCount; i++) {
+		const SEGMENT *seg = &si->Segments[i];
+		uint64_t in_seg = Offset - seg->Start;
+		if(in_seg >= seg->Size) {
+			continue;
+		}
+		DWORD len = (DWORD)min(Size, seg->Size - in_seg);
+		DWORD read = 0;
+		OVERLAPPED ov = {
+			.Offset = (DWORD)in_seg,
+			.OffsetHigh = (DWORD)(in_seg >> 32),
+		};
+		if(!ReadFile(seg->File, Buf, len, &read, &ov) || read != len) {
+			return false;
+		}
+		Buf += len;
+		Offset += len;
+		Size -= len;
+	}
+	return Size == 0;
+}
+
+// There's nothing to overlap, but the requests still arrive coalesced.
+void SegmentImageReadBatch(BLOCK_SOURCE *Source, BLOCK_REQUEST *Requests, size_t Count)
+{
+	for(size_t i = 0; i < Count; i++) {
+		BLOCK_REQUEST *req = &Requests[i];
+		req->OK = SegmentImageRead(Source, req->Offset, req->Buf, req->Size);
+	}
+}
+
+void SegmentImageFree(BLOCK_SOURCE *Source)
+{
+	SEGMENT_IMAGE *si = (SEGMENT_IMAGE*)Source;
+	for(size_t i = 0; i < si->SegmentCount; i++) {
+		CloseHandle(si->Segments[i].File);
+	}
+	HeapFree(GetProcessHeap(), 0, si->Segments);
+	HeapFree(GetProcessHeap(), 0, si);
+}
+
+// Opens the segment set starting with [FN], and presents the concatenation
+// of all its segments in [Image]. Returns 0 on success, or the negative exit
+// code of dimount on failure.
+int SegmentImageOpen(CONTAINER *Image, const wchar_t *FN)
+{
+	int ret = 0;
+	wchar_t fn[MAX_PATH];
+	uint64_t size = 0;
+	ULARGE_INTEGER mtime = {0};
+	const wchar_t *num = SegmentNumber(FN);
+	size_t num_pos = num - FN;
+	int num_width = (int)wcslen(num);
+
+	SEGMENT_IMAGE *si = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(SEGMENT_IMAGE));
+	if(!si) {
+		goto oom;
+	}
+	wcscpy_s(fn, elementsof(fn), FN);
+	for(unsigned int n = 1; n <= SEGMENTS_MAX; n++) {
+		if(swprintf_s(
+			fn + num_pos, elementsof(fn) - num_pos, L"%0*u", num_width, n
+		) <= 0) {
+			break;
+		}
+		HANDLE file = CreateFileW(
+			fn, GENERIC_READ, FILE_SHARE_READ, NULL,
+			OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, NULL
+		);
+		if(file == INVALID_HANDLE_VALUE) {
+			if(n == 1) {
+				ret = ReportError(-2, GetLastError(), L"Error opening %s", fn);
+				goto end;
+			}
+			// End of the set.
+			break;
+		}
+		if(!ArrayReserve(
+			(void**)&si->Segments, &si->SegmentCap, sizeof(SEGMENT), si->SegmentCount + 1
+		)) {
+			CloseHandle(file);
+			goto oom;
+		}
+		SEGMENT *seg = &si->Segments[si->SegmentCount++];
+		LARGE_INTEGER seg_size;
+		FILETIME seg_mtime;
+		seg->File = file;
+		W32_ERR_REPORT(!GetFileSizeEx(file, &seg_size),
+			-3, L"Error retrieving the file size of %s", fn
+		);
+		seg->Start = size;
+		seg->Size = seg_size.QuadPart;
+		size += seg->Size;
+		// The image counts as modified whenever any of its segments was.
+		if(GetFileTime(file, NULL, NULL, &seg_mtime)) {
+			ULARGE_INTEGER t = {
+				.LowPart = seg_mtime.dwLowDateTime,
+				.HighPart = seg_mtime.dwHighDateTime,
+			};
+			mtime.QuadPart = max(mtime.QuadPart, t.QuadPart);
+		}
+	}
+	if(size == 0) {
+		fwprintf(stderr, L"Not mounting an empty file.\n");
+		ret = -4;
+		goto end;
+	}
+	si->Source.Read = SegmentImageRead;
+	si->Source.ReadBatch = SegmentImageReadBatch;
+	si->Source.Free = SegmentImageFree;
+	DWORD err = BlockSourceOpen(&si->Source, size, FN);
+	if(err) {
+		ret = ReportError(-6, err, L"Error mapping %s into memory", FN);
+		goto end;
+	}
+	Image->Source = &si->Source;
+	Image->FileView = si->Source.View;
+	Image->View = Image->FileView;
+	Image->MTime.dwLowDateTime = mtime.LowPart;
+	Image->MTime.dwHighDateTime = mtime.HighPart;
+	si = NULL;
+	goto end;
+oom:
+	fwprintf(stderr, L"**Error** Out of memory while opening %s.\n", FN);
+	ret = -5;
+end:
+	if(si) {
+		SegmentImageFree(&si->Source);
+	}
+	return ret;
+}
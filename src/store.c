@@ -0,0 +1,944 @@
+/*
+ * Dokan Image Mounter
+ *
+ * Content-addressed, deduplicating store for image collections.
+ */
+
+// A store is a directory that contains
+// • chunks.dat, the data of every unique chunk, appended in the order they
+//   were first ingested,
+// • chunks.idx, one STORE_CHUNK record for every chunk in chunks.dat, in the
+//   same order,
+// • and one recipe per image, listing the runs of chunks it consists of.
+//
+// Chunks are cut at the cluster boundaries of the image's file system, so
+// that the same file data deduplicates regardless of where the partition
+// starts within each image. Everything before the data area is cut into
+// chunks of the same size, starting at the beginning of the image.
+#define STORE_CHUNKS_FN L"chunks.dat"
+#define STORE_INDEX_FN L"chunks.idx"
+#define STORE_RECIPE_EXT L".dimrcp"
+#define STORE_RECIPE_MAGIC "DIMRCP\x1a\x01"
+
+// Chunk size for images without a supported file system, and upper limit
+// for file systems with larger clusters.
+#define STORE_CHUNK_DEFAULT 0x1000
+#define STORE_CHUNK_MIN 0x200
+#define STORE_CHUNK_MAX 0x10000
+
+// Chunks are looked up by two 64-bit hashes with different seeds. Those
+// aren't collision-resistant, so a stored chunk is only reused after its
+// bytes were compared with the new one.
+#define STORE_SEED_A 0
+#define STORE_SEED_B 0x53544F5245ULL
+
+// Number of chunks a hashing worker takes from the queue at once.
+#define STORE_HASH_BATCH 1024
+
+typedef struct {
+	uint64_t Hash[2];
+	uint64_t Offset; // into chunks.dat
+	uint32_t Length;
+	uint32_t Reserved;
+} STORE_CHUNK;
+
+typedef struct {
+	char Magic[8];
+	uint32_t HeaderSize;
+	// StoreSourceID() of the ingested image, or 0 if unknown
+	uint32_t Source;
+	uint64_t ImageSize;
+	uint64_t ImageMTime;
+	uint64_t RunCount;
+} STORE_RECIPE_HEADER;
+
+// Consecutive chunks of an image that are also stored consecutively in
+// chunks.dat are merged into a single run.
+typedef struct {
+	uint64_t ImageOffset;
+	uint64_t ChunkOffset;
+	uint64_t Length;
+} STORE_RUN;
+
+bool StoreIsRecipe(const wchar_t *FN)
+{
+	size_t len = wcslen(FN);
+	size_t ext_len = elementsof(STORE_RECIPE_EXT) - 1;
+	return len > ext_len && !_wcsicmp(FN + len - ext_len, STORE_RECIPE_EXT);
+}
+
+/// Ingestion
+/// ---------
+typedef struct {
+	const wchar_t *Dir;
+	HANDLE ChunksFile;
+	HANDLE IndexFile;
+	OUTBUF *Chunks;
+	OUTBUF *Index;
+	// Current end of chunks.dat, including data still in [Chunks].
+	uint64_t ChunksSize;
+	// End of the data that already went through [ChunksFile].
+	uint64_t ChunksWritten;
+	// Second handle of chunks.dat, which doesn't move the file pointer of
+	// [ChunksFile], and a buffer for reading back chunks to compare.
+	HANDLE ChunksRead;
+	uint8_t *Compare;
+
+	STORE_CHUNK *Records;
+	size_t RecordCount;
+	size_t RecordCap;
+	// Open-addressed hash table of [Records] indices + 1, 0 marks free slots.
+	size_t *Table;
+	size_t TableSize;
+
+	// Statistics
+	uint64_t BytesIngested;
+	uint64_t BytesNew;
+	uint64_t Collisions;
+} STORE_WRITER;
+
+typedef struct {
+	const uint8_t *Data;
+	uint64_t Size;
+	// Start of the file system's data area, and its chunk size
+	uint64_t DataStart;
+	uint32_t ChunkSize;
+	size_t HeadChunks; // before [DataStart]
+	size_t ChunkCount;
+	uint64_t(*Hashes)[2];
+	volatile LONG NextBatch;
+} STORE_INGEST;
+
+// Returns the length of chunk [Chunk] of [In], and its offset in [Offset].
+uint32_t StoreChunkAt(const STORE_INGEST *In, size_t Chunk, uint64_t *Offset)
+{
+	uint64_t end;
+	if(Chunk < In->HeadChunks) {
+		*Offset = (uint64_t)Chunk * In->ChunkSize;
+		end = In->DataStart;
+	} else {
+		*Offset = In->DataStart + (uint64_t)(Chunk - In->HeadChunks) * In->ChunkSize;
+		end = In->Size;
+	}
+	return (uint32_t)min(In->ChunkSize, end - *Offset);
+}
+
+DWORD WINAPI StoreHashWorker(void *Param)
+{
+	STORE_INGEST *in = (STORE_INGEST*)Param;
+	size_t first;
+	while((first = (size_t)(InterlockedIncrement(&in->NextBatch) - 1) * STORE_HASH_BATCH) < in->ChunkCount) {
+		size_t last = min(first + STORE_HASH_BATCH, in->ChunkCount);
+		for(size_t i = first; i < last; i++) {
+			uint64_t offset;
+			uint32_t len = StoreChunkAt(in, i, &offset);
+			in->Hashes[i][0] = Hash64(in->Data + offset, len, STORE_SEED_A);
+			in->Hashes[i][1] = Hash64(in->Data + offset, len, STORE_SEED_B);
+		}
+	}
+	return 0;
+}
+
+// Aligns the chunks of [In] to the clusters of [FS], if we know its layout.
+void StoreAlign(STORE_INGEST *In, FILESYSTEM *FS)
+{
+	const uint8_t *data = NULL;
+	uint32_t cluster_size = 0;
+	if(FS->FSFormat == &FS_FAT) {
+		FAT_INFO *fi = FS->FSData;
+		data = fi->Data.Memory;
+		cluster_size = fi->ClusterSize;
+	} else if(FS->FSFormat == &FS_EXFAT) {
+		EXFAT_INFO *ei = FS->FSData;
+		data = ei->Heap.Memory;
+		cluster_size = ei->ClusterSize;
+	}
+	if(!data) {
+		return;
+	}
+	In->DataStart = data - In->Data;
+	In->ChunkSize = min(max(cluster_size, STORE_CHUNK_MIN), STORE_CHUNK_MAX);
+}
+
+size_t StoreTableSlot(const STORE_WRITER *W, const uint64_t Hash[2])
+{
+	return (size_t)Hash[0] & (W->TableSize - 1);
+}
+
+// Returns whether the stored chunk [C] holds the same bytes as [Data]. A
+// chunk that can't be read back counts as different, which only costs space.
+bool StoreChunkEquals(STORE_WRITER *W, const STORE_CHUNK *C, const uint8_t *Data)
+{
+	DWORD read = 0;
+	OVERLAPPED ov = {
+		.Offset = (DWORD)C->Offset,
+		.OffsetHigh = (DWORD)(C->Offset >> 32),
+	};
+	if(C->Offset + C->Length > W->ChunksWritten) {
+		OutFlush(W->Chunks);
+		W->ChunksWritten = W->ChunksSize;
+	}
+	return (
+		ReadFile(W->ChunksRead, W->Compare, C->Length, &read, &ov)
+		&& read == C->Length
+		&& !memcmp(W->Compare, Data, C->Length)
+	);
+}
+
+// Returns the index of the chunk with [Hash], [Length] and the contents of
+// [Data] in [W]->Records, or -1 if there is none.
+size_t StoreLookup(STORE_WRITER *W, const uint64_t Hash[2], const uint8_t *Data, uint32_t Length)
+{
+	for(size_t slot = StoreTableSlot(W, Hash); W->Table[slot]; slot = (slot + 1) & (W->TableSize - 1)) {
+		const STORE_CHUNK *c = &W->Records[W->Table[slot] - 1];
+		if(c->Hash[0] != Hash[0] || c->Hash[1] != Hash[1] || c->Length != Length) {
+			continue;
+		}
+		if(StoreChunkEquals(W, c, Data)) {
+			return W->Table[slot] - 1;
+		}
+		// Keeps looking, since an earlier collision might have stored the
+		// chunk under the same hashes after this one.
+		W->Collisions++;
+	}
+	return (size_t)-1;
+}
+
+// Makes room in the hash table for one more record, keeping the load factor
+// below 1/2.
+bool StoreTableReserve(STORE_WRITER *W)
+{
+	if((W->RecordCount + 1) * 2 <= W->TableSize) {
+		return true;
+	}
+	size_t new_size = max(W->TableSize * 2, 0x10000);
+	size_t *table = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, new_size * sizeof(size_t));
+	if(!table) {
+		return false;
+	}
+	HeapFree(GetProcessHeap(), 0, W->Table);
+	W->Table = table;
+	W->TableSize = new_size;
+	for(size_t i = 0; i < W->RecordCount; i++) {
+		size_t slot = StoreTableSlot(W, W->Records[i].Hash);
+		while(W->Table[slot]) {
+			slot = (slot + 1) & (new_size - 1);
+		}
+		W->Table[slot] = i + 1;
+	}
+	return true;
+}
+
+// Returns the offset of the chunk with the given contents in chunks.dat,
+// appending it if it's new, or -1 if we're out of memory.
+uint64_t StoreAddChunk(STORE_WRITER *W, const uint64_t Hash[2], const uint8_t *Data, uint32_t Length)
+{
+	size_t i = StoreLookup(W, Hash, Data, Length);
+	W->BytesIngested += Length;
+	if(i != (size_t)-1) {
+		return W->Records[i].Offset;
+	}
+	if(
+		!StoreTableReserve(W)
+		|| !ArrayReserve((void**)&W->Records, &W->RecordCap, sizeof(STORE_CHUNK), W->RecordCount + 1)
+	) {
+		return (uint64_t)-1;
+	}
+	STORE_CHUNK *c = &W->Records[W->RecordCount++];
+	c->Hash[0] = Hash[0];
+	c->Hash[1] = Hash[1];
+	c->Offset = W->ChunksSize;
+	c->Length = Length;
+	c->Reserved = 0;
+	size_t slot = StoreTableSlot(W, Hash);
+	while(W->Table[slot]) {
+		slot = (slot + 1) & (W->TableSize - 1);
+	}
+	W->Table[slot] = W->RecordCount;
+	OutWrite(W->Chunks, (const char*)Data, Length);
+	OutWrite(W->Index, (const char*)c, sizeof(STORE_CHUNK));
+	W->ChunksSize += Length;
+	W->BytesNew += Length;
+	return c->Offset;
+}
+
+bool StoreFileName(wchar_t *Buf, size_t BufLen, const wchar_t *Dir, const wchar_t *FN)
+{
+	return swprintf_s(Buf, BufLen, L"%s\\%s", Dir, FN) > 0;
+}
+
+// Loads the chunk index of the store, dropping any records whose data never
+// made it into chunks.dat.
+int StoreLoadIndex(STORE_WRITER *W)
+{
+	int ret = 0;
+	LARGE_INTEGER size;
+	LARGE_INTEGER valid_end;
+	DWORD read;
+
+	W32_ERR_REPORT(!GetFileSizeEx(W->IndexFile, &size),
+		-3, L"Error retrieving the size of %s", STORE_INDEX_FN
+	);
+	size_t count = (size_t)(size.QuadPart / sizeof(STORE_CHUNK));
+	if(!ArrayReserve((void**)&W->Records, &W->RecordCap, sizeof(STORE_CHUNK), count)) {
+		return ERROR_OUTOFMEMORY;
+	}
+	uint8_t *p = (uint8_t*)W->Records;
+	uint64_t remaining = (uint64_t)count * sizeof(STORE_CHUNK);
+	while(remaining) {
+		DWORD chunk = (DWORD)min(remaining, 0x1000000);
+		W32_ERR_REPORT(!ReadFile(W->IndexFile, p, chunk, &read, NULL) || read != chunk,
+			-4, L"Error reading %s", STORE_INDEX_FN
+		);
+		p += chunk;
+		remaining -= chunk;
+	}
+	while(
+		W->RecordCount < count
+		&& W->Records[W->RecordCount].Offset + W->Records[W->RecordCount].Length <= W->ChunksSize
+	) {
+		W->RecordCount++;
+	}
+	if(W->RecordCount != count || size.QuadPart % sizeof(STORE_CHUNK)) {
+		fwprintf(stderr,
+			L"**Warning** Dropping incomplete chunk records from %s.\n", STORE_INDEX_FN
+		);
+	}
+	valid_end.QuadPart = W->RecordCount * sizeof(STORE_CHUNK);
+	W32_ERR_REPORT(
+		!SetFilePointerEx(W->IndexFile, valid_end, NULL, FILE_BEGIN)
+		|| !SetEndOfFile(W->IndexFile),
+		-5, L"Error truncating %s", STORE_INDEX_FN
+	);
+	size_t records = W->RecordCount;
+	W->RecordCount = 0;
+	for(size_t i = 0; i < records; i++) {
+		if(!StoreTableReserve(W)) {
+			return ERROR_OUTOFMEMORY;
+		}
+		size_t slot = StoreTableSlot(W, W->Records[i].Hash);
+		while(W->Table[slot]) {
+			slot = (slot + 1) & (W->TableSize - 1);
+		}
+		W->Table[slot] = ++W->RecordCount;
+	}
+	if(!StoreTableReserve(W)) {
+		return ERROR_OUTOFMEMORY;
+	}
+end:
+	return ret;
+}
+
+int StoreWriterOpen(STORE_WRITER *W, const wchar_t *Dir)
+{
+	int ret = 0;
+	wchar_t fn[MAX_PATH];
+	LARGE_INTEGER size;
+
+	ZeroMemory(W, sizeof(STORE_WRITER));
+	W->Dir = Dir;
+	W->ChunksFile = INVALID_HANDLE_VALUE;
+	W->ChunksRead = INVALID_HANDLE_VALUE;
+	W->IndexFile = INVALID_HANDLE_VALUE;
+	if(!CreateDirectoryW(Dir, NULL) && GetLastError() != ERROR_ALREADY_EXISTS) {
+		return ReportError(-2, GetLastError(), L"Error creating %s", Dir);
+	}
+	// Only one process may ingest into a store at a time, but images can
+	// still be mounted from it in the meantime.
+	W32_ERR_REPORT(!StoreFileName(fn, elementsof(fn), Dir, STORE_CHUNKS_FN),
+		-2, L"Error opening %s", Dir
+	);
+	W->ChunksFile = CreateFileW(
+		fn, GENERIC_WRITE, FILE_SHARE_READ, NULL,
+		OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL
+	);
+	W32_ERR_REPORT(W->ChunksFile == INVALID_HANDLE_VALUE,
+		-2, L"Error opening %s", fn
+	);
+	W32_ERR_REPORT(!GetFileSizeEx(W->ChunksFile, &size),
+		-3, L"Error retrieving the size of %s", fn
+	);
+	W->ChunksSize = size.QuadPart;
+	W->ChunksWritten = size.QuadPart;
+	size.QuadPart = 0;
+	W32_ERR_REPORT(!SetFilePointerEx(W->ChunksFile, size, NULL, FILE_END),
+		-3, L"Error seeking in %s", fn
+	);
+	W->ChunksRead = CreateFileW(
+		fn, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, NULL
+	);
+	W32_ERR_REPORT(W->ChunksRead == INVALID_HANDLE_VALUE,
+		-2, L"Error opening %s", fn
+	);
+	W32_ERR_REPORT(!StoreFileName(fn, elementsof(fn), Dir, STORE_INDEX_FN),
+		-2, L"Error opening %s", Dir
+	);
+	W->IndexFile = CreateFileW(
+		fn, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+		OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL
+	);
+	W32_ERR_REPORT(W->IndexFile == INVALID_HANDLE_VALUE,
+		-2, L"Error opening %s", fn
+	);
+	W->Chunks = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(OUTBUF));
+	W->Index = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(OUTBUF));
+	W->Compare = HeapAlloc(GetProcessHeap(), 0, STORE_CHUNK_MAX);
+	if(!W->Chunks || !W->Index || !W->Compare) {
+		return ERROR_OUTOFMEMORY;
+	}
+	W->Chunks->Handle = W->ChunksFile;
+	W->Index->Handle = W->IndexFile;
+	ret = StoreLoadIndex(W);
+end:
+	return ret;
+}
+
+// Writes everything written so far through to the disk. Returns false if
+// any write failed.
+bool StoreWriterFlush(STORE_WRITER *W)
+{
+	// Data before records, so that a crash leaves no record without data.
+	OutFlush(W->Chunks);
+	if(W->Chunks->Failed || !FlushFileBuffers(W->ChunksFile)) {
+		return false;
+	}
+	OutFlush(W->Index);
+	return !W->Index->Failed && FlushFileBuffers(W->IndexFile);
+}
+
+void StoreWriterClose(STORE_WRITER *W)
+{
+	if(W->Chunks && W->Index) {
+		StoreWriterFlush(W);
+	}
+	if(W->ChunksFile != INVALID_HANDLE_VALUE) {
+		CloseHandle(W->ChunksFile);
+	}
+	if(W->ChunksRead != INVALID_HANDLE_VALUE) {
+		CloseHandle(W->ChunksRead);
+	}
+	if(W->IndexFile != INVALID_HANDLE_VALUE) {
+		CloseHandle(W->IndexFile);
+	}
+	HeapFree(GetProcessHeap(), 0, W->Chunks);
+	HeapFree(GetProcessHeap(), 0, W->Index);
+	HeapFree(GetProcessHeap(), 0, W->Compare);
+	HeapFree(GetProcessHeap(), 0, W->Records);
+	HeapFree(GetProcessHeap(), 0, W->Table);
+	ZeroMemory(W, sizeof(STORE_WRITER));
+}
+
+int StoreWriteRecipe(const wchar_t *FN, const STORE_RECIPE_HEADER *Header, const STORE_RUN *Runs)
+{
+	int ret = 0;
+	wchar_t temp_fn[MAX_PATH];
+	DWORD written;
+	HANDLE file = INVALID_HANDLE_VALUE;
+	uint64_t runs_size = Header->RunCount * sizeof(STORE_RUN);
+
+	if(swprintf_s(temp_fn, elementsof(temp_fn), L"%s.tmp", FN) <= 0) {
+		fwprintf(stderr, L"**Error** Recipe file name too long: %s\n", FN);
+		return -1;
+	}
+	file = CreateFileW(
+		temp_fn, GENERIC_WRITE, 0, NULL,
+		CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL
+	);
+	W32_ERR_REPORT(file == INVALID_HANDLE_VALUE,
+		-2, L"Error creating %s", temp_fn
+	);
+	W32_ERR_REPORT(!WriteFile(file, Header, sizeof(*Header), &written, NULL),
+		-3, L"Error writing %s", temp_fn
+	);
+	for(const uint8_t *p = (const uint8_t*)Runs; runs_size; ) {
+		DWORD chunk = (DWORD)min(runs_size, 0x1000000);
+		W32_ERR_REPORT(!WriteFile(file, p, chunk, &written, NULL),
+			-3, L"Error writing %s", temp_fn
+		);
+		p += chunk;
+		runs_size -= chunk;
+	}
+	// Otherwise, the rename could reach the disk before the recipe does.
+	W32_ERR_REPORT(!FlushFileBuffers(file),
+		-3, L"Error writing %s", temp_fn
+	);
+	CloseHandle(file);
+	file = INVALID_HANDLE_VALUE;
+	W32_ERR_REPORT(!MoveFileExW(temp_fn, FN, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH),
+		-4, L"Error replacing %s", FN
+	);
+end:
+	if(file != INVALID_HANDLE_VALUE) {
+		CloseHandle(file);
+		DeleteFileW(temp_fn);
+	}
+	return ret;
+}
+
+// Identifies the image file [FN] by its full path, so that images with the
+// same name in different directories don't replace each other's recipes.
+// Never 0.
+uint32_t StoreSourceID(const wchar_t *FN)
+{
+	wchar_t full[MAX_PATH];
+	wchar_t folded[MAX_PATH];
+	DWORD len = GetFullPathNameW(FN, elementsof(full), full, NULL);
+	if(len == 0 || len >= elementsof(full)) {
+		return 1;
+	}
+	int folded_len = LCMapStringEx(
+		LOCALE_NAME_INVARIANT, LCMAP_UPPERCASE,
+		full, (int)len, folded, elementsof(folded), NULL, NULL, 0
+	);
+	if(folded_len <= 0) {
+		return 1;
+	}
+	return (uint32_t)Hash64(folded, folded_len * sizeof(wchar_t), 0) | 1;
+}
+
+// Returns the source ID stored in the existing recipe [FN], or 0 if there is
+// no valid recipe.
+uint32_t StoreRecipeSource(const wchar_t *FN)
+{
+	STORE_RECIPE_HEADER header;
+	DWORD read = 0;
+	HANDLE file = CreateFileW(
+		FN, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL
+	);
+	if(file == INVALID_HANDLE_VALUE) {
+		return 0;
+	}
+	bool valid = (
+		ReadFile(file, &header, sizeof(header), &read, NULL)
+		&& read == sizeof(header)
+		&& !memcmp(header.Magic, STORE_RECIPE_MAGIC, sizeof(header.Magic))
+		&& header.HeaderSize == sizeof(header)
+	);
+	CloseHandle(file);
+	return valid ? header.Source : 0;
+}
+
+// Ingests the image [FN] into the store opened in [W], hashing its chunks on
+// [Threads] worker threads.
+int StoreIngest(STORE_WRITER *W, const wchar_t *FN, unsigned int Threads)
+{
+	CONTAINER image = {0};
+	FILESYSTEM *fs = NULL;
+	STORE_INGEST in = {0};
+	STORE_RECIPE_HEADER header = {0};
+	STORE_RUN *runs = NULL;
+	size_t runs_cap = 0;
+	wchar_t recipe_fn[MAX_PATH];
+	uint64_t bytes_new = W->BytesNew;
+	double start = TimeSeconds();
+
+	const wchar_t *name = FN;
+	for(const wchar_t *p = FN; *p; p++) {
+		if(IsDirSepW(*p)) {
+			name = p + 1;
+		}
+	}
+	if(swprintf_s(recipe_fn, elementsof(recipe_fn), L"%s\\%s%s", W->Dir, name, STORE_RECIPE_EXT) <= 0) {
+		fwprintf(stderr, L"**Error** Recipe file name too long: %s\n", name);
+		return -1;
+	}
+	// Re-ingesting the same image updates its recipe.
+	header.Source = StoreSourceID(FN);
+	uint32_t existing = StoreRecipeSource(recipe_fn);
+	if(existing && existing != header.Source) {
+		fwprintf(stderr,
+			L"**Error** %s already holds the recipe of a different image named %s. Rename one of them.\n",
+			recipe_fn, name
+		);
+		return -1;
+	}
+	int ret = ImageOpen(&image, FN);
+	if(ret) {
+		goto end;
+	}
+	in.Data = image.FileView.Memory;
+	in.Size = image.FileView.Size;
+	in.ChunkSize = STORE_CHUNK_DEFAULT;
+	// We only need the layout of the file system to align the chunks, and
+	// can still store the image without it.
+	if(!ImageProbe(&image, &fs, NULL)) {
+		StoreAlign(&in, fs);
+	} else {
+		fwprintf(stderr,
+			L"**Warning** %s: storing in %u-byte chunks without file system alignment.\n",
+			FN, in.ChunkSize
+		);
+	}
+	in.DataStart = min(in.DataStart, in.Size);
+	in.HeadChunks = (size_t)((in.DataStart + in.ChunkSize - 1) / in.ChunkSize);
+	in.ChunkCount = in.HeadChunks + (size_t)(
+		(in.Size - in.DataStart + in.ChunkSize - 1) / in.ChunkSize
+	);
+	in.Hashes = HeapAlloc(GetProcessHeap(), 0, in.ChunkCount * sizeof(in.Hashes[0]));
+	if(!in.Hashes) {
+		ret = ERROR_OUTOFMEMORY;
+		goto oom;
+	}
+	WorkersRun(Threads, StoreHashWorker, &in);
+
+	header.RunCount = 0;
+	for(size_t i = 0; i < in.ChunkCount; i++) {
+		uint64_t offset;
+		uint32_t len = StoreChunkAt(&in, i, &offset);
+		uint64_t chunk_offset = StoreAddChunk(W, in.Hashes[i], in.Data + offset, len);
+		if(chunk_offset == (uint64_t)-1) {
+			ret = ERROR_OUTOFMEMORY;
+			goto oom;
+		}
+		STORE_RUN *last = header.RunCount ? &runs[header.RunCount - 1] : NULL;
+		if(last && last->ChunkOffset + last->Length == chunk_offset) {
+			last->Length += len;
+			continue;
+		}
+		if(!ArrayReserve((void**)&runs, &runs_cap, sizeof(STORE_RUN), (size_t)header.RunCount + 1)) {
+			ret = ERROR_OUTOFMEMORY;
+			goto oom;
+		}
+		STORE_RUN *run = &runs[header.RunCount++];
+		run->ImageOffset = offset;
+		run->ChunkOffset = chunk_offset;
+		run->Length = len;
+	}
+	// The recipe must never reference chunks that aren't written yet.
+	if(!StoreWriterFlush(W)) {
+		ret = ReportError(-3, GetLastError(), L"Error writing to %s", W->Dir);
+		goto end;
+	}
+	memcpy(header.Magic, STORE_RECIPE_MAGIC, sizeof(header.Magic));
+	header.HeaderSize = sizeof(header);
+	header.ImageSize = in.Size;
+	header.ImageMTime = FileTimeToU64(&image.MTime);
+	ret = StoreWriteRecipe(recipe_fn, &header, runs);
+	if(!ret) {
+		double elapsed = TimeSeconds() - start;
+		fwprintf(stdout,
+			L"%s: %Iu chunks of %u bytes in %llu runs, %.1f MiB new, %.1f MiB/s\n",
+			recipe_fn, in.ChunkCount, in.ChunkSize, header.RunCount,
+			(W->BytesNew - bytes_new) / (1024.0 * 1024.0),
+			elapsed > 0 ? (in.Size / (1024.0 * 1024.0)) / elapsed : 0.0
+		);
+	}
+	goto end;
+oom:
+	fwprintf(stderr, L"**Error** Out of memory while storing %s.\n", FN);
+end:
+	HeapFree(GetProcessHeap(), 0, in.Hashes);
+	HeapFree(GetProcessHeap(), 0, runs);
+	ImageClose(&image);
+	return ret;
+}
+
+int CMD_Store_Main(int argc, const wchar_t *argv[])
+{
+	unsigned int threads = 0;
+	STORE_WRITER w;
+	int arg = 1 + WorkersArg(argc - 1, argv + 1, &threads);
+	int ret = StoreWriterOpen(&w, argv[0]);
+	for(; arg < argc && !ret; arg++) {
+		ret = StoreIngest(&w, argv[arg], threads);
+	}
+	if(w.BytesIngested) {
+		fwprintf(stderr,
+			L"Stored %.1f MiB as %.1f MiB of new chunks (%.1f%% deduplicated), %Iu chunks in the store.\n",
+			w.BytesIngested / (1024.0 * 1024.0), w.BytesNew / (1024.0 * 1024.0),
+			100.0 - (100.0 * w.BytesNew / w.BytesIngested), w.RecordCount
+		);
+	}
+	if(w.Collisions) {
+		fwprintf(stderr,
+			L"**Warning** %llu chunks had the same hashes as different stored chunks, and were stored separately.\n",
+			w.Collisions
+		);
+	}
+	StoreWriterClose(&w);
+	return ret;
+}
+
+NEW_COMMAND(Store, L"store", L"storedir [-j threads] imagefile [imagefile ...]", 2);
+/// ---------
+
+/// Mounting
+/// --------
+// chunks.dat of a store, shared by all images mounted from it, so that
+// chunks referenced by several of them are only cached once.
+typedef struct STORE {
+	struct STORE *Next;
+	LONG Refs;
+	HANDLE File;
+	HANDLE Map;
+	VIEW Chunks;
+	wchar_t Dir[MAX_PATH];
+} STORE;
+
+struct {
+	SRWLOCK Lock;
+	STORE *List;
+} Stores = {SRWLOCK_INIT};
+
+typedef struct {
+	BLOCK_SOURCE Source;
+	STORE *Store;
+	STORE_RUN *Runs;
+	uint64_t RunCount;
+} STORE_IMAGE;
+
+void StoreFree(STORE *Store)
+{
+	if(Store->Chunks.Memory) {
+		UnmapViewOfFile(Store->Chunks.Memory);
+	}
+	if(Store->Map) {
+		CloseHandle(Store->Map);
+	}
+	if(Store->File != INVALID_HANDLE_VALUE) {
+		CloseHandle(Store->File);
+	}
+	HeapFree(GetProcessHeap(), 0, Store);
+}
+
+void StoreRelease(STORE *Store)
+{
+	AcquireSRWLockExclusive(&Stores.Lock);
+	bool last = --Store->Refs == 0;
+	if(last) {
+		STORE **link = &Stores.List;
+		while(*link != Store) {
+			link = &(*link)->Next;
+		}
+		*link = Store->Next;
+	}
+	ReleaseSRWLockExclusive(&Stores.Lock);
+	if(last) {
+		StoreFree(Store);
+	}
+}
+
+// Returns the store in [Dir] with at least [MinSize] bytes of chunk data,
+// opening it if no mounted image uses it yet.
+STORE* StoreAcquire(const wchar_t *Dir, uint64_t MinSize)
+{
+	wchar_t fn[MAX_PATH];
+	LARGE_INTEGER size;
+	STORE *store;
+
+	AcquireSRWLockExclusive(&Stores.Lock);
+	for(store = Stores.List; store; store = store->Next) {
+		// Images ingested after the store was mapped need a fresh mapping.
+		if(!_wcsicmp(store->Dir, Dir) && store->Chunks.Size >= MinSize) {
+			store->Refs++;
+			break;
+		}
+	}
+	ReleaseSRWLockExclusive(&Stores.Lock);
+	if(store) {
+		return store;
+	}
+
+	store = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(STORE));
+	if(!store || !StoreFileName(fn, elementsof(fn), Dir, STORE_CHUNKS_FN)) {
+		HeapFree(GetProcessHeap(), 0, store);
+		return NULL;
+	}
+	store->Refs = 1;
+	store->File = INVALID_HANDLE_VALUE;
+	wcscpy_s(store->Dir, elementsof(store->Dir), Dir);
+	store->File = CreateFileW(
+		fn, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, NULL
+	);
+	if(
+		store->File == INVALID_HANDLE_VALUE
+		|| !GetFileSizeEx(store->File, &size)
+		|| (uint64_t)size.QuadPart < MinSize
+		|| size.QuadPart == 0
+	) {
+		goto fail;
+	}
+	store->Map = CreateFileMapping(store->File, NULL, PAGE_READONLY, 0, 0, NULL);
+	if(!store->Map) {
+		goto fail;
+	}
+	store->Chunks.Memory = MapViewOfFile(store->Map, FILE_MAP_READ, 0, 0, 0);
+	store->Chunks.Size = size.QuadPart;
+	if(!store->Chunks.Memory) {
+		goto fail;
+	}
+	AcquireSRWLockExclusive(&Stores.Lock);
+	store->Next = Stores.List;
+	Stores.List = store;
+	ReleaseSRWLockExclusive(&Stores.Lock);
+	return store;
+fail:
+	StoreFree(store);
+	return NULL;
+}
+
+bool StoreImageRead(BLOCK_SOURCE *Source, uint64_t Offset, uint8_t *Buf, size_t Size)
+{
+	STORE_IMAGE *si = (STORE_IMAGE*)Source;
+	uint64_t lo = 0;
+	uint64_t hi = si->RunCount;
+	while(hi - lo > 1) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		if(si->Runs[mid].ImageOffset <= Offset) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	for(uint64_t i = lo; Size && i < si->RunCount; i++) {
+		const STORE_RUN *run = &si->Runs[i];
+		uint64_t in_run = Offset - run->ImageOffset;
+		UINT copy = (UINT)min(Size, run->Length - in_run);
+		uint8_t *src = At(&si->Store->Chunks, run->ChunkOffset + in_run, copy);
+		if(!src) {
+			return false;
+		}
+		memcpy(Buf, src, copy);
+		Buf += copy;
+		Offset += copy;
+		Size -= copy;
+	}
+	return Size == 0;
+}
+
+void StoreImageFree(BLOCK_SOURCE *Source)
+{
+	STORE_IMAGE *si = (STORE_IMAGE*)Source;
+	if(si->Store) {
+		StoreRelease(si->Store);
+	}
+	HeapFree(GetProcessHeap(), 0, si->Runs);
+	HeapFree(GetProcessHeap(), 0, si);
+}
+
+// Opens the recipe [FN] and presents the image it describes in [Image].
+// Returns 0 on success, or the negative exit code of dimount on failure.
+int StoreImageOpen(CONTAINER *Image, const wchar_t *FN)
+{
+	int ret = 0;
+	STORE_RECIPE_HEADER header;
+	STORE_IMAGE *si = NULL;
+	LARGE_INTEGER size;
+	DWORD read;
+	wchar_t dir[MAX_PATH];
+
+	HANDLE file = CreateFileW(
+		FN, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL
+	);
+	W32_ERR_REPORT(file == INVALID_HANDLE_VALUE,
+		-2, L"Error opening %s", FN
+	);
+	W32_ERR_REPORT(!GetFileSizeEx(file, &size),
+		-3, L"Error retrieving the file size of %s", FN
+	);
+	W32_ERR_REPORT(!ReadFile(file, &header, sizeof(header), &read, NULL),
+		-3, L"Error reading %s", FN
+	);
+	if(
+		read != sizeof(header)
+		|| memcmp(header.Magic, STORE_RECIPE_MAGIC, sizeof(header.Magic))
+		|| header.HeaderSize != sizeof(header)
+		|| header.ImageSize == 0
+		|| header.RunCount == 0
+		|| header.RunCount > ((uint64_t)size.QuadPart - sizeof(header)) / sizeof(STORE_RUN)
+	) {
+		fwprintf(stderr, L"**Error** %s is not a valid recipe.\n", FN);
+		ret = -4;
+		goto end;
+	}
+	si = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(STORE_IMAGE));
+	if(!si) {
+		ret = -5;
+		goto oom;
+	}
+	si->Source.Read = StoreImageRead;
+	si->Source.Free = StoreImageFree;
+	si->RunCount = header.RunCount;
+	si->Runs = HeapAlloc(GetProcessHeap(), 0, (size_t)(header.RunCount * sizeof(STORE_RUN)));
+	if(!si->Runs) {
+		ret = -5;
+		goto oom;
+	}
+	uint8_t *p = (uint8_t*)si->Runs;
+	uint64_t remaining = header.RunCount * sizeof(STORE_RUN);
+	while(remaining) {
+		DWORD chunk = (DWORD)min(remaining, 0x1000000);
+		W32_ERR_REPORT(!ReadFile(file, p, chunk, &read, NULL) || read != chunk,
+			-3, L"Error reading %s", FN
+		);
+		p += chunk;
+		remaining -= chunk;
+	}
+
+	// The runs have to cover the image without gaps.
+	uint64_t image_offset = 0;
+	uint64_t chunks_end = 0;
+	for(uint64_t i = 0; i < si->RunCount; i++) {
+		const STORE_RUN *run = &si->Runs[i];
+		if(run->ImageOffset != image_offset || run->Length == 0) {
+			fwprintf(stderr, L"**Error** %s is not a valid recipe.\n", FN);
+			ret = -4;
+			goto end;
+		}
+		image_offset += run->Length;
+		chunks_end = max(chunks_end, run->ChunkOffset + run->Length);
+	}
+	if(image_offset != header.ImageSize) {
+		fwprintf(stderr, L"**Error** %s is not a valid recipe.\n", FN);
+		ret = -4;
+		goto end;
+	}
+
+	// The store is the directory of the recipe.
+	wcscpy_s(dir, elementsof(dir), FN);
+	wchar_t *sep = NULL;
+	for(wchar_t *d = dir; *d; d++) {
+		if(IsDirSepW(*d)) {
+			sep = d;
+		}
+	}
+	if(sep) {
+		*sep = L'\0';
+	} else {
+		wcscpy_s(dir, elementsof(dir), L".");
+	}
+	si->Store = StoreAcquire(dir, chunks_end);
+	if(!si->Store) {
+		fwprintf(stderr,
+			L"**Error** Could not open the chunk store of %s, or it is missing chunks.\n", FN
+		);
+		ret = -6;
+		goto end;
+	}
+	DWORD err = BlockSourceOpen(&si->Source, header.ImageSize, FN);
+	if(err) {
+		ret = ReportError(-6, err, L"Error mapping %s into memory", FN);
+		goto end;
+	}
+	Image->Source = &si->Source;
+	Image->FileView = si->Source.View;
+	Image->View = Image->FileView;
+	Image->MTime = U64ToFileTime(header.ImageMTime);
+	si = NULL;
+	goto end;
+oom:
+	fwprintf(stderr, L"**Error** Out of memory while opening %s.\n", FN);
+end:
+	if(si) {
+		StoreImageFree(&si->Source);
+	}
+	if(file != INVALID_HANDLE_VALUE) {
+		CloseHandle(file);
+	}
+	return ret;
+}
+/// --------
@@ -0,0 +1,450 @@
+/*
+ * Dokan Image Mounter
+ *
+ * Persistent local cache files for images on slow storage.
+ */
+
+// Blocks of the cache file are the pages of the block source.
+#define TIER_BLOCK BLOCK_SOURCE_PAGE
+// The header and the bitmap are each padded to this size.
+#define TIER_ALIGN 4096
+#define TIER_VERSION 1
+// Maximum number of misses read from the image at once.
+#define TIER_MISS_BATCH 64
+// Blocks evicted at once, which amortizes the write of the bitmap.
+#define TIER_EVICT_BATCH 64
+// Newly cached blocks after which the bitmap is written out again.
+#define TIER_FLUSH_BLOCKS 1024
+
+// Cache cost of a page. Evicted pages usually come back from the local
+// cache file rather than the slow storage.
+#define TIER_IMAGE_COST 2
+
+// Set from the command line. NULL reads images directly.
+const wchar_t *TierCacheFN = NULL;
+// Upper limit for the data in the cache file, in bytes. 0 allows the whole
+// image.
+uint64_t TierCacheBudget = 0;
+
+// Layout of a cache file:
+// • TIER_HEADER, padded to TIER_ALIGN
+// • One bit per block of the image, set if the block holds valid data,
+//   padded to TIER_ALIGN
+// • The blocks, at their offsets in the image. The file is sparse, and the
+//   blocks are deallocated again when they are evicted.
+// Blocks are flushed to disk before the bits that declare them valid, and the
+// bits of evicted blocks are cleared on disk before their data is
+// deallocated. A crash can therefore only lose blocks, but never turn them
+// into garbage.
+typedef struct {
+	char Magic[8];
+	uint32_t Version;
+	uint32_t BlockSize;
+	uint64_t ImageSize;
+	// Modification time of the image, which invalidates the cache if changed
+	uint64_t ImageMTime;
+} TIER_HEADER;
+
+const char TIER_MAGIC[8] = "DIMTIER";
+
+typedef struct {
+	volatile LONGLONG Hits; // in blocks
+	volatile LONGLONG Misses; // in blocks
+	volatile LONGLONG BytesSaved;
+	volatile LONGLONG BytesFetched;
+	volatile LONGLONG Evictions; // in blocks
+} TIER_STATS;
+
+typedef struct {
+	BLOCK_SOURCE Source;
+	AIO Base;
+	HANDLE Cache;
+	// The block source reads several pages at once. Reads from the cache
+	// file hold this shared, so that their blocks can't be evicted under
+	// them, while storing and evicting blocks holds it exclusively. Reads
+	// from the image hold neither.
+	SRWLOCK Lock;
+	uint64_t Blocks;
+	// In blocks
+	uint64_t Capacity;
+	uint64_t ValidCount;
+	// Bitmaps with one bit per block. [Hot] is set by every hit, and cleared
+	// by the eviction clock.
+	uint8_t *Valid;
+	uint8_t *Hot;
+	size_t BitmapSize;
+	uint64_t Hand;
+	uint64_t Unflushed;
+	bool WriteFailed;
+	TIER_STATS Stats;
+} TIER_IMAGE;
+
+typedef struct {
+	BLOCK_REQUEST Reads[TIER_MISS_BATCH];
+	// Request that each read belongs to
+	BLOCK_REQUEST *Parents[TIER_MISS_BATCH];
+	size_t Count;
+} TIER_MISSES;
+
+bool TierReadAt(HANDLE File, uint64_t Offset, void *Buf, size_t Size)
+{
+	DWORD bytes = 0;
+	OVERLAPPED ov = {
+		.Offset = (DWORD)Offset,
+		.OffsetHigh = (DWORD)(Offset >> 32),
+	};
+	return ReadFile(File, Buf, (DWORD)Size, &bytes, &ov) && bytes == Size;
+}
+
+bool TierWriteAt(HANDLE File, uint64_t Offset, const void *Buf, size_t Size)
+{
+	DWORD bytes = 0;
+	OVERLAPPED ov = {
+		.Offset = (DWORD)Offset,
+		.OffsetHigh = (DWORD)(Offset >> 32),
+	};
+	return WriteFile(File, Buf, (DWORD)Size, &bytes, &ov) && bytes == Size;
+}
+
+uint64_t TierDataOffset(const TIER_IMAGE *TI)
+{
+	return TIER_ALIGN + TI->BitmapSize;
+}
+
+bool TierIsValid(const TIER_IMAGE *TI, uint64_t Block)
+{
+	return (TI->Valid[Block / 8] >> (Block % 8)) & 1;
+}
+
+// Writes the bitmap to the cache file, after everything written before.
+bool TierFlush(TIER_IMAGE *TI)
+{
+	TI->Unflushed = 0;
+	return (
+		FlushFileBuffers(TI->Cache)
+		&& TierWriteAt(TI->Cache, TIER_ALIGN, TI->Valid, TI->BitmapSize)
+		&& FlushFileBuffers(TI->Cache)
+	);
+}
+
+// Evicts blocks until [Blocks] more of them fit into the budget.
+void TierMakeRoom(TIER_IMAGE *TI, uint64_t Blocks)
+{
+	while(TI->ValidCount && TI->ValidCount + Blocks > TI->Capacity) {
+		uint64_t victims[TIER_EVICT_BATCH];
+		size_t count = 0;
+		while(count < TIER_EVICT_BATCH && TI->ValidCount) {
+			uint64_t block = TI->Hand;
+			TI->Hand = (TI->Hand + 1) % TI->Blocks;
+			uint8_t bit = 1 << (block % 8);
+			if(!(TI->Valid[block / 8] & bit)) {
+				continue;
+			} else if(TI->Hot[block / 8] & bit) {
+				TI->Hot[block / 8] &= ~bit;
+				continue;
+			}
+			TI->Valid[block / 8] &= ~bit;
+			TI->ValidCount--;
+			victims[count++] = block;
+		}
+		TierFlush(TI);
+		for(size_t i = 0; i < count; i++) {
+			DWORD bytes;
+			FILE_ZERO_DATA_INFORMATION zero;
+			zero.FileOffset.QuadPart = TierDataOffset(TI) + victims[i] * TIER_BLOCK;
+			zero.BeyondFinalZero.QuadPart = zero.FileOffset.QuadPart + TIER_BLOCK;
+			DeviceIoControl(
+				TI->Cache, FSCTL_SET_ZERO_DATA, &zero, sizeof(zero), NULL, 0, &bytes, NULL
+			);
+		}
+		InterlockedExchangeAdd64(&TI->Stats.Evictions, count);
+	}
+}
+
+// Writes [Size] bytes of freshly read image data at [Offset] into the cache.
+// Must be called with the lock held exclusively.
+void TierStore(TIER_IMAGE *TI, uint64_t Offset, const uint8_t *Buf, size_t Size)
+{
+	uint64_t first = Offset / TIER_BLOCK;
+	uint64_t last = (Offset + Size - 1) / TIER_BLOCK;
+	if(TI->WriteFailed) {
+		return;
+	}
+	TierMakeRoom(TI, last - first + 1);
+	if(!TierWriteAt(TI->Cache, TierDataOffset(TI) + Offset, Buf, Size)) {
+		// Most likely a full disk, which won't get any better.
+		fwprintf(stderr,
+			L"**Warning** Could not write to the local cache file, no longer caching new blocks.\n"
+		);
+		TI->WriteFailed = true;
+		return;
+	}
+	for(uint64_t block = first; block <= last; block++) {
+		uint8_t bit = 1 << (block % 8);
+		if(!(TI->Valid[block / 8] & bit)) {
+			TI->Valid[block / 8] |= bit;
+			TI->ValidCount++;
+			TI->Unflushed++;
+		}
+	}
+	if(TI->Unflushed >= TIER_FLUSH_BLOCKS) {
+		TierFlush(TI);
+	}
+}
+
+// Must be called without holding the lock.
+void TierFetch(TIER_IMAGE *TI, TIER_MISSES *Misses)
+{
+	AioRead(&TI->Base, Misses->Reads, Misses->Count);
+	AcquireSRWLockExclusive(&TI->Lock);
+	for(size_t i = 0; i < Misses->Count; i++) {
+		const BLOCK_REQUEST *read = &Misses->Reads[i];
+		if(!read->OK) {
+			Misses->Parents[i]->OK = false;
+			continue;
+		}
+		InterlockedExchangeAdd64(&TI->Stats.BytesFetched, read->Size);
+		TierStore(TI, read->Offset, read->Buf, read->Size);
+	}
+	ReleaseSRWLockExclusive(&TI->Lock);
+	Misses->Count = 0;
+}
+
+// Serves every run of valid blocks from the cache file right away, and
+// reads the remaining runs from the image in batches.
+void TierImageReadBatch(BLOCK_SOURCE *Source, BLOCK_REQUEST *Requests, size_t Count)
+{
+	TIER_IMAGE *ti = (TIER_IMAGE*)Source;
+	TIER_MISSES misses;
+	misses.Count = 0;
+	for(size_t i = 0; i < Count; i++) {
+		BLOCK_REQUEST *req = &Requests[i];
+		uint64_t end = req->Offset + req->Size;
+		req->OK = true;
+		for(uint64_t offset = req->Offset; offset < end;) {
+			AcquireSRWLockShared(&ti->Lock);
+			uint64_t block = offset / TIER_BLOCK;
+			bool valid = TierIsValid(ti, block);
+			uint64_t run_end;
+			uint64_t blocks = 0;
+			do {
+				run_end = min((block + 1) * TIER_BLOCK, end);
+				block++;
+				blocks++;
+			} while(run_end < end && TierIsValid(ti, block) == valid);
+
+			size_t len = (size_t)(run_end - offset);
+			uint8_t *buf = req->Buf + (offset - req->Offset);
+			bool hit = valid && TierReadAt(ti->Cache, TierDataOffset(ti) + offset, buf, len);
+			if(hit) {
+				for(uint64_t b = block - blocks; b < block; b++) {
+					InterlockedOr8((char*)&ti->Hot[b / 8], 1 << (b % 8));
+				}
+			}
+			ReleaseSRWLockShared(&ti->Lock);
+			if(hit) {
+				InterlockedExchangeAdd64(&ti->Stats.Hits, blocks);
+				InterlockedExchangeAdd64(&ti->Stats.BytesSaved, len);
+			} else {
+				if(misses.Count == TIER_MISS_BATCH) {
+					TierFetch(ti, &misses);
+				}
+				misses.Reads[misses.Count].Offset = offset;
+				misses.Reads[misses.Count].Buf = buf;
+				misses.Reads[misses.Count].Size = len;
+				misses.Parents[misses.Count] = req;
+				misses.Count++;
+				InterlockedExchangeAdd64(&ti->Stats.Misses, blocks);
+			}
+			offset = run_end;
+		}
+	}
+	if(misses.Count) {
+		TierFetch(ti, &misses);
+	}
+}
+
+bool TierImageRead(BLOCK_SOURCE *Source, uint64_t Offset, uint8_t *Buf, size_t Size)
+{
+	BLOCK_REQUEST req = {.Offset = Offset, .Buf = Buf, .Size = Size};
+	TierImageReadBatch(Source, &req, 1);
+	return req.OK;
+}
+
+void TierImageFree(BLOCK_SOURCE *Source)
+{
+	TIER_IMAGE *ti = (TIER_IMAGE*)Source;
+	if(ti->Cache && ti->Cache != INVALID_HANDLE_VALUE) {
+		// Only complete sources have a bitmap worth keeping.
+		if(ti->Source.Read && !ti->WriteFailed) {
+			TierFlush(ti);
+		}
+		CloseHandle(ti->Cache);
+	}
+	AioClose(&ti->Base);
+	HeapFree(GetProcessHeap(), 0, ti->Valid);
+	HeapFree(GetProcessHeap(), 0, ti->Hot);
+	HeapFree(GetProcessHeap(), 0, ti);
+}
+
+// Reads the bitmap of an existing cache file that matches [Header]. Returns
+// false if there is none.
+bool TierLoad(TIER_IMAGE *TI, const TIER_HEADER *Header)
+{
+	TIER_HEADER on_disk;
+	if(
+		!TierReadAt(TI->Cache, 0, &on_disk, sizeof(on_disk))
+		|| memcmp(&on_disk, Header, sizeof(on_disk))
+		|| !TierReadAt(TI->Cache, TIER_ALIGN, TI->Valid, TI->BitmapSize)
+	) {
+		ZeroMemory(TI->Valid, TI->BitmapSize);
+		return false;
+	}
+	TI->ValidCount = 0;
+	for(size_t i = 0; i < TI->BitmapSize; i++) {
+		for(uint8_t b = TI->Valid[i]; b; b &= b - 1) {
+			TI->ValidCount++;
+		}
+	}
+	return true;
+}
+
+// Turns the cache file into an empty one for [Header]. Returns 0 on success,
+// or a Win32 error code.
+DWORD TierReset(TIER_IMAGE *TI, const TIER_HEADER *Header)
+{
+	uint8_t header[TIER_ALIGN] = {0};
+	LARGE_INTEGER pos = {0};
+	DWORD bytes;
+	if(
+		!SetFilePointerEx(TI->Cache, pos, NULL, FILE_BEGIN)
+		|| !SetEndOfFile(TI->Cache)
+	) {
+		return GetLastError();
+	}
+	if(!DeviceIoControl(TI->Cache, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &bytes, NULL)) {
+		fwprintf(stderr,
+			L"**Warning** The local cache file can't be made sparse, so evicted blocks will keep taking up space.\n"
+		);
+	}
+	// The header goes last, so that an interrupted reset leaves no valid
+	// cache file behind.
+	pos.QuadPart = TierDataOffset(TI) + Header->ImageSize;
+	memcpy(header, Header, sizeof(TIER_HEADER));
+	if(
+		!TierWriteAt(TI->Cache, TIER_ALIGN, TI->Valid, TI->BitmapSize)
+		|| !SetFilePointerEx(TI->Cache, pos, NULL, FILE_BEGIN)
+		|| !SetEndOfFile(TI->Cache)
+		|| !FlushFileBuffers(TI->Cache)
+		|| !TierWriteAt(TI->Cache, 0, header, sizeof(header))
+	) {
+		return GetLastError();
+	}
+	return 0;
+}
+
+// Prints the statistics of [Image] if it's read through a local cache file.
+void TierReport(const CONTAINER *Image, FILE *Out)
+{
+	if(!Image->Source || Image->Source->Free != TierImageFree) {
+		return;
+	}
+	const TIER_IMAGE *ti = (const TIER_IMAGE*)Image->Source;
+	const TIER_STATS *s = &ti->Stats;
+	LONGLONG lookups = s->Hits + s->Misses;
+	fwprintf(Out,
+		L"Local cache: %lld of %lld block reads hit (%.1f%%), %lld bytes saved, %lld bytes fetched, %lld blocks evicted.\n",
+		s->Hits, lookups, lookups ? (100.0 * s->Hits / lookups) : 0.0,
+		s->BytesSaved, s->BytesFetched, s->Evictions
+	);
+}
+
+// Opens [FN] through the local cache file at [TierCacheFN], reusing the
+// blocks it already holds for the same image. Returns 0 on success, or the
+// negative exit code of dimount on failure.
+int TierImageOpen(CONTAINER *Image, const wchar_t *FN)
+{
+	int ret = 0;
+	LARGE_INTEGER size;
+	TIER_HEADER header = {0};
+	TIER_IMAGE *ti = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(TIER_IMAGE));
+	if(!ti) {
+		goto oom;
+	}
+	InitializeSRWLock(&ti->Lock);
+	// The image is only read once per block, so it shouldn't take up any
+	// room in the system's file cache either.
+	DWORD err = AioOpen(&ti->Base, FN, max(AioImageDepth, 1), false);
+	if(err) {
+		ret = ReportError(-2, err, L"Error opening %s", FN);
+		goto end;
+	}
+	W32_ERR_REPORT(!GetFileSizeEx(ti->Base.File, &size),
+		-3, L"Error retrieving the file size of %s", FN
+	);
+	if(size.QuadPart == 0) {
+		fwprintf(stderr, L"Not mounting an empty file.\n");
+		ret = -4;
+		goto end;
+	}
+	GetFileTime(ti->Base.File, NULL, NULL, &Image->MTime);
+	memcpy(header.Magic, TIER_MAGIC, sizeof(header.Magic));
+	header.Version = TIER_VERSION;
+	header.BlockSize = TIER_BLOCK;
+	header.ImageSize = size.QuadPart;
+	header.ImageMTime = (
+		((uint64_t)Image->MTime.dwHighDateTime << 32) | Image->MTime.dwLowDateTime
+	);
+
+	ti->Blocks = (size.QuadPart + TIER_BLOCK - 1) / TIER_BLOCK;
+	ti->BitmapSize = (size_t)(((ti->Blocks + 7) / 8 + TIER_ALIGN - 1) & ~(uint64_t)(TIER_ALIGN - 1));
+	ti->Capacity = TierCacheBudget ? max(TierCacheBudget / TIER_BLOCK, 1) : ti->Blocks;
+	ti->Valid = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, ti->BitmapSize);
+	ti->Hot = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, ti->BitmapSize);
+	if(!ti->Valid || !ti->Hot) {
+		goto oom;
+	}
+	ti->Cache = CreateFileW(
+		TierCacheFN, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+		OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, NULL
+	);
+	W32_ERR_REPORT(ti->Cache == INVALID_HANDLE_VALUE,
+		-2, L"Error opening the local cache file %s", TierCacheFN
+	);
+	if(TierLoad(ti, &header)) {
+		fwprintf(stdout,
+			L"Reusing %llu cached bytes from %s.\n",
+			ti->ValidCount * TIER_BLOCK, TierCacheFN
+		);
+		// The budget might have shrunk since the last run.
+		TierMakeRoom(ti, 0);
+	} else {
+		err = TierReset(ti, &header);
+		if(err) {
+			ret = ReportError(-3, err, L"Error creating the local cache file %s", TierCacheFN);
+			goto end;
+		}
+	}
+	ti->Source.Read = TierImageRead;
+	ti->Source.ReadBatch = TierImageReadBatch;
+	ti->Source.Free = TierImageFree;
+	ti->Source.Cost = TIER_IMAGE_COST;
+	err = BlockSourceOpen(&ti->Source, size.QuadPart, FN);
+	if(err) {
+		ret = ReportError(-6, err, L"Error mapping %s into memory", FN);
+		goto end;
+	}
+	Image->Source = &ti->Source;
+	Image->FileView = ti->Source.View;
+	Image->View = Image->FileView;
+	ti = NULL;
+	goto end;
+oom:
+	fwprintf(stderr, L"**Error** Out of memory while opening %s.\n", FN);
+	ret = -5;
+end:
+	if(ti) {
+		TierImageFree(&ti->Source);
+	}
+	return ret;
+}
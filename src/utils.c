@@ -25,3 +25,299 @@ bool IsDirSepW(const wchar_t c)
 {
 	return c == L'/' || c == L'\\';
 }
+
+// Returns true if [FN] is one of the "." or ".." pseudo-entries that
+// FindFiles() may return for subdirectories.
+bool IsDotEntryW(const wchar_t *FN)
+{
+	assert(FN);
+	return FN[0] == L'.' && (FN[1] == L'\0' || (FN[1] == L'.' && FN[2] == L'\0'));
+}
+
+// Makes sure that [*Array] can hold at least [Count] elements of
+// [ElementSize] bytes, growing it on the process heap if necessary.
+// Returns false if we ran out of memory, leaving [*Array] untouched.
+bool ArrayReserve(void **Array, size_t *Capacity, size_t ElementSize, size_t Count)
+{
+	assert(Array && Capacity);
+	if(Count <= *Capacity) {
+		return true;
+	}
+	size_t new_cap = *Capacity ? *Capacity : 64;
+	while(new_cap < Count) {
+		new_cap *= 2;
+	}
+	void *ret = *Array
+		? HeapReAlloc(GetProcessHeap(), 0, *Array, new_cap * ElementSize)
+		: HeapAlloc(GetProcessHeap(), 0, new_cap * ElementSize);
+	if(!ret) {
+		return false;
+	}
+	*Array = ret;
+	*Capacity = new_cap;
+	return true;
+}
+
+uint64_t FileTimeToU64(const FILETIME *FT)
+{
+	assert(FT);
+	return ((uint64_t)FT->dwHighDateTime << 32) | FT->dwLowDateTime;
+}
+
+FILETIME U64ToFileTime(uint64_t Time)
+{
+	FILETIME ret = {
+		.dwLowDateTime = (DWORD)Time,
+		.dwHighDateTime = (DWORD)(Time >> 32)
+	};
+	return ret;
+}
+
+// Returns a monotonic timestamp in seconds, for measuring durations.
+double TimeSeconds(void)
+{
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+	if(!freq.QuadPart) {
+		QueryPerformanceFrequency(&freq);
+	}
+	QueryPerformanceCounter(&now);
+	return (double)now.QuadPart / (double)freq.QuadPart;
+}
+
+/// Threads
+/// -------
+// Upper limit for WorkersRun(), imposed by WaitForMultipleObjects().
+#define WORKERS_MAX 64
+
+unsigned int ProcessorCount(void)
+{
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	return si.dwNumberOfProcessors;
+}
+
+// Runs [Func] with [Param] on [Count] threads, or one per processor if
+// [Count] is 0, and waits for all of them to finish. Meant for workers that
+// pull their work from a shared queue, and thus still get everything done if
+// fewer threads could be started than requested.
+void WorkersRun(unsigned int Count, LPTHREAD_START_ROUTINE Func, void *Param)
+{
+	HANDLE threads[WORKERS_MAX];
+	DWORD started = 0;
+	if(Count == 0) {
+		Count = ProcessorCount();
+	}
+	Count = min(max(Count, 1), WORKERS_MAX);
+	while(started < Count) {
+		threads[started] = CreateThread(NULL, 0, Func, Param, 0, NULL);
+		if(!threads[started]) {
+			break;
+		}
+		started++;
+	}
+	if(started == 0) {
+		Func(Param);
+		return;
+	}
+	WaitForMultipleObjects(started, threads, TRUE, INFINITE);
+	for(DWORD i = 0; i < started; i++) {
+		CloseHandle(threads[i]);
+	}
+}
+
+// Parses the common "-j threads" option at the start of [argv]. Returns the
+// number of arguments consumed.
+int WorkersArg(int argc, const wchar_t *argv[], unsigned int *Count)
+{
+	if(argc >= 2 && !wcscmp(argv[0], L"-j")) {
+		*Count = (unsigned int)wcstoul(argv[1], NULL, 10);
+		return 2;
+	}
+	return 0;
+}
+/// -------
+
+/// Hashing
+/// -------
+// Fast non-cryptographic 64-bit hash, following the xxHash64 algorithm.
+#define HASH64_P1 0x9E3779B185EBCA87ULL
+#define HASH64_P2 0xC2B2AE3D27D4EB4FULL
+#define HASH64_P3 0x165667B19E3779F9ULL
+#define HASH64_P4 0x85EBCA77C2B2AE63ULL
+#define HASH64_P5 0x27D4EB2F165667C5ULL
+
+uint64_t RotL64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+uint64_t Hash64Round(uint64_t Acc, uint64_t Input)
+{
+	Acc += Input * HASH64_P2;
+	return RotL64(Acc, 31) * HASH64_P1;
+}
+
+uint64_t Hash64Merge(uint64_t Acc, uint64_t Val)
+{
+	Acc ^= Hash64Round(0, Val);
+	return Acc * HASH64_P1 + HASH64_P4;
+}
+
+uint64_t Hash64(const void *Data, size_t Size, uint64_t Seed)
+{
+	const uint8_t *p = (const uint8_t*)Data;
+	const uint8_t *end = p + Size;
+	uint64_t h;
+	uint64_t k;
+	uint32_t k32;
+
+	assert(Data || !Size);
+	if(Size >= 32) {
+		uint64_t v1 = Seed + HASH64_P1 + HASH64_P2;
+		uint64_t v2 = Seed + HASH64_P2;
+		uint64_t v3 = Seed;
+		uint64_t v4 = Seed - HASH64_P1;
+		do {
+			memcpy(&k, p +  0, 8); v1 = Hash64Round(v1, k);
+			memcpy(&k, p +  8, 8); v2 = Hash64Round(v2, k);
+			memcpy(&k, p + 16, 8); v3 = Hash64Round(v3, k);
+			memcpy(&k, p + 24, 8); v4 = Hash64Round(v4, k);
+			p += 32;
+		} while(p + 32 <= end);
+		h = RotL64(v1, 1) + RotL64(v2, 7) + RotL64(v3, 12) + RotL64(v4, 18);
+		h = Hash64Merge(h, v1);
+		h = Hash64Merge(h, v2);
+		h = Hash64Merge(h, v3);
+		h = Hash64Merge(h, v4);
+	} else {
+		h = Seed + HASH64_P5;
+	}
+	h += Size;
+	while(p + 8 <= end) {
+		memcpy(&k, p, 8);
+		h ^= Hash64Round(0, k);
+		h = RotL64(h, 27) * HASH64_P1 + HASH64_P4;
+		p += 8;
+	}
+	if(p + 4 <= end) {
+		memcpy(&k32, p, 4);
+		h ^= (uint64_t)k32 * HASH64_P1;
+		h = RotL64(h, 23) * HASH64_P2 + HASH64_P3;
+		p += 4;
+	}
+	while(p < end) {
+		h ^= (*p++) * HASH64_P5;
+		h = RotL64(h, 11) * HASH64_P1;
+	}
+	h ^= h >> 33;
+	h *= HASH64_P2;
+	h ^= h >> 29;
+	h *= HASH64_P3;
+	h ^= h >> 32;
+	return h;
+}
+/// -------
+
+/// Buffered output
+/// ---------------
+#define OUTBUF_SIZE 0x10000
+
+// Buffered UTF-8 output to a file handle, for streaming large amounts of
+// records without going through the CRT or allocating per record.
+typedef struct {
+	HANDLE Handle;
+	bool Failed;
+	size_t Len;
+	char Buf[OUTBUF_SIZE];
+} OUTBUF;
+
+void OutFlush(OUTBUF *Out)
+{
+	DWORD written;
+	if(Out->Len && !Out->Failed) {
+		if(!WriteFile(Out->Handle, Out->Buf, (DWORD)Out->Len, &written, NULL)) {
+			Out->Failed = true;
+		}
+	}
+	Out->Len = 0;
+}
+
+// Makes sure that at least [Size] bytes are free in [Out], which must be
+// less than OUTBUF_SIZE.
+char* OutReserve(OUTBUF *Out, size_t Size)
+{
+	assert(Size < OUTBUF_SIZE);
+	if(OUTBUF_SIZE - Out->Len < Size) {
+		OutFlush(Out);
+	}
+	return &Out->Buf[Out->Len];
+}
+
+void OutWrite(OUTBUF *Out, const char *Str, size_t Len)
+{
+	while(Len) {
+		size_t chunk = min(Len, OUTBUF_SIZE / 2);
+		memcpy(OutReserve(Out, chunk), Str, chunk);
+		Out->Len += chunk;
+		Str += chunk;
+		Len -= chunk;
+	}
+}
+
+// Converts [Len] UTF-16 characters of [Str] to UTF-8.
+void OutWriteW(OUTBUF *Out, const wchar_t *Str, size_t Len)
+{
+	while(Len) {
+		// Worst case: 3 bytes per UTF-16 code unit.
+		size_t chunk = min(Len, OUTBUF_SIZE / 8);
+		char *dst = OutReserve(Out, chunk * 3);
+		Out->Len += WideCharToMultiByte(
+			CP_UTF8, 0, Str, (int)chunk, dst, (int)(chunk * 3), NULL, NULL
+		);
+		Str += chunk;
+		Len -= chunk;
+	}
+}
+
+void OutPrintf(OUTBUF *Out, const char *Format, ...)
+{
+	va_list va;
+	va_start(va, Format);
+	char *dst = OutReserve(Out, 256);
+	int len = vsnprintf(dst, 256, Format, va);
+	if(len > 0) {
+		Out->Len += min(len, 255);
+	}
+	va_end(va);
+}
+/// ---------------
+
+/// Error reporting
+/// ---------------
+#define W32_ERR_REPORT(FailCondition, ReturnValue, Prefix, ...) \
+	if(FailCondition) { \
+		ret = ReportError(ReturnValue, GetLastError(), Prefix, __VA_ARGS__); \
+		goto end; \
+	}
+
+int ReportError(int ReturnValue, DWORD Error, const wchar_t *Prefix, ...)
+{
+	va_list va;
+	wchar_t *msg_str = NULL;
+
+	va_start(va, Prefix);
+
+	FormatMessageW(
+		FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_ALLOCATE_BUFFER,
+		NULL, Error, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
+		(LPWSTR)&msg_str, 0, NULL
+	);
+
+	vfwprintf(stderr, Prefix, va);
+	fwprintf(stderr, L": %s", msg_str);
+	LocalFree(msg_str);
+	va_end(va);
+	return ReturnValue;
+}
+/// ---------------